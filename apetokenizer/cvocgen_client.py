@@ -0,0 +1,105 @@
+import socket
+import struct
+import subprocess
+
+# Client for `cvocgen serve`: batch encoding by a server that loads the vocabulary
+# once. The message layout is described in src/cvocgen_serve.h; integers are in
+# native byte order, since the server runs on the same host.
+
+SERVE_MAGIC = 0x45535643
+SERVE_FLAG_SPECIAL_TOKENS = 1
+SERVE_OK = 0
+SERVE_BAD_REQUEST = 1
+SERVE_SERVER_ERROR = 2
+
+_REQUEST = struct.Struct("=IIII")
+_RESPONSE = struct.Struct("=IIQ")
+
+
+class ServeError(RuntimeError):
+    pass
+
+
+class ServeClient:
+    """
+    Encode batches of molecules with a running `cvocgen serve`.
+
+    Connect to a server listening on a Unix socket with ServeClient(socket_path=...),
+    or start one on stdin/stdout with ServeClient(command=["cvocgen", "serve", "vocab.bin"]).
+    A client must not be used by two threads at once; open one per data loader worker.
+    """
+
+    def __init__(self, socket_path=None, command=None):
+        self._sock = None
+        self._process = None
+        if socket_path is not None:
+            self._sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            self._sock.connect(socket_path)
+            self._in = self._sock.makefile("rb")
+            self._out = self._sock.makefile("wb")
+        elif command is not None:
+            self._process = subprocess.Popen(command, stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+            self._in = self._process.stdout
+            self._out = self._process.stdin
+        else:
+            raise ValueError("give socket_path or command")
+
+    def encode_batch(self, molecules, add_special_tokens=False):
+        """
+        Encode a batch of molecules.
+
+        :param molecules: List of strings, the molecules.
+        :param add_special_tokens: Boolean, whether to add bos and eos tokens.
+        :return: List of lists of integers, the encoded molecules in order.
+        """
+        data = [m.encode("utf-8") for m in molecules]
+        text = b"".join(data)
+        flags = SERVE_FLAG_SPECIAL_TOKENS if add_special_tokens else 0
+        self._out.write(_REQUEST.pack(SERVE_MAGIC, len(data), flags, len(text)))
+        self._out.write(struct.pack("=%dI" % len(data), *[len(d) for d in data]))
+        self._out.write(text)
+        self._out.flush()
+
+        status, count, id_count = _RESPONSE.unpack(self._read(_RESPONSE.size))
+        if status == SERVE_SERVER_ERROR:
+            raise ServeError("the server ran out of memory for the request")
+        if status != SERVE_OK:
+            raise ServeError("the server rejected the request")
+        counts = struct.unpack("=%dI" % count, self._read(4 * count))
+        ids = struct.unpack("=%dI" % id_count, self._read(4 * id_count))
+        result = []
+        offset = 0
+        for n in counts:
+            result.append(list(ids[offset:offset + n]))
+            offset += n
+        return result
+
+    def encode(self, text, add_special_tokens=False):
+        return self.encode_batch([text], add_special_tokens)[0]
+
+    def _read(self, size):
+        data = self._in.read(size)
+        if data is None or len(data) != size:
+            raise ServeError("the server closed the connection")
+        return data
+
+    def close(self):
+        if self._sock is not None:
+            self._in.close()
+            self._out.close()
+            self._sock.close()
+            self._sock = None
+        if self._process is not None:
+            self._process.stdin.close()
+            self._process.wait()
+            self._process.stdout.close()
+            self._process = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def __del__(self):
+        self.close()
@@ -0,0 +1,260 @@
+import ctypes
+import ctypes.util
+import os
+
+# Thin ctypes binding for libcvocgen (build it with `make -C src lib`).
+#
+# The library is looked up in $CVOCGEN_LIBRARY, then in lib/ of this repository,
+# then on the system library path.
+
+FORMAT_SELFIES = 0
+FORMAT_SMILES = 1
+NO_ID = 0xFFFFFFFF
+VOCAB_ORDERS = {"insertion": 0, "rank": 1, "frequency": 2}
+
+_lib = None
+
+
+class CvocgenError(RuntimeError):
+    pass
+
+
+def _library_path():
+    path = os.environ.get("CVOCGEN_LIBRARY")
+    if path:
+        return path
+    here = os.path.dirname(os.path.abspath(__file__))
+    local = os.path.join(here, os.pardir, "lib", "libcvocgen.so")
+    if os.path.exists(local):
+        return local
+    found = ctypes.util.find_library("cvocgen")
+    if found:
+        return found
+    raise CvocgenError("libcvocgen not found; run `make -C src lib` or set CVOCGEN_LIBRARY")
+
+
+def _load():
+    global _lib
+    if _lib is not None:
+        return _lib
+
+    lib = ctypes.CDLL(_library_path())
+    c_ctx = ctypes.c_void_p
+    signatures = {
+        "cvocgen_context_create": (c_ctx, []),
+        "cvocgen_context_free": (None, [c_ctx]),
+        "cvocgen_set_format": (None, [c_ctx, ctypes.c_int]),
+        "cvocgen_set_threads": (None, [c_ctx, ctypes.c_int]),
+        "cvocgen_set_deduplicate": (None, [c_ctx, ctypes.c_int]),
+        "cvocgen_set_max_memory": (None, [c_ctx, ctypes.c_size_t, ctypes.c_char_p]),
+        "cvocgen_set_checkpoint": (None, [c_ctx, ctypes.c_char_p, ctypes.c_int, ctypes.c_int]),
+        "cvocgen_set_extend": (None, [c_ctx, ctypes.c_char_p]),
+        "cvocgen_set_snapshots": (None, [c_ctx, ctypes.POINTER(ctypes.c_int), ctypes.c_int, ctypes.c_char_p]),
+        "cvocgen_set_vocab_order": (None, [c_ctx, ctypes.c_int]),
+        "cvocgen_set_stop_rules": (None, [c_ctx, ctypes.c_int, ctypes.c_int]),
+        "cvocgen_set_prune_below": (None, [c_ctx, ctypes.c_int]),
+        "cvocgen_set_cache": (None, [c_ctx, ctypes.c_char_p]),
+        "cvocgen_set_verbose": (None, [c_ctx, ctypes.c_int]),
+        "cvocgen_last_error": (ctypes.c_char_p, [c_ctx]),
+        "cvocgen_train_file": (ctypes.c_void_p, [c_ctx, ctypes.c_char_p, ctypes.c_int]),
+        "cvocgen_train_buffer": (ctypes.c_void_p, [c_ctx, ctypes.c_char_p, ctypes.c_size_t, ctypes.c_int]),
+        "cvocgen_resume": (ctypes.c_void_p, [c_ctx, ctypes.c_char_p, ctypes.c_int]),
+        "cvocgen_model_merge_count": (ctypes.c_int, [ctypes.c_void_p]),
+        "cvocgen_model_save": (ctypes.c_int, [c_ctx, ctypes.c_void_p, ctypes.c_char_p]),
+        "cvocgen_model_free": (None, [ctypes.c_void_p]),
+        "cvocgen_load": (ctypes.c_void_p, [c_ctx, ctypes.c_char_p]),
+        "cvocgen_tokenizer_free": (None, [ctypes.c_void_p]),
+        "cvocgen_vocab_size": (ctypes.c_uint32, [ctypes.c_void_p]),
+        "cvocgen_id_to_token": (ctypes.c_char_p, [ctypes.c_void_p, ctypes.c_uint32]),
+        "cvocgen_token_to_id": (ctypes.c_uint32, [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t]),
+        "cvocgen_encode": (ctypes.c_size_t, [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t,
+                                             ctypes.c_int, ctypes.POINTER(ctypes.c_uint32), ctypes.c_size_t]),
+    }
+    for name, (restype, argtypes) in signatures.items():
+        function = getattr(lib, name)
+        function.restype = restype
+        function.argtypes = argtypes
+    _lib = lib
+    return lib
+
+
+class Model:
+    """A vocabulary trained by Context.train_file or Context.train_buffer."""
+
+    def __init__(self, context, handle):
+        self._context = context
+        self._handle = handle
+
+    @property
+    def merge_count(self):
+        return _lib.cvocgen_model_merge_count(self._handle)
+
+    def save(self, base):
+        """
+        Write base.txt, base.json, base_freq.json and base.bin.
+
+        :param base: String, the path without extension.
+        """
+        if _lib.cvocgen_model_save(self._context._handle, self._handle, os.fsencode(base)) != 0:
+            raise CvocgenError(self._context.last_error)
+
+    def close(self):
+        if self._handle:
+            _lib.cvocgen_model_free(self._handle)
+            self._handle = None
+
+    def __del__(self):
+        self.close()
+
+
+class Tokenizer:
+    """A binary vocabulary (.bin) loaded for encoding; safe to share between threads."""
+
+    def __init__(self, handle):
+        self._handle = handle
+
+    def __len__(self):
+        return _lib.cvocgen_vocab_size(self._handle)
+
+    def id_to_token(self, token_id):
+        token = _lib.cvocgen_id_to_token(self._handle, token_id)
+        return token.decode("utf-8") if token is not None else None
+
+    def token_to_id(self, token):
+        data = token.encode("utf-8")
+        token_id = _lib.cvocgen_token_to_id(self._handle, data, len(data))
+        return None if token_id == NO_ID else token_id
+
+    def encode(self, text, add_special_tokens=False):
+        """
+        Encode one molecule into token IDs.
+
+        :param text: String, the molecule.
+        :param add_special_tokens: Boolean, whether to add bos and eos tokens.
+        :return: List of integers, the encoded molecule.
+        """
+        data = text.encode("utf-8")
+        ids = (ctypes.c_uint32 * 256)()
+        count = _lib.cvocgen_encode(self._handle, data, len(data), int(add_special_tokens), ids, len(ids))
+        if count > len(ids):
+            ids = (ctypes.c_uint32 * count)()
+            _lib.cvocgen_encode(self._handle, data, len(data), int(add_special_tokens), ids, count)
+        return list(ids[:count])
+
+    def close(self):
+        if self._handle:
+            _lib.cvocgen_tokenizer_free(self._handle)
+            self._handle = None
+
+    def __del__(self):
+        self.close()
+
+
+class Context:
+    """
+    Training options and error state for libcvocgen calls.
+
+    A context must not be used by two threads at once; create one per thread.
+    """
+
+    def __init__(self, smiles=False, threads=1, deduplicate=False, max_memory=0,
+                 spill_directory=None, checkpoint=None, checkpoint_every=0,
+                 checkpoint_seconds=0, snapshots=None, snapshot_prefix=None, vocab_order="insertion",
+                 min_frequency=0, target_vocab_size=0, prune_below=0, cache=None, verbose=False):
+        self._handle = None
+        if vocab_order not in VOCAB_ORDERS:
+            raise ValueError("vocab_order must be one of " + ", ".join(VOCAB_ORDERS))
+        lib = _load()
+        self._handle = lib.cvocgen_context_create()
+        if not self._handle:
+            raise MemoryError("cvocgen_context_create failed")
+        lib.cvocgen_set_format(self._handle, FORMAT_SMILES if smiles else FORMAT_SELFIES)
+        lib.cvocgen_set_threads(self._handle, threads)
+        lib.cvocgen_set_deduplicate(self._handle, int(deduplicate))
+        lib.cvocgen_set_max_memory(self._handle, max_memory,
+                                   os.fsencode(spill_directory) if spill_directory else None)
+        lib.cvocgen_set_checkpoint(self._handle, os.fsencode(checkpoint) if checkpoint else None,
+                                   checkpoint_every, checkpoint_seconds)
+        if snapshots and snapshot_prefix:
+            merges = (ctypes.c_int * len(snapshots))(*snapshots)
+            lib.cvocgen_set_snapshots(self._handle, merges, len(snapshots), os.fsencode(snapshot_prefix))
+        lib.cvocgen_set_vocab_order(self._handle, VOCAB_ORDERS[vocab_order])
+        lib.cvocgen_set_stop_rules(self._handle, min_frequency, target_vocab_size)
+        lib.cvocgen_set_prune_below(self._handle, prune_below)
+        lib.cvocgen_set_cache(self._handle, os.fsencode(cache) if cache else None)
+        lib.cvocgen_set_verbose(self._handle, int(verbose))
+
+    @property
+    def last_error(self):
+        return _lib.cvocgen_last_error(self._handle).decode("utf-8", "replace")
+
+    def _train(self, train, extend):
+        _lib.cvocgen_set_extend(self._handle, os.fsencode(extend) if extend else None)
+        try:
+            handle = train()
+        finally:
+            _lib.cvocgen_set_extend(self._handle, None)
+        if not handle:
+            raise CvocgenError(self.last_error)
+        return Model(self, handle)
+
+    def train_file(self, path, num_merges, extend=None):
+        """
+        Train on a corpus file with one molecule per line.
+
+        :param path: String, the corpus file ("-" reads stdin).
+        :param num_merges: Int, the total number of merges.
+        :param extend: String, a vocab_<n>.txt whose merges are replayed first.
+        :return: Model, the trained vocabulary.
+        """
+        return self._train(lambda: _lib.cvocgen_train_file(self._handle, os.fsencode(path), num_merges), extend)
+
+    def train_buffer(self, corpus, num_merges, extend=None):
+        """
+        Train on an in-memory corpus.
+
+        :param corpus: Bytes or string with one molecule per line, or an iterable of molecules.
+        :param num_merges: Int, the total number of merges.
+        :param extend: String, a vocab_<n>.txt whose merges are replayed first.
+        :return: Model, the trained vocabulary.
+        """
+        if isinstance(corpus, str):
+            data = corpus.encode("utf-8")
+        elif isinstance(corpus, (bytes, bytearray)):
+            data = bytes(corpus)
+        else:
+            data = "\n".join(corpus).encode("utf-8")
+        return self._train(lambda: _lib.cvocgen_train_buffer(self._handle, data, len(data), num_merges), extend)
+
+    def resume(self, checkpoint, num_merges):
+        """
+        Continue a checkpointed training run.
+
+        :param checkpoint: String, the checkpoint file.
+        :param num_merges: Int, the total number of merges.
+        :return: Model, the trained vocabulary.
+        """
+        handle = _lib.cvocgen_resume(self._handle, os.fsencode(checkpoint), num_merges)
+        if not handle:
+            raise CvocgenError(self.last_error)
+        return Model(self, handle)
+
+    def load(self, path):
+        """
+        Load a binary vocabulary (.bin) for encoding.
+
+        :param path: String, the .bin file.
+        :return: Tokenizer, the loaded vocabulary.
+        """
+        handle = _lib.cvocgen_load(self._handle, os.fsencode(path))
+        if not handle:
+            raise CvocgenError(self.last_error)
+        return Tokenizer(handle)
+
+    def close(self):
+        if self._handle:
+            _lib.cvocgen_context_free(self._handle)
+            self._handle = None
+
+    def __del__(self):
+        self.close()
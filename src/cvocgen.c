@@ -9,23 +9,74 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <limits.h>  /* For PATH_MAX */
+#include <pthread.h>
 #include "progress_bar.h"
+#include "cvocgen_lexer.h"
+#include "cvocgen_corpus.h"
+#include "cvocgen_threads.h"
+#include "cvocgen_segments.h"
+#include "cvocgen_vocab.h"
+#include "cvocgen_checkpoint.h"
+#include "cvocgen_stats.h"
+#include "cvocgen_cluster.h"
+#include "cvocgen_cache.h"
+#include "cvocgen_serve.h"
 
-// Global variables
-int input_format_is_smiles = 0; // 0 = SELFIES (default), 1 = SMILES
-char output_directory[PATH_MAX] = "."; // Default to current directory
+// Format and lexer of pre_tokenize and the other tokenizers without explicit
+// options; the command line sets them, libcvocgen keeps the defaults
+static int input_format_is_smiles = 0; // 0 = SELFIES (default), 1 = SMILES
+static int lexer_mode = LEXER_FAST;
 
-// Hash function
-unsigned int hash(const char* key, unsigned int size) {
-    unsigned long int value = 0;
-    unsigned int i = 0;
-    unsigned int key_len = strlen(key);
+// 64x64 -> 128-bit multiply, folded to 64 bits
+static inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
 
-    for (; i < key_len; ++i) {
-        value = value * 37 + key[i];
-    }
+static inline uint64_t hash_read64(const unsigned char* p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t hash_read32(const unsigned char* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// String hash (wyhash-style: 16 bytes per step, one multiply per 8 bytes).
+// The key need not be NUL-terminated.
+uint64_t hash_bytes(const char* key, size_t len) {
+    const uint64_t s0 = 0xa0761d6478bd642fULL, s1 = 0xe7037ed1a0b428dbULL, s2 = 0x8ebc6af09c88c6e3ULL;
+    const unsigned char* p = (const unsigned char*)key;
+    uint64_t seed = s0 ^ hash_mix(len ^ s1, s2);
+    uint64_t a, b;
 
-    return value % size;
+    if (len <= 16) {
+        if (len >= 8) {
+            a = hash_read64(p);
+            b = hash_read64(p + len - 8);
+        } else if (len >= 4) {
+            a = hash_read32(p);
+            b = hash_read32(p + len - 4);
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t remaining = len;
+        while (remaining > 16) {
+            seed = hash_mix(hash_read64(p) ^ s1, hash_read64(p + 8) ^ seed);
+            p += 16;
+            remaining -= 16;
+        }
+        a = hash_read64(p + remaining - 16);
+        b = hash_read64(p + remaining - 8);
+    }
+    return hash_mix(s1 ^ len, hash_mix(a ^ s1, b ^ seed));
 }
 
 // Create a hash table with default load threshold
@@ -39,15 +90,25 @@ HashTable* ht_create_with_threshold(unsigned int size, float load_threshold) {
     if (size == 0) {
         size = HT_DEFAULT_SIZE;
     }
-    
+
     HashTable* ht = malloc(sizeof(HashTable));
     if (!ht) return NULL;
 
-    ht->size = size;
+    // Power-of-two slot count so probing can mask instead of taking a modulus
+    unsigned int slots = 16;
+    while (slots < size) slots <<= 1;
+
+    ht->size = slots;
     ht->count = 0;
+    ht->capacity = (unsigned int)(slots * load_threshold) + 1;
     ht->load_threshold = load_threshold;
-    ht->items = calloc(ht->size, sizeof(Ht_item*));
-    if (!ht->items) {
+    ht->resizes = 0;
+    ht->items = malloc(sizeof(Ht_item) * ht->capacity);
+    ht->slots = calloc(ht->size, sizeof(uint32_t));
+    arena_init(&ht->keys);
+    if (!ht->items || !ht->slots) {
+        free(ht->items);
+        free(ht->slots);
         free(ht);
         return NULL;
     }
@@ -58,148 +119,274 @@ HashTable* ht_create_with_threshold(unsigned int size, float load_threshold) {
 void ht_free(HashTable* ht) {
     if (!ht) return;
 
-    for (unsigned int i = 0; i < ht->size; ++i) {
-        Ht_item* item = ht->items[i];
-        while (item) {
-            Ht_item* next = item->next;
-            free(item->key);
-            free(item);
-            item = next;
-        }
-    }
-
+    arena_free(&ht->keys);
     free(ht->items);
+    free(ht->slots);
     free(ht);
 }
 
-// Search in hash table for an item
-Ht_item* hash_search(HashTable* ht, const char* key) {
-    unsigned int slot = hash(key, ht->size);
-    Ht_item* item = ht->items[slot];
-
-    while (item) {
-        if (strcmp(item->key, key) == 0) {
-            return item;
+// Find the slot holding key, or the empty slot where it would go
+static inline uint32_t ht_find_slot(const HashTable* ht, const char* key, uint32_t hash) {
+    uint32_t mask = ht->size - 1;
+    uint32_t slot = hash & mask;
+    while (ht->slots[slot]) {
+        const Ht_item* item = &ht->items[ht->slots[slot] - 1];
+        if (item->hash == hash && strcmp(item->key, key) == 0) {
+            break;
         }
-        item = item->next;
+        slot = (slot + 1) & mask;
     }
-    return NULL;
+    return slot;
+}
+
+// Search in hash table for an item
+Ht_item* hash_search(HashTable* ht, const char* key) {
+    uint32_t slot = ht_find_slot(ht, key, (uint32_t)hash_bytes(key, strlen(key)));
+    return ht->slots[slot] ? &ht->items[ht->slots[slot] - 1] : NULL;
 }
 
-// Resize the hash table to a new size
+// Resize the hash table index to at least new_size slots
 int ht_resize(HashTable* ht, unsigned int new_size) {
     if (!ht || new_size == 0) return 0;
-    
-    // Create a new items array
-    Ht_item** new_items = calloc(new_size, sizeof(Ht_item*));
-    if (!new_items) return 0;
-    
-    // Rehash all existing items
-    for (unsigned int i = 0; i < ht->size; ++i) {
-        Ht_item* item = ht->items[i];
-        while (item) {
-            // Get next item before modifying current item
-            Ht_item* next = item->next;
-            
-            // Insert item into new array
-            unsigned int new_slot = hash(item->key, new_size);
-            item->next = new_items[new_slot];
-            new_items[new_slot] = item;
-            
-            // Move to next item
-            item = next;
-        }
+
+    unsigned int slots = 16;
+    while (slots < new_size || slots * ht->load_threshold <= ht->count) slots <<= 1;
+
+    uint32_t* new_slots = calloc(slots, sizeof(uint32_t));
+    if (!new_slots) return 0;
+
+    // Reinsert every item using its cached hash
+    uint32_t mask = slots - 1;
+    for (unsigned int i = 0; i < ht->count; ++i) {
+        uint32_t slot = ht->items[i].hash & mask;
+        while (new_slots[slot]) slot = (slot + 1) & mask;
+        new_slots[slot] = i + 1;
     }
-    
-    // Free old array and update hash table
-    free(ht->items);
-    ht->items = new_items;
-    ht->size = new_size;
-    
+
+    free(ht->slots);
+    ht->slots = new_slots;
+    ht->size = slots;
+    ht->resizes++;
     return 1;
 }
 
-// Insert into hash table or increment count
-void hash_insert_or_increment(HashTable* ht, const char* key) {
-    // Check if we need to resize before inserting
-    float load_factor = (float)(ht->count + 1) / ht->size;
-    if (load_factor >= ht->load_threshold) {
-        // Double the size when resizing
-        ht_resize(ht, ht->size * 2);
+// Look up key, inserting it with a count of 0 if it is not present yet
+static Ht_item* ht_lookup_or_insert(HashTable* ht, const char* key) {
+    size_t len = strlen(key);
+    uint32_t hash = (uint32_t)hash_bytes(key, len);
+    uint32_t slot = ht_find_slot(ht, key, hash);
+    if (ht->slots[slot]) {
+        return &ht->items[ht->slots[slot] - 1];
     }
-    
-    Ht_item* item = hash_search(ht, key);
 
-    if (item) {
-        // Found, increment count
-        item->count++;
-    } else {
-        // Not found, insert new item with count 1
-        unsigned int slot = hash(key, ht->size);
-        Ht_item* new_item = malloc(sizeof(Ht_item));
-        new_item->key = strdup(key);
-        new_item->count = 1;
-        new_item->next = ht->items[slot];
-        ht->items[slot] = new_item;
-        
-        // Increment item count
-        ht->count++;
+    if ((float)(ht->count + 1) / ht->size >= ht->load_threshold) {
+        // Double the size when resizing
+        if (!ht_resize(ht, ht->size * 2)) return NULL;
+        slot = ht_find_slot(ht, key, hash);
+    }
+    if (ht->count >= ht->capacity) {
+        unsigned int capacity = ht->capacity * 2;
+        Ht_item* items = realloc(ht->items, sizeof(Ht_item) * capacity);
+        if (!items) return NULL;
+        ht->items = items;
+        ht->capacity = capacity;
     }
+
+    Ht_item* item = &ht->items[ht->count];
+    item->key = arena_strndup(&ht->keys, key, len);
+    if (!item->key) return NULL;
+    item->count = 0;
+    item->hash = hash;
+    ht->slots[slot] = ++ht->count;
+    return item;
 }
 
-// Pre-tokenize a string using a regex pattern based on input format
-TokenList* pre_tokenize(const char* text) {
-    const char* smiles_pattern = "(\\[[^]]+\\]|Br?|Cl?|N|O|S|P|F|I|b|c|n|o|s|p|\\(|\\)|\\.|=|#|-|\\+|\\\\|/|:|~|@|\\?|>|\\*|\\$|%[0-9]{2}|[0-9])";
-    const char* selfies_pattern = "(\\[[^]]+\\]|\\.)";
-    
-    // Choose pattern based on global format setting
-    const char* pattern = input_format_is_smiles ? smiles_pattern : selfies_pattern;
+// Insert into hash table or increment count
+void hash_insert_or_increment(HashTable* ht, const char* key) {
+    Ht_item* item = ht_lookup_or_insert(ht, key);
+    if (item) item->count++;
+}
 
-    regex_t re;
-    int reti;
+// Add delta to the count of a key, inserting it if it is not present yet
+Ht_item* hash_add(HashTable* ht, const char* key, int64_t delta) {
+    Ht_item* item = ht_lookup_or_insert(ht, key);
+    if (item) item->count += delta;
+    return item;
+}
 
-    reti = regcomp(&re, pattern, REG_EXTENDED);
-    if (reti) {
-        fprintf(stderr, "Could not compile regex\n");
-        return NULL;
+// Set the count of a key, inserting it if it is not present yet
+Ht_item* hash_set(HashTable* ht, const char* key, int64_t count) {
+    Ht_item* item = ht_lookup_or_insert(ht, key);
+    if (item) item->count = count;
+    return item;
+}
+
+// Append a token to a token list
+static void token_list_push(TokenList* list, const char* token, size_t len) {
+    if (list->count >= list->capacity) {
+        list->capacity *= 2;
+        list->tokens = realloc(list->tokens, sizeof(char*) * list->capacity);
     }
 
+    list->tokens[list->count++] = arena_strndup(&list->strings, token, len);
+}
+
+// Create a token list for a text of len bytes. No token is empty, so the text
+// holds at most len tokens taking at most 2 * len bytes with their NULs; both
+// the token array and the first block of strings are sized for that.
+static TokenList* token_list_create(size_t len) {
     TokenList* list = malloc(sizeof(TokenList));
-    list->tokens = malloc(sizeof(char*) * 10); // Initial capacity
+    list->capacity = len ? len : 1;
+    list->tokens = malloc(sizeof(char*) * list->capacity);
     list->count = 0;
-    list->capacity = 10;
+    arena_init(&list->strings);
+    arena_reserve(&list->strings, 2 * len + 1);
+    return list;
+}
+
+// Generate the tokenizers of a format from its scanner, lex_<fmt>_scanner_next.
+// Every loop calls that scanner directly, so it inlines into each of them.
+#define DEFINE_INPUT_FORMAT(fmt)                                                            \
+static void tokenize_##fmt(TokenList* list, const char* text, size_t len) {                 \
+    LexScanner scan;                                                                        \
+    lex_scanner_init(&scan, text, text + len);                                              \
+    const char* start;                                                                      \
+    size_t token_len;                                                                       \
+    while ((token_len = lex_##fmt##_scanner_next(&scan, &start)) > 0) {                     \
+        token_list_push(list, start, token_len);                                            \
+    }                                                                                       \
+}                                                                                           \
+static long intern_##fmt(SymbolTable* st, uint32_t* ids, const char* text, size_t len) {    \
+    LexScanner scan;                                                                        \
+    lex_scanner_init(&scan, text, text + len);                                              \
+    const char* start;                                                                      \
+    size_t token_len;                                                                       \
+    long count = 0;                                                                         \
+    while ((token_len = lex_##fmt##_scanner_next(&scan, &start)) > 0) {                     \
+        ids[count] = symbol_table_intern(st, start, token_len);                             \
+        if (ids[count++] == UINT32_MAX) return -1;                                          \
+    }                                                                                       \
+    return count;                                                                           \
+}                                                                                           \
+static size_t lookup_##fmt(const BinaryVocab* vocab, uint32_t unk_id, uint32_t* ids,        \
+                           const char* text, size_t len) {                                  \
+    LexScanner scan;                                                                        \
+    lex_scanner_init(&scan, text, text + len);                                              \
+    const char* start;                                                                      \
+    size_t token_len;                                                                       \
+    size_t count = 0;                                                                       \
+    while ((token_len = lex_##fmt##_scanner_next(&scan, &start)) > 0) {                     \
+        uint32_t id = binary_vocab_find(vocab, start, token_len);                           \
+        ids[count++] = id == UINT32_MAX ? unk_id : id;                                      \
+    }                                                                                       \
+    return count;                                                                           \
+}
+
+DEFINE_INPUT_FORMAT(selfies)
+DEFINE_INPUT_FORMAT(smiles)
+
+static const InputFormat input_formats[FORMAT_COUNT] = {
+    [FORMAT_SELFIES] = {
+        "SELFIES", "(\\[[^]]+\\]|\\.)",
+        tokenize_selfies, intern_selfies, lookup_selfies
+    },
+    [FORMAT_SMILES] = {
+        "SMILES", "(\\[[^]]+\\]|Br?|Cl?|N|O|S|P|F|I|b|c|n|o|s|p|\\(|\\)|\\.|=|#|-|\\+|\\\\|/|:|~|@|\\?|>|\\*|\\$|%[0-9]{2}|[0-9])",
+        tokenize_smiles, intern_smiles, lookup_smiles
+    },
+};
+
+const InputFormat* input_format(int format) {
+    return format > 0 && format < FORMAT_COUNT ? &input_formats[format] : &input_formats[FORMAT_SELFIES];
+}
+
+// Pre-tokenize a string using the regex pattern of a format (is_smiles: 0 = SELFIES, 1 = SMILES)
+TokenList* pre_tokenize_regex_for(const char* text, int is_smiles) {
+    // Compile each pattern once and keep it for later calls
+    static regex_t compiled[FORMAT_COUNT];
+    static int is_compiled[FORMAT_COUNT];
+
+    static pthread_mutex_t compile_lock = PTHREAD_MUTEX_INITIALIZER;
+    const InputFormat* input = input_format(is_smiles);
+    int format = (int)(input - input_formats);
+
+    pthread_mutex_lock(&compile_lock);
+    if (!is_compiled[format]) {
+        if (regcomp(&compiled[format], input->pattern, REG_EXTENDED)) {
+            pthread_mutex_unlock(&compile_lock);
+            fprintf(stderr, "Could not compile regex\n");
+            return NULL;
+        }
+        is_compiled[format] = 1;
+    }
+    pthread_mutex_unlock(&compile_lock);
+    regex_t* re = &compiled[format];
+
+    TokenList* list = token_list_create(strlen(text));
 
     const char* p = text;
     regmatch_t pmatch[1];
 
     while (1) {
-        if (regexec(&re, p, 1, pmatch, 0)) {
+        if (regexec(re, p, 1, pmatch, 0)) {
             break; // No more matches
         }
 
-        int len = pmatch[0].rm_eo - pmatch[0].rm_so;
-        if (list->count >= list->capacity) {
-            list->capacity *= 2;
-            list->tokens = realloc(list->tokens, sizeof(char*) * list->capacity);
-        }
+        token_list_push(list, p + pmatch[0].rm_so, pmatch[0].rm_eo - pmatch[0].rm_so);
+        p += pmatch[0].rm_eo;
+    }
 
-        char* token = malloc(len + 1);
-        strncpy(token, p + pmatch[0].rm_so, len);
-        token[len] = '\0';
-        list->tokens[list->count++] = token;
+    return list;
+}
 
-        p += pmatch[0].rm_eo;
+// Pre-tokenize a string with the hand-written lexer for a format
+TokenList* pre_tokenize_fast_for(const char* text, int is_smiles) {
+    size_t text_len = strlen(text);
+    TokenList* list = token_list_create(text_len);
+    input_format(is_smiles)->tokenize(list, text, text_len);
+    return list;
+}
+
+// Pre-tokenize a string with the tokenizer selected by mode (LEXER_*).
+// LEXER_CHECK runs both tokenizers and reports lines where they disagree.
+TokenList* pre_tokenize_for(const char* text, int is_smiles, int mode) {
+    if (mode == LEXER_REGEX) {
+        return pre_tokenize_regex_for(text, is_smiles);
     }
 
-    regfree(&re);
+    TokenList* list = pre_tokenize_fast_for(text, is_smiles);
+    if (mode == LEXER_CHECK) {
+        TokenList* expected = pre_tokenize_regex_for(text, is_smiles);
+        int same = expected && expected->count == list->count;
+        for (size_t i = 0; same && i < list->count; ++i) {
+            same = strcmp(expected->tokens[i], list->tokens[i]) == 0;
+        }
+        if (!same) {
+            fprintf(stderr, "Lexer mismatch, using regex tokens for: %s\n", text);
+            free_token_list(list);
+            return expected;
+        }
+        free_token_list(expected);
+    }
     return list;
 }
 
+// The command-line tokenizers: format and lexer come from the global options
+TokenList* pre_tokenize(const char* text) {
+    return pre_tokenize_for(text, input_format_is_smiles, lexer_mode);
+}
+
+TokenList* pre_tokenize_fast(const char* text) {
+    return pre_tokenize_fast_for(text, input_format_is_smiles);
+}
+
+TokenList* pre_tokenize_regex(const char* text) {
+    return pre_tokenize_regex_for(text, input_format_is_smiles);
+}
+
 void free_token_list(TokenList* list) {
     if (!list) return;
-    for (size_t i = 0; i < list->count; ++i) {
-        free(list->tokens[i]);
-    }
+    arena_free(&list->strings);
     free(list->tokens);
     free(list);
 }
@@ -222,30 +409,31 @@ HashTable* get_word_counts(const char* text) {
 }
 
 unsigned int count_unique_tokens(HashTable* ht) {
-    unsigned int count = 0;
-    for (unsigned int i = 0; i < ht->size; ++i) {
-        Ht_item* item = ht->items[i];
-        while (item) {
-            count++;
-            item = item->next;
-        }
-    }
-    return count;
+    return ht->count;
 }
 
 void print_word_counts(HashTable* ht) {
     if (!ht) return;
     printf("Word Counts:\n");
     printf("Unique tokens: %u\n", count_unique_tokens(ht));
-    for (unsigned int i = 0; i < ht->size; ++i) {
-        Ht_item* item = ht->items[i];
-        while (item) {
-            printf("  - '%s': %d\n", item->key, item->count);
-            item = item->next;
-        }
+    for (unsigned int i = 0; i < ht->count; ++i) {
+        Ht_item* item = &ht->items[i];
+        printf("  - '%s': %lld\n", item->key, (long long)item->count);
     }
 }
 
+// Join a, sep and b into buf when they fit in size bytes, else into a malloc'd
+// string; the caller frees the result when it is not buf. Tokens are never cut short.
+static char* join_tokens(char* buf, size_t size, const char* a, const char* sep, const char* b) {
+    size_t a_len = strlen(a), sep_len = strlen(sep), b_len = strlen(b);
+    size_t len = a_len + sep_len + b_len;
+    char* out = len < size ? buf : malloc(len + 1);
+    memcpy(out, a, a_len);
+    memcpy(out + a_len, sep, sep_len);
+    memcpy(out + a_len + sep_len, b, b_len + 1);
+    return out;
+}
+
 // Get statistics on adjacent pairs
 HashTable* get_pair_stats(TokenList* tokens) {
     if (!tokens || tokens->count < 2) {
@@ -253,35 +441,43 @@ HashTable* get_pair_stats(TokenList* tokens) {
     }
 
     HashTable* stats = ht_create(HT_DEFAULT_SIZE / 10); // Create a new hash table for pair stats
+    accumulate_pair_stats(stats, tokens);
+    return stats;
+}
+
+// Add the adjacent pairs of a token list to an existing pair stats table
+void accumulate_pair_stats(HashTable* stats, TokenList* tokens) {
+    if (!stats || !tokens || tokens->count < 2) {
+        return;
+    }
 
     for (size_t i = 0; i < tokens->count - 1; ++i) {
         // Create a key for the pair, e.g., "[C] [C]"
-        char pair_key[256];
-        snprintf(pair_key, sizeof(pair_key), "%s %s", tokens->tokens[i], tokens->tokens[i+1]);
+        char stack_key[256];
+        char* pair_key = join_tokens(stack_key, sizeof(stack_key), tokens->tokens[i], " ", tokens->tokens[i+1]);
         hash_insert_or_increment(stats, pair_key);
+        if (pair_key != stack_key) free(pair_key);
     }
-
-    return stats;
 }
 
 // Find the best (most frequent) pair in the stats hash table
 // Returns the best pair and sets *count to its frequency
-const char* get_best_pair(HashTable* stats, int* count) {
+const char* get_best_pair(HashTable* stats, int64_t* count) {
     if (!stats || !count) {
         return NULL;
     }
 
     const char* best_pair = NULL;
-    int max_count = -1;
+    int64_t max_count = -1;
 
-    for (unsigned int i = 0; i < stats->size; ++i) {
-        Ht_item* item = stats->items[i];
-        while (item) {
-            if (item->count > max_count) {
-                max_count = item->count;
-                best_pair = item->key;
-            }
-            item = item->next;
+    for (unsigned int i = 0; i < stats->count; ++i) {
+        Ht_item* item = &stats->items[i];
+        // Incrementally maintained stats keep pairs whose count dropped to zero
+        if (item->count > 0 &&
+            (item->count > max_count ||
+             (item->count == max_count && strcmp(item->key, best_pair) < 0))) {
+            max_count = item->count;
+            best_pair = item->key;
         }
     }
     
@@ -311,11 +507,18 @@ TokenList* merge_pair(TokenList* tokens, const char* pair) {
         return tokens;
     }
 
-    // Create a new token list for the result
+    // Create a new token list for the result; it holds no more tokens and no more
+    // bytes than the input
+    size_t bytes = 0;
+    for (size_t i = 0; i < tokens->count; ++i) {
+        bytes += strlen(tokens->tokens[i]) + 1;
+    }
     TokenList* result = malloc(sizeof(TokenList));
-    result->capacity = tokens->capacity;
+    result->capacity = tokens->count ? tokens->count : 1;
     result->count = 0;
     result->tokens = malloc(sizeof(char*) * result->capacity);
+    arena_init(&result->strings);
+    arena_reserve(&result->strings, bytes);
 
     // Process the tokens
     for (size_t i = 0; i < tokens->count; ++i) {
@@ -325,25 +528,18 @@ TokenList* merge_pair(TokenList* tokens, const char* pair) {
             strcmp(tokens->tokens[i+1], second) == 0) {
             
             // Create the merged token
-            char merged[256];
-            snprintf(merged, sizeof(merged), "%s%s", first, second);
+            char stack_merged[256];
+            char* merged = join_tokens(stack_merged, sizeof(stack_merged), first, "", second);
             
             // Add the merged token to the result
-            if (result->count >= result->capacity) {
-                result->capacity *= 2;
-                result->tokens = realloc(result->tokens, sizeof(char*) * result->capacity);
-            }
-            result->tokens[result->count++] = strdup(merged);
+            token_list_push(result, merged, strlen(merged));
+            if (merged != stack_merged) free(merged);
             
             // Skip the next token since we've merged it
             i++;
         } else {
             // Just copy the current token
-            if (result->count >= result->capacity) {
-                result->capacity *= 2;
-                result->tokens = realloc(result->tokens, sizeof(char*) * result->capacity);
-            }
-            result->tokens[result->count++] = strdup(tokens->tokens[i]);
+            token_list_push(result, tokens->tokens[i], strlen(tokens->tokens[i]));
         }
     }
 
@@ -351,373 +547,3515 @@ TokenList* merge_pair(TokenList* tokens, const char* pair) {
     return result;
 }
 
-// Save vocabulary and merges to a file
-// These functions have been moved to cvocgen_io.h
+// Hash for open-addressing tables keyed on 64-bit values
+static inline uint32_t hash_u64(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return (uint32_t)key;
+}
 
-// This function has been moved to cvocgen_io.h
+// Round up to a power of two (at least 16)
+static uint32_t next_pow2(uint32_t n) {
+    uint32_t size = 16;
+    while (size < n) size <<= 1;
+    return size;
+}
 
-// Train BPE on the given text for a specified number of merges
-HashTable* train_bpe(const char* text, int num_merges) {
-    if (!text || num_merges <= 0) {
-        return NULL;
+// Create a symbol table with room for initial_capacity symbols
+SymbolTable* symbol_table_create(uint32_t initial_capacity) {
+    if (initial_capacity == 0) {
+        initial_capacity = 1024;
     }
 
-    // 1. Initial tokenization
-    TokenList* tokens = pre_tokenize(text);
-    if (!tokens) {
+    SymbolTable* st = malloc(sizeof(SymbolTable));
+    if (!st) return NULL;
+
+    st->count = 0;
+    st->resizes = 0;
+    st->capacity = initial_capacity;
+    st->strings = malloc(sizeof(char*) * st->capacity);
+    st->lengths = malloc(sizeof(size_t) * st->capacity);
+    st->slot_mask = next_pow2(initial_capacity * 2) - 1;
+    st->slots = calloc(st->slot_mask + 1, sizeof(uint32_t));
+    if (!st->strings || !st->lengths || !st->slots) {
+        free(st->strings);
+        free(st->lengths);
+        free(st->slots);
+        free(st);
         return NULL;
     }
+    return st;
+}
 
-    // 2. Create initial vocabulary from tokens
-    HashTable* vocab = ht_create(100);
-    for (size_t i = 0; i < tokens->count; ++i) {
-        hash_insert_or_increment(vocab, tokens->tokens[i]);
+void symbol_table_free(SymbolTable* st) {
+    if (!st) return;
+    for (uint32_t i = 0; i < st->count; ++i) {
+        free(st->strings[i]);
     }
+    free(st->strings);
+    free(st->lengths);
+    free(st->slots);
+    free(st);
+}
 
-    // 3. Perform BPE merges
-    char** merges = malloc(sizeof(char*) * num_merges);
-    int merge_count = 0;
+// Double the symbol index and reinsert every symbol; returns -1 if out of memory
+static int symbol_table_grow_index(SymbolTable* st) {
+    uint32_t new_mask = (st->slot_mask + 1) * 2 - 1;
+    uint32_t* new_slots = calloc(new_mask + 1, sizeof(uint32_t));
+    if (!new_slots) return -1;
 
-    for (int i = 0; i < num_merges; ++i) {
-        // Get pair statistics
-        HashTable* pair_stats = get_pair_stats(tokens);
-        if (!pair_stats) {
-            break;
+    for (uint32_t id = 0; id < st->count; ++id) {
+        uint32_t slot = (uint32_t)hash_bytes(st->strings[id], st->lengths[id]) & new_mask;
+        while (new_slots[slot]) slot = (slot + 1) & new_mask;
+        new_slots[slot] = id + 1;
+    }
+    free(st->slots);
+    st->slots = new_slots;
+    st->slot_mask = new_mask;
+    st->resizes++;
+    return 0;
+}
+
+// Return the ID of a token, adding it to the table on first sight
+uint32_t symbol_table_intern(SymbolTable* st, const char* token, size_t len) {
+    uint32_t hash = (uint32_t)hash_bytes(token, len);
+    uint32_t slot = hash & st->slot_mask;
+    while (st->slots[slot]) {
+        uint32_t id = st->slots[slot] - 1;
+        if (st->lengths[id] == len && memcmp(st->strings[id], token, len) == 0) {
+            return id;
         }
+        slot = (slot + 1) & st->slot_mask;
+    }
 
-        // Find the best pair
-        int pair_count = 0;
-        const char* best_pair = get_best_pair(pair_stats, &pair_count);
-        if (!best_pair) {
-            ht_free(pair_stats);
-            break;
+    // Not found, add a new symbol. The index grows before it reaches its load
+    // threshold, so it always keeps free slots and probing ends.
+    if ((float)(st->count + 1) / (st->slot_mask + 1) >= HT_DEFAULT_LOAD_THRESHOLD) {
+        if (symbol_table_grow_index(st) != 0) return UINT32_MAX;
+        slot = hash & st->slot_mask;
+        while (st->slots[slot]) slot = (slot + 1) & st->slot_mask;
+    }
+    if (st->count >= st->capacity) {
+        uint32_t capacity = st->capacity * 2;
+        char** strings = realloc(st->strings, sizeof(char*) * capacity);
+        if (!strings) return UINT32_MAX;
+        st->strings = strings;
+        size_t* lengths = realloc(st->lengths, sizeof(size_t) * capacity);
+        if (!lengths) return UINT32_MAX;
+        st->lengths = lengths;
+        st->capacity = capacity;
+    }
+    char* string = malloc(len + 1);
+    if (!string) return UINT32_MAX;
+    uint32_t id = st->count++;
+    st->strings[id] = string;
+    memcpy(st->strings[id], token, len);
+    st->strings[id][len] = '\0';
+    st->lengths[id] = len;
+    st->slots[slot] = id + 1;
+    return id;
+}
+
+uint32_t symbol_table_find(const SymbolTable* st, const char* token, size_t len) {
+    uint32_t slot = (uint32_t)hash_bytes(token, len) & st->slot_mask;
+    while (st->slots[slot]) {
+        uint32_t id = st->slots[slot] - 1;
+        if (st->lengths[id] == len && memcmp(st->strings[id], token, len) == 0) {
+            return id;
         }
+        slot = (slot + 1) & st->slot_mask;
+    }
+    return UINT32_MAX;
+}
 
-        // Store the merge operation
-        merges[merge_count++] = strdup(best_pair);
+// Return the ID of the concatenation of two symbols
+uint32_t symbol_table_intern_concat(SymbolTable* st, uint32_t left, uint32_t right) {
+    size_t left_len = st->lengths[left];
+    size_t right_len = st->lengths[right];
+    char stack_buf[256];
+    char* buf = (left_len + right_len <= sizeof(stack_buf)) ? stack_buf : malloc(left_len + right_len);
+    if (!buf) return UINT32_MAX;
 
-        // Merge the best pair
-        TokenList* new_tokens = merge_pair(tokens, best_pair);
-        if (!new_tokens) {
-            ht_free(pair_stats);
-            break;
+    memcpy(buf, st->strings[left], left_len);
+    memcpy(buf + left_len, st->strings[right], right_len);
+    uint32_t id = symbol_table_intern(st, buf, left_len + right_len);
+
+    if (buf != stack_buf) free(buf);
+    return id;
+}
+
+// Allocate a molecule with room for capacity IDs. From an arena the list and its
+// IDs are one allocation, so its unused tail can be handed back by id_list_fit.
+IdList* id_list_alloc(Arena* arena, size_t capacity) {
+    IdList* list;
+    if (arena) {
+        list = arena_alloc(arena, sizeof(IdList) + sizeof(uint32_t) * capacity);
+        if (!list) return NULL;
+        list->ids = (uint32_t*)(list + 1);
+    } else {
+        list = malloc(sizeof(IdList));
+        if (!list) return NULL;
+        list->ids = malloc(sizeof(uint32_t) * (capacity ? capacity : 1));
+        if (!list->ids) {
+            free(list);
+            return NULL;
         }
+    }
+    list->count = 0;
+    list->weight = 1;
+    return list;
+}
 
-        // Update the vocabulary with the merged token
-        // Split the pair into first and second tokens
-        char* pair_copy = strdup(best_pair);
-        char* first = pair_copy;
-        char* second = NULL;
-        
-        // Find the space separating the two tokens
-        char* space = strchr(pair_copy, ' ');
-        if (space) {
-            *space = '\0';  // Split the string
-            second = space + 1;
-            
-            // Create the merged token
-            char merged[256];
-            snprintf(merged, sizeof(merged), "%s%s", first, second);
-            
-            // Add to vocabulary
-            hash_insert_or_increment(vocab, merged);
+// Release the room a molecule allocated for capacity IDs does not use
+static void id_list_fit(Arena* arena, IdList* list, size_t capacity) {
+    if (arena) {
+        arena_shrink(arena, list, sizeof(IdList) + sizeof(uint32_t) * capacity,
+                     sizeof(IdList) + sizeof(uint32_t) * list->count);
+    } else if (list->count < capacity) {
+        uint32_t* ids = realloc(list->ids, sizeof(uint32_t) * (list->count ? list->count : 1));
+        if (ids) list->ids = ids;
+    }
+}
+
+// Convert a token list to symbol IDs, interning new tokens
+IdList* intern_token_list(SymbolTable* st, TokenList* tokens) {
+    if (!st || !tokens) return NULL;
+
+    IdList* list = id_list_alloc(NULL, tokens->count);
+    if (!list) return NULL;
+    list->count = tokens->count;
+    for (size_t i = 0; i < tokens->count; ++i) {
+        list->ids[i] = symbol_table_intern(st, tokens->tokens[i], strlen(tokens->tokens[i]));
+        if (list->ids[i] == UINT32_MAX) {
+            free_id_list(list);
+            return NULL;
         }
-        free(pair_copy);
+    }
+    return list;
+}
 
-        // Free old tokens and update
+// Tokenize a (not necessarily NUL-terminated) line straight into symbol IDs.
+// The fast lexer interns its token views without copying them; the regex
+// and check modes tokenize a NUL-terminated copy through pre_tokenize_for.
+long pre_tokenize_ids_into(SymbolTable* st, uint32_t* ids, const char* text, size_t len,
+                           int is_smiles, int mode) {
+    if (mode != LEXER_FAST) {
+        char* copy = malloc(len + 1);
+        if (!copy) return -1;
+        memcpy(copy, text, len);
+        copy[len] = '\0';
+        TokenList* tokens = pre_tokenize_for(copy, is_smiles, mode);
+        free(copy);
+        if (!tokens) return -1;
+        long count = (long)tokens->count;
+        for (size_t i = 0; count >= 0 && i < tokens->count; ++i) {
+            ids[i] = symbol_table_intern(st, tokens->tokens[i], strlen(tokens->tokens[i]));
+            if (ids[i] == UINT32_MAX) count = -1;
+        }
         free_token_list(tokens);
-        tokens = new_tokens;
+        return count;
+    }
 
-        ht_free(pair_stats);
+    return input_format(is_smiles)->intern(st, ids, text, len);
+}
+
+// Tokenize a line into a new molecule. No token is empty, so the line holds at
+// most len of them: the ID array is allocated at that size and trimmed once the
+// line is done, rather than grown.
+IdList* pre_tokenize_ids_for(SymbolTable* st, Arena* arena, const char* text, size_t len,
+                             int is_smiles, int mode) {
+    IdList* list = id_list_alloc(arena, len);
+    if (!list) return NULL;
+    long count = pre_tokenize_ids_into(st, list->ids, text, len, is_smiles, mode);
+    list->count = count > 0 ? (size_t)count : 0;
+    id_list_fit(arena, list, len);
+    if (count < 0) {
+        if (!arena) free_id_list(list);
+        return NULL;
     }
+    return list;
+}
 
-    // Save the vocabulary and merges in both formats
-    save_vocabulary(vocab, merges, merge_count, "vocab.txt");
-    save_vocabulary_json(vocab, merges, merge_count, "vocab");
+IdList* pre_tokenize_ids(SymbolTable* st, const char* text, size_t len) {
+    return pre_tokenize_ids_for(st, NULL, text, len, input_format_is_smiles, lexer_mode);
+}
 
-    // Free the merge operations array
-    for (int i = 0; i < merge_count; ++i) {
-        free(merges[i]);
+void free_id_list(IdList* list) {
+    if (!list) return;
+    free(list->ids);
+    free(list);
+}
+
+static inline uint32_t hash_id_list(const IdList* list) {
+    return (uint32_t)hash_bytes((const char*)list->ids, list->count * sizeof(uint32_t));
+}
+
+int dedup_id_lists(IdList* molecules, int molecule_count) {
+    if (!molecules || molecule_count <= 0) {
+        return 0;
     }
-    free(merges);
 
-    // Free the final token list
-    free_token_list(tokens);
+    // Open-addressing index over the unique molecules: index + 1, 0 = empty.
+    // Past 2^30 molecules the index stays at 2^31 slots, still more than INT_MAX.
+    uint32_t mask = (molecule_count > (1 << 30) ? 1u << 31 : next_pow2((uint32_t)molecule_count * 2)) - 1;
+    uint32_t* slots = calloc(mask + 1, sizeof(uint32_t));
+    if (!slots) {
+        return molecule_count;
+    }
 
-    return vocab;
+    int unique = 0;
+    for (int i = 0; i < molecule_count; ++i) {
+        IdList mol = molecules[i];
+        uint32_t slot = hash_id_list(&mol) & mask;
+        IdList* found = NULL;
+        while (slots[slot]) {
+            IdList* other = &molecules[slots[slot] - 1];
+            if (other->count == mol.count &&
+                memcmp(other->ids, mol.ids, mol.count * sizeof(uint32_t)) == 0) {
+                found = other;
+                break;
+            }
+            slot = (slot + 1) & mask;
+        }
+
+        if (found) {
+            found->weight += mol.weight;
+        } else {
+            molecules[unique] = mol;
+            slots[slot] = ++unique;
+        }
+    }
+
+    free(slots);
+    return unique;
 }
 
-// Train BPE on a corpus from a file
-HashTable* train_bpe_from_file(const char* corpus_file, int num_merges) {
-    if (!corpus_file || num_merges < 0) {
-        return NULL;
+void molecule_set_init(MoleculeSet* set) {
+    memset(set, 0, sizeof(*set));
+}
+
+// Make room for n more IDs after the last molecule's; returns where they go, or
+// NULL when out of memory. The buffer may move, so spans are only pointed at by
+// molecule_set_seal.
+uint32_t* molecule_set_reserve(MoleculeSet* set, size_t n) {
+    if (!set->ids || set->id_count + n > set->id_capacity) {
+        size_t capacity = set->id_capacity ? set->id_capacity : 4096;
+        while (capacity < set->id_count + n) capacity *= 2;
+        uint32_t* ids = realloc(set->ids, sizeof(uint32_t) * capacity);
+        if (!ids) return NULL;
+        set->ids = ids;
+        set->id_capacity = capacity;
+    }
+    return set->ids + set->id_count;
+}
+
+// Add a molecule whose count IDs were written at molecule_set_reserve's place.
+// Returns 0, or -1 with errno set when out of memory or past INT_MAX molecules.
+int molecule_set_push(MoleculeSet* set, size_t count, int64_t weight) {
+    if (set->count == INT_MAX) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+    if (set->count >= set->capacity) {
+        int capacity = !set->capacity ? 1024 : set->capacity > INT_MAX / 2 ? INT_MAX : set->capacity * 2;
+        IdList* molecules = realloc(set->molecules, sizeof(IdList) * capacity);
+        if (!molecules) return -1;
+        set->molecules = molecules;
+        set->capacity = capacity;
+    }
+    set->molecules[set->count++] = (IdList){ NULL, count, weight };
+    set->id_count += count;
+    return 0;
+}
+
+// Point every molecule at its span. Until the first merge the spans are packed,
+// so molecule i starts where molecule i - 1 ends.
+void molecule_set_seal(MoleculeSet* set) {
+    size_t offset = 0;
+    for (int i = 0; i < set->count; ++i) {
+        set->molecules[i].ids = set->ids + offset;
+        offset += set->molecules[i].count;
+    }
+}
+
+// Make room for molecule_count molecules and id_count IDs in all; returns 0, or
+// -1 when out of memory
+int molecule_set_grow(MoleculeSet* set, int molecule_count, size_t id_count) {
+    if (id_count > set->id_capacity || !set->ids) {
+        uint32_t* ids = realloc(set->ids, sizeof(uint32_t) * (id_count ? id_count : 1));
+        if (!ids) return -1;
+        set->ids = ids;
+        set->id_capacity = id_count ? id_count : 1;
+    }
+    if (molecule_count > set->capacity || !set->molecules) {
+        IdList* molecules = realloc(set->molecules, sizeof(IdList) * (molecule_count ? molecule_count : 1));
+        if (!molecules) return -1;
+        set->molecules = molecules;
+        set->capacity = molecule_count ? molecule_count : 1;
+    }
+    return 0;
+}
+
+// Give back the room beyond the molecules and IDs in use
+void molecule_set_trim(MoleculeSet* set) {
+    if (set->ids && set->id_count < set->id_capacity) {
+        uint32_t* ids = realloc(set->ids, sizeof(uint32_t) * (set->id_count ? set->id_count : 1));
+        if (ids) {
+            set->ids = ids;
+            set->id_capacity = set->id_count ? set->id_count : 1;
+        }
+    }
+    if (set->molecules && set->count < set->capacity) {
+        IdList* molecules = realloc(set->molecules, sizeof(IdList) * (set->count ? set->count : 1));
+        if (molecules) {
+            set->molecules = molecules;
+            set->capacity = set->count ? set->count : 1;
+        }
     }
+}
+
+// Pack the spans of the molecules left (after dedup_id_lists or merges) to the
+// front of the buffer and give the rest back. They are still in buffer order,
+// so each moves down over space that is no longer used.
+void molecule_set_compact(MoleculeSet* set) {
+    size_t offset = 0;
+    for (int i = 0; i < set->count; ++i) {
+        IdList* mol = &set->molecules[i];
+        memmove(set->ids + offset, mol->ids, sizeof(uint32_t) * mol->count);
+        offset += mol->count;
+    }
+    set->id_count = offset;
+    molecule_set_trim(set);
+    molecule_set_seal(set);
+}
+
+// Drop every molecule, keeping the buffers for reuse
+void molecule_set_clear(MoleculeSet* set) {
+    set->count = 0;
+    set->id_count = 0;
+}
+
+void molecule_set_free(MoleculeSet* set) {
+    free(set->molecules);
+    free(set->ids);
+    molecule_set_init(set);
+}
+
+// Create a pair table with room for initial_capacity distinct pairs
+PairTable* pair_table_create(uint32_t initial_capacity) {
+    if (initial_capacity == 0) {
+        initial_capacity = HT_DEFAULT_SIZE;
+    }
+
+    PairTable* pt = malloc(sizeof(PairTable));
+    if (!pt) return NULL;
+
+    pt->count = 0;
+    pt->resizes = 0;
+    pt->capacity = initial_capacity;
+    pt->keys = malloc(sizeof(uint64_t) * pt->capacity);
+    pt->counts = malloc(sizeof(int64_t) * pt->capacity);
+    pt->slot_mask = next_pow2(initial_capacity * 2) - 1;
+    pt->slots = calloc(pt->slot_mask + 1, sizeof(uint32_t));
+    if (!pt->keys || !pt->counts || !pt->slots) {
+        free(pt->keys);
+        free(pt->counts);
+        free(pt->slots);
+        free(pt);
+        return NULL;
+    }
+    return pt;
+}
+
+void pair_table_free(PairTable* pt) {
+    if (!pt) return;
+    free(pt->keys);
+    free(pt->counts);
+    free(pt->slots);
+    free(pt);
+}
+
+// Double the pair index and reinsert every pair; returns -1 if out of memory
+static int pair_table_grow_index(PairTable* pt) {
+    uint32_t new_mask = (pt->slot_mask + 1) * 2 - 1;
+    uint32_t* new_slots = calloc(new_mask + 1, sizeof(uint32_t));
+    if (!new_slots) return -1;
+
+    for (uint32_t idx = 0; idx < pt->count; ++idx) {
+        uint32_t slot = hash_u64(pt->keys[idx]) & new_mask;
+        while (new_slots[slot]) slot = (slot + 1) & new_mask;
+        new_slots[slot] = idx + 1;
+    }
+    free(pt->slots);
+    pt->slots = new_slots;
+    pt->slot_mask = new_mask;
+    pt->resizes++;
+    return 0;
+}
+
+// Add delta to the count of a pair, inserting it if needed; returns its pair index,
+// or UINT32_MAX if out of memory (the table is left as it was)
+uint32_t pair_table_add(PairTable* pt, uint64_t key, int64_t delta) {
+    uint32_t hash = hash_u64(key);
+    uint32_t slot = hash & pt->slot_mask;
+    while (pt->slots[slot]) {
+        uint32_t idx = pt->slots[slot] - 1;
+        if (pt->keys[idx] == key) {
+            pt->counts[idx] += delta;
+            return idx;
+        }
+        slot = (slot + 1) & pt->slot_mask;
+    }
+
+    // Grow the index before it reaches its load threshold, as symbol_table_intern does
+    if ((float)(pt->count + 1) / (pt->slot_mask + 1) >= HT_DEFAULT_LOAD_THRESHOLD) {
+        if (pair_table_grow_index(pt) != 0) return UINT32_MAX;
+        slot = hash & pt->slot_mask;
+        while (pt->slots[slot]) slot = (slot + 1) & pt->slot_mask;
+    }
+    if (pt->count >= pt->capacity) {
+        uint32_t capacity = pt->capacity * 2;
+        uint64_t* keys = realloc(pt->keys, sizeof(uint64_t) * capacity);
+        if (!keys) return UINT32_MAX;
+        pt->keys = keys;
+        int64_t* counts = realloc(pt->counts, sizeof(int64_t) * capacity);
+        if (!counts) return UINT32_MAX;
+        pt->counts = counts;
+        pt->capacity = capacity;
+    }
+    uint32_t idx = pt->count++;
+    pt->keys[idx] = key;
+    pt->counts[idx] = delta;
+    pt->slots[slot] = idx + 1;
+    return idx;
+}
+
+uint32_t pair_table_find(const PairTable* pt, uint64_t key) {
+    uint32_t slot = hash_u64(key) & pt->slot_mask;
+    while (pt->slots[slot]) {
+        uint32_t idx = pt->slots[slot] - 1;
+        if (pt->keys[idx] == key) {
+            return idx;
+        }
+        slot = (slot + 1) & pt->slot_mask;
+    }
+    return UINT32_MAX;
+}
+
+// Remove every pair from the table, keeping its allocations
+void pair_table_clear(PairTable* pt) {
+    if (pt->count > (pt->slot_mask + 1) / 8) {
+        memset(pt->slots, 0, sizeof(uint32_t) * (pt->slot_mask + 1));
+    } else {
+        // Few pairs: clear just their slots
+        for (uint32_t idx = 0; idx < pt->count; ++idx) {
+            uint32_t slot = hash_u64(pt->keys[idx]) & pt->slot_mask;
+            while (pt->slots[slot] != idx + 1) slot = (slot + 1) & pt->slot_mask;
+            pt->slots[slot] = 0;
+        }
+    }
+    pt->count = 0;
+}
+
+// Add the adjacent pairs of a molecule (times its weight) to the pair table
+int pair_table_accumulate(PairTable* pt, const IdList* mol) {
+    for (size_t i = 0; i + 1 < mol->count; ++i) {
+        if (pair_table_add(pt, PAIR_KEY(mol->ids[i], mol->ids[i+1]), mol->weight) == UINT32_MAX) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Apply a pair count delta and queue the new count on the heap; returns -1 if out of memory
+static inline int pair_update(PairTable* pt, PairHeap* heap, uint32_t left, uint32_t right, int64_t delta) {
+    uint32_t idx = pair_table_add(pt, PAIR_KEY(left, right), delta);
+    if (idx == UINT32_MAX) return -1;
+    return heap ? pair_heap_push(heap, idx) : 0;
+}
+
+// Merge occurrences of (left, right) left to right, compacting the molecule in place.
+// Only pairs touching a merged occurrence change: the old neighbours of each occurrence
+// are decremented and the pairs around the new merged tokens are incremented,
+// each by the molecule's weight.
+size_t merge_pair_ids(IdList* mol, uint32_t left, uint32_t right, uint32_t merged,
+                      PairTable* pt, PairHeap* heap) {
+    size_t n = mol->count;
+    uint32_t* ids = mol->ids;
+    int64_t weight = mol->weight;
+
+    // Cheap scan first: most molecules do not contain the pair at all
+    size_t r = 0;
+    while (r + 1 < n && !(ids[r] == left && ids[r+1] == right)) r++;
+    if (r + 1 >= n) {
+        return 0;
+    }
+
+    size_t w = r;                 // Write position; ids[0..w) is final
+    size_t merges = 0;
+    int failed = 0;               // A pair update ran out of memory
+    int prev_consumed = 0;        // Old token at r-1 was the right half of a merge
+    int pending_right = 0;        // ids[w-1] is a merged token, so its right pair is new
+
+    uint32_t old_prev = r > 0 ? ids[r-1] : 0;
+    while (r < n) {
+        uint32_t cur = ids[r];
+        if (r + 1 < n && cur == left && ids[r+1] == right) {
+            // Old pairs touching this occurrence disappear
+            if (r > 0 && !prev_consumed) failed |= pair_update(pt, heap, old_prev, cur, -weight);
+            failed |= pair_update(pt, heap, left, right, -weight);
+            if (r + 2 < n) failed |= pair_update(pt, heap, right, ids[r+2], -weight);
+
+            // New pair to the left of the merged token appears
+            if (w > 0) failed |= pair_update(pt, heap, ids[w-1], merged, weight);
+
+            ids[w++] = merged;
+            pending_right = 1;
+            prev_consumed = 1;
+            old_prev = right;
+            merges++;
+            r += 2;
+        } else {
+            if (pending_right) failed |= pair_update(pt, heap, ids[w-1], cur, weight);
+            ids[w++] = cur;
+            pending_right = 0;
+            prev_consumed = 0;
+            old_prev = cur;
+            r++;
+        }
+    }
+
+    mol->count = w;
+    return failed ? SIZE_MAX : merges;
+}
+
+PairOccurrences* pair_occurrences_create(void) {
+    return calloc(1, sizeof(PairOccurrences));
+}
+
+void pair_occurrences_free(PairOccurrences* occ) {
+    if (!occ) return;
+    for (uint32_t i = 0; i < occ->size; ++i) {
+        free(occ->lists[i].molecules);
+    }
+    free(occ->lists);
+    free(occ->pruned);
+    free(occ);
+}
+
+// Make room for pair indices up to pair; returns -1 if out of memory
+static int pair_occurrences_reserve(PairOccurrences* occ, uint32_t pair) {
+    if (pair < occ->size) {
+        return 0;
+    }
+    uint32_t size = occ->size ? occ->size : 1024;
+    while (size <= pair) size *= 2;
+    OccurrenceList* lists = realloc(occ->lists, sizeof(OccurrenceList) * size);
+    if (!lists) return -1;
+    occ->lists = lists;
+    memset(occ->lists + occ->size, 0, sizeof(OccurrenceList) * (size - occ->size));
+    uint8_t* pruned = realloc(occ->pruned, size);
+    if (!pruned) return -1;
+    occ->pruned = pruned;
+    memset(occ->pruned + occ->size, 0, size - occ->size);
+    occ->size = size;
+    return 0;
+}
+
+// Append molecule to the pair's list (a molecule is recorded once per visit)
+int pair_occurrences_add(PairOccurrences* occ, uint32_t pair, uint32_t molecule) {
+    if (pair_occurrences_reserve(occ, pair) != 0) {
+        return -1;
+    }
+
+    OccurrenceList* list = &occ->lists[pair];
+    if (list->count > 0 && list->molecules[list->count - 1] == molecule) {
+        return 0;
+    }
+    if (list->count >= list->capacity) {
+        uint32_t capacity = list->capacity ? list->capacity * 2 : 4;
+        uint32_t* molecules = realloc(list->molecules, sizeof(uint32_t) * capacity);
+        if (!molecules) return -1;
+        list->molecules = molecules;
+        list->capacity = capacity;
+        occ->allocations++;
+    }
+    list->molecules[list->count++] = molecule;
+    return 0;
+}
+
+int pair_occurrences_add_molecule(PairOccurrences* occ, const PairTable* pt,
+                                  const IdList* mol, uint32_t molecule, uint32_t symbol) {
+    for (size_t i = 0; i + 1 < mol->count; ++i) {
+        uint32_t left = mol->ids[i], right = mol->ids[i+1];
+        if (symbol != UINT32_MAX && left != symbol && right != symbol) {
+            continue;
+        }
+        uint32_t pair = pair_table_find(pt, PAIR_KEY(left, right));
+        if (pair == UINT32_MAX) {
+            continue;
+        }
+        if (pt->counts[pair] < occ->min_count) {
+            // Too rare to index; if the pair ever becomes the best one,
+            // the merge falls back to visiting every molecule
+            if (pair_occurrences_reserve(occ, pair) != 0) {
+                return -1;
+            }
+            occ->pruned[pair] = 1;
+        } else if (pair_occurrences_add(occ, pair, molecule) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Compare two pairs as their "<left> <right>" keys would compare with strcmp
+static int pair_key_cmp(const SymbolTable* st, uint64_t a, uint64_t b) {
+    const unsigned char* a_left = (const unsigned char*)st->strings[PAIR_LEFT(a)];
+    const unsigned char* b_left = (const unsigned char*)st->strings[PAIR_LEFT(b)];
+    const unsigned char* pa = a_left;
+    const unsigned char* pb = b_left;
+    int a_part = 0, b_part = 0;  // 0 = left token, 1 = right token, 2 = end
+
+    for (;;) {
+        unsigned char ca, cb;
+        if (a_part == 0 && !*pa) { ca = ' '; a_part = 1; pa = (const unsigned char*)st->strings[PAIR_RIGHT(a)]; }
+        else if (a_part == 1 && !*pa) { ca = '\0'; a_part = 2; }
+        else ca = *pa++;
+        if (b_part == 0 && !*pb) { cb = ' '; b_part = 1; pb = (const unsigned char*)st->strings[PAIR_RIGHT(b)]; }
+        else if (b_part == 1 && !*pb) { cb = '\0'; b_part = 2; }
+        else cb = *pb++;
+
+        if (ca != cb) return ca < cb ? -1 : 1;
+        if (a_part == 2) return 0;
+    }
+}
+
+// Heap order: higher count first, then the lexicographically smaller pair key
+static int pair_heap_before(const PairHeap* heap, const PairHeapEntry* a, const PairHeapEntry* b) {
+    if (a->count != b->count) {
+        return a->count > b->count;
+    }
+    if (a->pair == b->pair) {
+        return 0;
+    }
+    return pair_key_cmp(heap->symbols, heap->pairs->keys[a->pair], heap->pairs->keys[b->pair]) < 0;
+}
+
+static void pair_heap_sift_up(PairHeap* heap, size_t i) {
+    PairHeapEntry entry = heap->entries[i];
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!pair_heap_before(heap, &entry, &heap->entries[parent])) break;
+        heap->entries[i] = heap->entries[parent];
+        i = parent;
+    }
+    heap->entries[i] = entry;
+}
+
+static void pair_heap_sift_down(PairHeap* heap, size_t i) {
+    PairHeapEntry entry = heap->entries[i];
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= heap->count) break;
+        if (child + 1 < heap->count &&
+            pair_heap_before(heap, &heap->entries[child + 1], &heap->entries[child])) {
+            child++;
+        }
+        if (!pair_heap_before(heap, &heap->entries[child], &entry)) break;
+        heap->entries[i] = heap->entries[child];
+        i = child;
+    }
+    heap->entries[i] = entry;
+}
+
+// Create a heap holding every pair of the table with a positive count
+PairHeap* pair_heap_create(const PairTable* pairs, const SymbolTable* symbols) {
+    PairHeap* heap = malloc(sizeof(PairHeap));
+    if (!heap) return NULL;
+    heap->entries = NULL;
+    heap->count = 0;
+    heap->capacity = 0;
+    heap->allocations = 0;
+    heap->pairs = pairs;
+    heap->symbols = symbols;
+    heap->min_count = 1;
+    if (pair_heap_rebuild(heap) != 0) {
+        pair_heap_free(heap);
+        return NULL;
+    }
+    return heap;
+}
+
+void pair_heap_free(PairHeap* heap) {
+    if (!heap) return;
+    free(heap->entries);
+    free(heap);
+}
+
+// Push the current count of a pair; older entries for it become stale.
+// Returns -1 if out of memory.
+int pair_heap_push(PairHeap* heap, uint32_t pair) {
+    int64_t count = heap->pairs->counts[pair];
+    if (count <= 0 || count < heap->min_count) {
+        return 0;
+    }
+    if (heap->count >= heap->capacity) {
+        size_t capacity = heap->capacity ? heap->capacity * 2 : 1024;
+        PairHeapEntry* entries = realloc(heap->entries, sizeof(PairHeapEntry) * capacity);
+        if (!entries) return -1;
+        heap->entries = entries;
+        heap->capacity = capacity;
+        heap->allocations++;
+    }
+    heap->entries[heap->count].pair = pair;
+    heap->entries[heap->count].count = count;
+    pair_heap_sift_up(heap, heap->count++);
+    return 0;
+}
+
+// Drop all entries and re-heapify from the live counts in the pair table.
+// Returns -1 if out of memory, leaving the heap empty.
+int pair_heap_rebuild(PairHeap* heap) {
+    const PairTable* pairs = heap->pairs;
+    heap->count = 0;
+    if (heap->capacity < pairs->count) {
+        size_t capacity = pairs->count > 1024 ? pairs->count : 1024;
+        PairHeapEntry* entries = realloc(heap->entries, sizeof(PairHeapEntry) * capacity);
+        if (!entries) return -1;
+        heap->entries = entries;
+        heap->capacity = capacity;
+        heap->allocations++;
+    }
+    for (uint32_t idx = 0; idx < pairs->count; ++idx) {
+        if (pairs->counts[idx] > 0 && pairs->counts[idx] >= heap->min_count) {
+            heap->entries[heap->count].pair = idx;
+            heap->entries[heap->count].count = pairs->counts[idx];
+            heap->count++;
+        }
+    }
+    for (size_t i = heap->count / 2; i-- > 0; ) {
+        pair_heap_sift_down(heap, i);
+    }
+    return 0;
+}
+
+// Return the best pair, discarding stale entries on the way.
+// The entry is left on the heap; it goes stale once the merge updates its count.
+uint32_t pair_heap_best(PairHeap* heap, int64_t* count) {
+    // Stale entries pile up as counts change; compact when they dominate.
+    // The entries already outnumber the pairs, so this never allocates.
+    if (heap->count > 4 * (size_t)heap->pairs->count + 1024) {
+        pair_heap_rebuild(heap);
+    }
+
+    while (heap->count > 0) {
+        PairHeapEntry top = heap->entries[0];
+        if (top.count == heap->pairs->counts[top.pair]) {
+            *count = top.count;
+            return top.pair;
+        }
+        heap->entries[0] = heap->entries[--heap->count];
+        if (heap->count > 0) {
+            pair_heap_sift_down(heap, 0);
+        }
+    }
+
+    *count = -1;
+    return UINT32_MAX;
+}
+
+// Create a heap of the pairs counted at least min_count times (--prune-below);
+// NULL if out of memory
+static PairHeap* pair_heap_create_pruned(const PairTable* pairs, const SymbolTable* symbols, int min_count) {
+    PairHeap* heap = pair_heap_create(pairs, symbols);
+    if (heap && min_count > 1) {
+        heap->min_count = min_count;
+        if (pair_heap_rebuild(heap) != 0) {
+            pair_heap_free(heap);
+            return NULL;
+        }
+    }
+    return heap;
+}
+
+// Pair counting and merge application shared out over a thread pool.
+// Each worker handles a contiguous range of molecules and records its pair count
+// changes in its own delta table; the deltas are then reduced in worker order.
+typedef struct {
+    IdList* molecules;
+    int molecule_count;
+    const uint32_t* targets; // Molecules a merge is applied to
+    int target_count;
+    int workers;
+    PairTable** deltas;      // One per worker
+    int* failed;             // One per worker: its delta table ran out of memory
+    uint32_t left, right, merged;
+    ProgressBar* bar;        // Pair counting progress, updated by worker 0 only
+} MergeJob;
+
+static void count_pairs_task(void* arg, int worker) {
+    MergeJob* job = arg;
+    if (worker >= job->workers) return;
+    int begin, end;
+    thread_pool_range(job->molecule_count, worker, job->workers, &begin, &end);
+    for (int j = begin; j < end && !job->failed[worker]; ++j) {
+        job->failed[worker] = pair_table_accumulate(job->deltas[worker], &job->molecules[j]) != 0;
+        if (worker == 0 && job->bar) progress_bar_update(job->bar, j - begin + 1);
+    }
+}
+
+static void apply_merge_task(void* arg, int worker) {
+    MergeJob* job = arg;
+    if (worker >= job->workers) return;
+    int begin, end;
+    thread_pool_range(job->target_count, worker, job->workers, &begin, &end);
+    pair_table_clear(job->deltas[worker]);
+    for (int k = begin; k < end && !job->failed[worker]; ++k) {
+        job->failed[worker] = merge_pair_ids(&job->molecules[job->targets[k]], job->left, job->right,
+                                             job->merged, job->deltas[worker], NULL) == SIZE_MAX;
+    }
+}
+
+// Add every non-zero delta of the workers to pairs, in worker order.
+// Returns -1 if a worker or pairs ran out of memory.
+static int reduce_pair_deltas(MergeJob* job, PairTable* pairs, PairHeap* heap) {
+    for (int w = 0; w < job->workers; ++w) {
+        const PairTable* delta = job->deltas[w];
+        if (job->failed[w]) {
+            return -1;
+        }
+        for (uint32_t idx = 0; idx < delta->count; ++idx) {
+            if (delta->counts[idx] != 0) {
+                uint32_t pair = pair_table_add(pairs, delta->keys[idx], delta->counts[idx]);
+                if (pair == UINT32_MAX || (heap && pair_heap_push(heap, pair) != 0)) return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Merges touching fewer molecules than this per worker are applied on one thread
+#define PARALLEL_MERGE_MIN_TARGETS 256
+
+// Stopping rules shared by the merge loops: checked before each merge, and on
+// the best pair found for it
+static int bpe_vocab_full(const SymbolTable* symbols, const BpeRunOptions* options, ProgressBar* bar) {
+    if (options->max_symbols == 0 || symbols->count < options->max_symbols) {
+        return 0;
+    }
+    if (options->verbose) {
+        progress_bar_printf(bar, "Stopping early: the vocabulary has reached its target size\n");
+    }
+    return 1;
+}
+
+// Whether the best pair found (UINT32_MAX = none) is too rare to merge
+static int bpe_pair_too_rare(uint32_t best, int64_t pair_count, const BpeRunOptions* options,
+                             ProgressBar* bar) {
+    if (best == UINT32_MAX) {
+        if (options->verbose && options->prune_below > 1) {
+            progress_bar_printf(bar, "Stopping early: no pair occurs %d times\n", options->prune_below);
+        }
+        return 1;
+    }
+    if (pair_count >= options->min_frequency) {
+        return 0;
+    }
+    if (options->verbose) {
+        progress_bar_printf(bar, "Stopping early: the best pair occurs %lld times, below the minimum frequency %d\n",
+                            (long long)pair_count, options->min_frequency);
+    }
+    return 1;
+}
+
+// Run BPE merges over ID-encoded molecules.
+// Pair counts are collected once and then updated incrementally by each merge.
+// An occurrence index records which molecules hold each pair, so a merge only
+// visits the molecules that contain it instead of the whole corpus.
+// With a pool of more than one worker, counting and merging run in parallel;
+// the result is the same for any number of workers.
+// A resumed run (options->done, options->pairs) continues exactly where the
+// checkpointed run stopped, so its result is that of an uninterrupted run.
+int bpe_train_ids(SymbolTable* symbols, IdList* molecules, int molecule_count,
+                  int num_merges, BpeMerge* merges, struct ThreadPool* pool,
+                  const BpeRunOptions* options) {
+    BpeRunOptions plain = {0};
+    if (!options) options = &plain;
+    int verbose = options->verbose;
+    TrainStats* stats = options->stats;
+    double started = stats_clock(stats);
+    int workers = thread_pool_size(pool);
+    if (workers > molecule_count) workers = molecule_count > 0 ? molecule_count : 1;
+
+    MergeJob job = { molecules, molecule_count, NULL, 0, workers, NULL, NULL, 0, 0, 0, NULL };
+    PairTable* pairs = options->pairs ? options->pairs : pair_table_create(HT_DEFAULT_SIZE);
+    PairOccurrences* occurrences = pair_occurrences_create();
+    int failed = !pairs || !occurrences;     // Out of memory
+    if (occurrences) occurrences->min_count = options->prune_below;
+
+    // With several workers the bar follows worker 0 through its range
+    int pairs_total = molecule_count;
+    if (workers > 1 && !options->pairs) {
+        int begin;
+        thread_pool_range(molecule_count, 0, workers, &begin, &pairs_total);
+        pairs_total -= begin;
+    }
+    ProgressBar bar_pairs;
+    progress_bar_start(&bar_pairs, "Collecting pair statistics", pairs_total, !verbose);
+    if (workers > 1) {
+        job.deltas = calloc(workers, sizeof(PairTable*));
+        job.failed = calloc(workers, sizeof(int));
+        failed = failed || !job.deltas || !job.failed;
+        for (int w = 0; !failed && w < workers; ++w) {
+            job.deltas[w] = pair_table_create(HT_DEFAULT_SIZE);
+            failed = !job.deltas[w];
+        }
+    }
+    if (failed) {
+        // Out of memory setting up: there is nothing to count into
+    } else if (options->pairs) {
+        // The pair counts are known; only the occurrence index is rebuilt
+        for (int j = 0; !failed && j < molecule_count; ++j) {
+            failed = pair_occurrences_add_molecule(occurrences, pairs, &molecules[j], j, UINT32_MAX) != 0;
+        }
+    } else if (workers > 1) {
+        job.bar = &bar_pairs;
+        thread_pool_run(pool, count_pairs_task, &job);
+        job.bar = NULL;
+        failed = reduce_pair_deltas(&job, pairs, NULL) != 0;
+        for (int j = 0; !failed && j < molecule_count; ++j) {
+            failed = pair_occurrences_add_molecule(occurrences, pairs, &molecules[j], j, UINT32_MAX) != 0;
+        }
+    } else if (options->prune_below > 1) {
+        // Which pairs are rare is only known once all of them are counted
+        for (int j = 0; !failed && j < molecule_count; ++j) {
+            failed = pair_table_accumulate(pairs, &molecules[j]) != 0;
+            progress_bar_increment(&bar_pairs);
+        }
+        for (int j = 0; !failed && j < molecule_count; ++j) {
+            failed = pair_occurrences_add_molecule(occurrences, pairs, &molecules[j], j, UINT32_MAX) != 0;
+        }
+    } else {
+        for (int j = 0; !failed && j < molecule_count; ++j) {
+            const IdList* mol = &molecules[j];
+            for (size_t k = 0; !failed && k + 1 < mol->count; ++k) {
+                uint32_t pair = pair_table_add(pairs, PAIR_KEY(mol->ids[k], mol->ids[k+1]), mol->weight);
+                failed = pair == UINT32_MAX || pair_occurrences_add(occurrences, pair, j) != 0;
+            }
+            progress_bar_increment(&bar_pairs);
+        }
+    }
+    progress_bar_finish(&bar_pairs);
+    PairHeap* heap = failed ? NULL : pair_heap_create_pruned(pairs, symbols, options->prune_below);
+    failed = failed || !heap;
+    stats_phase(stats, STATS_PAIR_COUNT, started);
+
+    // Molecules a merge visits, and the last merge each molecule was visited by
+    uint32_t* targets = malloc(sizeof(uint32_t) * (molecule_count > 0 ? molecule_count : 1));
+    int* visited = malloc(sizeof(int) * (molecule_count > 0 ? molecule_count : 1));
+    failed = failed || !targets || !visited;
+    for (int j = 0; !failed && j < molecule_count; ++j) {
+        visited[j] = -1;
+    }
+    job.targets = targets;
+    if (failed) {
+        errno = ENOMEM;
+    }
+
+    int merge_count = options->done;
+    ProgressBar bar;
+    progress_bar_start(&bar, "Performing BPE merges", num_merges, !verbose);
+    if (merge_count > 0) {
+        progress_bar_update(&bar, merge_count);
+    }
+
+    for (int i = options->done; !failed && i < num_merges; ++i) {
+        if (bpe_vocab_full(symbols, options, &bar)) {
+            break;
+        }
+        double merge_start = stats_clock(stats);
+        int64_t pair_count = 0;
+        uint32_t best, left, right;
+        if (i < options->given) {
+            // Replay a given merge, whether or not the pair still occurs
+            left = merges[i].left;
+            right = merges[i].right;
+            best = pair_table_find(pairs, PAIR_KEY(left, right));
+            pair_count = best != UINT32_MAX ? pairs->counts[best] : 0;
+        } else {
+            // Find the best pair and its frequency
+            best = pair_heap_best(heap, &pair_count);
+            if (bpe_pair_too_rare(best, pair_count, options, &bar)) {
+                break;
+            }
+            left = PAIR_LEFT(pairs->keys[best]);
+            right = PAIR_RIGHT(pairs->keys[best]);
+        }
+        double applied = stats_phase(stats, STATS_BEST_PAIR, merge_start);
+        uint32_t merged = symbol_table_intern_concat(symbols, left, right);
+        if (merged == UINT32_MAX) {
+            errno = ENOMEM;
+            failed = 1;
+            break;
+        }
+
+        if (verbose) {
+            progress_bar_printf(&bar, "  Merge %d/%d: %s pair: %s %s (frequency: %lld)\n", i+1, num_merges,
+                                i < options->given ? "Replayed" : "Best",
+                                symbols->strings[left], symbols->strings[right], (long long)pair_count);
+        }
+
+        merges[merge_count].left = left;
+        merges[merge_count].right = right;
+        merges[merge_count].merged = merged;
+        merges[merge_count].count = pair_count;
+        merge_count++;
+
+        // Take the pair's occurrence list; every occurrence is merged away below
+        OccurrenceList list = { NULL, 0, 0 };
+        if (best < occurrences->size) {
+            list = occurrences->lists[best];
+            occurrences->lists[best] = (OccurrenceList){ NULL, 0, 0 };
+        }
+        int target_count = 0;
+        if (best < occurrences->size && occurrences->pruned[best]) {
+            // Some occurrences were never indexed, so visit every molecule
+            occurrences->pruned[best] = 0;
+            for (int j = 0; j < molecule_count; ++j) {
+                visited[j] = i;
+                targets[target_count++] = j;
+            }
+        } else {
+            for (uint32_t k = 0; k < list.count; ++k) {
+                uint32_t j = list.molecules[k];
+                if (visited[j] != i) {
+                    visited[j] = i;
+                    targets[target_count++] = j;
+                }
+            }
+        }
+        free(list.molecules);
+
+        // Apply the merge to the molecules holding the pair, updating the pair counts
+        if (workers > 1 && target_count >= workers * PARALLEL_MERGE_MIN_TARGETS) {
+            job.target_count = target_count;
+            job.left = left;
+            job.right = right;
+            job.merged = merged;
+            thread_pool_run(pool, apply_merge_task, &job);
+            failed = reduce_pair_deltas(&job, pairs, heap) != 0;
+        } else {
+            for (int k = 0; !failed && k < target_count; ++k) {
+                failed = merge_pair_ids(&molecules[targets[k]], left, right, merged, pairs, heap) == SIZE_MAX;
+            }
+        }
+        if (failed) {
+            errno = ENOMEM;
+            break;
+        }
+
+        // Index the pairs around the new merged tokens
+        double indexed = stats_phase(stats, STATS_APPLY, applied);
+        for (int k = 0; !failed && k < target_count; ++k) {
+            failed = pair_occurrences_add_molecule(occurrences, pairs, &molecules[targets[k]], targets[k],
+                                                   merged) != 0;
+        }
+        if (failed) {
+            errno = ENOMEM;
+            break;
+        }
+        double merge_end = stats_phase(stats, STATS_INDEX, indexed);
+        stats_merge_latency(stats, merge_end - merge_start);
+
+        progress_bar_increment(&bar);
+
+        if (options->after_merge) {
+            options->after_merge(options->after_merge_arg, symbols, merges, merge_count);
+        }
+        Checkpoint* checkpoint = options->checkpoint;
+        if (checkpoint && checkpoint_due(checkpoint, merge_count) &&
+            save_checkpoint(checkpoint, symbols, merges, merge_count, molecules, molecule_count, pairs) != 0) {
+            fprintf(stderr, "Warning: could not write checkpoint %s\n", checkpoint->path);
+        }
+        stats_phase(stats, STATS_CHECKPOINT, merge_end);
+    }
+    progress_bar_finish(&bar);
+
+    if (heap) {
+        stats_pair_state(stats, pairs, heap, occurrences);
+    }
+    if (job.deltas) {
+        for (int w = 0; w < workers; ++w) {
+            if (stats && job.deltas[w]) {
+                stats->delta_tables++;
+                stats->delta_resizes += job.deltas[w]->resizes;
+            }
+            pair_table_free(job.deltas[w]);
+        }
+    }
+    free(job.deltas);
+    free(job.failed);
+    free(targets);
+    free(visited);
+    pair_occurrences_free(occurrences);
+    pair_heap_free(heap);
+    pair_table_free(pairs);
+    return failed ? -1 : merge_count;
+}
+
+// Save vocabulary and merges to a file
+// These functions have been moved to cvocgen_io.h
+
+// This function has been moved to cvocgen_io.h
+
+// Train BPE on the given text for a specified number of merges
+HashTable* train_bpe(const char* text, int num_merges) {
+    if (!text || num_merges <= 0) {
+        return NULL;
+    }
+
+    // 1. Initial tokenization
+    TokenList* tokens = pre_tokenize(text);
+    if (!tokens) {
+        return NULL;
+    }
+
+    // 2. Create initial vocabulary from tokens
+    HashTable* vocab = ht_create(100);
+    for (size_t i = 0; i < tokens->count; ++i) {
+        hash_insert_or_increment(vocab, tokens->tokens[i]);
+    }
+
+    // 3. Perform BPE merges
+    char** merges = malloc(sizeof(char*) * num_merges);
+    int merge_count = 0;
+
+    for (int i = 0; i < num_merges; ++i) {
+        // Get pair statistics
+        HashTable* pair_stats = get_pair_stats(tokens);
+        if (!pair_stats) {
+            break;
+        }
+
+        // Find the best pair
+        int64_t pair_count = 0;
+        const char* best_pair = get_best_pair(pair_stats, &pair_count);
+        if (!best_pair) {
+            ht_free(pair_stats);
+            break;
+        }
+
+        // Store the merge operation
+        merges[merge_count++] = strdup(best_pair);
+
+        // Merge the best pair
+        TokenList* new_tokens = merge_pair(tokens, best_pair);
+        if (!new_tokens) {
+            ht_free(pair_stats);
+            break;
+        }
+
+        // Update the vocabulary with the merged token
+        // Split the pair into first and second tokens
+        char* pair_copy = strdup(best_pair);
+        char* first = pair_copy;
+        char* second = NULL;
+        
+        // Find the space separating the two tokens
+        char* space = strchr(pair_copy, ' ');
+        if (space) {
+            *space = '\0';  // Split the string
+            second = space + 1;
+            
+            // Create the merged token
+            char stack_merged[256];
+            char* merged = join_tokens(stack_merged, sizeof(stack_merged), first, "", second);
+            
+            // Add to vocabulary
+            hash_insert_or_increment(vocab, merged);
+            if (merged != stack_merged) free(merged);
+        }
+        free(pair_copy);
+
+        // Free old tokens and update
+        free_token_list(tokens);
+        tokens = new_tokens;
+
+        ht_free(pair_stats);
+    }
+
+    // Save the vocabulary and merges in both formats
+    save_vocabulary(vocab, merges, merge_count, "vocab.txt");
+    save_vocabulary_json(vocab, merges, merge_count, "vocab");
+
+    // Free the merge operations array
+    for (int i = 0; i < merge_count; ++i) {
+        free(merges[i]);
+    }
+    free(merges);
+
+    // Free the final token list
+    free_token_list(tokens);
+
+    return vocab;
+}
+
+// Build a vocabulary table from per-symbol token counts.
+// Symbols are inserted in ID (first-seen) order.
+HashTable* build_initial_vocab(const SymbolTable* symbols, const int64_t* counts) {
+    HashTable* vocab = ht_create(HT_DEFAULT_SIZE);  // Larger initial size for corpus
+    if (!vocab) {
+        return NULL;
+    }
+
+    for (uint32_t id = 0; id < symbols->count; ++id) {
+        if (counts[id] > 0) {
+            hash_add(vocab, symbols->strings[id], counts[id]);
+        }
+    }
+    return vocab;
+}
+
+// One slice of the corpus, tokenized by one thread
+typedef struct {
+    const char* data;        // Mapped corpus
+    size_t begin, end;       // Byte range of whole lines
+    CorpusReader* reader;    // Streaming input instead of a byte range
+    ProgressBar* bar;        // Progress reporting, NULL for silent shards
+    const TrainConfig* config;  // Format and lexer
+    SymbolTable* symbols;    // Shard-local symbols
+    uint32_t symbol_count;   // Number of shard-local symbols
+    int64_t* counts;         // Shard-local token counts by symbol ID
+    uint32_t counts_capacity;
+    MoleculeSet molecules;   // Shard-local molecules
+    const uint32_t* remap;   // Local -> global symbol IDs (second phase)
+    int fingerprint;         // Hash the lines for the cache
+    uint64_t content;        // Sum of corpus_line_hash over the shard's lines
+    uint64_t offset;         // Offset after the shard's last line
+    int failed;              // errno of a failure: ENOMEM, or EOVERFLOW past INT_MAX molecules
+} CorpusShard;
+
+// Hash of one corpus line at its byte offset. Summed over the lines, it gives a
+// content hash of the text that is the same however the corpus was sharded.
+static inline uint64_t corpus_line_hash(const char* line, size_t len, uint64_t offset) {
+    return hash_mix(hash_bytes(line, len) ^ 0x9e3779b97f4a7c15ULL, offset ^ 0xe7037ed1a0b428dbULL);
+}
+
+// Shards of a corpus being tokenized by a thread pool
+typedef struct {
+    CorpusShard* shards;
+    int shard_count;
+} CorpusShardJob;
+
+// Tokenize every line of a shard into shard-local symbols and counts.
+// Sets shard->failed and stops when memory runs out or there are too many molecules.
+static void tokenize_shard(void* arg, int worker) {
+    CorpusShardJob* job = arg;
+    if (worker >= job->shard_count) return;
+    CorpusShard* shard = &job->shards[worker];
+    shard->symbols = symbol_table_create(1024);
+    shard->counts_capacity = 1024;
+    shard->counts = calloc(shard->counts_capacity, sizeof(int64_t));
+    molecule_set_init(&shard->molecules);
+    if (!shard->symbols || !shard->counts) {
+        shard->failed = ENOMEM;
+        return;
+    }
+
+    size_t pos = shard->begin;
+    shard->offset = shard->begin;
+    const char* line;
+    size_t len;
+    while (!shard->failed && (shard->reader ? corpus_next_line(shard->reader, &line, &len)
+                                            : corpus_range_next_line(shard->data, shard->end, &pos, &line, &len))) {
+        // Update progress bar (not for pipes or other inputs without a size)
+        if (shard->bar) {
+            progress_bar_update(shard->bar, shard->reader ? corpus_offset(shard->reader)
+                                                          : (long)(pos - shard->begin));
+        }
+        if (shard->fingerprint) {
+            shard->content += corpus_line_hash(line, len, shard->offset);
+        }
+        shard->offset += len + 1;
+
+        // Skip empty lines
+        if (len == 0) {
+            continue;
+        }
+
+        // Tokenize the molecule straight into the shard's buffer
+        uint32_t* ids = molecule_set_reserve(&shard->molecules, len);
+        long count = ids ? pre_tokenize_ids_into(shard->symbols, ids, line, len, shard->config->is_smiles,
+                                                 shard->config->lexer_mode) : -1;
+        if (count < 0) {
+            shard->failed = ENOMEM;
+            break;
+        }
+
+        if (shard->symbols->count > shard->counts_capacity) {
+            uint32_t old_capacity = shard->counts_capacity;
+            uint32_t capacity = old_capacity;
+            while (capacity < shard->symbols->count) capacity *= 2;
+            int64_t* counts = realloc(shard->counts, sizeof(int64_t) * capacity);
+            if (!counts) {
+                shard->failed = ENOMEM;
+                break;
+            }
+            memset(counts + old_capacity, 0, sizeof(int64_t) * (capacity - old_capacity));
+            shard->counts = counts;
+            shard->counts_capacity = capacity;
+        }
+        for (long k = 0; k < count; ++k) {
+            shard->counts[ids[k]]++;
+        }
+        if (molecule_set_push(&shard->molecules, (size_t)count, 1) != 0) {
+            shard->failed = errno == EOVERFLOW ? EOVERFLOW : ENOMEM;
+        }
+    }
+    shard->symbol_count = shard->symbols->count;
+    molecule_set_trim(&shard->molecules);
+}
+
+// IDs copied per step by concat_shard
+#define CONCAT_STEP_IDS (1 << 20)
+
+// Append a later shard's molecules to the corpus, rewriting them from local to
+// global symbol IDs, and release the shard. The IDs are copied from the end a
+// step at a time and the shard's buffer is shrunk behind the copy, so the two
+// never hold more than a step of the same IDs.
+static void concat_shard(MoleculeSet* corpus, CorpusShard* shard) {
+    MoleculeSet* local = &shard->molecules;
+    memcpy(corpus->molecules + corpus->count, local->molecules, sizeof(IdList) * local->count);
+    uint32_t* ids = corpus->ids + corpus->id_count;
+    size_t remaining = local->id_count;
+    while (remaining > 0) {
+        size_t n = remaining < CONCAT_STEP_IDS ? remaining : CONCAT_STEP_IDS;
+        remaining -= n;
+        for (size_t k = remaining; k < remaining + n; ++k) {
+            ids[k] = shard->remap[local->ids[k]];
+        }
+        uint32_t* shrunk = realloc(local->ids, sizeof(uint32_t) * (remaining ? remaining : 1));
+        if (shrunk) local->ids = shrunk;
+    }
+    corpus->count += local->count;
+    corpus->id_count += local->id_count;
+    molecule_set_free(local);
+}
+
+// Tokenize a whole corpus into ID-encoded molecules, one shard per pool worker.
+// Mapped corpora are split at line boundaries; shards are merged in file order, so
+// symbol IDs, molecule order and counts are the same for any thread count.
+// Each shard collects its molecules in its own flat buffer. The first shard's
+// buffers are then grown to hold the whole corpus and the later shards are moved
+// in after it.
+// Sets *symbols_out and *counts_out (token counts by symbol ID), and with a
+// non-NULL fingerprint, fingerprint[0] and [1] to the content hash and length of the
+// text. Returns 0, or -1 with errno set when the molecules do not fit in memory
+// (ENOMEM) or there are more than INT_MAX of them (EOVERFLOW).
+static int tokenize_corpus(CorpusReader* reader, ThreadPool* pool, const TrainConfig* config,
+                           MoleculeSet* corpus, SymbolTable** symbols_out, int64_t** counts_out,
+                           uint64_t* fingerprint) {
+    int threads = thread_pool_size(pool);
+    molecule_set_init(corpus);
+    *symbols_out = NULL;
+    *counts_out = NULL;
+
+    size_t* bounds = malloc(sizeof(size_t) * (threads + 1));
+    if (!bounds) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int shard_count = 1;
+    if (reader->data && threads > 1) {
+        shard_count = corpus_split(reader, threads, bounds);
+    } else {
+        bounds[0] = 0;
+        bounds[1] = reader->size;
+    }
+    CorpusShard* shards = calloc(shard_count, sizeof(CorpusShard));
+    if (!shards) {
+        free(bounds);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // Progress follows the first shard; shards are about the same size. Inputs
+    // without a size (pipes) show no bar.
+    long progress_total = reader->data ? (long)(bounds[1] - bounds[0]) : reader->total_size;
+    ProgressBar bar;
+    progress_bar_start(&bar, "Tokenizing corpus", progress_total, !config->verbose || progress_total <= 0);
+
+    for (int i = 0; i < shard_count; ++i) {
+        shards[i].data = reader->data;
+        shards[i].begin = bounds[i];
+        shards[i].end = bounds[i + 1];
+        shards[i].reader = reader->data ? NULL : reader;
+        shards[i].bar = (i == 0 && progress_total > 0) ? &bar : NULL;
+        shards[i].config = config;
+        shards[i].fingerprint = fingerprint != NULL;
+    }
+
+    CorpusShardJob job = { shards, shard_count };
+    thread_pool_run(pool, tokenize_shard, &job);
+    progress_bar_finish(&bar);
+    if (fingerprint) {
+        fingerprint[0] = 0;
+        for (int i = 0; i < shard_count; ++i) {
+            fingerprint[0] += shards[i].content;
+        }
+        fingerprint[1] = shards[shard_count - 1].offset;
+    }
+    int error = 0;
+    for (int i = 0; !error && i < shard_count; ++i) {
+        error = shards[i].failed;
+    }
+    int failed = error != 0;
+
+    // The first shard's symbols become the global table: its local IDs are already
+    // in global first-seen order. Later shards are interned after it in file order.
+    SymbolTable* symbols = shards[0].symbols;
+    for (int i = 1; !failed && i < shard_count; ++i) {
+        SymbolTable* local = shards[i].symbols;
+        uint32_t* remap = malloc(sizeof(uint32_t) * (local->count ? local->count : 1));
+        failed = !remap;
+        for (uint32_t id = 0; !failed && id < local->count; ++id) {
+            remap[id] = symbol_table_intern(symbols, local->strings[id], local->lengths[id]);
+            failed = remap[id] == UINT32_MAX;
+        }
+        shards[i].remap = remap;
+    }
+
+    // Sum the token counts in shard order
+    int64_t* counts = failed ? NULL : calloc(symbols->count ? symbols->count : 1, sizeof(int64_t));
+    failed = failed || !counts;
+    for (int i = 0; !failed && i < shard_count; ++i) {
+        CorpusShard* shard = &shards[i];
+        for (uint32_t id = 0; id < shard->symbol_count; ++id) {
+            counts[i == 0 ? id : shard->remap[id]] += shard->counts[id];
+        }
+    }
+
+    // Concatenate the molecules after the first shard's
+    if (!failed) {
+        *corpus = shards[0].molecules;
+        molecule_set_init(&shards[0].molecules);
+    }
+    if (!failed && shard_count > 1) {
+        long long molecule_count = corpus->count;
+        size_t id_count = corpus->id_count;
+        for (int i = 1; i < shard_count; ++i) {
+            molecule_count += shards[i].molecules.count;
+            id_count += shards[i].molecules.id_count;
+        }
+        // Molecules are counted in int
+        error = molecule_count > INT_MAX ? EOVERFLOW : 0;
+        failed = error || molecule_set_grow(corpus, (int)molecule_count, id_count) != 0;
+        for (int i = 1; !failed && i < shard_count; ++i) {
+            concat_shard(corpus, &shards[i]);
+        }
+    }
+    molecule_set_seal(corpus);
+
+    for (int i = 0; i < shard_count; ++i) {
+        molecule_set_free(&shards[i].molecules);   // Left by a failure
+        if (i > 0 || failed) {
+            symbol_table_free(shards[i].symbols);
+        }
+        free(shards[i].counts);
+        free((uint32_t*)shards[i].remap);
+    }
+    free(shards);
+    free(bounds);
+
+    if (failed) {
+        molecule_set_free(corpus);
+        free(counts);
+        errno = error ? error : ENOMEM;
+        return -1;
+    }
+    *symbols_out = symbols;
+    *counts_out = counts;
+    return 0;
+}
+
+// Encoding with a trained vocabulary (bpe_encoder_create, bpe_encode): the
+// vocabulary's merges are replayed by rank on each new molecule.
+
+// Create an encoder for a loaded binary vocabulary; NULL when out of memory
+BpeEncoder* bpe_encoder_create(const BinaryVocab* vocab) {
+    if (!vocab) return NULL;
+
+    BpeEncoder* encoder = calloc(1, sizeof(BpeEncoder));
+    if (!encoder) return NULL;
+    encoder->vocab = vocab;
+
+    // The merge index is sorted by (left, right), so each left token's merges are
+    // one run of it
+    encoder->merge_starts = calloc((size_t)vocab->token_count + 1, sizeof(uint32_t));
+    if (!encoder->merge_starts) {
+        free(encoder);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < vocab->merge_count; ++i) {
+        encoder->merge_starts[vocab->merges[vocab->merge_index[i]].left + 1]++;
+    }
+    for (uint32_t id = 0; id < vocab->token_count; ++id) {
+        encoder->merge_starts[id + 1] += encoder->merge_starts[id];
+    }
+
+    encoder->is_smiles = (vocab->header->flags & BINARY_VOCAB_FLAG_SMILES) != 0;
+    encoder->format = input_format(encoder->is_smiles);
+    encoder->bos_id = binary_vocab_find(vocab, "<s>", 3);
+    encoder->pad_id = binary_vocab_find(vocab, "<pad>", 5);
+    encoder->eos_id = binary_vocab_find(vocab, "</s>", 4);
+    encoder->unk_id = binary_vocab_find(vocab, "<unk>", 5);
+    return encoder;
+}
+
+void bpe_encoder_free(BpeEncoder* encoder) {
+    if (!encoder) return;
+    free(encoder->merge_starts);
+    free(encoder);
+}
+
+void encode_buffer_init(EncodeBuffer* buf) {
+    memset(buf, 0, sizeof(*buf));
+}
+
+void encode_buffer_free(EncodeBuffer* buf) {
+    free(buf->ids);
+    free(buf->symbols);
+    free(buf->prev);
+    free(buf->next);
+    free(buf->heap);
+    memset(buf, 0, sizeof(*buf));
+}
+
+// Merge rank of the pair at (left, right), or UINT32_MAX if it is never merged.
+// Only the left token's run of the merge index is searched; duplicate pairs keep
+// their first (lowest) rank, which sorts first.
+static inline uint32_t encoder_pair_rank(const BpeEncoder* encoder, uint32_t left, uint32_t right) {
+    const BinaryVocab* vocab = encoder->vocab;
+    if (left >= vocab->token_count) {
+        return UINT32_MAX;   // An unknown token without <unk>
+    }
+    uint32_t lo = encoder->merge_starts[left], end = encoder->merge_starts[left + 1], hi = end;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (vocab->merges[vocab->merge_index[mid]].right < right) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < end && vocab->merges[vocab->merge_index[lo]].right == right ? vocab->merge_index[lo] : UINT32_MAX;
+}
+
+// Min-heap on (rank, position): lowest rank first, leftmost among equal ranks
+static inline int encode_heap_before(const EncodeHeapEntry* a, const EncodeHeapEntry* b) {
+    return a->rank < b->rank || (a->rank == b->rank && a->pos < b->pos);
+}
+
+static void encode_heap_push(EncodeBuffer* buf, uint32_t rank, uint32_t pos) {
+    if (buf->heap_count >= buf->heap_capacity) {
+        buf->heap_capacity = buf->heap_capacity ? buf->heap_capacity * 2 : 64;
+        buf->heap = realloc(buf->heap, sizeof(EncodeHeapEntry) * buf->heap_capacity);
+    }
+    size_t i = buf->heap_count++;
+    buf->heap[i].rank = rank;
+    buf->heap[i].pos = pos;
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!encode_heap_before(&buf->heap[i], &buf->heap[parent])) break;
+        EncodeHeapEntry tmp = buf->heap[i];
+        buf->heap[i] = buf->heap[parent];
+        buf->heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+static EncodeHeapEntry encode_heap_pop(EncodeBuffer* buf) {
+    EncodeHeapEntry top = buf->heap[0];
+    buf->heap[0] = buf->heap[--buf->heap_count];
+    size_t i = 0;
+    for (;;) {
+        size_t l = 2 * i + 1, r = l + 1, best = i;
+        if (l < buf->heap_count && encode_heap_before(&buf->heap[l], &buf->heap[best])) best = l;
+        if (r < buf->heap_count && encode_heap_before(&buf->heap[r], &buf->heap[best])) best = r;
+        if (best == i) break;
+        EncodeHeapEntry tmp = buf->heap[i];
+        buf->heap[i] = buf->heap[best];
+        buf->heap[best] = tmp;
+        i = best;
+    }
+    return top;
+}
+
+static void encode_buffer_append(EncodeBuffer* buf, uint32_t id) {
+    if (buf->count >= buf->capacity) {
+        buf->capacity = buf->capacity ? buf->capacity * 2 : 1024;
+        buf->ids = realloc(buf->ids, sizeof(uint32_t) * buf->capacity);
+    }
+    buf->ids[buf->count++] = id;
+}
+
+// Encode one molecule.
+// The pre-tokens form a linked list, and a heap holds every adjacent pair that has
+// a merge rank. Repeatedly merging the lowest-ranked pair (leftmost on ties) gives
+// the same tokens as applying the merges one after another in training order,
+// because a merge only ever creates pairs of higher rank than its own.
+size_t bpe_encode(const BpeEncoder* encoder, EncodeBuffer* buf, const char* text, size_t len,
+                  int add_special_tokens) {
+    size_t start_count = buf->count;
+    if (add_special_tokens && encoder->bos_id != UINT32_MAX) {
+        encode_buffer_append(buf, encoder->bos_id);
+    }
+
+    // Pre-tokenize with the lexer for the vocabulary's format. No token is empty,
+    // so the scratch arrays are sized for len tokens before the scan.
+    if (len > buf->scratch_capacity) {
+        size_t capacity = buf->scratch_capacity ? buf->scratch_capacity : 256;
+        while (capacity < len) capacity *= 2;
+        buf->scratch_capacity = capacity;
+        buf->symbols = realloc(buf->symbols, sizeof(uint32_t) * capacity);
+        buf->prev = realloc(buf->prev, sizeof(int32_t) * capacity);
+        buf->next = realloc(buf->next, sizeof(int32_t) * capacity);
+    }
+    size_t n = encoder->format->lookup(encoder->vocab, encoder->unk_id, buf->symbols, text, len);
+
+    // Seed the heap with every mergeable adjacent pair
+    buf->heap_count = 0;
+    for (size_t i = 0; i < n; ++i) {
+        buf->prev[i] = (int32_t)i - 1;
+        buf->next[i] = i + 1 < n ? (int32_t)(i + 1) : -1;
+        if (i + 1 < n) {
+            uint32_t rank = encoder_pair_rank(encoder, buf->symbols[i], buf->symbols[i + 1]);
+            if (rank != UINT32_MAX) encode_heap_push(buf, rank, (uint32_t)i);
+        }
+    }
+
+    while (buf->heap_count > 0) {
+        EncodeHeapEntry top = encode_heap_pop(buf);
+        uint32_t pos = top.pos;
+        int32_t right = buf->next[pos];
+        // Skip entries whose pair has changed since they were pushed
+        const BinaryVocabMerge* merge = &encoder->vocab->merges[top.rank];
+        if (buf->prev[pos] == -2 || right < 0 ||
+            buf->symbols[pos] != merge->left || buf->symbols[right] != merge->right) {
+            continue;
+        }
+
+        buf->symbols[pos] = merge->merged;
+        buf->next[pos] = buf->next[right];
+        if (buf->next[right] >= 0) buf->prev[buf->next[right]] = (int32_t)pos;
+        buf->prev[right] = -2;  // Removed
+
+        if (buf->prev[pos] >= 0) {
+            uint32_t before = (uint32_t)buf->prev[pos];
+            uint32_t rank = encoder_pair_rank(encoder, buf->symbols[before], buf->symbols[pos]);
+            if (rank != UINT32_MAX) encode_heap_push(buf, rank, before);
+        }
+        if (buf->next[pos] >= 0) {
+            uint32_t rank = encoder_pair_rank(encoder, buf->symbols[pos], buf->symbols[buf->next[pos]]);
+            if (rank != UINT32_MAX) encode_heap_push(buf, rank, pos);
+        }
+    }
+
+    // Position 0 always survives: merges keep their left position
+    for (int32_t i = n > 0 ? 0 : -1; i >= 0; i = buf->next[i]) {
+        encode_buffer_append(buf, buf->symbols[i]);
+    }
+    if (add_special_tokens && encoder->eos_id != UINT32_MAX) {
+        encode_buffer_append(buf, encoder->eos_id);
+    }
+    return buf->count - start_count;
+}
+
+// Rough heap footprint of a molecule in a MoleculeSet, for the memory budget
+static size_t id_list_footprint(const IdList* mol) {
+    return sizeof(IdList) + sizeof(uint32_t) * mol->count;
+}
+
+// Tokenize a corpus into deduplicated on-disk segments.
+// Molecules are collected until they use a quarter of the memory budget, then
+// deduplicated and written out as one segment.
+// Fills fingerprint like tokenize_corpus (may be NULL).
+// Returns the number of molecules read, or -1 with errno set on a write error,
+// when out of memory or past INT_MAX molecules (EOVERFLOW).
+static int segment_corpus(CorpusReader* reader, SegmentStore* store, const TrainConfig* config,
+                          SymbolTable** symbols_out, int64_t** counts_out, int* unique_out,
+                          uint64_t* fingerprint) {
+    size_t chunk_budget = config->max_memory / 4;
+    SymbolTable* symbols = symbol_table_create(1024);
+    uint32_t counts_capacity = 1024;
+    int64_t* counts = calloc(counts_capacity, sizeof(int64_t));
+    MoleculeSet chunk;
+    molecule_set_init(&chunk);
+    size_t chunk_bytes = 0;
+    int molecule_count = 0;
+    int unique_count = 0;
+    int failed = !symbols || !counts;
+    uint64_t content = 0;
+    uint64_t offset = 0;
+    if (failed) {
+        errno = ENOMEM;
+    }
+
+    ProgressBar bar;
+    progress_bar_start(&bar, "Tokenizing corpus", reader->total_size, !config->verbose || reader->total_size <= 0);
+    const char* line;
+    size_t len;
+    while (!failed) {
+        int more = corpus_next_line(reader, &line, &len);
+        if (more) {
+            if (fingerprint) {
+                content += corpus_line_hash(line, len, offset);
+            }
+            offset += len + 1;
+        }
+        if (more && len > 0) {
+            if (molecule_count == INT_MAX) {
+                errno = EOVERFLOW;
+                failed = 1;
+                break;
+            }
+            uint32_t* ids = molecule_set_reserve(&chunk, len);
+            long count = ids ? pre_tokenize_ids_into(symbols, ids, line, len, config->is_smiles,
+                                                     config->lexer_mode) : -1;
+            if (count >= 0 && symbols->count > counts_capacity) {
+                uint32_t old_capacity = counts_capacity;
+                uint32_t capacity = counts_capacity;
+                while (capacity < symbols->count) capacity *= 2;
+                int64_t* grown = realloc(counts, sizeof(int64_t) * capacity);
+                if (grown) {
+                    memset(grown + old_capacity, 0, sizeof(int64_t) * (capacity - old_capacity));
+                    counts = grown;
+                    counts_capacity = capacity;
+                } else {
+                    count = -1;
+                }
+            }
+            if (count < 0 || molecule_set_push(&chunk, (size_t)count, 1) != 0) {
+                errno = ENOMEM;
+                failed = 1;
+                break;
+            }
+            for (long k = 0; k < count; ++k) {
+                counts[ids[k]]++;
+            }
+            chunk_bytes += id_list_footprint(&chunk.molecules[chunk.count - 1]);
+            molecule_count++;
+        }
+        if (reader->total_size > 0) {
+            progress_bar_update(&bar, corpus_offset(reader));
+        }
+
+        if ((!more && chunk.count > 0) || chunk_bytes >= chunk_budget) {
+            molecule_set_seal(&chunk);
+            chunk.count = dedup_id_lists(chunk.molecules, chunk.count);
+            unique_count += chunk.count;
+            failed = segment_store_append(store, chunk.molecules, chunk.count) != 0;
+            molecule_set_clear(&chunk);
+            chunk_bytes = 0;
+        }
+        if (!more) break;
+    }
+    progress_bar_finish(&bar);
+    molecule_set_free(&chunk);
+    if (!failed && corpus_failed(reader)) {
+        failed = 1;
+        errno = EIO;
+    }
+
+    *symbols_out = symbols;
+    *counts_out = counts;
+    *unique_out = unique_count;
+    if (fingerprint) {
+        fingerprint[0] = content;
+        fingerprint[1] = offset;
+    }
+    return failed ? -1 : molecule_count;
+}
+
+// Rough heap footprint of the pair table and heap
+static size_t pair_state_footprint(const PairTable* pairs, const PairHeap* heap) {
+    return (sizeof(uint64_t) + sizeof(int64_t)) * pairs->capacity +
+           sizeof(uint32_t) * (pairs->slot_mask + 1) +
+           sizeof(PairHeapEntry) * heap->capacity;
+}
+
+// Run BPE merges over molecules stored in on-disk segments.
+// Pair counts stay exact and in memory (they grow with the number of distinct
+// pairs, not with the corpus); each merge streams the segments that contain
+// both halves of the pair and rewrites the affected molecules in place.
+// Returns the merge count, or -1 with errno set if a segment cannot be mapped
+// or memory runs out.
+static int bpe_train_segments(SymbolTable* symbols, SegmentStore* store, int num_merges,
+                              BpeMerge* merges, size_t budget, const BpeRunOptions* options) {
+    int verbose = options->verbose;
+    TrainStats* stats = options->stats;
+    double started = stats_clock(stats);
+    PairTable* pairs = pair_table_create(HT_DEFAULT_SIZE);
+    if (!pairs) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    ProgressBar bar_pairs;
+    progress_bar_start(&bar_pairs, "Collecting pair statistics", store->count, !verbose);
+    int failed = 0;
+    for (int s = 0; !failed && s < store->count; ++s) {
+        const Segment* seg = &store->segments[s];
+        uint32_t* records = seg->size > 0 ? segment_map(store, seg) : NULL;
+        failed = seg->size > 0 && !records;
+        const uint32_t* end = records + seg->size / sizeof(uint32_t);
+        for (const uint32_t* rec = records; !failed && records && rec < end; rec += SEGMENT_RECORD_HEAD + rec[2]) {
+            const uint32_t* ids = rec + SEGMENT_RECORD_HEAD;
+            for (uint32_t k = 0; !failed && k + 1 < rec[3]; ++k) {
+                failed = pair_table_add(pairs, PAIR_KEY(ids[k], ids[k + 1]), segment_record_weight(rec)) == UINT32_MAX;
+                if (failed) errno = ENOMEM;
+            }
+        }
+        segment_unmap(seg, records);
+        progress_bar_increment(&bar_pairs);
+    }
+    progress_bar_finish(&bar_pairs);
+    if (failed) {
+        pair_table_free(pairs);
+        return -1;
+    }
+    PairHeap* heap = pair_heap_create_pruned(pairs, symbols, options->prune_below);
+    if (!heap) {
+        errno = ENOMEM;
+        pair_table_free(pairs);
+        return -1;
+    }
+    stats_phase(stats, STATS_PAIR_COUNT, started);
+
+    int warned = 0;
+    int merge_count = 0;
+    ProgressBar bar;
+    progress_bar_start(&bar, "Performing BPE merges", num_merges, !verbose);
+
+    for (int i = 0; i < num_merges; ++i) {
+        if (!warned && pair_state_footprint(pairs, heap) > budget) {
+            fprintf(stderr, "Warning: pair statistics (%.1f MB) exceed the memory budget, which only bounds the molecules\n",
+                    pair_state_footprint(pairs, heap) / (1024.0 * 1024.0));
+            warned = 1;
+        }
+
+        // Find the best pair and its frequency
+        int64_t pair_count = 0;
+        if (bpe_vocab_full(symbols, options, &bar)) {
+            break;
+        }
+        double merge_start = stats_clock(stats);
+        uint32_t best = pair_heap_best(heap, &pair_count);
+        if (bpe_pair_too_rare(best, pair_count, options, &bar)) {
+            break;
+        }
+        double applied = stats_phase(stats, STATS_BEST_PAIR, merge_start);
+
+        uint32_t left = PAIR_LEFT(pairs->keys[best]);
+        uint32_t right = PAIR_RIGHT(pairs->keys[best]);
+        uint32_t merged = symbol_table_intern_concat(symbols, left, right);
+        if (merged == UINT32_MAX) {
+            errno = ENOMEM;
+            failed = 1;
+            break;
+        }
+
+        if (verbose) {
+            progress_bar_printf(&bar, "  Merge %d/%d: Best pair: %s %s (frequency: %lld)\n", i+1, num_merges,
+                                symbols->strings[left], symbols->strings[right], (long long)pair_count);
+        }
+
+        merges[merge_count].left = left;
+        merges[merge_count].right = right;
+        merges[merge_count].merged = merged;
+        merges[merge_count].count = pair_count;
+        merge_count++;
+
+        // Apply the merge segment by segment, updating the pair counts
+        for (int s = 0; !failed && s < store->count; ++s) {
+            Segment* seg = &store->segments[s];
+            if (seg->size > 0 && segment_has_symbol(seg, left) && segment_has_symbol(seg, right)) {
+                uint32_t* records = segment_map(store, seg);
+                failed = !records;
+                uint32_t* end = records + seg->size / sizeof(uint32_t);
+                size_t merged_here = 0;
+                for (uint32_t* rec = records; records && rec < end; rec += SEGMENT_RECORD_HEAD + rec[2]) {
+                    IdList mol = { rec + SEGMENT_RECORD_HEAD, rec[3], segment_record_weight(rec) };
+                    size_t merged_pairs = merge_pair_ids(&mol, left, right, merged, pairs, heap);
+                    if (merged_pairs > 0) {
+                        rec[3] = (uint32_t)mol.count;
+                        merged_here++;
+                    }
+                    if (merged_pairs == SIZE_MAX) {
+                        errno = ENOMEM;
+                        failed = 1;
+                        break;
+                    }
+                }
+                segment_unmap(seg, records);
+                if (merged_here > 0 && segment_add_symbol(seg, merged) != 0) {
+                    failed = 1;
+                }
+            }
+        }
+        if (failed) {
+            // The merge is applied to some segments only; training cannot go on
+            break;
+        }
+        double merge_end = stats_phase(stats, STATS_APPLY, applied);
+        stats_merge_latency(stats, merge_end - merge_start);
+
+        progress_bar_increment(&bar);
+
+        if (options->after_merge) {
+            options->after_merge(options->after_merge_arg, symbols, merges, merge_count);
+        }
+        stats_phase(stats, STATS_CHECKPOINT, merge_end);
+    }
+    progress_bar_finish(&bar);
+
+    stats_pair_state(stats, pairs, heap, NULL);
+    pair_heap_free(heap);
+    pair_table_free(pairs);
+    return failed ? -1 : merge_count;
+}
+
+// Run BPE merges with the molecules spread over the workers of a cluster
+// (cvocgen_cluster.h). The molecules are in corpus, or in store with
+// --max-memory (the other is NULL); once they are sent to the workers both are
+// released. The coordinator keeps the global pair counts and heap and adds
+// the workers' count changes in worker order, so the merges are those of
+// bpe_train_ids on the same molecules. Returns the merge count, or -1 with
+// errno set if a worker is lost or memory runs out.
+static int bpe_train_cluster(SymbolTable* symbols, MoleculeSet* corpus, SegmentStore* store,
+                             int num_merges, BpeMerge* merges, Cluster* cluster,
+                             const BpeRunOptions* options) {
+    int verbose = options->verbose;
+    TrainStats* stats = options->stats;
+    double started = stats_clock(stats);
+    int workers = cluster->worker_count;
+
+    // Each worker takes a contiguous shard and answers with its pair counts
+    int failed;
+    if (store) {
+        failed = cluster_send_segments(cluster, store) != 0;
+        segment_store_close(store);
+    } else {
+        failed = cluster_send_molecules(cluster, corpus->molecules, corpus->count) != 0;
+        molecule_set_free(corpus);
+    }
+    PairTable* pairs = failed ? NULL : pair_table_create(HT_DEFAULT_SIZE);
+    if (!failed && !pairs) {
+        errno = ENOMEM;
+        failed = 1;
+    }
+    for (int w = 0; !failed && w < workers; ++w) {
+        failed = cluster_add_deltas(&cluster->workers[w], pairs, NULL) != 0;
+    }
+    if (failed) {
+        pair_table_free(pairs);
+        return -1;
+    }
+    PairHeap* heap = pair_heap_create_pruned(pairs, symbols, options->prune_below);
+    if (!heap) {
+        errno = ENOMEM;
+        pair_table_free(pairs);
+        return -1;
+    }
+    stats_phase(stats, STATS_PAIR_COUNT, started);
+
+    int merge_count = 0;
+    ProgressBar bar;
+    progress_bar_start(&bar, "Performing BPE merges", num_merges, !verbose);
+
+    for (int i = 0; i < num_merges; ++i) {
+        if (bpe_vocab_full(symbols, options, &bar)) {
+            break;
+        }
+        double merge_start = stats_clock(stats);
+        int64_t pair_count = 0;
+        uint32_t best, left, right;
+        if (i < options->given) {
+            // Replay a given merge, whether or not the pair still occurs
+            left = merges[i].left;
+            right = merges[i].right;
+            best = pair_table_find(pairs, PAIR_KEY(left, right));
+            pair_count = best != UINT32_MAX ? pairs->counts[best] : 0;
+        } else {
+            best = pair_heap_best(heap, &pair_count);
+            if (bpe_pair_too_rare(best, pair_count, options, &bar)) {
+                break;
+            }
+            left = PAIR_LEFT(pairs->keys[best]);
+            right = PAIR_RIGHT(pairs->keys[best]);
+        }
+        double applied = stats_phase(stats, STATS_BEST_PAIR, merge_start);
+        uint32_t merged = symbol_table_intern_concat(symbols, left, right);
+        if (merged == UINT32_MAX) {
+            errno = ENOMEM;
+            failed = 1;
+            break;
+        }
+
+        if (verbose) {
+            progress_bar_printf(&bar, "  Merge %d/%d: %s pair: %s %s (frequency: %lld)\n", i+1, num_merges,
+                                i < options->given ? "Replayed" : "Best",
+                                symbols->strings[left], symbols->strings[right], (long long)pair_count);
+        }
+
+        merges[merge_count].left = left;
+        merges[merge_count].right = right;
+        merges[merge_count].merged = merged;
+        merges[merge_count].count = pair_count;
+        merge_count++;
+
+        // Every worker applies the merge to its shard; their changes are added in order
+        failed = cluster_broadcast_merge(cluster, left, right, merged) != 0;
+        for (int w = 0; !failed && w < workers; ++w) {
+            failed = cluster_add_deltas(&cluster->workers[w], pairs, heap) != 0;
+        }
+        if (failed) {
+            break;
+        }
+        double merge_end = stats_phase(stats, STATS_APPLY, applied);
+        stats_merge_latency(stats, merge_end - merge_start);
+
+        progress_bar_increment(&bar);
+
+        if (options->after_merge) {
+            options->after_merge(options->after_merge_arg, symbols, merges, merge_count);
+        }
+        stats_phase(stats, STATS_CHECKPOINT, merge_end);
+    }
+    progress_bar_finish(&bar);
+
+    stats_pair_state(stats, pairs, heap, NULL);
+    pair_heap_free(heap);
+    pair_table_free(pairs);
+    return failed ? -1 : merge_count;
+}
+
+// Worker side of a cluster: receive a shard from the coordinator at address
+// ("host:port"), then apply the merges it sends until it is done. The shard is
+// counted and merged with the given number of threads. Returns 0 once the
+// coordinator finishes, or -1 with errno set.
+int run_cluster_worker(const char* address, int threads, int verbose) {
+    ClusterPeer peer;
+    if (cluster_connect(&peer, address) != 0) {
+        return -1;
+    }
+    if (verbose) {
+        printf("Connected to coordinator %s\n", address);
+    }
+    uint32_t tag;
+    MoleculeSet shard;
+    if (cluster_read(&peer, &tag, sizeof(tag)) != 0 || tag != CLUSTER_SHARD ||
+        cluster_read_shard(&peer, &shard) != 0) {
+        cluster_peer_close(&peer);
+        errno = EIO;
+        return -1;
+    }
+    IdList* molecules = shard.molecules;
+    int molecule_count = shard.count;
+    if (verbose) {
+        printf("Received a shard of %d molecules\n", molecule_count);
+    }
+
+    ThreadPool* pool = thread_pool_create(threads);
+    int workers = thread_pool_size(pool);
+    if (workers > molecule_count) workers = molecule_count > 0 ? molecule_count : 1;
+    MergeJob job = { molecules, molecule_count, NULL, 0, workers, NULL, NULL, 0, 0, 0, NULL };
+    job.deltas = calloc(workers, sizeof(PairTable*));
+    job.failed = calloc(workers, sizeof(int));
+    PairTable* pairs = pair_table_create(HT_DEFAULT_SIZE);
+    int out_of_memory = !job.deltas || !job.failed || !pairs;
+    for (int w = 0; !out_of_memory && w < workers; ++w) {
+        job.deltas[w] = pair_table_create(HT_DEFAULT_SIZE);
+        out_of_memory = !job.deltas[w];
+    }
+
+    // The initial pair counts of the shard are its first reply
+    if (out_of_memory) {
+        // Nothing to count into
+    } else if (workers > 1) {
+        thread_pool_run(pool, count_pairs_task, &job);
+        out_of_memory = reduce_pair_deltas(&job, pairs, NULL) != 0;
+    } else {
+        for (int j = 0; !out_of_memory && j < molecule_count; ++j) {
+            out_of_memory = pair_table_accumulate(pairs, &molecules[j]) != 0;
+        }
+    }
+    PairOccurrences* occurrences = pair_occurrences_create();
+    out_of_memory = out_of_memory || !occurrences;
+    for (int j = 0; !out_of_memory && j < molecule_count; ++j) {
+        out_of_memory = pair_occurrences_add_molecule(occurrences, pairs, &molecules[j], j, UINT32_MAX) != 0;
+    }
+
+    uint32_t* targets = malloc(sizeof(uint32_t) * (molecule_count > 0 ? molecule_count : 1));
+    int* visited = malloc(sizeof(int) * (molecule_count > 0 ? molecule_count : 1));
+    out_of_memory = out_of_memory || !targets || !visited;
+    for (int j = 0; !out_of_memory && j < molecule_count; ++j) {
+        visited[j] = -1;
+    }
+    job.targets = targets;
+    int failed = out_of_memory || cluster_send_deltas(&peer, &pairs, 1) != 0;
+
+    int merge_count = 0;
+    while (!failed) {
+        uint32_t merge[3];
+        failed = cluster_read(&peer, &tag, sizeof(tag)) != 0;
+        if (failed || tag == CLUSTER_QUIT) {
+            break;
+        }
+        failed = tag != CLUSTER_MERGE || cluster_read(&peer, merge, sizeof(merge)) != 0;
+        if (failed) {
+            break;
+        }
+        uint32_t left = merge[0], right = merge[1], merged = merge[2];
+
+        // Molecules of this shard holding the pair
+        int target_count = 0;
+        uint32_t best = pair_table_find(pairs, PAIR_KEY(left, right));
+        if (best < occurrences->size) {
+            OccurrenceList list = occurrences->lists[best];
+            occurrences->lists[best] = (OccurrenceList){ NULL, 0, 0 };
+            for (uint32_t k = 0; k < list.count; ++k) {
+                uint32_t j = list.molecules[k];
+                if (visited[j] != merge_count) {
+                    visited[j] = merge_count;
+                    targets[target_count++] = j;
+                }
+            }
+            free(list.molecules);
+        }
+
+        // Apply it, collecting the count changes per thread
+        int used = 1;
+        if (workers > 1 && target_count >= workers * PARALLEL_MERGE_MIN_TARGETS) {
+            job.target_count = target_count;
+            job.left = left;
+            job.right = right;
+            job.merged = merged;
+            thread_pool_run(pool, apply_merge_task, &job);
+            used = workers;
+            for (int w = 0; w < workers; ++w) {
+                out_of_memory = out_of_memory || job.failed[w];
+            }
+        } else {
+            pair_table_clear(job.deltas[0]);
+            for (int k = 0; !out_of_memory && k < target_count; ++k) {
+                out_of_memory = merge_pair_ids(&molecules[targets[k]], left, right, merged,
+                                               job.deltas[0], NULL) == SIZE_MAX;
+            }
+        }
+        failed = out_of_memory || cluster_send_deltas(&peer, job.deltas, used) != 0;
+        for (int w = 0; !failed && w < used; ++w) {
+            const PairTable* delta = job.deltas[w];
+            for (uint32_t idx = 0; !failed && idx < delta->count; ++idx) {
+                if (delta->counts[idx] == 0) continue;
+                out_of_memory = pair_table_add(pairs, delta->keys[idx], delta->counts[idx]) == UINT32_MAX;
+                failed = out_of_memory;
+            }
+        }
+        for (int k = 0; !failed && k < target_count; ++k) {
+            out_of_memory = pair_occurrences_add_molecule(occurrences, pairs, &molecules[targets[k]], targets[k],
+                                                          merged) != 0;
+            failed = out_of_memory;
+        }
+        if (failed) {
+            break;
+        }
+        merge_count++;
+    }
+    if (verbose && !failed) {
+        printf("Applied %d merges\n", merge_count);
+    }
+
+    for (int w = 0; job.deltas && w < workers; ++w) {
+        pair_table_free(job.deltas[w]);
+    }
+    free(job.deltas);
+    free(job.failed);
+    free(targets);
+    free(visited);
+    pair_occurrences_free(occurrences);
+    pair_table_free(pairs);
+    molecule_set_free(&shard);
+    thread_pool_free(pool);
+    cluster_peer_close(&peer);
+    if (failed) {
+        errno = out_of_memory ? ENOMEM : EIO;
+        return -1;
+    }
+    return 0;
+}
+
+// A vocabulary snapshot being written in the background. It holds copies of the
+// training state, so the merge loop can carry on while it is saved.
+typedef struct {
+    TrainResult result;
+    int is_smiles;
+    int vocab_order;
+    char base[PATH_MAX];
+} SnapshotJob;
+
+// --snapshots: the merge counts still to save and the writer thread
+typedef struct {
+    const TrainConfig* config;
+    const HashTable* vocab;  // Initial vocabulary
+    int num_merges;          // The final vocabulary is saved by the caller, not as a snapshot
+    int next;                // Next entry of config->snapshots
+    JobQueue writer;
+} SnapshotState;
+
+// Copy a hash table, or return NULL when out of memory
+static HashTable* ht_copy(const HashTable* ht) {
+    HashTable* copy = ht_create(ht->size);
+    for (unsigned int i = 0; copy && i < ht->count; ++i) {
+        if (!hash_set(copy, ht->items[i].key, ht->items[i].count)) {
+            ht_free(copy);
+            copy = NULL;
+        }
+    }
+    return copy;
+}
+
+// Copy a symbol table, or return NULL when out of memory
+static SymbolTable* symbol_table_copy(const SymbolTable* st) {
+    SymbolTable* copy = symbol_table_create(st->count > 1024 ? st->count : 1024);
+    for (uint32_t id = 0; copy && id < st->count; ++id) {
+        if (symbol_table_intern(copy, st->strings[id], st->lengths[id]) == UINT32_MAX) {
+            symbol_table_free(copy);
+            copy = NULL;
+        }
+    }
+    return copy;
+}
+
+static void write_snapshot(void* arg) {
+    SnapshotJob* job = arg;
+    if (save_train_result(&job->result, job->is_smiles, job->vocab_order, job->base) != 0) {
+        fprintf(stderr, "Warning: could not write snapshot %s\n", job->base);
+    }
+    train_result_free(&job->result);
+    free(job);
+}
+
+static void take_snapshot(void* arg, const SymbolTable* symbols, const BpeMerge* merges, int merge_count) {
+    SnapshotState* state = arg;
+    const TrainConfig* config = state->config;
+    while (state->next < config->snapshot_count && config->snapshots[state->next] < merge_count) {
+        state->next++;
+    }
+    if (state->next >= config->snapshot_count || config->snapshots[state->next] != merge_count ||
+        merge_count >= state->num_merges) {
+        return;
+    }
+    state->next++;
+
+    SnapshotJob* job = calloc(1, sizeof(SnapshotJob));
+    if (!job) {
+        fprintf(stderr, "Warning: out of memory for the snapshot at %d merges\n", merge_count);
+        return;
+    }
+    int len = snprintf(job->base, sizeof(job->base), "%s%d", config->snapshot_prefix, merge_count);
+    if (len < 0 || len + 5 >= (int)sizeof(job->base)) {
+        fprintf(stderr, "Warning: snapshot path too long for %d merges\n", merge_count);
+        free(job);
+        return;
+    }
+    job->is_smiles = config->is_smiles;
+    job->vocab_order = config->vocab_order;
+    job->result.symbols = symbol_table_copy(symbols);
+    job->result.vocab = ht_copy(state->vocab);
+    job->result.merges = malloc(sizeof(BpeMerge) * (merge_count > 0 ? merge_count : 1));
+    if (!job->result.symbols || !job->result.vocab || !job->result.merges) {
+        fprintf(stderr, "Warning: out of memory for snapshot %s\n", job->base);
+        train_result_free(&job->result);
+        free(job);
+        return;
+    }
+    memcpy(job->result.merges, merges, sizeof(BpeMerge) * merge_count);
+    job->result.merge_count = merge_count;
+    job_queue_push(&state->writer, write_snapshot, job);
+}
+
+// Read the merges of a vocab_<n>.txt into merges[].left/right, interning their tokens.
+// Returns the number of merges stored (at most max_merges), or -1 with errno set if the
+// file cannot be read or memory runs out.
+static int load_given_merges(const char* path, SymbolTable* symbols, BpeMerge* merges, int max_merges) {
+    char** strings = NULL;
+    int count = 0;
+    HashTable* vocab = load_vocabulary(path, &strings, &count);
+    if (!vocab) {
+        return -1;
+    }
+    ht_free(vocab);
+
+    int given = 0;
+    int failed = 0;
+    for (int i = 0; !failed && i < count; ++i) {
+        const char* space = strchr(strings[i], ' ');
+        if (given < max_merges && space) {
+            merges[given].left = symbol_table_intern(symbols, strings[i], (size_t)(space - strings[i]));
+            merges[given].right = symbol_table_intern(symbols, space + 1, strlen(space + 1));
+            failed = merges[given].left == UINT32_MAX || merges[given].right == UINT32_MAX;
+            given++;
+        }
+    }
+    free_merge_strings(strings, count);
+    if (failed) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return given;
+}
+
+// Train BPE on a corpus from a file
+// Every line of the reader is trained on, with the given settings (see cvocgen.h)
+int train_corpus(CorpusReader* reader, const TrainConfig* config, int num_merges, TrainResult* result) {
+    memset(result, 0, sizeof(*result));
+    int resumable = config->checkpoint_path || config->resume_path || config->extend_path;
+    int checkpointed = config->checkpoint_path || config->resume_path;
+    if (num_merges < 0 || (config->max_memory > 0 && resumable) || (config->cluster && checkpointed)) {
+        errno = EINVAL;
+        return -1;
+    }
+    int verbose = config->verbose;
+    BpeRunOptions run = {0};
+    run.verbose = verbose;
+    run.min_frequency = config->min_frequency;
+    run.prune_below = config->prune_below;
+    run.stats = config->stats;
+    double started = stats_clock(config->stats);
+    if (config->target_vocab_size > 0) {
+        // Every symbol is one saved token, next to the special tokens
+        run.max_symbols = config->target_vocab_size > VOCAB_SPECIAL_COUNT
+                        ? (uint32_t)(config->target_vocab_size - VOCAB_SPECIAL_COUNT) : 1;
+    }
+
+    SymbolTable* symbols = NULL;
+    HashTable* vocab = NULL;
+    BpeMerge* merges = NULL;
+    int token_count = 0;
+    int molecule_count = 0;
+    int unique_count = 0;        // Entries in the on-disk segments (--max-memory)
+    int64_t* token_counts = NULL;  // Token counts by symbol ID, from tokenizing
+    MoleculeSet corpus;          // The molecules trained on, token_count of them
+    molecule_set_init(&corpus);
+    ThreadPool* pool = NULL;
+    SegmentStore store;
+
+    // A cached run of the same corpus and settings replaces training
+    VocabCache cache;
+    CheckpointData hit;
+    int use_cache = config->cache_directory && !config->resume_path && !config->extend_path && !config->cluster;
+    int cached = 0;
+    if (use_cache) {
+        if (vocab_cache_open(&cache, config->cache_directory, config, config->corpus_path) != 0) {
+            if (verbose) {
+                fprintf(stderr, "Warning: cannot use cache directory %s: %s\n", config->cache_directory,
+                        strerror(errno));
+            }
+            use_cache = 0;
+        } else {
+            cached = vocab_cache_load(&cache, num_merges, config->is_smiles, &hit) == 0;
+        }
+    }
+
+    if (config->resume_path) {
+        // Continue from a checkpoint: the corpus is not read again
+        CheckpointData data;
+        errno = 0;
+        if (load_checkpoint(config->resume_path, num_merges, &data) != 0) {
+            if (errno == 0) errno = EINVAL;
+            return -1;
+        }
+        if (data.is_smiles != config->is_smiles) {
+            if (verbose) {
+                fprintf(stderr, "Error: %s was written for %s input\n", config->resume_path,
+                        data.is_smiles ? "SMILES" : "SELFIES");
+            }
+            checkpoint_data_free(&data);
+            errno = EINVAL;
+            return -1;
+        }
+        symbols = data.symbols;
+        vocab = data.vocab;
+        merges = data.merges;
+        corpus = data.molecules;
+        token_count = corpus.count;
+        molecule_count = data.corpus_molecules;
+        run.done = data.merge_count < num_merges ? data.merge_count : num_merges;
+        run.pairs = data.pairs;
+        pool = thread_pool_create(config->threads);
+
+        stats_phase(config->stats, STATS_READ, started);
+        if (verbose) {
+            printf("Resumed %d merges from %s\n", data.merge_count, config->resume_path);
+            printf("\nProcessed a total of %d molecules.\n", molecule_count);
+            printf("Initial vocabulary size: %d tokens\n", count_unique_tokens(vocab));
+        }
+    } else if (!cached) {
+        // Single pass: tokenize all molecules and store them as symbol IDs.
+        // Progress is tracked in bytes against the file size, so no line pre-count is needed
+        uint64_t fingerprint[2];
+        if (config->max_memory > 0) {
+            // Bounded memory: molecules live in on-disk segments
+            if (segment_store_open(&store, config->spill_directory ? config->spill_directory : ".") != 0) {
+                return -1;
+            }
+            token_count = segment_corpus(reader, &store, config, &symbols, &token_counts, &unique_count,
+                                         use_cache ? fingerprint : NULL);
+            if (token_count < 0) {
+                int saved_errno = errno;
+                segment_store_close(&store);
+                symbol_table_free(symbols);
+                free(token_counts);
+                errno = saved_errno;
+                return -1;
+            }
+        } else {
+            pool = thread_pool_create(config->threads);
+            int failed = tokenize_corpus(reader, pool, config, &corpus, &symbols, &token_counts,
+                                         use_cache ? fingerprint : NULL) != 0;
+            int saved_errno = failed ? errno : EIO;
+            token_count = corpus.count;
+            if (failed || corpus_failed(reader)) {
+                molecule_set_free(&corpus);
+                symbol_table_free(symbols);
+                free(token_counts);
+                thread_pool_free(pool);
+                errno = saved_errno;
+                return -1;
+            }
+        }
+
+        // The corpus text may be cached under another file name or mtime
+        if (use_cache) {
+            vocab_cache_set_content(&cache, fingerprint[0], fingerprint[1]);
+            cached = vocab_cache_load(&cache, num_merges, config->is_smiles, &hit) == 0;
+            if (cached) {
+                if (config->max_memory > 0) {
+                    segment_store_close(&store);
+                }
+                molecule_set_free(&corpus);
+                symbol_table_free(symbols);
+                free(token_counts);
+                thread_pool_free(pool);
+                pool = NULL;
+                vocab_cache_store_ref(&cache);
+            }
+        }
+    }
+
+    if (cached) {
+        symbols = hit.symbols;
+        vocab = hit.vocab;
+        merges = hit.merges;
+        molecule_count = hit.corpus_molecules;
+        token_count = 0;
+        molecule_set_free(&hit.molecules);
+        pair_table_free(hit.pairs);
+        stats_phase(config->stats, STATS_READ, started);
+        if (verbose) {
+            printf("Found %d merges for this corpus in cache %s\n", hit.merge_count, config->cache_directory);
+        }
+    } else if (!config->resume_path) {
+        // Build the initial vocabulary from the token counts
+        vocab = build_initial_vocab(symbols, token_counts);
+        free(token_counts);
+        if (!vocab) {
+            if (config->max_memory > 0) {
+                segment_store_close(&store);
+            }
+            molecule_set_free(&corpus);
+            symbol_table_free(symbols);
+            thread_pool_free(pool);
+            errno = ENOMEM;
+            return -1;
+        }
+        double deduplicated = stats_phase(config->stats, STATS_READ, started);
+
+        if (verbose) {
+            printf("\nProcessed a total of %d molecules.\n", token_count);
+            printf("Initial vocabulary size: %d tokens\n", count_unique_tokens(vocab));
+        }
+
+        // Collapse repeated molecules into weighted entries
+        molecule_count = token_count;
+        if (config->max_memory > 0) {
+            if (verbose) {
+                printf("Stored %d unique entries in %d on-disk segments\n", unique_count, store.count);
+            }
+            token_count = 0;
+        } else if (config->deduplicate) {
+            token_count = corpus.count = dedup_id_lists(corpus.molecules, corpus.count);
+            if (token_count < molecule_count - molecule_count / 4) {
+                // Give back the room of the duplicates
+                molecule_set_compact(&corpus);
+            }
+            if (verbose) {
+                printf("Deduplicated %d molecules into %d unique entries\n", molecule_count, token_count);
+            }
+            stats_phase(config->stats, STATS_DEDUP, deduplicated);
+        }
+
+        merges = malloc(sizeof(BpeMerge) * (num_merges ? num_merges : 1));
+
+        // Start with the merges of an existing vocabulary
+        if (config->extend_path) {
+            run.given = load_given_merges(config->extend_path, symbols, merges, num_merges);
+            if (run.given < 0) {
+                int saved_errno = errno ? errno : EINVAL;
+                molecule_set_free(&corpus);
+                free(merges);
+                ht_free(vocab);
+                symbol_table_free(symbols);
+                thread_pool_free(pool);
+                errno = saved_errno;
+                return -1;
+            }
+            if (verbose) {
+                printf("Replaying %d merges from %s\n", run.given, config->extend_path);
+            }
+        }
+    }
+
+    Checkpoint checkpoint = {
+        config->checkpoint_path, config->checkpoint_merges, config->checkpoint_seconds,
+        run.done, time(NULL), config->is_smiles, num_merges, molecule_count, vocab
+    };
+    if (config->checkpoint_path && (config->checkpoint_merges > 0 || config->checkpoint_seconds > 0)) {
+        run.checkpoint = &checkpoint;
+    }
+
+    SnapshotState snapshots = { config, vocab, num_merges, 0 };
+    if (config->snapshot_count > 0 && config->snapshot_prefix) {
+        job_queue_start(&snapshots.writer);
+        run.after_merge = take_snapshot;
+        run.after_merge_arg = &snapshots;
+    }
+
+    // Perform BPE merges
+    if (verbose && !cached) {
+        printf("\nStarting BPE training with %d merges...\n", num_merges);
+    }
+    int merge_count;
+    if (cached) {
+        // The snapshots are prefixes of the cached merges
+        merge_count = hit.merge_count;
+        for (int i = 0; run.after_merge && i < config->snapshot_count; ++i) {
+            if (config->snapshots[i] <= merge_count) {
+                take_snapshot(&snapshots, symbols, merges, config->snapshots[i]);
+            }
+        }
+    } else if (config->cluster) {
+        thread_pool_free(pool);
+        merge_count = bpe_train_cluster(symbols, &corpus, config->max_memory > 0 ? &store : NULL, num_merges,
+                                        merges, config->cluster, &run);
+    } else if (config->max_memory > 0) {
+        merge_count = bpe_train_segments(symbols, &store, num_merges, merges, config->max_memory, &run);
+        segment_store_close(&store);
+    } else {
+        merge_count = bpe_train_ids(symbols, corpus.molecules, token_count, num_merges, merges, pool, &run);
+        thread_pool_free(pool);
+    }
+
+    if (run.after_merge) {
+        // Wait for the snapshots still being written
+        job_queue_finish(&snapshots.writer);
+    }
+
+    // Free all token lists
+    molecule_set_free(&corpus);
+
+    if (merge_count < 0) {
+        // Out of memory, a lost worker of the cluster or failed on-disk segments
+        int saved_errno = errno;
+        free(merges);
+        ht_free(vocab);
+        symbol_table_free(symbols);
+        errno = saved_errno;
+        return -1;
+    }
+    if (verbose && !cached) {
+        printf("BPE training completed with %d merges.\n", merge_count);
+    }
+    if (use_cache && !cached) {
+        // The vocabulary still holds the initial counts only
+        if (vocab_cache_store(&cache, symbols, vocab, merges, merge_count, num_merges,
+                              molecule_count, config->is_smiles) != 0) {
+            if (verbose) {
+                fprintf(stderr, "Warning: could not store the vocabulary in cache %s\n", config->cache_directory);
+            }
+        } else if (verbose) {
+            printf("Stored %d merges in cache %s\n", merge_count, config->cache_directory);
+        }
+    }
+
+    TrainStats* stats = config->stats;
+    if (stats) {
+        stats->molecules = molecule_count;
+        stats->entries = config->max_memory > 0 ? unique_count : token_count;
+        stats->merges = merge_count;
+        stats_table(&stats->symbols, symbols->count, symbols->slot_mask + 1, symbols->resizes);
+        stats_table(&stats->vocab, vocab->count, vocab->size, vocab->resizes);
+    }
+
+    result->symbols = symbols;
+    result->vocab = vocab;
+    result->merges = merges;
+    result->merge_count = merge_count;
+    result->molecule_count = molecule_count;
+    return 0;
+}
+
+void train_result_free(TrainResult* result) {
+    symbol_table_free(result->symbols);
+    ht_free(result->vocab);
+    free(result->merges);
+    memset(result, 0, sizeof(*result));
+}
+
+// Save a training result in the text, JSON and binary formats
+int save_train_result(TrainResult* result, int is_smiles, int vocab_order, const char* base) {
+    char vocab_file[PATH_MAX + 8];
+    char vocab_bin[PATH_MAX + 8];
+    int ret1 = snprintf(vocab_file, sizeof(vocab_file), "%s.txt", base);
+    int ret2 = snprintf(vocab_bin, sizeof(vocab_bin), "%s.bin", base);
+    if (ret1 < 0 || ret1 >= (int)sizeof(vocab_file) || ret2 < 0 || ret2 >= (int)sizeof(vocab_bin)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    int failed = save_vocabulary_ids(result->vocab, result->symbols, result->merges,
+                                     result->merge_count, vocab_file) != 0;
+
+    // The JSON and binary files share one token order, so their IDs agree
+    uint32_t token_count;
+    const Ht_item** tokens = vocab_token_order(result->vocab, result->symbols, result->merges,
+                                               result->merge_count, vocab_order, &token_count);
+    if (!tokens) {
+        return -1;
+    }
+    failed |= save_vocabulary_json_tokens(tokens, token_count, base) != 0;
+    failed |= save_vocabulary_binary(tokens, token_count, result->symbols, result->merges,
+                                     result->merge_count, is_smiles, vocab_bin) != 0;
+    free(tokens);
+    return failed ? -1 : 0;
+}
+
+// Everything below is the command-line program; libcvocgen is built without it
+#ifndef CVOCGEN_LIBRARY
+
+// Command-line options
+static char output_directory[PATH_MAX] = "."; // Default to current directory
+static int deduplicate_molecules = 0; // 1 = train on unique molecules weighted by their count
+static int num_threads = 1; // Worker threads for tokenization, pair counting and merging
+static size_t max_memory = 0; // Memory budget in bytes; > 0 trains from on-disk segments
+static int checkpoint_merges = 0; // Write a checkpoint every this many merges (0 = off)
+static int checkpoint_seconds = 0; // Write a checkpoint every this many seconds (0 = off)
+static const char* resume_file = NULL; // Checkpoint to continue from
+static const char* extend_file = NULL; // vocab_<n>.txt whose merges are replayed before training more
+static int* snapshot_merges = NULL; // Ascending merge counts to save extra vocabularies at
+static int snapshot_count = 0;
+static int vocab_order = VOCAB_ORDER_INSERTION; // Token order of the saved JSON and binary vocabularies
+static int min_frequency = 0; // Stop once the best pair occurs fewer times (0 = off)
+static int target_vocab_size = 0; // Stop once the vocabulary has this many tokens (0 = off)
+static int prune_below = 0; // Leave pairs counted fewer times out of best-pair selection (0 = off)
+static const char* stats_json_file = NULL; // Where to write the timing and table statistics report
+static int coordinator_port = 0; // > 0: train with workers connecting on this TCP port
+static int cluster_workers = 0; // Number of workers to wait for
+static const char* cache_directory = NULL; // Reuse and store trained vocabularies here
+
+// Train BPE on a corpus file with the command-line options and save the result
+// to output_directory/vocab_<num_merges>.*
+HashTable* train_bpe_from_file(const char* corpus_file, int num_merges) {
+    if (!corpus_file || num_merges < 0) {
+        return NULL;
+    }
+
+    // Check the output paths before doing any work
+    char vocab_base[PATH_MAX];
+    int ret = snprintf(vocab_base, sizeof(vocab_base), "%s/vocab_%d", output_directory, num_merges);
+    if (ret < 0 || ret + 5 >= (int)sizeof(vocab_base)) {
+        printf("Error: Path too long for vocabulary files\n");
+        return NULL;
+    }
+    char checkpoint_file[PATH_MAX + 8];
+    snprintf(checkpoint_file, sizeof(checkpoint_file), "%s.ckpt", vocab_base);
+    char snapshot_prefix[PATH_MAX + 8];
+    snprintf(snapshot_prefix, sizeof(snapshot_prefix), "%s/vocab_", output_directory);
+
+    // Open the corpus file ("-" reads stdin); a resumed run does not read it
+    TrainStats stats;
+    stats_init(&stats);
+
+    // Distributed run: every worker connects before the corpus is read
+    Cluster cluster;
+    if (coordinator_port > 0 && cluster_listen(&cluster, coordinator_port, cluster_workers, 1) != 0) {
+        perror("Error waiting for workers");
+        return NULL;
+    }
+
+    CorpusReader reader;
+    memset(&reader, 0, sizeof(reader));
+    if (!resume_file) {
+        if (corpus_open_threads(&reader, corpus_file, num_threads) != 0) {
+            perror(errno == ENOTSUP ? "Error opening corpus file (zstd input needs a build with make ZSTD=1)"
+                                    : "Error opening corpus file");
+            if (coordinator_port > 0) cluster_close(&cluster);
+            return NULL;
+        }
+
+
+        // Debug: Print file info
+        printf("Processing file: %s\n", corpus_file);
+        
+        printf("Reading corpus from %s...\n", corpus_file);
+    }
+
+    TrainConfig config = {
+        .is_smiles = input_format_is_smiles,
+        .lexer_mode = lexer_mode,
+        .threads = num_threads,
+        .deduplicate = deduplicate_molecules,
+        .max_memory = max_memory,
+        .spill_directory = output_directory,
+        .verbose = 1,
+        .checkpoint_path = (checkpoint_merges > 0 || checkpoint_seconds > 0) ? checkpoint_file : NULL,
+        .checkpoint_merges = checkpoint_merges,
+        .checkpoint_seconds = checkpoint_seconds,
+        .resume_path = resume_file,
+        .extend_path = extend_file,
+        .snapshots = snapshot_merges,
+        .snapshot_count = snapshot_count,
+        .snapshot_prefix = snapshot_prefix,
+        .vocab_order = vocab_order,
+        .min_frequency = min_frequency,
+        .target_vocab_size = target_vocab_size,
+        .prune_below = prune_below,
+        .stats = stats_json_file ? &stats : NULL,
+        .cluster = coordinator_port > 0 ? &cluster : NULL,
+        .cache_directory = cache_directory,
+        .corpus_path = corpus_file,
+    };
+    TrainResult result;
+    int failed = train_corpus(&reader, &config, num_merges, &result);
+    int saved_errno = errno;
+    int corpus_error = failed && corpus_failed(&reader);
+    corpus_close(&reader);
+    if (coordinator_port > 0) {
+        cluster_close(&cluster);
+    }
+    if (failed) {
+        errno = saved_errno;
+        perror(resume_file ? "Error reading checkpoint" : corpus_error ? "Error reading corpus file"
+                           : coordinator_port > 0 ? "Error in distributed training"
+                           : errno == EIO ? "Error reading corpus file"
+                           : errno == EOVERFLOW ? "Error: the corpus has more than INT_MAX molecules"
+                           : max_memory > 0 ? "Error using spill file" : "Error training vocabulary");
+        return NULL;
+    }
+
+    // Save the vocabulary and merges in all formats
+    double saving = stats_clock(config.stats);
+    if (save_train_result(&result, input_format_is_smiles, vocab_order, vocab_base) != 0) {
+        printf("Error: Could not save vocabulary files to %s\n", output_directory);
+        train_result_free(&result);
+        return NULL;
+    }
+    stats_phase(config.stats, STATS_SAVE, saving);
+    
+    printf("Vocabulary saved to %s.txt\n", vocab_base);
+    printf("JSON vocabulary saved to %s.json and %s_freq.json\n", vocab_base, vocab_base);
+    printf("Binary vocabulary saved to %s.bin\n", vocab_base);
+    if (stats_json_file) {
+        if (save_train_stats(&stats, stats_json_file) != 0) {
+            perror("Error writing training statistics");
+        } else {
+            printf("Training statistics saved to %s\n", stats_json_file);
+        }
+    }
+
+    HashTable* vocab = result.vocab;
+    result.vocab = NULL;
+    train_result_free(&result);
+    return vocab;
+}
+
+// Output formats of the encode mode
+#define ENCODE_FORMAT_TEXT 0    // One line of space-separated token IDs per molecule
+#define ENCODE_FORMAT_BIN 1     // Per molecule: uint32 ID count, then the uint32 IDs
+#define ENCODE_FORMAT_NPY 2     // NumPy .npy uint32 array(s)
+
+typedef struct {
+    int format;                 // ENCODE_FORMAT_*
+    int max_length;             // > 0: truncate or pad every molecule to this many IDs
+    int add_special_tokens;     // Wrap each molecule in <s> ... </s>
+} EncodeOptions;
+
+// Lines per batch handed to the worker threads
+#define ENCODE_BATCH_LINES 65536
+
+// One batch of input lines, encoded by a thread pool
+typedef struct {
+    const BpeEncoder* encoder;
+    const EncodeOptions* options;
+    const char** lines;
+    size_t* lengths;            // Line lengths in, encoded ID counts out
+    int line_count;
+    int workers;
+    EncodeBuffer* buffers;      // One per worker
+    EncodeCache* cache;         // Recently encoded molecules (serve), NULL = none
+} EncodeJob;
+
+// Encode one molecule, taking its IDs from the cache when it was seen recently
+static size_t encode_cached(const BpeEncoder* encoder, EncodeCache* cache, EncodeBuffer* buf,
+                            const char* text, size_t len, int add_special_tokens) {
+    if (!cache) {
+        return bpe_encode(encoder, buf, text, len, add_special_tokens);
+    }
+    size_t start_count = buf->count;
+    if (add_special_tokens && encoder->bos_id != UINT32_MAX) {
+        encode_buffer_append(buf, encoder->bos_id);
+    }
+    uint64_t hash = hash_bytes(text, len);
+    if (encode_cache_get(cache, hash, text, len, buf) < 0) {
+        size_t n = bpe_encode(encoder, buf, text, len, 0);
+        encode_cache_put(cache, hash, text, len, buf->ids + buf->count - n, n);
+    }
+    if (add_special_tokens && encoder->eos_id != UINT32_MAX) {
+        encode_buffer_append(buf, encoder->eos_id);
+    }
+    return buf->count - start_count;
+}
+
+static void encode_batch_task(void* arg, int worker) {
+    EncodeJob* job = arg;
+    if (worker >= job->workers) return;
+    int begin, end;
+    thread_pool_range(job->line_count, worker, job->workers, &begin, &end);
+    EncodeBuffer* buf = &job->buffers[worker];
+    buf->count = 0;
+    for (int i = begin; i < end; ++i) {
+        job->lengths[i] = encode_cached(job->encoder, job->cache, buf, job->lines[i], job->lengths[i],
+                                        job->options->add_special_tokens);
+    }
+}
+
+// Write a .npy header for a uint32 (or uint64) array; always 128 bytes so it can be
+// rewritten in place once the final shape is known
+static void write_npy_header(FILE* out, const char* descr, size_t rows, int columns) {
+    char header[128];
+    memset(header, ' ', sizeof(header));
+    memcpy(header, "\x93NUMPY\x01\x00", 8);
+    header[8] = (char)(sizeof(header) - 10);
+    header[9] = 0;
+    char dict[118];
+    int len = columns > 0
+        ? snprintf(dict, sizeof(dict), "{'descr': '%s', 'fortran_order': False, 'shape': (%zu, %d), }", descr, rows, columns)
+        : snprintf(dict, sizeof(dict), "{'descr': '%s', 'fortran_order': False, 'shape': (%zu,), }", descr, rows);
+    memcpy(header + 10, dict, (size_t)len);
+    header[sizeof(header) - 1] = '\n';
+    fwrite(header, 1, sizeof(header), out);
+}
+
+// Append an unsigned number in decimal to a text buffer, returning the new end
+static inline char* format_uint(char* p, uint32_t value) {
+    char digits[10];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    while (n > 0) *p++ = digits[--n];
+    return p;
+}
+
+// Write one encoded molecule
+static void write_encoded(FILE* out, FILE* offsets, const EncodeOptions* options, const uint32_t* ids,
+                          size_t count, uint32_t pad_id, uint64_t* total) {
+    size_t padded = count;
+    if (options->max_length > 0) {
+        if (count > (size_t)options->max_length) count = (size_t)options->max_length;
+        padded = (size_t)options->max_length;
+    }
+    *total += padded;
+
+    if (options->format == ENCODE_FORMAT_TEXT) {
+        char line[4096];
+        char* p = line;
+        for (size_t k = 0; k < padded; ++k) {
+            if (p - line > (ptrdiff_t)sizeof(line) - 12) {
+                fwrite(line, 1, (size_t)(p - line), out);
+                p = line;
+            }
+            if (k > 0) *p++ = ' ';
+            p = format_uint(p, k < count ? ids[k] : pad_id);
+        }
+        *p++ = '\n';
+        fwrite(line, 1, (size_t)(p - line), out);
+        return;
+    }
+
+    if (options->format == ENCODE_FORMAT_BIN) {
+        uint32_t n = (uint32_t)padded;
+        fwrite(&n, sizeof(n), 1, out);
+    }
+    fwrite(ids, sizeof(uint32_t), count, out);
+    for (size_t k = count; k < padded; ++k) {
+        fwrite(&pad_id, sizeof(pad_id), 1, out);
+    }
+    if (offsets) {
+        fwrite(total, sizeof(*total), 1, offsets);
+    }
+}
+
+// Encode every line of input ("-" = stdin) with a binary vocabulary.
+// output NULL writes to stdout (not for .npy). Status messages go to stderr.
+static int encode_corpus(const char* vocab_file, const char* input, const char* output,
+                         const EncodeOptions* options) {
+    if (options->format == ENCODE_FORMAT_NPY && !output) {
+        fprintf(stderr, "Error: --output-format npy needs an output file (-o)\n");
+        return 1;
+    }
+
+    BinaryVocab* vocab = load_vocabulary_binary(vocab_file);
+    if (!vocab) {
+        fprintf(stderr, "Error: Failed to load binary vocabulary from %s\n", vocab_file);
+        return 1;
+    }
+    BpeEncoder* encoder = bpe_encoder_create(vocab);
+    if (!encoder) {
+        fprintf(stderr, "Error: Out of memory creating the encoder\n");
+        binary_vocab_close(vocab);
+        return 1;
+    }
+
+    CorpusReader reader;
+    if (corpus_open_threads(&reader, input, num_threads) != 0) {
+        perror("Error opening input file");
+        bpe_encoder_free(encoder);
+        binary_vocab_close(vocab);
+        return 1;
+    }
+
+    FILE* out = output ? fopen(output, "wb") : stdout;
+    FILE* offsets = NULL;
+    char offsets_file[PATH_MAX];
+    if (!out) {
+        perror("Error opening output file");
+        corpus_close(&reader);
+        bpe_encoder_free(encoder);
+        binary_vocab_close(vocab);
+        return 1;
+    }
+    static char out_buffer[1 << 20];
+    setvbuf(out, out_buffer, _IOFBF, sizeof(out_buffer));
+
+    // Ragged .npy output is a flat ID array plus a <name>_offsets.npy of row ends
+    if (options->format == ENCODE_FORMAT_NPY) {
+        write_npy_header(out, "<u4", 0, options->max_length);
+        if (options->max_length <= 0) {
+            size_t base_len = strlen(output);
+            if (base_len > 4 && strcmp(output + base_len - 4, ".npy") == 0) base_len -= 4;
+            snprintf(offsets_file, sizeof(offsets_file), "%.*s_offsets.npy", (int)base_len, output);
+            offsets = fopen(offsets_file, "wb");
+            if (!offsets) {
+                perror("Error opening offsets file");
+                fclose(out);
+                corpus_close(&reader);
+                bpe_encoder_free(encoder);
+                binary_vocab_close(vocab);
+                return 1;
+            }
+            write_npy_header(offsets, "<u8", 0, 0);
+            uint64_t zero = 0;
+            fwrite(&zero, sizeof(zero), 1, offsets);
+        }
+    }
+
+    ThreadPool* pool = thread_pool_create(num_threads);
+    int workers = thread_pool_size(pool);
+    EncodeBuffer* buffers = malloc(sizeof(EncodeBuffer) * workers);
+    for (int w = 0; w < workers; ++w) {
+        encode_buffer_init(&buffers[w]);
+    }
+
+    const char** lines = malloc(sizeof(char*) * ENCODE_BATCH_LINES);
+    size_t* lengths = malloc(sizeof(size_t) * ENCODE_BATCH_LINES);
+    size_t* starts = malloc(sizeof(size_t) * ENCODE_BATCH_LINES);
+    char* text = NULL;          // Copies of streamed lines for the current batch
+    size_t text_size = 0, text_capacity = 0;
+
+    size_t molecule_count = 0;
+    uint64_t total = 0;
+    const char* line;
+    size_t len;
+    int more = 1;
+    while (more) {
+        // Collect a batch of lines; streamed lines are copied, mapped ones are used in place
+        int line_count = 0;
+        text_size = 0;
+        while (line_count < ENCODE_BATCH_LINES && (more = corpus_next_line(&reader, &line, &len))) {
+            // Empty lines get a row too, so rows match input lines
+            if (len > 0 && line[len - 1] == '\r') len--;
+            if (!reader.data) {
+                if (text_size + len > text_capacity) {
+                    text_capacity = (text_size + len) * 2;
+                    text = realloc(text, text_capacity);
+                }
+                memcpy(text + text_size, line, len);
+                starts[line_count] = text_size;
+                text_size += len;
+            } else {
+                lines[line_count] = line;
+            }
+            lengths[line_count++] = len;
+        }
+        if (!reader.data) {
+            for (int i = 0; i < line_count; ++i) lines[i] = text + starts[i];
+        }
+        if (line_count == 0) break;
+
+        EncodeJob job = { encoder, options, lines, lengths, line_count,
+                          workers < line_count ? workers : line_count, buffers, NULL };
+        thread_pool_run(pool, encode_batch_task, &job);
+
+        // Write the results in input order
+        for (int w = 0; w < job.workers; ++w) {
+            int begin, end;
+            thread_pool_range(line_count, w, job.workers, &begin, &end);
+            const uint32_t* ids = buffers[w].ids;
+            for (int i = begin; i < end; ++i) {
+                write_encoded(out, offsets, options, ids, lengths[i], encoder->pad_id, &total);
+                ids += lengths[i];
+            }
+        }
+        molecule_count += (size_t)line_count;
+    }
+
+    // Now that the number of rows is known, finish the .npy headers
+    if (options->format == ENCODE_FORMAT_NPY) {
+        fflush(out);
+        fseek(out, 0, SEEK_SET);
+        write_npy_header(out, "<u4", options->max_length > 0 ? molecule_count : (size_t)total,
+                         options->max_length);
+        if (offsets) {
+            fseek(offsets, 0, SEEK_SET);
+            write_npy_header(offsets, "<u8", molecule_count + 1, 0);
+        }
+    }
+
+    int ret = 0;
+    if (corpus_failed(&reader)) {
+        fprintf(stderr, "Error: Could not read %s to the end (corrupt or truncated input?)\n", input);
+        ret = 1;
+    }
+    if (ferror(out) || (output && fclose(out) != 0)) {
+        perror("Error writing encoded output");
+        ret = 1;
+    } else if (!output) {
+        fflush(out);
+    }
+    if (offsets && fclose(offsets) != 0) {
+        perror("Error writing offsets file");
+        ret = 1;
+    }
+
+    if (ret == 0) {
+        fprintf(stderr, "Encoded %zu molecules into %llu tokens\n", molecule_count, (unsigned long long)total);
+        if (offsets) {
+            fprintf(stderr, "Row offsets saved to %s\n", offsets_file);
+        }
+    }
+
+    for (int w = 0; w < workers; ++w) {
+        encode_buffer_free(&buffers[w]);
+    }
+    free(buffers);
+    free(lines);
+    free(lengths);
+    free(starts);
+    free(text);
+    thread_pool_free(pool);
+    corpus_close(&reader);
+    bpe_encoder_free(encoder);
+    binary_vocab_close(vocab);
+    return ret;
+}
+
+// One client stream of the encode server. Requests are encoded on pool, split
+// across its workers, or on the calling thread when pool is NULL.
+typedef struct {
+    const BpeEncoder* encoder;
+    EncodeCache* cache;
+    ThreadPool* pool;
+    int workers;
+    EncodeBuffer* buffers;      // One per worker
+    uint32_t* counts;           // Molecule lengths in, ID counts out
+    size_t* lengths;
+    const char** lines;
+    uint32_t capacity;          // Entries in counts/lengths/lines
+    char* text;
+    size_t text_capacity;
+    uint64_t requests;
+    uint64_t molecules;
+} ServeSession;
+
+// Returns 0 on success, or -1 if the worker buffers cannot be allocated
+static int serve_session_init(ServeSession* session, const BpeEncoder* encoder, EncodeCache* cache,
+                              ThreadPool* pool) {
+    memset(session, 0, sizeof(*session));
+    session->encoder = encoder;
+    session->cache = cache;
+    session->pool = pool;
+    session->workers = pool ? thread_pool_size(pool) : 1;
+    session->buffers = malloc(sizeof(EncodeBuffer) * session->workers);
+    if (!session->buffers) {
+        session->workers = 0;
+        return -1;
+    }
+    for (int w = 0; w < session->workers; ++w) {
+        encode_buffer_init(&session->buffers[w]);
+    }
+    return 0;
+}
+
+static void serve_session_free(ServeSession* session) {
+    for (int w = 0; w < session->workers; ++w) {
+        encode_buffer_free(&session->buffers[w]);
+    }
+    free(session->buffers);
+    free(session->counts);
+    free(session->lengths);
+    free(session->lines);
+    free(session->text);
+}
+
+// Answer a request with only a status and close the stream
+static int serve_session_fail(ServePeer* peer, uint32_t status) {
+    ServeResponse response = { status, 0, 0 };
+    serve_write(peer, &response, sizeof(response));
+    fflush(peer->out);
+    return -1;
+}
+
+// Make room for a request of count molecules and text_size bytes. Returns 0 on
+// success, or -1 with the session buffers released if the memory is not there.
+static int serve_session_reserve(ServeSession* session, uint32_t count, uint32_t text_size) {
+    if (count > session->capacity) {
+        free(session->counts);
+        free(session->lengths);
+        free(session->lines);
+        session->counts = malloc(sizeof(uint32_t) * count);
+        session->lengths = malloc(sizeof(size_t) * count);
+        session->lines = malloc(sizeof(char*) * count);
+        session->capacity = count;
+        if (!session->counts || !session->lengths || !session->lines) {
+            free(session->counts);
+            free(session->lengths);
+            free(session->lines);
+            session->counts = NULL;
+            session->lengths = NULL;
+            session->lines = NULL;
+            session->capacity = 0;
+            return -1;
+        }
+    }
+    if (text_size > session->text_capacity) {
+        free(session->text);
+        session->text = malloc(text_size);
+        session->text_capacity = session->text ? text_size : 0;
+        if (!session->text) {
+            return -1;
+        }
+    }
+    return 0;
+}
 
-    // Open the corpus file
-    FILE* file = fopen(corpus_file, "r");
-    if (!file) {
-        perror("Error opening corpus file");
-        return NULL;
-    }
+// Answer the requests of a stream until it ends. Returns 0 when the client is
+// done, or -1 after a bad request, a request it has no memory for, or a failed write.
+static int serve_session_run(ServeSession* session, ServePeer* peer) {
+    ServeRequest request;
+    while (serve_read(peer, &request, sizeof(request)) == 0) {
+        int valid = request.magic == SERVE_MAGIC && request.count <= SERVE_MAX_MOLECULES &&
+                    request.text_size <= SERVE_MAX_TEXT;
+        uint32_t count = valid ? request.count : 0;
+        if (valid && serve_session_reserve(session, count, request.text_size) != 0) {
+            fprintf(stderr, "Error: Out of memory for a request of %u molecules (%u bytes)\n",
+                    count, request.text_size);
+            return serve_session_fail(peer, SERVE_SERVER_ERROR);
+        }
+        if (valid && (serve_read(peer, session->counts, sizeof(uint32_t) * count) != 0 ||
+                      serve_read(peer, session->text, request.text_size) != 0)) {
+            return -1;
+        }
 
-    // Create a hash table for the initial vocabulary
-    HashTable* vocab = ht_create(HT_DEFAULT_SIZE);  // Larger initial size for corpus
-    
-    // Debug: Print file info
-    printf("Processing file: %s\n", corpus_file);
+        // The lengths must add up to the text
+        uint64_t offset = 0;
+        for (uint32_t i = 0; valid && i < count; ++i) {
+            session->lines[i] = session->text + offset;
+            session->lengths[i] = session->counts[i];
+            offset += session->counts[i];
+            valid = offset <= request.text_size;
+        }
+        if (!valid || offset != request.text_size) {
+            return serve_session_fail(peer, SERVE_BAD_REQUEST);
+        }
 
-    // Read the file line by line and process each molecule
-    char line[65536];  // Increased buffer size for very long lines
-    int line_count = 0;
-    
-    printf("Reading corpus from %s...\n", corpus_file);
-    
-    // Count total lines in file for progress bar
-    int total_lines = 0;
-    while (fgets(line, sizeof(line), file)) {
-        total_lines++;
-    }
-    rewind(file);
-    
-    // Initialize progress bar for first pass
-    ProgressBar bar = progress_bar_init("Tokenizing corpus", total_lines, 30);
-    
-    // First pass: tokenize all molecules and build initial vocabulary
-    while (fgets(line, sizeof(line), file)) {
-        // Remove newline if present
-        size_t len = strlen(line);
-        if (len > 0 && line[len-1] == '\n') {
-            line[len-1] = '\0';
+        EncodeOptions options = { ENCODE_FORMAT_BIN, 0, (request.flags & SERVE_FLAG_SPECIAL_TOKENS) != 0 };
+        int workers = session->workers < (int)count ? session->workers : (int)count;
+        EncodeJob job = { session->encoder, &options, session->lines, session->lengths, (int)count,
+                          workers > 0 ? workers : 1, session->buffers, session->cache };
+        if (session->pool && job.workers > 1) {
+            thread_pool_run(session->pool, encode_batch_task, &job);
+        } else {
+            encode_batch_task(&job, 0);
         }
-        
-        // Skip empty lines
-        if (strlen(line) == 0) {
-            progress_bar_increment(&bar);
-            continue;
+
+        // Each worker's IDs are in input order, after those of the workers before it
+        ServeResponse response = { SERVE_OK, count, 0 };
+        for (uint32_t i = 0; i < count; ++i) {
+            session->counts[i] = (uint32_t)session->lengths[i];
+            response.id_count += session->lengths[i];
         }
-        
-        // Tokenize the molecule
-        TokenList* tokens = pre_tokenize(line);
-        if (!tokens) {
-            progress_bar_increment(&bar);
-            continue;
+        int failed = serve_write(peer, &response, sizeof(response)) != 0 ||
+                     serve_write(peer, session->counts, sizeof(uint32_t) * count) != 0;
+        for (int w = 0; !failed && count > 0 && w < job.workers; ++w) {
+            failed = serve_write(peer, session->buffers[w].ids, sizeof(uint32_t) * session->buffers[w].count) != 0;
         }
-        
-        // Add tokens to vocabulary
-        for (size_t i = 0; i < tokens->count; ++i) {
-            hash_insert_or_increment(vocab, tokens->tokens[i]);
+        if (failed || fflush(peer->out) != 0) {
+            return -1;
         }
-        
-        free_token_list(tokens);
-        line_count++;
-        
-        // Update progress bar
-        progress_bar_increment(&bar);
+        session->requests++;
+        session->molecules += count;
     }
-    
-    // First pass complete
-    
-    printf("\nProcessed a total of %d molecules.\n", line_count);
-    printf("Initial vocabulary size: %d tokens\n", count_unique_tokens(vocab));
-    
-    // Rewind the file for the second pass
-    rewind(file);
-    
-    // Allocate memory for all tokenized molecules
-    TokenList** all_tokens = malloc(sizeof(TokenList*) * line_count);
-    int token_count = 0;
-    
-    // Initialize progress bar for second pass
-    ProgressBar bar2 = progress_bar_init("Building token lists", total_lines, 30);
-    
-    // Second pass: re-tokenize and store all molecules
-    while (fgets(line, sizeof(line), file) && token_count < line_count) {
-        // Remove newline if present
-        size_t len = strlen(line);
-        if (len > 0 && line[len-1] == '\n') {
-            line[len-1] = '\0';
-        }
-        
-        // Skip empty lines
-        if (strlen(line) == 0) {
-            progress_bar_increment(&bar2);
-            continue;
+    return 0;
+}
+
+// The shared state of a server listening on a Unix socket
+typedef struct {
+    int listen_fd;
+    const BpeEncoder* encoder;
+    EncodeCache* cache;
+} ServeSocket;
+
+// Take connections one after another and serve each until it closes
+static void* serve_socket_worker(void* arg) {
+    ServeSocket* server = arg;
+    ServeSession session;
+    if (serve_session_init(&session, server->encoder, server->cache, NULL) != 0) {
+        fprintf(stderr, "Error: Out of memory starting a server thread\n");
+        return NULL;
+    }
+    for (;;) {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("Error accepting a connection");
+            break;
         }
-        
-        // Tokenize the molecule
-        TokenList* tokens = pre_tokenize(line);
-        if (!tokens) {
-            progress_bar_increment(&bar2);
+        ServePeer peer;
+        if (serve_peer_open(&peer, fd) != 0) {
             continue;
         }
-        
-        all_tokens[token_count++] = tokens;
-        
-        // Update progress bar
-        progress_bar_increment(&bar2);
+        serve_session_run(&session, &peer);
+        serve_peer_close(&peer);
     }
-    
-    // Second pass complete
-    
-    fclose(file);
-    
-    // 3. Perform BPE merges
-    char** merges = malloc(sizeof(char*) * num_merges);
-    int merge_count = 0;
-    
-    printf("\nStarting BPE training with %d merges...\n", num_merges);
-    
-    // Initialize progress bar for BPE merges
-    ProgressBar bar3 = progress_bar_init("Performing BPE merges", num_merges, 30);
-    
-    for (int i = 0; i < num_merges; ++i) {
-        // Create a hash table for pair statistics
-        HashTable* pair_stats = ht_create(HT_DEFAULT_SIZE);
-        
-        // Initialize progress bar for pair statistics collection
-        ProgressBar bar_pairs = progress_bar_init("Collecting pair statistics", token_count, 30);
-        
-        // Collect pair statistics from all molecules
-        for (int j = 0; j < token_count; ++j) {
-            TokenList* tokens = all_tokens[j];
-            
-            // Skip molecules with fewer than 2 tokens
-            if (tokens->count < 2) {
-                progress_bar_increment(&bar_pairs);
-                continue;
+    serve_session_free(&session);
+    return NULL;
+}
+
+// Serve batch encode requests (cvocgen_serve.h) with a binary vocabulary. With a
+// socket path, each of threads workers takes one connection at a time; otherwise
+// requests come on stdin and are split over threads workers. Status messages go
+// to stderr.
+static int serve_vocabulary(const char* vocab_file, const char* socket_path, int threads,
+                            uint32_t cache_entries) {
+    BinaryVocab* vocab = load_vocabulary_binary(vocab_file);
+    if (!vocab) {
+        fprintf(stderr, "Error: Failed to load binary vocabulary from %s\n", vocab_file);
+        return 1;
+    }
+    BpeEncoder* encoder = bpe_encoder_create(vocab);
+    if (!encoder) {
+        fprintf(stderr, "Error: Out of memory creating the encoder\n");
+        binary_vocab_close(vocab);
+        return 1;
+    }
+    EncodeCache* cache = encode_cache_create(cache_entries);
+    if (cache_entries > 0 && !cache) {
+        fprintf(stderr, "Error: Out of memory creating a cache of %u molecules\n", cache_entries);
+        bpe_encoder_free(encoder);
+        binary_vocab_close(vocab);
+        return 1;
+    }
+
+    int ret = 0;
+    if (socket_path) {
+        ServeSocket server = { serve_listen(socket_path), encoder, cache };
+        if (server.listen_fd < 0) {
+            perror("Error listening on socket");
+            ret = 1;
+        } else {
+            // Serve with the threads that start; the calling thread is always one of them
+            pthread_t* workers = malloc(sizeof(pthread_t) * threads);
+            int started = 1;
+            while (workers && started < threads &&
+                   pthread_create(&workers[started], NULL, serve_socket_worker, &server) == 0) {
+                started++;
             }
-            
-            // Count pairs in this molecule
-            for (size_t k = 0; k < tokens->count - 1; ++k) {
-                char pair_key[256];
-                snprintf(pair_key, sizeof(pair_key), "%s %s", tokens->tokens[k], tokens->tokens[k+1]);
-                hash_insert_or_increment(pair_stats, pair_key);
+            if (started < threads) {
+                fprintf(stderr, "Warning: Started only %d of %d server threads\n", started, threads);
             }
-            
-            // Update pair statistics progress bar
-            progress_bar_increment(&bar_pairs);
-        }
-        
-        // Pair statistics collection complete
-        
-        // Find the best pair and its frequency
-        int pair_count = 0;
-        const char* best_pair = get_best_pair(pair_stats, &pair_count);
-        if (!best_pair) {
-            ht_free(pair_stats);
-            break;
-        }
-        
-        printf("  Merge %d/%d: Best pair: %s (frequency: %d)\n", i+1, num_merges, best_pair, pair_count);
-        
-        // Store the merge operation
-        merges[merge_count++] = strdup(best_pair);
-        
-        // Split the pair into first and second tokens
-        char* pair_copy = strdup(best_pair);
-        char* first = pair_copy;
-        char* second = NULL;
-        
-        // Find the space separating the two tokens
-        char* space = strchr(pair_copy, ' ');
-        if (!space) {
-            free(pair_copy);
-            ht_free(pair_stats);
-            break;
-        }
-        
-        *space = '\0';  // Split the string
-        second = space + 1;
-        
-        // Create the merged token
-        char merged[256];
-        snprintf(merged, sizeof(merged), "%s%s", first, second);
-        
-        // Store the merged token with the correct frequency from pair_stats
-        // This ensures the frequency in the JSON file will be accurate
-        Ht_item* item = hash_search(vocab, merged);
-        if (item) {
-            // If it already exists, update its count to the pair frequency
-            item->count = pair_count;
-        } else {
-            // Otherwise add it with the correct frequency
-            unsigned int slot = hash(merged, vocab->size);
-            Ht_item* new_item = malloc(sizeof(Ht_item));
-            new_item->key = strdup(merged);
-            new_item->count = pair_count;
-            new_item->next = vocab->items[slot];
-            vocab->items[slot] = new_item;
-            vocab->count++;
+            fprintf(stderr, "Serving %s on %s with %d threads\n", vocab_file, socket_path, started);
+            serve_socket_worker(&server);
+            for (int w = 1; w < started; ++w) {
+                pthread_join(workers[w], NULL);
+            }
+            free(workers);
+            close(server.listen_fd);
+            unlink(socket_path);
+            ret = 1;
         }
-        
-        // Initialize progress bar for applying merges
-        ProgressBar bar_merge = progress_bar_init("Applying merge operation", token_count, 30);
-        
-        // Apply the merge to all molecules
-        for (int j = 0; j < token_count; ++j) {
-            TokenList* new_tokens = merge_pair(all_tokens[j], best_pair);
-            free_token_list(all_tokens[j]);
-            all_tokens[j] = new_tokens;
-            
-            // Update merge application progress bar
-            progress_bar_increment(&bar_merge);
+    } else {
+        ThreadPool* pool = thread_pool_create(threads);
+        ServeSession session;
+        ServePeer peer = { stdin, stdout };
+        static char out_buffer[1 << 20];
+        setvbuf(stdout, out_buffer, _IOFBF, sizeof(out_buffer));
+        if (serve_session_init(&session, encoder, cache, pool) != 0) {
+            fprintf(stderr, "Error: Out of memory starting the server\n");
+            ret = 1;
+        } else if (serve_session_run(&session, &peer) != 0) {
+            fprintf(stderr, "Error: Bad request or closed output\n");
+            ret = 1;
         }
-        
-        // Merge application complete
-        
-        // Update the overall BPE merge progress bar
-        progress_bar_increment(&bar3);
-        
-        free(pair_copy);
-        ht_free(pair_stats);
+        uint64_t hits, misses;
+        encode_cache_stats(cache, &hits, &misses);
+        fprintf(stderr, "Served %llu requests with %llu molecules (cache: %llu hits, %llu misses)\n",
+                (unsigned long long)session.requests, (unsigned long long)session.molecules,
+                (unsigned long long)hits, (unsigned long long)misses);
+        serve_session_free(&session);
+        thread_pool_free(pool);
     }
-    
-    printf("BPE training completed with %d merges.\n", merge_count);
-    
-    // Save the vocabulary and merges in both formats
-    char vocab_file[PATH_MAX];
-    char vocab_base[PATH_MAX];
-    
-    // Use the output directory for file paths
-    int ret1 = snprintf(vocab_file, sizeof(vocab_file), "%s/vocab_%d.txt", output_directory, num_merges);
-    int ret2 = snprintf(vocab_base, sizeof(vocab_base), "%s/vocab_%d", output_directory, num_merges);
-    
-    // Check for truncation
-    if (ret1 < 0 || ret1 >= sizeof(vocab_file) || ret2 < 0 || ret2 >= sizeof(vocab_base)) {
-        printf("Error: Path too long for vocabulary files\n");
-        return NULL;
+
+    encode_cache_free(cache);
+    bpe_encoder_free(encoder);
+    binary_vocab_close(vocab);
+    return ret;
+}
+
+// Parse a memory size: a number of megabytes, or a number with a K, M or G suffix.
+// Returns 0 if the size is not valid.
+static size_t parse_memory_size(const char* text) {
+    char* end;
+    double value = strtod(text, &end);
+    if (end == text || value <= 0) {
+        return 0;
     }
-    
-    save_vocabulary(vocab, merges, merge_count, vocab_file);
-    save_vocabulary_json(vocab, merges, merge_count, vocab_base);
-    
-    printf("Vocabulary saved to %s\n", vocab_file);
-    printf("JSON vocabulary saved to %s.json and %s_freq.json\n", vocab_base, vocab_base);
-    
-    // Free all token lists
-    for (int i = 0; i < token_count; ++i) {
-        free_token_list(all_tokens[i]);
+    double unit = 1024.0 * 1024.0;
+    if (*end == 'K' || *end == 'k') { unit = 1024.0; end++; }
+    else if (*end == 'M' || *end == 'm') { end++; }
+    else if (*end == 'G' || *end == 'g') { unit = 1024.0 * 1024.0 * 1024.0; end++; }
+    if (*end == 'B' || *end == 'b') end++;
+    if (*end != '\0') {
+        return 0;
     }
-    free(all_tokens);
-    
-    // Free the merges
-    for (int i = 0; i < merge_count; ++i) {
-        free(merges[i]);
+    return (size_t)(value * unit);
+}
+
+static int compare_ints(const void* a, const void* b) {
+    int x = *(const int*)a, y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+// Parse a comma-separated list of merge counts into a sorted array without duplicates.
+// Returns the number of entries, or -1 if an entry is not a positive integer.
+static int parse_merge_list(const char* text, int** list_out) {
+    int count = 0;
+    int capacity = 8;
+    int* list = malloc(sizeof(int) * capacity);
+    const char* p = text;
+    while (*p) {
+        char* end;
+        long value = strtol(p, &end, 10);
+        if (end == p || value <= 0 || value > INT_MAX || (*end != ',' && *end != '\0')) {
+            free(list);
+            return -1;
+        }
+        if (count >= capacity) {
+            capacity *= 2;
+            list = realloc(list, sizeof(int) * capacity);
+        }
+        list[count++] = (int)value;
+        p = *end == ',' ? end + 1 : end;
     }
-    free(merges);
-    
-    return vocab;
+    qsort(list, count, sizeof(int), compare_ints);
+    int unique = 0;
+    for (int i = 0; i < count; ++i) {
+        if (unique == 0 || list[unique - 1] != list[i]) {
+            list[unique++] = list[i];
+        }
+    }
+    *list_out = list;
+    return unique;
 }
 
 void print_usage() {
     printf("Usage:\n");
     printf("  cvocgen                       Display this help message\n");
-    printf("  cvocgen -f <corpus_file> -n <num_merges> [-t <type>] [-o <output_dir>]  Train on a corpus file\n");
+    printf("  cvocgen -f <corpus_file> -n <num_merges> [-t <type>] [-o <output_dir>] [-d]  Train on a corpus file\n");
     printf("  cvocgen -l <vocab_file>       Load and display a vocabulary file\n");
     printf("  cvocgen -j <vocab_json>       Load and display a JSON vocabulary file\n");
+    printf("  cvocgen -b <vocab_bin>        Load and display a binary vocabulary file\n");
+    printf("  cvocgen encode <vocab_bin> <input_file> [-o <output_file>] [--output-format <fmt>]  Encode molecules to token IDs\n");
+    printf("  cvocgen worker <host>:<port> [--threads <n>]  Serve as a worker of a distributed training run\n");
+    printf("  cvocgen serve <vocab_bin> [--socket <path>] [--threads <n>]  Answer batch encode requests\n");
     printf("\nOptions:\n");
+    printf("  <corpus_file> may be '-' to read the corpus from stdin\n");
     printf("  -t, --type <type>              Input format type: 'smiles' or 'selfies' (default: selfies)\n");
     printf("  -o, --output <dir>             Output directory for vocabulary files (default: current directory)\n");
+    printf("  --threads <n>                  Worker threads for tokenizing and training (default: 1)\n");
+    printf("  --lexer <fast|regex|check>     Tokenizer: hand-written lexer (default), POSIX regex, or both cross-checked\n");
+    printf("  -d, --dedup                    Train on unique molecules weighted by their count (same result, less work)\n");
+    printf("  --max-memory <size>            Keep molecules in on-disk segments to stay within <size> (MB, or K/M/G suffix);\n");
+    printf("                                 the budget covers the molecules only: pair counts stay exact and in memory\n");
+    printf("  --checkpoint-every <n>         Write <output_dir>/vocab_<num_merges>.ckpt every n merges\n");
+    printf("  --checkpoint-seconds <s>       Write the checkpoint every s seconds\n");
+    printf("  --resume <checkpoint>          Continue a run from a checkpoint (the corpus is not read again)\n");
+    printf("  --extend <vocab_txt>           Replay the merges of an existing vocab_<n>.txt, then train up to <num_merges>\n");
+    printf("  --snapshots <k1,k2,...>        Also save vocab_<k> for each k < <num_merges> as training passes it\n");
+    printf("  --min-frequency <n>            Stop early once the best pair occurs fewer than n times\n");
+    printf("  --target-vocab-size <n>        Stop early once the vocabulary (special tokens included) has n tokens\n");
+    printf("  --prune-below <n>              Never merge pairs occurring fewer than n times and leave them out of\n");
+    printf("                                 the pair index (stops like --min-frequency n, using less memory)\n");
+    printf("  --stats-json <file>            Write per-phase times, merge latencies, peak RSS and table sizes as JSON\n");
+    printf("  --cache <dir>                  Reuse a run cached in <dir> for the same corpus and options (fewer\n");
+    printf("                                 merges are cut from a longer run), or cache this one there\n");
+    printf("  --coordinator <port>           Distributed training: accept workers on <port> and split the molecules\n");
+    printf("                                 among them (same result as training on one node)\n");
+    printf("  --cluster-workers <n>          Number of workers to wait for (each runs 'cvocgen worker <host>:<port>')\n");
+    printf("  --vocab-order <insertion|rank|frequency>\n");
+    printf("                                 Token ID order: first seen (default), base tokens then merges, or by count\n");
+    printf("\nEncode options:\n");
+    printf("  <input_file> may be '-' to read molecules from stdin; output goes to stdout without -o\n");
+    printf("  --output-format <fmt>          'text' (default), 'bin' (uint32 count + IDs per molecule) or 'npy'\n");
+    printf("  --max-length <n>               Truncate or pad (<pad>) every molecule to n IDs; npy output becomes 2-D\n");
+    printf("  --add-special-tokens           Wrap every molecule in <s> ... </s>\n");
+    printf("  --threads <n>                  Worker threads for encoding (default: 1)\n");
+    printf("\nServe options:\n");
+    printf("  Requests and responses are framed as in cvocgen_serve.h, on stdin/stdout without --socket\n");
+    printf("  --socket <path>                Listen on a Unix socket; each thread serves one connection at a time\n");
+    printf("  --threads <n>                  Worker threads (default: 1)\n");
+    printf("  --cache-entries <n>            Keep the IDs of the n most recently encoded molecules (default: 65536, 0 = off)\n");
 }
 
 // Global variable already declared at the top of the file
@@ -738,7 +4076,16 @@ int main(int argc, char *argv[]) {
             }
             
             // Check for optional arguments
-            for (int i = 5; i < argc - 1; i++) {
+            for (int i = 5; i < argc; i++) {
+                // Flags without a value
+                if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--dedup") == 0) {
+                    deduplicate_molecules = 1;
+                    continue;
+                }
+                if (i + 1 >= argc) {
+                    break;
+                }
+                
                 if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--type") == 0) {
                     if (strcmp(argv[i+1], "smiles") == 0) {
                         input_format_is_smiles = 1;
@@ -749,6 +4096,135 @@ int main(int argc, char *argv[]) {
                         print_usage();
                         return 1;
                     }
+                    i++;
+                }
+                else if (strcmp(argv[i], "--threads") == 0) {
+                    num_threads = atoi(argv[i+1]);
+                    if (num_threads < 1) {
+                        printf("Error: Number of threads must be at least 1\n");
+                        print_usage();
+                        return 1;
+                    }
+                    i++;
+                }
+                else if (strcmp(argv[i], "--max-memory") == 0) {
+                    max_memory = parse_memory_size(argv[i+1]);
+                    if (max_memory == 0) {
+                        printf("Error: Invalid memory size '%s'\n", argv[i+1]);
+                        print_usage();
+                        return 1;
+                    }
+                    i++;
+                }
+                else if (strcmp(argv[i], "--checkpoint-every") == 0 ||
+                         strcmp(argv[i], "--checkpoint-seconds") == 0) {
+                    int value = atoi(argv[i+1]);
+                    if (value < 1) {
+                        printf("Error: %s must be at least 1\n", argv[i]);
+                        print_usage();
+                        return 1;
+                    }
+                    if (strcmp(argv[i], "--checkpoint-every") == 0) {
+                        checkpoint_merges = value;
+                    } else {
+                        checkpoint_seconds = value;
+                    }
+                    i++;
+                }
+                else if (strcmp(argv[i], "--min-frequency") == 0 ||
+                         strcmp(argv[i], "--target-vocab-size") == 0 ||
+                         strcmp(argv[i], "--prune-below") == 0) {
+                    int value = atoi(argv[i+1]);
+                    if (value < 1) {
+                        printf("Error: %s must be at least 1\n", argv[i]);
+                        print_usage();
+                        return 1;
+                    }
+                    if (strcmp(argv[i], "--min-frequency") == 0) {
+                        min_frequency = value;
+                    } else if (strcmp(argv[i], "--target-vocab-size") == 0) {
+                        target_vocab_size = value;
+                    } else {
+                        prune_below = value;
+                    }
+                    i++;
+                }
+                else if (strcmp(argv[i], "--snapshots") == 0) {
+                    free(snapshot_merges);
+                    snapshot_count = parse_merge_list(argv[i+1], &snapshot_merges);
+                    if (snapshot_count < 0) {
+                        printf("Error: Invalid snapshot list '%s'\n", argv[i+1]);
+                        print_usage();
+                        return 1;
+                    }
+                    if (snapshot_merges[snapshot_count - 1] > num_merges) {
+                        printf("Error: Snapshot %d is beyond the %d merges of the run\n",
+                               snapshot_merges[snapshot_count - 1], num_merges);
+                        return 1;
+                    }
+                    i++;
+                }
+                else if (strcmp(argv[i], "--resume") == 0) {
+                    resume_file = argv[i+1];
+                    i++;
+                }
+                else if (strcmp(argv[i], "--extend") == 0) {
+                    extend_file = argv[i+1];
+                    i++;
+                }
+                else if (strcmp(argv[i], "--stats-json") == 0) {
+                    stats_json_file = argv[i+1];
+                    i++;
+                }
+                else if (strcmp(argv[i], "--cache") == 0) {
+                    cache_directory = argv[i+1];
+                    i++;
+                }
+                else if (strcmp(argv[i], "--coordinator") == 0) {
+                    coordinator_port = atoi(argv[i+1]);
+                    if (coordinator_port < 1 || coordinator_port > 65535) {
+                        printf("Error: Invalid port '%s'\n", argv[i+1]);
+                        print_usage();
+                        return 1;
+                    }
+                    i++;
+                }
+                else if (strcmp(argv[i], "--cluster-workers") == 0) {
+                    cluster_workers = atoi(argv[i+1]);
+                    if (cluster_workers < 1) {
+                        printf("Error: Number of cluster workers must be at least 1\n");
+                        print_usage();
+                        return 1;
+                    }
+                    i++;
+                }
+                else if (strcmp(argv[i], "--lexer") == 0) {
+                    if (strcmp(argv[i+1], "fast") == 0) {
+                        lexer_mode = LEXER_FAST;
+                    } else if (strcmp(argv[i+1], "regex") == 0) {
+                        lexer_mode = LEXER_REGEX;
+                    } else if (strcmp(argv[i+1], "check") == 0) {
+                        lexer_mode = LEXER_CHECK;
+                    } else {
+                        printf("Error: Unknown lexer '%s'. Must be 'fast', 'regex' or 'check'\n", argv[i+1]);
+                        print_usage();
+                        return 1;
+                    }
+                    i++;
+                }
+                else if (strcmp(argv[i], "--vocab-order") == 0) {
+                    if (strcmp(argv[i+1], "insertion") == 0) {
+                        vocab_order = VOCAB_ORDER_INSERTION;
+                    } else if (strcmp(argv[i+1], "rank") == 0) {
+                        vocab_order = VOCAB_ORDER_RANK;
+                    } else if (strcmp(argv[i+1], "frequency") == 0) {
+                        vocab_order = VOCAB_ORDER_FREQUENCY;
+                    } else {
+                        printf("Error: Unknown vocabulary order '%s'. Must be 'insertion', 'rank' or 'frequency'\n", argv[i+1]);
+                        print_usage();
+                        return 1;
+                    }
+                    i++;
                 }
                 else if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0) {
                     strncpy(output_directory, argv[i+1], sizeof(output_directory) - 1);
@@ -764,9 +4240,31 @@ int main(int argc, char *argv[]) {
                         }
                         printf("Created output directory: %s\n", output_directory);
                     }
+                    i++;
                 }
             }
             
+            if (max_memory > 0 && (checkpoint_merges > 0 || checkpoint_seconds > 0 || resume_file || extend_file)) {
+                printf("Error: --max-memory cannot be combined with checkpoints, --resume or --extend\n");
+                return 1;
+            }
+            if (resume_file && extend_file) {
+                printf("Error: --resume and --extend cannot be combined\n");
+                return 1;
+            }
+            if ((coordinator_port > 0) != (cluster_workers > 0)) {
+                printf("Error: --coordinator and --cluster-workers must be given together\n");
+                return 1;
+            }
+            if (coordinator_port > 0 && (checkpoint_merges > 0 || checkpoint_seconds > 0 || resume_file)) {
+                printf("Error: --coordinator cannot be combined with checkpoints or --resume\n");
+                return 1;
+            }
+            if (cache_directory && (resume_file || extend_file || coordinator_port > 0)) {
+                printf("Error: --cache cannot be combined with --resume, --extend or --coordinator\n");
+                return 1;
+            }
+
             printf("Training BPE on corpus file %s with %d merges (format: %s)\n", 
                    corpus_file, num_merges, input_format_is_smiles ? "SMILES" : "SELFIES");
             HashTable* vocab = train_bpe_from_file(corpus_file, num_merges);
@@ -779,6 +4277,109 @@ int main(int argc, char *argv[]) {
                 printf("Error: Failed to train BPE on corpus file\n");
                 return 1;
             }
+        } else if (strcmp(argv[1], "encode") == 0 && argc >= 4) {
+            // Encode molecules with a trained binary vocabulary
+            const char* vocab_file = argv[2];
+            const char* input_file = argv[3];
+            const char* output_file = NULL;
+            EncodeOptions options = { ENCODE_FORMAT_TEXT, 0, 0 };
+
+            for (int i = 4; i < argc; i++) {
+                // Flags without a value
+                if (strcmp(argv[i], "--add-special-tokens") == 0) {
+                    options.add_special_tokens = 1;
+                    continue;
+                }
+                if (i + 1 >= argc) {
+                    break;
+                }
+
+                if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0) {
+                    output_file = argv[i+1];
+                    i++;
+                }
+                else if (strcmp(argv[i], "--output-format") == 0) {
+                    if (strcmp(argv[i+1], "text") == 0) {
+                        options.format = ENCODE_FORMAT_TEXT;
+                    } else if (strcmp(argv[i+1], "bin") == 0) {
+                        options.format = ENCODE_FORMAT_BIN;
+                    } else if (strcmp(argv[i+1], "npy") == 0) {
+                        options.format = ENCODE_FORMAT_NPY;
+                    } else {
+                        fprintf(stderr, "Error: Unknown output format '%s'. Must be 'text', 'bin' or 'npy'\n", argv[i+1]);
+                        return 1;
+                    }
+                    i++;
+                }
+                else if (strcmp(argv[i], "--max-length") == 0) {
+                    options.max_length = atoi(argv[i+1]);
+                    if (options.max_length < 1) {
+                        fprintf(stderr, "Error: Maximum length must be at least 1\n");
+                        return 1;
+                    }
+                    i++;
+                }
+                else if (strcmp(argv[i], "--threads") == 0) {
+                    num_threads = atoi(argv[i+1]);
+                    if (num_threads < 1) {
+                        fprintf(stderr, "Error: Number of threads must be at least 1\n");
+                        return 1;
+                    }
+                    i++;
+                }
+            }
+
+            return encode_corpus(vocab_file, input_file, output_file, &options);
+        } else if (strcmp(argv[1], "serve") == 0 && argc >= 3) {
+            // Answer batch encode requests with a vocabulary loaded once
+            const char* vocab_file = argv[2];
+            const char* socket_path = NULL;
+            long cache_entries = 65536;
+            for (int i = 3; i + 1 < argc; i++) {
+                if (strcmp(argv[i], "--socket") == 0) {
+                    socket_path = argv[i+1];
+                    i++;
+                }
+                else if (strcmp(argv[i], "--threads") == 0) {
+                    num_threads = atoi(argv[i+1]);
+                    if (num_threads < 1) {
+                        fprintf(stderr, "Error: Number of threads must be at least 1\n");
+                        return 1;
+                    }
+                    i++;
+                }
+                else if (strcmp(argv[i], "--cache-entries") == 0) {
+                    cache_entries = atol(argv[i+1]);
+                    if (cache_entries < 0 || cache_entries > UINT32_MAX / 2) {
+                        fprintf(stderr, "Error: Invalid cache size '%s'\n", argv[i+1]);
+                        return 1;
+                    }
+                    i++;
+                }
+            }
+            return serve_vocabulary(vocab_file, socket_path, num_threads, (uint32_t)cache_entries);
+        } else if (strcmp(argv[1], "worker") == 0 && argc >= 3) {
+            // Hold a shard of a distributed run and apply the coordinator's merges
+            const char* address = argv[2];
+            for (int i = 3; i + 1 < argc; i++) {
+                if (strcmp(argv[i], "--threads") == 0) {
+                    num_threads = atoi(argv[i+1]);
+                    if (num_threads < 1) {
+                        fprintf(stderr, "Error: Number of threads must be at least 1\n");
+                        return 1;
+                    }
+                    i++;
+                }
+            }
+            if (run_cluster_worker(address, num_threads, 1) != 0) {
+                if (errno == EINVAL) {
+                    fprintf(stderr, "Error: Invalid coordinator address '%s'. Must be <host>:<port>\n", address);
+                } else {
+                    perror("Error in distributed training");
+                }
+                return 1;
+            }
+            return 0;
         } else if (strcmp(argv[1], "-l") == 0 && argc >= 3) {
             // Load vocabulary file
             const char* vocab_file = argv[2];
@@ -796,15 +4397,12 @@ int main(int argc, char *argv[]) {
                 
                 printf("\nLoaded vocabulary (showing first 20 entries):\n");
                 int count = 0;
-                for (unsigned int i = 0; i < loaded_vocab->size && count < 20; ++i) {
-                    Ht_item* item = loaded_vocab->items[i];
-                    while (item && count < 20) {
-                        printf("  - %s: %d\n", item->key, item->count);
-                        item = item->next;
-                        count++;
-                    }
+                for (unsigned int i = 0; i < loaded_vocab->count && count < 20; ++i) {
+                    Ht_item* item = &loaded_vocab->items[i];
+                    printf("  - %s: %lld\n", item->key, (long long)item->count);
+                    count++;
                 }
-                printf("Total vocabulary size: %d tokens\n", loaded_vocab->size);
+                printf("Total vocabulary size: %d tokens\n", loaded_vocab->count);
                 
                 // Free loaded resources
                 for (int i = 0; i < loaded_merge_count; ++i) {
@@ -834,15 +4432,12 @@ int main(int argc, char *argv[]) {
                 
                 printf("\nLoaded vocabulary (showing first 20 entries):\n");
                 int count = 0;
-                for (unsigned int i = 0; i < loaded_vocab->size && count < 20; ++i) {
-                    Ht_item* item = loaded_vocab->items[i];
-                    while (item && count < 20) {
-                        printf("  - %s: %d\n", item->key, item->count);
-                        item = item->next;
-                        count++;
-                    }
+                for (unsigned int i = 0; i < loaded_vocab->count && count < 20; ++i) {
+                    Ht_item* item = &loaded_vocab->items[i];
+                    printf("  - %s: %lld\n", item->key, (long long)item->count);
+                    count++;
                 }
-                printf("Total vocabulary size: %d tokens\n", loaded_vocab->size);
+                printf("Total vocabulary size: %d tokens\n", loaded_vocab->count);
                 
                 // Free loaded resources
                 for (int i = 0; i < loaded_merge_count; ++i) {
@@ -855,6 +4450,33 @@ int main(int argc, char *argv[]) {
                 printf("Error: Failed to load JSON vocabulary from %s\n", json_file);
                 return 1;
             }
+        } else if (strcmp(argv[1], "-b") == 0 && argc >= 3) {
+            // Load binary vocabulary file
+            const char* bin_file = argv[2];
+
+            printf("Loading binary vocabulary from %s\n", bin_file);
+            BinaryVocab* bv = load_vocabulary_binary(bin_file);
+
+            if (bv) {
+                printf("Loaded %u merge operations (format: %s):\n", bv->merge_count,
+                       (bv->header->flags & BINARY_VOCAB_FLAG_SMILES) ? "SMILES" : "SELFIES");
+                for (uint32_t i = 0; i < bv->merge_count; ++i) {
+                    printf("  %u. %s %s\n", i+1, binary_vocab_token(bv, bv->merges[i].left),
+                           binary_vocab_token(bv, bv->merges[i].right));
+                }
+
+                printf("\nLoaded vocabulary (showing first 20 entries):\n");
+                for (uint32_t id = 0; id < bv->token_count && id < 20; ++id) {
+                    printf("  - %s: %lld\n", binary_vocab_token(bv, id), (long long)bv->tokens[id].count);
+                }
+                printf("Total vocabulary size: %u tokens\n", bv->token_count);
+
+                binary_vocab_close(bv);
+                return 0;
+            } else {
+                printf("Error: Failed to load binary vocabulary from %s\n", bin_file);
+                return 1;
+            }
         } else {
             print_usage();
             return 1;
@@ -890,10 +4512,10 @@ int main(int argc, char *argv[]) {
             printf("\n");
 
             // Find the best pair and its frequency
-            int pair_count = 0;
+            int64_t pair_count = 0;
             const char* best_pair = get_best_pair(pair_stats, &pair_count);
             if (best_pair) {
-                printf("Best pair: %s (frequency: %d)\n\n", best_pair, pair_count);
+                printf("Best pair: %s (frequency: %lld)\n\n", best_pair, (long long)pair_count);
                 
                 // 4. Merge the best pair
                 TokenList* merged_tokens = merge_pair(tokens, best_pair);
@@ -953,3 +4575,5 @@ int main(int argc, char *argv[]) {
 
     return 0;
 }
+
+#endif // CVOCGEN_LIBRARY
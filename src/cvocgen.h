@@ -4,21 +4,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <regex.h>
 
+#include "cvocgen_arena.h"
+
 // Hash table entry
 typedef struct Ht_item {
-    char* key;
-    int count;
-    struct Ht_item* next;
+    char* key;               // NUL-terminated, owned by the table's arena
+    int64_t count;
+    uint32_t hash;           // Cached hash of key
 } Ht_item;
 
-// Hash table
+// Open-addressing hash table from strings to counts.
+// Entries are stored densely in insertion order, so iterate with
+//   for (unsigned int i = 0; i < ht->count; ++i) { Ht_item* item = &ht->items[i]; ... }
+// Pointers to entries are invalidated by the next insertion.
 typedef struct HashTable {
-    Ht_item** items;
-    unsigned int size;       // Number of buckets
+    Ht_item* items;          // Entries in insertion order
     unsigned int count;      // Number of items stored
+    unsigned int capacity;   // Allocated entries in items
+    uint32_t* slots;         // Linear probing index: item index + 1, 0 = empty
+    unsigned int size;       // Number of slots (power of two)
     float load_threshold;    // Load factor threshold for resizing
+    unsigned int resizes;    // Times the index was rebuilt larger
+    Arena keys;              // Storage for the keys
 } HashTable;
 
 // Structure to hold a list of tokens
@@ -26,33 +36,374 @@ typedef struct {
     char** tokens;
     size_t count;
     size_t capacity;
+    Arena strings;           // Storage for the tokens, released with the list
 } TokenList;
 
+// Interned token strings. Every atomic and merged token is stored once and
+// identified by its uint32_t ID (assigned in first-seen order).
+typedef struct {
+    char** strings;          // ID -> NUL-terminated token
+    size_t* lengths;         // ID -> strlen of the token
+    uint32_t count;          // Number of symbols
+    uint32_t capacity;       // Allocated entries in strings/lengths
+    uint32_t* slots;         // Open-addressing index: symbol ID + 1, 0 = empty
+    uint32_t slot_mask;      // Number of slots - 1 (power of two)
+    uint32_t resizes;        // Times the index was rebuilt larger
+} SymbolTable;
+
+// A molecule as a list of symbol IDs
+typedef struct {
+    uint32_t* ids;
+    size_t count;
+    int64_t weight;          // Number of identical molecules this entry stands for
+} IdList;
+
+// A corpus of molecules stored flat, CSR style: the IDs of every molecule lie back
+// to back in one buffer, in molecule order, and molecules[i].ids points at the span
+// of molecule i. Merges shorten spans in place, so they stay in buffer order.
+typedef struct {
+    IdList* molecules;
+    int count;
+    int capacity;
+    uint32_t* ids;           // The IDs of all molecules
+    size_t id_count;         // IDs in use, gaps left by merges included
+    size_t id_capacity;
+} MoleculeSet;
+
+// Pack a (left_id, right_id) pair into a single 64-bit key
+#define PAIR_KEY(left, right) (((uint64_t)(left) << 32) | (uint32_t)(right))
+#define PAIR_LEFT(key) ((uint32_t)((key) >> 32))
+#define PAIR_RIGHT(key) ((uint32_t)(key))
+
+// Pair statistics keyed on packed pair keys. Each distinct pair gets a dense
+// pair index that stays valid for the lifetime of the table.
+typedef struct {
+    uint64_t* keys;          // Pair index -> packed pair key
+    int64_t* counts;         // Pair index -> occurrence count
+    uint32_t count;          // Number of distinct pairs
+    uint32_t capacity;       // Allocated entries in keys/counts
+    uint32_t* slots;         // Open-addressing index: pair index + 1, 0 = empty
+    uint32_t slot_mask;      // Number of slots - 1 (power of two)
+    uint32_t resizes;        // Times the index was rebuilt larger
+} PairTable;
+
+// Max-heap entry: a pair index and its count when it was pushed.
+// An entry is stale once the pair's count no longer matches (lazy invalidation).
+typedef struct {
+    uint32_t pair;
+    int64_t count;
+} PairHeapEntry;
+
+// Priority queue over a pair table for best-pair selection
+typedef struct {
+    PairHeapEntry* entries;
+    size_t count;
+    size_t capacity;
+    const PairTable* pairs;
+    const SymbolTable* symbols;  // For the lexicographic tie rule
+    int min_count;               // Pairs counted fewer times are left out (--prune-below)
+    uint32_t allocations;        // Times entries was (re)allocated
+} PairHeap;
+
+// Molecules that may contain a pair, by molecule index. Entries go stale once a
+// molecule no longer holds the pair and are skipped when the pair is merged.
+typedef struct {
+    uint32_t* molecules;
+    uint32_t count;
+    uint32_t capacity;
+} OccurrenceList;
+
+// Occurrence index: pair index -> OccurrenceList
+typedef struct {
+    OccurrenceList* lists;
+    uint8_t* pruned;         // Pair index -> 1 if some occurrences were left out
+    uint32_t size;           // Pair indices covered
+    int min_count;           // Pairs counted fewer times are not indexed (--prune-below)
+    uint64_t allocations;    // List (re)allocations
+} PairOccurrences;
+
+// A merge chosen by the ID-based trainer
+typedef struct {
+    uint32_t left;
+    uint32_t right;
+    uint32_t merged;
+    int64_t count;
+} BpeMerge;
+
+// Input formats. The value indexes the format table and is what is_smiles holds
+// in configs, checkpoints and binary vocabularies.
+#define FORMAT_SELFIES 0
+#define FORMAT_SMILES 1
+#define FORMAT_COUNT 2
+
+// The tokenizers of one input format. Each format's functions are generated from
+// its scanner (cvocgen_lexer.h), so their loops call it directly: the format is
+// chosen once per molecule, never per token. A new format needs a scanner, a
+// reference pattern and an entry in the table in cvocgen.c.
+struct BinaryVocab;
+typedef struct {
+    const char* name;
+    const char* pattern;     // POSIX pattern of the reference tokenizer (LEXER_REGEX)
+    // Append the tokens of text to list
+    void (*tokenize)(TokenList* list, const char* text, size_t len);
+    // Intern the tokens of text into ids, which has room for len IDs; returns their
+    // number, or -1 when out of memory
+    long (*intern)(SymbolTable* st, uint32_t* ids, const char* text, size_t len);
+    // Look up the tokens of text in a binary vocabulary, unknown ones as unk_id;
+    // same bound and result as intern
+    size_t (*lookup)(const struct BinaryVocab* vocab, uint32_t unk_id, uint32_t* ids, const char* text,
+                     size_t len);
+} InputFormat;
+
+// The tokenizers of a format (FORMAT_*, or an is_smiles flag)
+const InputFormat* input_format(int format);
+
+// Encoder: applies a trained vocabulary's merges to new molecules by merge rank.
+// Token IDs and merge ranks are looked up through the vocabulary's mapped
+// indexes. It is read-only once created and can be shared between threads, each
+// using its own EncodeBuffer.
+typedef struct {
+    const struct BinaryVocab* vocab;
+    uint32_t* merge_starts;  // The merges with left token id are at merge_starts[id] ..
+                             // merge_starts[id + 1] - 1 of the vocabulary's merge index
+    int is_smiles;           // Format of the vocabulary
+    const InputFormat* format;  // Its tokenizers
+    uint32_t unk_id, bos_id, eos_id, pad_id;
+} BpeEncoder;
+
+// Candidate merge at a position of the molecule being encoded
+typedef struct {
+    uint32_t rank;
+    uint32_t pos;
+} EncodeHeapEntry;
+
+// Output and scratch space for bpe_encode
+typedef struct {
+    uint32_t* ids;           // Token IDs of the encoded molecules, appended
+    size_t count;
+    size_t capacity;
+    uint32_t* symbols;       // Scratch: symbol at each pre-token position
+    int32_t* prev;           // Scratch: linked list over live positions
+    int32_t* next;
+    size_t scratch_capacity;
+    EncodeHeapEntry* heap;
+    size_t heap_count;
+    size_t heap_capacity;
+} EncodeBuffer;
+
+// Settings of one training run. The command line fills one from its options;
+// library callers own theirs, so concurrent runs share no state.
+struct TrainStats;
+struct Cluster;
+typedef struct {
+    int is_smiles;           // 0 = SELFIES, 1 = SMILES
+    int lexer_mode;          // LEXER_*
+    int threads;             // Worker threads for tokenization, pair counting and merging
+    int deduplicate;         // Train on unique molecules weighted by their count
+    size_t max_memory;       // Memory budget in bytes; > 0 trains from on-disk segments
+    const char* spill_directory;  // Where bounded-memory training puts its spill file
+    int verbose;             // Print progress and merges to stdout
+    const char* checkpoint_path;  // Checkpoint file (cvocgen_checkpoint.h), NULL = none
+    int checkpoint_merges;   // Write a checkpoint every this many merges (0 = off)
+    int checkpoint_seconds;  // ... or every this many seconds (0 = off)
+    const char* resume_path; // Continue from this checkpoint instead of reading the corpus
+    const char* extend_path; // Replay the merges of this vocab_<n>.txt, then keep training
+    const int* snapshots;    // Ascending merge counts k < num_merges at which to save
+    int snapshot_count;      // <snapshot_prefix><k>.txt/.json/_freq.json/.bin in the background
+    const char* snapshot_prefix;
+    int vocab_order;         // VOCAB_ORDER_* of the snapshots
+    int min_frequency;       // Stop once the best pair occurs fewer times (0 = off)
+    int target_vocab_size;   // Stop once the vocabulary, special tokens included, has this many tokens (0 = off)
+    int prune_below;         // Leave pairs counted fewer times out of best-pair selection (0 = off)
+    struct TrainStats* stats;  // Phase timings and table statistics (cvocgen_stats.h), NULL = none
+    struct Cluster* cluster; // Workers holding the molecules during the merges (cvocgen_cluster.h),
+                             // NULL = train locally
+    const char* cache_directory;  // Reuse and store finished runs here (cvocgen_cache.h), NULL = off
+    const char* corpus_path; // The corpus file, to find it in the cache unread; NULL or "-" = by content only
+} TrainConfig;
+
+// A trained vocabulary
+typedef struct {
+    SymbolTable* symbols;
+    HashTable* vocab;        // Token counts; merged tokens are added when saving
+    BpeMerge* merges;
+    int merge_count;
+    int molecule_count;      // Molecules (non-empty lines) read
+} TrainResult;
+
 // Default values for hash table
 #define HT_DEFAULT_SIZE 10000
 #define HT_DEFAULT_LOAD_THRESHOLD 0.7
 
 // Function prototypes for hash table
+uint64_t hash_bytes(const char* key, size_t len);
 HashTable* ht_create(unsigned int size);
 HashTable* ht_create_with_threshold(unsigned int size, float load_threshold);
 void ht_free(HashTable* ht);
 Ht_item* hash_search(HashTable* ht, const char* key);
 void hash_insert_or_increment(HashTable* ht, const char* key);
+Ht_item* hash_add(HashTable* ht, const char* key, int64_t delta);
+Ht_item* hash_set(HashTable* ht, const char* key, int64_t count);
 int ht_resize(HashTable* ht, unsigned int new_size);
 
+// Tokenizers selectable for pre_tokenize
+#define LEXER_FAST 0    // Hand-written lexer (default)
+#define LEXER_REGEX 1   // POSIX regex, the reference implementation
+#define LEXER_CHECK 2   // Run both and report disagreements
+
+// Token order of the saved JSON and binary vocabularies, after the special tokens
+#define VOCAB_ORDER_INSERTION 0  // Base tokens as first seen in the corpus, then merged tokens (default)
+#define VOCAB_ORDER_RANK 1       // Base tokens sorted byte-wise, then merged tokens by merge rank
+#define VOCAB_ORDER_FREQUENCY 2  // Most frequent first, ties sorted byte-wise
+
 // Function prototypes for tokenization
 TokenList* pre_tokenize(const char* text);
+TokenList* pre_tokenize_fast(const char* text);
+TokenList* pre_tokenize_regex(const char* text);
+// Reentrant variants taking the format (is_smiles) and lexer (LEXER_*) explicitly;
+// the functions above use the command-line options
+TokenList* pre_tokenize_for(const char* text, int is_smiles, int mode);
+TokenList* pre_tokenize_fast_for(const char* text, int is_smiles);
+TokenList* pre_tokenize_regex_for(const char* text, int is_smiles);
 void free_token_list(TokenList* list);
 
 // Function prototypes for vocabulary generation
 HashTable* get_word_counts(const char* text);
 void print_word_counts(HashTable* ht);
 HashTable* get_pair_stats(TokenList* tokens);
+void accumulate_pair_stats(HashTable* stats, TokenList* tokens);
 // Find the best (most frequent) pair in the stats hash table
-// Returns the best pair and sets *count to its frequency
-const char* get_best_pair(HashTable* stats, int* count);
+// Returns the best pair and sets *count to its frequency.
+// Ties are broken by the lexicographically smallest (strcmp) pair key.
+const char* get_best_pair(HashTable* stats, int64_t* count);
 TokenList* merge_pair(TokenList* tokens, const char* pair);
+
+// Function prototypes for the symbol table
+SymbolTable* symbol_table_create(uint32_t initial_capacity);
+void symbol_table_free(SymbolTable* st);
+// The intern functions return UINT32_MAX when out of memory
+uint32_t symbol_table_intern(SymbolTable* st, const char* token, size_t len);
+// ID of a token, or UINT32_MAX if it has not been interned
+uint32_t symbol_table_find(const SymbolTable* st, const char* token, size_t len);
+uint32_t symbol_table_intern_concat(SymbolTable* st, uint32_t left, uint32_t right);
+// Molecules taking an arena are carved out of it and released with it by arena_free;
+// with a NULL arena they are malloc'd and released with free_id_list
+IdList* id_list_alloc(Arena* arena, size_t capacity);
+IdList* intern_token_list(SymbolTable* st, TokenList* tokens);
+IdList* pre_tokenize_ids(SymbolTable* st, const char* text, size_t len);
+IdList* pre_tokenize_ids_for(SymbolTable* st, Arena* arena, const char* text, size_t len,
+                             int is_smiles, int mode);
+// Tokenize a line into ids, which has room for len IDs (no token is empty).
+// Returns the number of IDs, or -1 if the tokenizer failed.
+long pre_tokenize_ids_into(SymbolTable* st, uint32_t* ids, const char* text, size_t len,
+                           int is_smiles, int mode);
+void free_id_list(IdList* list);
+// Collapse identical molecules into one weighted entry (first occurrence order is kept).
+// Duplicates are only dropped from the array; returns the new molecule count.
+int dedup_id_lists(IdList* molecules, int molecule_count);
+
+// Function prototypes for flat molecule sets. A molecule is added by writing its
+// IDs at molecule_set_reserve and then calling molecule_set_push; once all are
+// added, molecule_set_seal points the molecules at their spans.
+void molecule_set_init(MoleculeSet* set);
+uint32_t* molecule_set_reserve(MoleculeSet* set, size_t n);
+int molecule_set_push(MoleculeSet* set, size_t count, int64_t weight);
+void molecule_set_seal(MoleculeSet* set);
+int molecule_set_grow(MoleculeSet* set, int molecule_count, size_t id_count);
+void molecule_set_trim(MoleculeSet* set);
+void molecule_set_compact(MoleculeSet* set);
+void molecule_set_clear(MoleculeSet* set);
+void molecule_set_free(MoleculeSet* set);
+
+// Function prototypes for ID-based pair statistics
+PairTable* pair_table_create(uint32_t initial_capacity);
+void pair_table_free(PairTable* pt);
+// Index of the pair after adding delta, or UINT32_MAX if out of memory
+uint32_t pair_table_add(PairTable* pt, uint64_t key, int64_t delta);
+void pair_table_clear(PairTable* pt);
+// Returns 0, or -1 if out of memory
+int pair_table_accumulate(PairTable* pt, const IdList* mol);
+// Index of a pair, or UINT32_MAX if the table does not hold it
+uint32_t pair_table_find(const PairTable* pt, uint64_t key);
+// Merge (left, right) into merged in place; updates pt and pushes changed pairs to heap.
+// Returns the number of occurrences merged, or SIZE_MAX if out of memory (the molecule
+// is still merged, but the pair counts are incomplete).
+size_t merge_pair_ids(IdList* mol, uint32_t left, uint32_t right, uint32_t merged,
+                      PairTable* pt, PairHeap* heap);
+
+// Function prototypes for the pair occurrence index
+PairOccurrences* pair_occurrences_create(void);
+void pair_occurrences_free(PairOccurrences* occ);
+// Both add functions return 0, or -1 if out of memory
+int pair_occurrences_add(PairOccurrences* occ, uint32_t pair, uint32_t molecule);
+// Record molecule for every adjacent pair of mol (or only those involving symbol,
+// if symbol != UINT32_MAX). The pairs must already be in pt; pairs counted fewer
+// than occ->min_count times are marked pruned instead.
+int pair_occurrences_add_molecule(PairOccurrences* occ, const PairTable* pt,
+                                  const IdList* mol, uint32_t molecule, uint32_t symbol);
+
+// Function prototypes for the best-pair priority queue
+PairHeap* pair_heap_create(const PairTable* pairs, const SymbolTable* symbols);
+void pair_heap_free(PairHeap* heap);
+// Both return 0, or -1 if out of memory
+int pair_heap_push(PairHeap* heap, uint32_t pair);
+int pair_heap_rebuild(PairHeap* heap);
+// Returns the index of the most frequent pair and sets *count, or UINT32_MAX if none.
+// Ties are broken like get_best_pair: smallest "<left> <right>" key by strcmp.
+uint32_t pair_heap_best(PairHeap* heap, int64_t* count);
+
+// Function prototypes for the encoder
+BpeEncoder* bpe_encoder_create(const struct BinaryVocab* vocab);
+void bpe_encoder_free(BpeEncoder* encoder);
+void encode_buffer_init(EncodeBuffer* buf);
+void encode_buffer_free(EncodeBuffer* buf);
+// Encode one molecule and append its token IDs to buf->ids.
+// Pre-tokens missing from the vocabulary become <unk>. Returns the number of IDs appended.
+size_t bpe_encode(const BpeEncoder* encoder, EncodeBuffer* buf, const char* text, size_t len,
+                  int add_special_tokens);
+
+HashTable* build_initial_vocab(const SymbolTable* symbols, const int64_t* counts);
+
+// Where a bpe_train_ids run starts and what it does besides merging (all zero = plain run)
+struct Checkpoint;
+typedef struct {
+    int done;                // merges[0 .. done) are already applied to the molecules (resume)
+    int given;               // merges[done .. given) have left/right set and are applied in order
+                             // instead of searching for the best pair (extend)
+    PairTable* pairs;        // Pair counts of the molecules, taken over; NULL = count them
+    struct Checkpoint* checkpoint;  // Periodic checkpoints, NULL = none
+    int verbose;             // Print progress and merges to stdout
+    // Called after every merge with the merges so far (--snapshots), NULL = none
+    void (*after_merge)(void* arg, const SymbolTable* symbols, const BpeMerge* merges, int merge_count);
+    void* after_merge_arg;
+    int min_frequency;       // Stop once the best pair occurs fewer times (0 = off)
+    uint32_t max_symbols;    // Stop once the symbol table holds this many tokens (0 = off)
+    int prune_below;         // Pairs counted fewer times never become the best pair and are
+                             // kept out of the heap and occurrence index (0 = off)
+    struct TrainStats* stats;  // Phase timings and table statistics, NULL = none
+} BpeRunOptions;
+
+// Run the merge loop over ID-encoded molecules; fills merges and returns how many there are,
+// or -1 with errno set when out of memory.
+// pool (from cvocgen_threads.h) may be NULL to run on the calling thread only.
+struct ThreadPool;
+int bpe_train_ids(SymbolTable* symbols, IdList* molecules, int molecule_count,
+                  int num_merges, BpeMerge* merges, struct ThreadPool* pool,
+                  const BpeRunOptions* options);
 HashTable* train_bpe(const char* text, int num_merges);
+// Train on every line of a corpus (from cvocgen_corpus.h) with the given settings.
+// Returns 0 and fills result, or -1 with errno set.
+struct CorpusReader;
+int train_corpus(struct CorpusReader* reader, const TrainConfig* config, int num_merges,
+                 TrainResult* result);
+void train_result_free(TrainResult* result);
+// Serve as a worker of a distributed run whose coordinator listens at "host:port".
+// Returns 0 once the coordinator is done, or -1 with errno set.
+int run_cluster_worker(const char* address, int threads, int verbose);
+// Write base.txt, base.json, base_freq.json and base.bin with the tokens in
+// vocab_order (VOCAB_ORDER_*). Returns 0, or -1 on error.
+int save_train_result(TrainResult* result, int is_smiles, int vocab_order, const char* base);
+// Train with the command-line options (cvocgen only; not part of libcvocgen)
 HashTable* train_bpe_from_file(const char* corpus_file, int num_merges);
 // Vocabulary I/O functions are now in cvocgen_io.h
 
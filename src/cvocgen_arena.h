@@ -0,0 +1,85 @@
+#ifndef CVOCGEN_ARENA_H
+#define CVOCGEN_ARENA_H
+
+#include <stdlib.h>
+#include <string.h>
+
+// Bump-pointer arena. Allocations are carved out of large blocks and are only
+// released all at once by arena_free, so freeing millions of small strings costs
+// one free() per block.
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock* head;        // Block currently being filled
+} Arena;
+
+static inline void arena_init(Arena* arena) {
+    arena->head = NULL;
+}
+
+// Start a new block with room for size bytes, for a caller that knows about how
+// much it will allocate; later allocations fill it before another block is taken
+static inline int arena_reserve(Arena* arena, size_t size) {
+    ArenaBlock* block = malloc(sizeof(ArenaBlock) + size);
+    if (!block) return -1;
+    block->used = 0;
+    block->size = size;
+    block->next = arena->head;
+    arena->head = block;
+    return 0;
+}
+
+// Allocate size bytes aligned to align (a power of two); returns NULL when out of memory
+static inline void* arena_alloc_aligned(Arena* arena, size_t size, size_t align) {
+    ArenaBlock* block = arena->head;
+    size_t offset = block ? (block->used + align - 1) & ~(align - 1) : 0;
+    if (!block || offset > block->size || block->size - offset < size) {
+        if (arena_reserve(arena, size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE) != 0) return NULL;
+        block = arena->head;
+        offset = 0;
+    }
+    block->used = offset + size;
+    return block->data + offset;
+}
+
+// Allocate size bytes aligned to 8; returns NULL when out of memory
+static inline void* arena_alloc(Arena* arena, size_t size) {
+    return arena_alloc_aligned(arena, size, 8);
+}
+
+// Copy len bytes of s into the arena as a NUL-terminated string
+static inline char* arena_strndup(Arena* arena, const char* s, size_t len) {
+    char* copy = arena_alloc_aligned(arena, len + 1, 1);
+    if (!copy) return NULL;
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+// Shrink the most recent allocation ptr from old_size to new_size bytes, giving
+// the rest back to its block. Anything else is left as it is.
+static inline void arena_shrink(Arena* arena, void* ptr, size_t old_size, size_t new_size) {
+    ArenaBlock* block = arena->head;
+    if (block && new_size <= old_size && (char*)ptr + old_size == block->data + block->used) {
+        block->used -= old_size - new_size;
+    }
+}
+
+static inline void arena_free(Arena* arena) {
+    ArenaBlock* block = arena->head;
+    while (block) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+}
+
+#endif /* CVOCGEN_ARENA_H */
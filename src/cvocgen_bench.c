@@ -0,0 +1,438 @@
+#include "cvocgen.h"
+#include "cvocgen_io.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>  /* For PATH_MAX */
+#include <unistd.h>
+#include "cvocgen_corpus.h"
+#include "cvocgen_vocab.h"
+#include "cvocgen_stats.h"
+
+// Benchmarks of the training and encoding hot paths (make bench).
+//
+//   cvocgen_bench <corpus> [--scale <n>] [--merges <n>] [--threads <n>] [--repeat <n>] [--quick]
+//
+// Microbenchmarks run each function over the whole corpus --repeat times and keep
+// the fastest run; end-to-end runs train on the corpus as read from disk and on a
+// synthetic corpus --scale times larger, then encode the corpus with the result.
+//
+// Every result is one tab-separated line, so runs can be diffed and scraped:
+//   <benchmark>\t<value>\t<unit>
+// Lines starting with '#' describe the run and are not results.
+
+#define BENCH_FORMAT_VERSION 1
+
+typedef struct {
+    char* data;              // All molecules, each NUL-terminated
+    size_t size;
+    size_t capacity;
+    char** lines;            // Into data
+    int count;
+    int capacity_lines;
+} Corpus;
+
+static void corpus_add(Corpus* corpus, const char* line, size_t len) {
+    if (corpus->size + len + 1 > corpus->capacity) {
+        size_t capacity = corpus->capacity ? corpus->capacity : 1 << 20;
+        while (capacity < corpus->size + len + 1) capacity *= 2;
+        char* data = realloc(corpus->data, capacity);
+        // Keep the line pointers valid across the move
+        for (int i = 0; i < corpus->count; ++i) {
+            corpus->lines[i] = data + (corpus->lines[i] - corpus->data);
+        }
+        corpus->data = data;
+        corpus->capacity = capacity;
+    }
+    if (corpus->count >= corpus->capacity_lines) {
+        corpus->capacity_lines = corpus->capacity_lines ? corpus->capacity_lines * 2 : 4096;
+        corpus->lines = realloc(corpus->lines, sizeof(char*) * corpus->capacity_lines);
+    }
+    char* copy = corpus->data + corpus->size;
+    memcpy(copy, line, len);
+    copy[len] = '\0';
+    corpus->size += len + 1;
+    corpus->lines[corpus->count++] = copy;
+}
+
+// The molecules joined by newlines, as a training corpus buffer
+static char* corpus_text(const Corpus* corpus, size_t* size) {
+    char* text = malloc(corpus->size ? corpus->size : 1);
+    for (size_t k = 0; k < corpus->size; ++k) {
+        text[k] = corpus->data[k] ? corpus->data[k] : '\n';
+    }
+    *size = corpus->size;
+    return text;
+}
+
+static void corpus_free(Corpus* corpus) {
+    free(corpus->data);
+    free(corpus->lines);
+    memset(corpus, 0, sizeof(*corpus));
+}
+
+static int load_corpus(const char* path, Corpus* corpus) {
+    CorpusReader reader;
+    if (corpus_open(&reader, path) != 0) {
+        return -1;
+    }
+    const char* line;
+    size_t len;
+    while (corpus_next_line(&reader, &line, &len)) {
+        while (len > 0 && (line[len-1] == '\r' || line[len-1] == ' ')) len--;
+        if (len > 0) {
+            corpus_add(corpus, line, len);
+        }
+    }
+    int failed = corpus_failed(&reader);
+    corpus_close(&reader);
+    return failed ? -1 : 0;
+}
+
+// Synthetic corpus: each molecule joins the first tokens of one corpus molecule to
+// the last tokens of another, so token and pair statistics stay realistic while
+// the molecules are new. Deterministic for a given corpus and scale.
+static void build_synthetic(const Corpus* corpus, int scale, Corpus* out) {
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    char* buf = NULL;
+    size_t buf_cap = 0;
+    for (long n = 0; n < (long)corpus->count * scale; ++n) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        const char* a = corpus->lines[(state >> 33) % corpus->count];
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        const char* b = corpus->lines[(state >> 33) % corpus->count];
+
+        TokenList* ta = pre_tokenize(a);
+        TokenList* tb = pre_tokenize(b);
+        size_t len = 0;
+        size_t cut_a = ta->count / 2, cut_b = tb->count / 2;
+        for (size_t i = 0; i < cut_a; ++i) len += strlen(ta->tokens[i]);
+        for (size_t i = cut_b; i < tb->count; ++i) len += strlen(tb->tokens[i]);
+        if (len + 1 > buf_cap) {
+            buf_cap = (len + 1) * 2;
+            buf = realloc(buf, buf_cap);
+        }
+        size_t pos = 0;
+        for (size_t i = 0; i < cut_a; ++i) {
+            size_t l = strlen(ta->tokens[i]);
+            memcpy(buf + pos, ta->tokens[i], l);
+            pos += l;
+        }
+        for (size_t i = cut_b; i < tb->count; ++i) {
+            size_t l = strlen(tb->tokens[i]);
+            memcpy(buf + pos, tb->tokens[i], l);
+            pos += l;
+        }
+        if (pos > 0) {
+            corpus_add(out, buf, pos);
+        }
+        free_token_list(ta);
+        free_token_list(tb);
+    }
+    free(buf);
+}
+
+static void result(const char* name, double value, const char* unit) {
+    printf("%s\t%.1f\t%s\n", name, value, unit);
+    fflush(stdout);
+}
+
+// The microbenchmarks share one token list per molecule
+static TokenList** tokenize_all(const Corpus* corpus, size_t* token_count) {
+    TokenList** lists = malloc(sizeof(TokenList*) * (corpus->count > 0 ? corpus->count : 1));
+    *token_count = 0;
+    for (int i = 0; i < corpus->count; ++i) {
+        lists[i] = pre_tokenize(corpus->lines[i]);
+        *token_count += lists[i]->count;
+    }
+    return lists;
+}
+
+static void free_all(TokenList** lists, int count) {
+    for (int i = 0; i < count; ++i) {
+        free_token_list(lists[i]);
+    }
+    free(lists);
+}
+
+static void bench_micro(const Corpus* corpus, int repeat) {
+    size_t token_count;
+    TokenList** lists = tokenize_all(corpus, &token_count);
+    double best;
+
+    // pre_tokenize
+    best = 0;
+    for (int r = 0; r < repeat; ++r) {
+        double start = stats_now();
+        for (int i = 0; i < corpus->count; ++i) {
+            free_token_list(pre_tokenize(corpus->lines[i]));
+        }
+        double t = stats_now() - start;
+        if (r == 0 || t < best) best = t;
+    }
+    result("pre_tokenize", corpus->count / best, "molecules/s");
+    result("pre_tokenize_tokens", token_count / best, "tokens/s");
+
+    // hash_insert_or_increment: count every token
+    best = 0;
+    for (int r = 0; r < repeat; ++r) {
+        HashTable* counts = ht_create(100);
+        double start = stats_now();
+        for (int i = 0; i < corpus->count; ++i) {
+            for (size_t k = 0; k < lists[i]->count; ++k) {
+                hash_insert_or_increment(counts, lists[i]->tokens[k]);
+            }
+        }
+        double t = stats_now() - start;
+        ht_free(counts);
+        if (r == 0 || t < best) best = t;
+    }
+    result("hash_insert_or_increment", token_count / best, "inserts/s");
+
+    // get_pair_stats per molecule, and the corpus-wide table the string trainer builds
+    size_t pair_count = token_count - (size_t)corpus->count;
+    best = 0;
+    for (int r = 0; r < repeat; ++r) {
+        double start = stats_now();
+        for (int i = 0; i < corpus->count; ++i) {
+            HashTable* stats = get_pair_stats(lists[i]);
+            if (stats) ht_free(stats);
+        }
+        double t = stats_now() - start;
+        if (r == 0 || t < best) best = t;
+    }
+    result("get_pair_stats", corpus->count / best, "molecules/s");
+
+    HashTable* pairs = NULL;   // The last table is kept for get_best_pair
+    best = 0;
+    for (int r = 0; r < repeat; ++r) {
+        HashTable* table = ht_create(HT_DEFAULT_SIZE);
+        double start = stats_now();
+        for (int i = 0; i < corpus->count; ++i) {
+            accumulate_pair_stats(table, lists[i]);
+        }
+        double t = stats_now() - start;
+        if (r == 0 || t < best) best = t;
+        if (pairs) ht_free(pairs);
+        pairs = table;
+    }
+    result("accumulate_pair_stats", pair_count / best, "pairs/s");
+
+    // get_best_pair scans the whole table
+    int64_t best_count = 0;
+    const char* best_pair = NULL;
+    best = 0;
+    for (int r = 0; r < repeat; ++r) {
+        double start = stats_now();
+        best_pair = get_best_pair(pairs, &best_count);
+        double t = stats_now() - start;
+        if (r == 0 || t < best) best = t;
+    }
+    result("get_best_pair", pairs->count / best, "pairs/s");
+    char* pair = strdup(best_pair ? best_pair : "");
+    ht_free(pairs);
+
+    // merge_pair: apply the most frequent pair to every molecule
+    best = 0;
+    for (int r = 0; r < repeat; ++r) {
+        double start = stats_now();
+        for (int i = 0; i < corpus->count; ++i) {
+            TokenList* merged = merge_pair(lists[i], pair);
+            if (merged != lists[i]) free_token_list(merged);
+        }
+        double t = stats_now() - start;
+        if (r == 0 || t < best) best = t;
+    }
+    result("merge_pair", token_count / best, "tokens/s");
+    free(pair);
+    free_all(lists, corpus->count);
+}
+
+// Train num_merges merges and report the phase throughputs. Returns the result for encoding.
+static int bench_train(const char* name, CorpusReader* reader, int num_merges, int threads,
+                       TrainResult* out) {
+    TrainStats stats;
+    stats_init(&stats);
+    TrainConfig config = {
+        .is_smiles = 0,
+        .lexer_mode = LEXER_FAST,
+        .threads = threads,
+        .spill_directory = ".",
+        .vocab_order = VOCAB_ORDER_INSERTION,
+        .stats = &stats,
+    };
+    TrainResult result_data;
+    if (train_corpus(reader, &config, num_merges, &result_data) != 0) {
+        fprintf(stderr, "Error: training failed for %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    double merging = stats.phases[STATS_BEST_PAIR] + stats.phases[STATS_APPLY] + stats.phases[STATS_INDEX];
+    char key[128];
+    snprintf(key, sizeof(key), "%s_read", name);
+    result(key, stats.molecules / stats.phases[STATS_READ], "molecules/s");
+    snprintf(key, sizeof(key), "%s_pair_count", name);
+    result(key, stats.molecules / stats.phases[STATS_PAIR_COUNT], "molecules/s");
+    snprintf(key, sizeof(key), "%s_merges", name);
+    result(key, stats.merges / merging, "merges/s");
+    snprintf(key, sizeof(key), "%s_merge_p99", name);
+    result(key, stats_latency_quantile(&stats, 0.99), "us");
+    snprintf(key, sizeof(key), "%s_total", name);
+    result(key, stats_now() - stats.start, "s");
+
+    if (out) {
+        *out = result_data;
+    } else {
+        train_result_free(&result_data);
+    }
+    return 0;
+}
+
+static void bench_encode(const Corpus* corpus, TrainResult* trained, int repeat) {
+    char dir[] = "/tmp/cvocgen_bench_XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("Error creating a temporary directory");
+        return;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/vocab.bin", dir);
+
+    add_merged_tokens_to_vocab(trained->vocab, trained->symbols, trained->merges, trained->merge_count);
+    uint32_t token_count;
+    const Ht_item** order = vocab_token_order(trained->vocab, trained->symbols, trained->merges,
+                                              trained->merge_count, VOCAB_ORDER_INSERTION, &token_count);
+    int saved = order && save_vocabulary_binary(order, token_count, trained->symbols, trained->merges,
+                                                trained->merge_count, 0, path) == 0;
+    free(order);
+    BinaryVocab* vocab = saved ? load_vocabulary_binary(path) : NULL;
+    BpeEncoder* encoder = vocab ? bpe_encoder_create(vocab) : NULL;
+    if (!encoder) {
+        fprintf(stderr, "Error: could not load the benchmark vocabulary %s\n", path);
+    } else {
+        EncodeBuffer buf;
+        encode_buffer_init(&buf);
+        double best = 0;
+        size_t ids = 0;
+        for (int r = 0; r < repeat; ++r) {
+            double start = stats_now();
+            ids = 0;
+            for (int i = 0; i < corpus->count; ++i) {
+                buf.count = 0;
+                ids += bpe_encode(encoder, &buf, corpus->lines[i], strlen(corpus->lines[i]), 0);
+            }
+            double t = stats_now() - start;
+            if (r == 0 || t < best) best = t;
+        }
+        encode_buffer_free(&buf);
+        result("bpe_encode", corpus->count / best, "molecules/s");
+        result("bpe_encode_ids", ids / best, "ids/s");
+    }
+    bpe_encoder_free(encoder);
+    binary_vocab_close(vocab);
+    remove(path);
+    rmdir(dir);
+}
+
+static void print_bench_usage(void) {
+    printf("Usage: cvocgen_bench <corpus> [--scale <n>] [--merges <n>] [--threads <n>] [--repeat <n>] [--quick]\n");
+    printf("  --scale <n>     Size of the synthetic corpus relative to <corpus> (default: 8)\n");
+    printf("  --merges <n>    Merges of the end-to-end training runs (default: 2000)\n");
+    printf("  --threads <n>   Threads of the multithreaded runs (default: number of CPUs)\n");
+    printf("  --repeat <n>    Runs per microbenchmark; the fastest is reported (default: 3)\n");
+    printf("  --quick         Same as --scale 2 --merges 500 --repeat 1\n");
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2 || argv[1][0] == '-') {
+        print_bench_usage();
+        return 1;
+    }
+    const char* corpus_path = argv[1];
+    int scale = 8;
+    int num_merges = 2000;
+    int repeat = 3;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus > 1 ? (int)cpus : 1;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            scale = 2;
+            num_merges = 500;
+            repeat = 1;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            print_bench_usage();
+            return 1;
+        }
+        int value = atoi(argv[i+1]);
+        if (value < 1) {
+            printf("Error: %s must be at least 1\n", argv[i]);
+            return 1;
+        }
+        if (strcmp(argv[i], "--scale") == 0) scale = value;
+        else if (strcmp(argv[i], "--merges") == 0) num_merges = value;
+        else if (strcmp(argv[i], "--threads") == 0) threads = value;
+        else if (strcmp(argv[i], "--repeat") == 0) repeat = value;
+        else {
+            print_bench_usage();
+            return 1;
+        }
+        i++;
+    }
+
+    Corpus corpus = {0};
+    if (load_corpus(corpus_path, &corpus) != 0) {
+        perror("Error reading corpus file");
+        return 1;
+    }
+    Corpus synthetic = {0};
+    build_synthetic(&corpus, scale, &synthetic);
+
+    printf("# cvocgen bench format %d\n", BENCH_FORMAT_VERSION);
+    printf("# corpus %s: %d molecules, %zu bytes\n", corpus_path, corpus.count, corpus.size);
+    printf("# synthetic x%d: %d molecules, %zu bytes\n", scale, synthetic.count, synthetic.size);
+    printf("# merges %d, threads %d, repeat %d\n", num_merges, threads, repeat);
+    fflush(stdout);
+
+    bench_micro(&corpus, repeat);
+
+    // End-to-end: the corpus file as given (decompression included), then in memory.
+    // The single-threaded file run also provides the vocabulary for encoding
+    TrainResult trained;
+    CorpusReader reader;
+    if (corpus_open(&reader, corpus_path) != 0) {
+        perror("Error opening corpus file");
+        return 1;
+    }
+    int have_trained = bench_train("train_file", &reader, num_merges, 1, &trained) == 0;
+    corpus_close(&reader);
+
+    size_t text_size;
+    char* text = corpus_text(&corpus, &text_size);
+    if (threads > 1) {
+        corpus_open_buffer(&reader, text, text_size);
+        bench_train("train_buffer_mt", &reader, num_merges, threads, NULL);
+        corpus_close(&reader);
+    }
+    free(text);
+
+    text = corpus_text(&synthetic, &text_size);
+    corpus_open_buffer(&reader, text, text_size);
+    bench_train("train_synthetic", &reader, num_merges, 1, NULL);
+    corpus_close(&reader);
+    if (threads > 1) {
+        corpus_open_buffer(&reader, text, text_size);
+        bench_train("train_synthetic_mt", &reader, num_merges, threads, NULL);
+        corpus_close(&reader);
+    }
+    free(text);
+
+    if (have_trained) {
+        bench_encode(&corpus, &trained, repeat);
+        train_result_free(&trained);
+    }
+
+    corpus_free(&synthetic);
+    corpus_free(&corpus);
+    return 0;
+}
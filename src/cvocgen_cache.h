@@ -0,0 +1,188 @@
+#ifndef CVOCGEN_CACHE_H
+#define CVOCGEN_CACHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "cvocgen.h"
+#include "cvocgen_checkpoint.h"
+
+// Trained-vocabulary cache (--cache <dir>): finished runs, found again by what they
+// were trained on.
+//
+// An entry is a checkpoint (cvocgen_checkpoint.h) with no molecules or pairs: the
+// symbol table, initial vocabulary and merges of a finished run. It is named
+// <content key>.ckpt, where the content key hashes the settings that change the
+// merges together with the corpus text (a hash taken while tokenizing). A corpus
+// file also gets a <file key>.ref holding that content key, keyed on the settings,
+// the file's canonical path, device, inode, size, mtime and ctime, so an unchanged
+// file is found without reading it. The ctime changes whenever the file is written
+// or its times are set, so a different corpus never shares a file key.
+//
+// The merge count is in neither key: a run for n merges is served by an entry with
+// at least n merges, cut to the first n, or by one that stopped before its own -n.
+// Thread count, --dedup, --max-memory and --coordinator give the same merges and
+// are left out of the keys too.
+#define CACHE_VERSION 1
+
+typedef struct {
+    const char* directory;
+    uint64_t settings;       // Hash of the settings that change the merges
+    uint64_t file_key;       // Key of the corpus file's path and stat identity, 0 = none (stdin)
+    uint64_t content_key;    // Key of the corpus text, 0 until it has been read
+} VocabCache;
+
+static inline uint64_t cache_hash_words(const uint64_t* words, size_t count) {
+    uint64_t key = hash_bytes((const char*)words, sizeof(uint64_t) * count);
+    return key ? key : 1;    // 0 means "no key"
+}
+
+// Set up a cache in directory (created if missing) for a run with config over
+// corpus_path ("-" or NULL: no file key). Returns 0, or -1 with errno set.
+static inline int vocab_cache_open(VocabCache* cache, const char* directory, const TrainConfig* config,
+                                   const char* corpus_path) {
+    memset(cache, 0, sizeof(*cache));
+    if (mkdir(directory, 0755) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    cache->directory = directory;
+
+    uint64_t settings[] = {
+        CACHE_VERSION, (uint64_t)config->is_smiles, (uint64_t)config->lexer_mode,
+        (uint64_t)config->min_frequency, (uint64_t)config->target_vocab_size, (uint64_t)config->prune_below
+    };
+    cache->settings = cache_hash_words(settings, sizeof(settings) / sizeof(settings[0]));
+
+    struct stat st;
+    char resolved[PATH_MAX];
+    if (corpus_path && strcmp(corpus_path, "-") != 0 && stat(corpus_path, &st) == 0 && S_ISREG(st.st_mode) &&
+        realpath(corpus_path, resolved)) {
+        uint64_t file[] = {
+            cache->settings, hash_bytes(resolved, strlen(resolved)),
+            (uint64_t)st.st_dev, (uint64_t)st.st_ino, (uint64_t)st.st_size,
+            (uint64_t)st.st_mtim.tv_sec, (uint64_t)st.st_mtim.tv_nsec,
+            (uint64_t)st.st_ctim.tv_sec, (uint64_t)st.st_ctim.tv_nsec
+        };
+        cache->file_key = cache_hash_words(file, sizeof(file) / sizeof(file[0]));
+    }
+    return 0;
+}
+
+// Record the content hash and length of the corpus text once it has been read
+static inline void vocab_cache_set_content(VocabCache* cache, uint64_t content_hash, uint64_t bytes) {
+    uint64_t content[] = { cache->settings, content_hash, bytes };
+    cache->content_key = cache_hash_words(content, sizeof(content) / sizeof(content[0]));
+}
+
+static inline int cache_path(char* path, size_t size, const VocabCache* cache, uint64_t key, const char* ext) {
+    int len = snprintf(path, size, "%s/%016llx.%s", cache->directory, (unsigned long long)key, ext);
+    return len > 0 && (size_t)len < size ? 0 : -1;
+}
+
+// Look up the content key of the corpus file; returns 0 if it has a .ref
+static inline int cache_read_ref(VocabCache* cache) {
+    char path[PATH_MAX];
+    if (!cache->file_key || cache_path(path, sizeof(path), cache, cache->file_key, "ref") != 0) {
+        return -1;
+    }
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    unsigned long long key = 0;
+    int ok = fscanf(f, "%16llx", &key) == 1 && key != 0;
+    fclose(f);
+    if (!ok) {
+        return -1;
+    }
+    cache->content_key = key;
+    return 0;
+}
+
+// Write a file of the cache under a name of its own and rename it into place,
+// so concurrent runs never see it half written
+static inline int cache_publish(const char* tmp_path, const char* path) {
+    if (rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Record the corpus file's content key, so the next run skips reading it
+static inline int vocab_cache_store_ref(const VocabCache* cache) {
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX + 32];
+    if (!cache->file_key || !cache->content_key ||
+        cache_path(path, sizeof(path), cache, cache->file_key, "ref") != 0) {
+        return -1;
+    }
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld", path, (long)getpid());
+    FILE* f = fopen(tmp_path, "w");
+    if (!f) {
+        return -1;
+    }
+    int ok = fprintf(f, "%016llx\n", (unsigned long long)cache->content_key) > 0;
+    if (fclose(f) != 0 || !ok) {
+        remove(tmp_path);
+        return -1;
+    }
+    return cache_publish(tmp_path, path);
+}
+
+// Load the entry for a run of num_merges merges. Without a content key the
+// corpus file's .ref is used. On a hit, fills data (merge_count cut to at most
+// num_merges) and returns 0; returns -1 on a miss.
+static inline int vocab_cache_load(VocabCache* cache, int num_merges, int is_smiles, CheckpointData* data) {
+    if (!cache->content_key && cache_read_ref(cache) != 0) {
+        return -1;
+    }
+    char path[PATH_MAX];
+    if (cache_path(path, sizeof(path), cache, cache->content_key, "ckpt") != 0 ||
+        load_checkpoint(path, num_merges, data) != 0) {
+        return -1;
+    }
+    // Stopped early (no pairs left, --min-frequency, ...): more merges would stop there too
+    int stopped = data->merge_count < data->num_merges;
+    if (data->is_smiles != is_smiles || data->molecules.count > 0 ||
+        (data->merge_count < num_merges && !stopped)) {
+        checkpoint_data_free(data);
+        return -1;
+    }
+    if (data->merge_count > num_merges) {
+        data->merge_count = num_merges;
+    }
+    return 0;
+}
+
+// Store a finished run of num_merges merges (merge_count made) under the content
+// key, and the corpus file's .ref. vocab is the initial vocabulary. Returns 0, or -1.
+static inline int vocab_cache_store(const VocabCache* cache, const SymbolTable* symbols, const HashTable* vocab,
+                                    const BpeMerge* merges, int merge_count, int num_merges,
+                                    int corpus_molecules, int is_smiles) {
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX + 32];
+    if (!cache->content_key || cache_path(path, sizeof(path), cache, cache->content_key, "ckpt") != 0) {
+        return -1;
+    }
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld", path, (long)getpid());
+
+    PairTable* no_pairs = pair_table_create(16);
+    Checkpoint cp = { tmp_path, 0, 0, 0, 0, is_smiles, num_merges, corpus_molecules, vocab };
+    int failed = save_checkpoint(&cp, symbols, merges, merge_count, NULL, 0, no_pairs) != 0;
+    pair_table_free(no_pairs);
+    if (failed || cache_publish(tmp_path, path) != 0) {
+        return -1;
+    }
+    if (cache->file_key) {
+        vocab_cache_store_ref(cache);
+    }
+    return 0;
+}
+
+#endif /* CVOCGEN_CACHE_H */
@@ -0,0 +1,304 @@
+#ifndef CVOCGEN_CHECKPOINT_H
+#define CVOCGEN_CHECKPOINT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "cvocgen.h"
+
+// Training checkpoints (.ckpt): everything needed to continue the merge loop.
+//
+// All integers are native little-endian:
+//   CheckpointHeader
+//   symbol_count x  [uint32 length][bytes]                 symbol table in ID order
+//   vocab_count x   [int64 count][uint32 length][bytes]    initial vocabulary in insertion order
+//   merge_count x   [uint32 left, right, merged][int64 count]   merges made so far
+//   molecule_count x [int64 weight][uint32 count][uint32 ids[count]]
+//   uint64 pair keys[pair_count], int64 pair counts[pair_count]
+// Molecules with fewer than two tokens hold no pairs and are not stored, and
+// only pairs with a nonzero count are.
+#define CHECKPOINT_MAGIC "CVOCCKP"
+#define CHECKPOINT_VERSION 2
+#define CHECKPOINT_FLAG_SMILES 1u
+
+typedef struct {
+    char magic[8];               // "CVOCCKP\0"
+    uint32_t version;
+    uint32_t flags;              // CHECKPOINT_FLAG_*
+    int32_t merge_count;         // Merges made so far
+    int32_t num_merges;          // Merges the run was started for
+    int32_t corpus_molecules;    // Molecules read from the corpus
+    uint32_t symbol_count;
+    uint32_t vocab_count;
+    uint32_t molecule_count;     // Stored molecules
+    uint32_t pair_count;
+    uint32_t reserved;
+} CheckpointHeader;
+
+// When and where a training run writes checkpoints, and the run data stored with them
+typedef struct Checkpoint {
+    const char* path;
+    int every_merges;            // Write after this many merges, 0 = never
+    int every_seconds;           // Write once this much time has passed, 0 = never
+    int last_merge;              // Merge count of the last checkpoint
+    time_t last_time;            // Time of the last checkpoint (or of the start)
+    int is_smiles;
+    int num_merges;
+    int corpus_molecules;
+    const HashTable* vocab;
+} Checkpoint;
+
+// A checkpoint read back by load_checkpoint; the caller owns every field
+typedef struct {
+    int is_smiles;
+    int num_merges;
+    int corpus_molecules;
+    SymbolTable* symbols;
+    HashTable* vocab;
+    BpeMerge* merges;
+    int merge_count;
+    MoleculeSet molecules;
+    PairTable* pairs;
+} CheckpointData;
+
+static inline int checkpoint_due(const Checkpoint* cp, int merge_count) {
+    if (cp->every_merges > 0 && merge_count - cp->last_merge >= cp->every_merges) {
+        return 1;
+    }
+    return cp->every_seconds > 0 && time(NULL) - cp->last_time >= cp->every_seconds;
+}
+
+static inline int checkpoint_write_string(FILE* f, const char* s, size_t len) {
+    uint32_t n = (uint32_t)len;
+    return fwrite(&n, sizeof(n), 1, f) == 1 && fwrite(s, 1, len, f) == len;
+}
+
+// Write a checkpoint of the current merge state. The file is written next to
+// cp->path and renamed over it, so an interrupted write never replaces the
+// previous checkpoint. Returns 0 on success, -1 on error.
+static inline int save_checkpoint(Checkpoint* cp, const SymbolTable* symbols, const BpeMerge* merges,
+                                  int merge_count, const IdList* molecules, int molecule_count,
+                                  const PairTable* pairs) {
+    // A failed write is retried at the next interval, not after every merge
+    cp->last_merge = merge_count;
+    cp->last_time = time(NULL);
+
+    char tmp_path[PATH_MAX + 8];
+    int len = snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cp->path);
+    if (len < 0 || (size_t)len >= sizeof(tmp_path)) {
+        return -1;
+    }
+    FILE* f = fopen(tmp_path, "wb");
+    if (!f) {
+        return -1;
+    }
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
+
+    CheckpointHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    h.version = CHECKPOINT_VERSION;
+    h.flags = cp->is_smiles ? CHECKPOINT_FLAG_SMILES : 0;
+    h.merge_count = merge_count;
+    h.num_merges = cp->num_merges;
+    h.corpus_molecules = cp->corpus_molecules;
+    h.symbol_count = symbols->count;
+    h.vocab_count = cp->vocab->count;
+    for (int i = 0; i < molecule_count; ++i) {
+        h.molecule_count += molecules[i].count >= 2;
+    }
+    for (uint32_t p = 0; p < pairs->count; ++p) {
+        h.pair_count += pairs->counts[p] != 0;
+    }
+
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    for (uint32_t id = 0; ok && id < symbols->count; ++id) {
+        ok = checkpoint_write_string(f, symbols->strings[id], symbols->lengths[id]);
+    }
+    for (unsigned int i = 0; ok && i < cp->vocab->count; ++i) {
+        const Ht_item* item = &cp->vocab->items[i];
+        int64_t count = item->count;
+        ok = fwrite(&count, sizeof(count), 1, f) == 1 &&
+             checkpoint_write_string(f, item->key, strlen(item->key));
+    }
+    for (int i = 0; ok && i < merge_count; ++i) {
+        uint32_t ids[3] = { merges[i].left, merges[i].right, merges[i].merged };
+        ok = fwrite(ids, sizeof(ids), 1, f) == 1 && fwrite(&merges[i].count, sizeof(int64_t), 1, f) == 1;
+    }
+    for (int i = 0; ok && i < molecule_count; ++i) {
+        const IdList* mol = &molecules[i];
+        if (mol->count < 2) continue;
+        uint32_t count = (uint32_t)mol->count;
+        ok = fwrite(&mol->weight, sizeof(int64_t), 1, f) == 1 && fwrite(&count, sizeof(count), 1, f) == 1 &&
+             fwrite(mol->ids, sizeof(uint32_t), mol->count, f) == mol->count;
+    }
+    for (uint32_t p = 0; ok && p < pairs->count; ++p) {
+        if (pairs->counts[p] != 0) ok = fwrite(&pairs->keys[p], sizeof(uint64_t), 1, f) == 1;
+    }
+    for (uint32_t p = 0; ok && p < pairs->count; ++p) {
+        if (pairs->counts[p] != 0) ok = fwrite(&pairs->counts[p], sizeof(int64_t), 1, f) == 1;
+    }
+
+    if (fclose(f) != 0) ok = 0;
+    if (!ok || rename(tmp_path, cp->path) != 0) {
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+static inline void checkpoint_data_free(CheckpointData* data) {
+    symbol_table_free(data->symbols);
+    ht_free(data->vocab);
+    free(data->merges);
+    molecule_set_free(&data->molecules);
+    if (data->pairs) pair_table_free(data->pairs);
+    memset(data, 0, sizeof(*data));
+}
+
+// Read a length-prefixed string into *buf (grown as needed) and NUL-terminate it.
+// The length must fit in what is left of the file. Returns 0, or -1 on a short
+// read, a bad length or a failed allocation.
+static inline int checkpoint_read_string(FILE* f, uint64_t file_size, char** buf, size_t* buf_cap,
+                                         uint32_t* len_out) {
+    uint32_t len;
+    if (fread(&len, sizeof(len), 1, f) != 1) {
+        return -1;
+    }
+    long pos = ftell(f);
+    if (pos < 0 || (uint64_t)len > file_size - (uint64_t)pos) {
+        return -1;
+    }
+    size_t need = (size_t)len + 1;
+    if (need > *buf_cap) {
+        char* grown = realloc(*buf, need);
+        if (!grown) {
+            return -1;
+        }
+        *buf = grown;
+        *buf_cap = need;
+    }
+    if (fread(*buf, 1, len, f) != len) {
+        return -1;
+    }
+    (*buf)[len] = '\0';
+    *len_out = len;
+    return 0;
+}
+
+// Whether count records of record_size bytes fit in what is left of the file
+static inline int checkpoint_fits(FILE* f, uint64_t file_size, uint64_t count, uint64_t record_size) {
+    long pos = ftell(f);
+    return pos >= 0 && count <= (file_size - (uint64_t)pos) / record_size;
+}
+
+// Read a checkpoint. merges gets room for at least min_merges entries.
+// Returns 0 on success, -1 if the file cannot be read, is not a valid checkpoint
+// or there is not enough memory to load it.
+static inline int load_checkpoint(const char* path, int min_merges, CheckpointData* data) {
+    memset(data, 0, sizeof(*data));
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0) {
+        fclose(f);
+        return -1;
+    }
+    uint64_t file_size = (uint64_t)st.st_size;
+
+    CheckpointHeader h;
+    int ok = fread(&h, sizeof(h), 1, f) == 1 &&
+             memcmp(h.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) == 0 &&
+             h.version == CHECKPOINT_VERSION && h.merge_count >= 0 &&
+             checkpoint_fits(f, file_size, h.symbol_count, sizeof(uint32_t)) &&
+             checkpoint_fits(f, file_size, h.pair_count, sizeof(uint64_t) + sizeof(int64_t)) &&
+             checkpoint_fits(f, file_size, (uint64_t)h.merge_count, 3 * sizeof(uint32_t) + sizeof(int64_t));
+    if (!ok) {
+        fclose(f);
+        return -1;
+    }
+    data->is_smiles = (h.flags & CHECKPOINT_FLAG_SMILES) != 0;
+    data->num_merges = h.num_merges;
+    data->corpus_molecules = h.corpus_molecules;
+
+    char* buf = NULL;
+    size_t buf_cap = 0;
+    uint32_t len;
+    data->symbols = symbol_table_create(h.symbol_count > 1024 ? h.symbol_count : 1024);
+    ok = data->symbols != NULL;
+    for (uint32_t id = 0; ok && id < h.symbol_count; ++id) {
+        ok = checkpoint_read_string(f, file_size, &buf, &buf_cap, &len) == 0 &&
+             symbol_table_intern(data->symbols, buf, len) == id;
+    }
+
+    data->vocab = ok ? ht_create(HT_DEFAULT_SIZE) : NULL;
+    ok = ok && data->vocab != NULL;
+    for (uint32_t i = 0; ok && i < h.vocab_count; ++i) {
+        int64_t count;
+        ok = fread(&count, sizeof(count), 1, f) == 1 &&
+             checkpoint_read_string(f, file_size, &buf, &buf_cap, &len) == 0 &&
+             hash_add(data->vocab, buf, count) != NULL;
+    }
+    free(buf);
+
+    int capacity = h.merge_count > min_merges ? h.merge_count : min_merges;
+    data->merges = ok ? malloc(sizeof(BpeMerge) * (size_t)(capacity > 0 ? capacity : 1)) : NULL;
+    ok = ok && data->merges != NULL;
+    data->merge_count = h.merge_count;
+    for (int i = 0; ok && i < h.merge_count; ++i) {
+        BpeMerge* m = &data->merges[i];
+        uint32_t ids[3];
+        ok = fread(ids, sizeof(ids), 1, f) == 1 && fread(&m->count, sizeof(int64_t), 1, f) == 1;
+        m->left = ids[0];
+        m->right = ids[1];
+        m->merged = ids[2];
+        ok = ok && m->left < h.symbol_count && m->right < h.symbol_count && m->merged < h.symbol_count;
+    }
+
+    for (uint32_t i = 0; ok && i < h.molecule_count; ++i) {
+        int64_t weight;
+        uint32_t count;
+        ok = fread(&weight, sizeof(weight), 1, f) == 1 && fread(&count, sizeof(count), 1, f) == 1 &&
+             checkpoint_fits(f, file_size, count, sizeof(uint32_t));
+        uint32_t* ids = ok ? molecule_set_reserve(&data->molecules, count) : NULL;
+        ok = ids && fread(ids, sizeof(uint32_t), count, f) == count;
+        for (uint32_t k = 0; ok && k < count; ++k) {
+            ok = ids[k] < h.symbol_count;
+        }
+        ok = ok && molecule_set_push(&data->molecules, count, weight) == 0;
+    }
+    molecule_set_seal(&data->molecules);
+
+    uint64_t* keys = NULL;
+    int64_t* counts = NULL;
+    if (ok) {
+        keys = malloc(sizeof(uint64_t) * (h.pair_count ? h.pair_count : 1));
+        counts = malloc(sizeof(int64_t) * (h.pair_count ? h.pair_count : 1));
+        ok = keys && counts && fread(keys, sizeof(uint64_t), h.pair_count, f) == h.pair_count &&
+             fread(counts, sizeof(int64_t), h.pair_count, f) == h.pair_count;
+    }
+    if (ok) {
+        data->pairs = pair_table_create(h.pair_count > HT_DEFAULT_SIZE ? h.pair_count : HT_DEFAULT_SIZE);
+        ok = data->pairs != NULL;
+        for (uint32_t p = 0; ok && p < h.pair_count; ++p) {
+            ok = pair_table_add(data->pairs, keys[p], counts[p]) != UINT32_MAX;
+        }
+    }
+    free(keys);
+    free(counts);
+    fclose(f);
+
+    if (!ok) {
+        checkpoint_data_free(data);
+        return -1;
+    }
+    return 0;
+}
+
+#endif /* CVOCGEN_CHECKPOINT_H */
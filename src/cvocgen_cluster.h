@@ -0,0 +1,406 @@
+#ifndef CVOCGEN_CLUSTER_H
+#define CVOCGEN_CLUSTER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/time.h>
+#include "cvocgen.h"
+#include "cvocgen_threads.h"
+#include "cvocgen_segments.h"
+
+// Distributed training over TCP: one coordinator and any number of workers.
+//
+// The coordinator reads, tokenizes and deduplicates the corpus as usual (in
+// memory, or into on-disk segments with --max-memory), hands each worker a
+// contiguous shard of the molecules, releases its own copy and from then on
+// keeps only the global pair counts, the heap and the merges. Each worker
+// counts the pairs of its shard, applies every merge to it and sends back the
+// pair count changes, which the coordinator adds up in worker order. The coordinator so
+// sees exactly the counts of a single-node run and picks the same merges.
+//
+// Messages. Integers are in native byte order, so every node must share it
+// (checked by the hello):
+//   worker -> coordinator, once   ClusterHello
+//   coordinator -> worker         'S' uint32 molecule_count, then per molecule
+//                                     [int64 weight][uint32 count][uint32 ids[count]]
+//                                 'M' uint32 left, right, merged   apply a merge
+//                                 'Q'                              training is over
+//   worker -> coordinator         after 'S' and each 'M': uint32 n, then
+//                                     n x [uint64 pair key][int64 count change]
+#define CLUSTER_MAGIC 0x434f5643u    // "CVOC" read in native order
+#define CLUSTER_VERSION 2
+#define CLUSTER_SHARD 'S'
+#define CLUSTER_MERGE 'M'
+#define CLUSTER_QUIT 'Q'
+#define CLUSTER_CONNECT_SECONDS 60   // How long a worker retries before the coordinator listens
+#define CLUSTER_HELLO_SECONDS 10     // How long the coordinator waits for a new connection's hello
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+} ClusterHello;
+
+// One connection, buffered in both directions
+typedef struct {
+    FILE* in;
+    FILE* out;
+} ClusterPeer;
+
+// The workers of a coordinator, in shard order
+typedef struct Cluster {
+    ClusterPeer* workers;
+    int worker_count;
+} Cluster;
+
+static inline int cluster_peer_open(ClusterPeer* peer, int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    int out_fd = dup(fd);
+    peer->in = fdopen(fd, "rb");
+    peer->out = out_fd >= 0 ? fdopen(out_fd, "wb") : NULL;
+    if (!peer->in || !peer->out) {
+        if (peer->in) fclose(peer->in); else close(fd);
+        if (peer->out) fclose(peer->out); else if (out_fd >= 0) close(out_fd);
+        peer->in = peer->out = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static inline void cluster_peer_close(ClusterPeer* peer) {
+    if (peer->out) fclose(peer->out);
+    if (peer->in) fclose(peer->in);
+    peer->in = peer->out = NULL;
+}
+
+// Read exactly size bytes; -1 with errno = EIO if the peer is gone
+static inline int cluster_read(ClusterPeer* peer, void* data, size_t size) {
+    if (fread(data, 1, size, peer->in) != size) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static inline int cluster_write(ClusterPeer* peer, const void* data, size_t size) {
+    if (fwrite(data, 1, size, peer->out) != size) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static inline int cluster_flush(ClusterPeer* peer) {
+    if (fflush(peer->out) != 0) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+// Split "host:port" (the host may be omitted for localhost)
+static inline int cluster_parse_address(const char* address, char* host, size_t host_size, const char** port) {
+    const char* colon = strrchr(address, ':');
+    if (!colon || colon[1] == '\0' || (size_t)(colon - address) >= host_size) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(host, address, colon - address);
+    host[colon - address] = '\0';
+    if (host[0] == '\0') strcpy(host, "localhost");
+    *port = colon + 1;
+    return 0;
+}
+
+// Listen on port and accept worker_count workers. Returns 0, or -1 with errno set.
+static inline int cluster_listen(Cluster* cluster, int port, int worker_count, int verbose) {
+    memset(cluster, 0, sizeof(*cluster));
+    // A worker that goes away must fail the write, not kill the coordinator
+    signal(SIGPIPE, SIG_IGN);
+
+    int fd = socket(AF_INET6, SOCK_STREAM, 0);
+    int v6 = fd >= 0;
+    if (!v6) fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    int one = 1, zero = 0;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    int bound;
+    if (v6) {
+        // Accept IPv4 workers on the same socket
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+        struct sockaddr_in6 addr = { .sin6_family = AF_INET6, .sin6_port = htons(port), .sin6_addr = in6addr_any };
+        bound = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    } else {
+        struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_ANY) };
+        bound = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    }
+    if (bound != 0 || listen(fd, worker_count) != 0) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    if (verbose) {
+        printf("Waiting for %d workers on port %d...\n", worker_count, port);
+    }
+    cluster->workers = calloc(worker_count, sizeof(ClusterPeer));
+    int failed = !cluster->workers;
+    while (!failed && cluster->worker_count < worker_count) {
+        int client = accept(fd, NULL, NULL);
+        if (client < 0) {
+            failed = errno != EINTR;
+            continue;
+        }
+        ClusterPeer* peer = &cluster->workers[cluster->worker_count];
+        ClusterHello hello;
+        struct timeval timeout = { CLUSTER_HELLO_SECONDS, 0 }, none = { 0, 0 };
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        if (cluster_peer_open(peer, client) != 0) {
+            failed = 1;
+        } else if (cluster_read(peer, &hello, sizeof(hello)) != 0 ||
+                   hello.magic != CLUSTER_MAGIC || hello.version != CLUSTER_VERSION) {
+            // Not a worker of this version (or of another byte order); keep waiting
+            fprintf(stderr, "Warning: rejected a connection that is not a compatible worker\n");
+            cluster_peer_close(peer);
+        } else {
+            // Merges may take long; from now on the coordinator waits as long as it takes
+            setsockopt(fileno(peer->in), SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+            cluster->worker_count++;
+            if (verbose) {
+                printf("Worker %d/%d connected\n", cluster->worker_count, worker_count);
+            }
+        }
+    }
+    int saved_errno = errno;
+    close(fd);
+    if (failed) {
+        for (int w = 0; w < cluster->worker_count; ++w) {
+            cluster_peer_close(&cluster->workers[w]);
+        }
+        free(cluster->workers);
+        memset(cluster, 0, sizeof(*cluster));
+        errno = saved_errno ? saved_errno : ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+// Tell every worker training is over and close the connections
+static inline void cluster_close(Cluster* cluster) {
+    for (int w = 0; w < cluster->worker_count; ++w) {
+        uint32_t tag = CLUSTER_QUIT;
+        if (cluster_write(&cluster->workers[w], &tag, sizeof(tag)) == 0) {
+            cluster_flush(&cluster->workers[w]);
+        }
+        cluster_peer_close(&cluster->workers[w]);
+    }
+    free(cluster->workers);
+    memset(cluster, 0, sizeof(*cluster));
+}
+
+// Connect a worker to "host:port", retrying while the coordinator is not up yet
+static inline int cluster_connect(ClusterPeer* peer, const char* address) {
+    signal(SIGPIPE, SIG_IGN);
+    char host[256];
+    const char* port;
+    if (cluster_parse_address(address, host, sizeof(host), &port) != 0) {
+        return -1;
+    }
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo* addresses;
+    if (getaddrinfo(host, port, &hints, &addresses) != 0) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+    int fd = -1;
+    for (int attempt = 0; fd < 0 && attempt < CLUSTER_CONNECT_SECONDS; ++attempt) {
+        if (attempt > 0) sleep(1);
+        for (struct addrinfo* a = addresses; a && fd < 0; a = a->ai_next) {
+            fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0 || cluster_peer_open(peer, fd) != 0) {
+        return -1;
+    }
+    ClusterHello hello = { CLUSTER_MAGIC, CLUSTER_VERSION };
+    if (cluster_write(peer, &hello, sizeof(hello)) != 0 || cluster_flush(peer) != 0) {
+        cluster_peer_close(peer);
+        return -1;
+    }
+    return 0;
+}
+
+// Send molecules[0 .. count) as a shard. Molecules with fewer than two tokens
+// hold no pairs and are left out.
+static inline int cluster_send_shard(ClusterPeer* peer, const IdList* molecules, int count) {
+    uint32_t kept = 0;
+    for (int i = 0; i < count; ++i) {
+        if (molecules[i].count >= 2) kept++;
+    }
+    uint32_t head[2] = { CLUSTER_SHARD, kept };
+    int ok = cluster_write(peer, head, sizeof(head)) == 0;
+    for (int i = 0; ok && i < count; ++i) {
+        const IdList* mol = &molecules[i];
+        if (mol->count < 2) continue;
+        uint32_t count = (uint32_t)mol->count;
+        ok = cluster_write(peer, &mol->weight, sizeof(int64_t)) == 0 &&
+             cluster_write(peer, &count, sizeof(count)) == 0 &&
+             cluster_write(peer, mol->ids, sizeof(uint32_t) * mol->count) == 0;
+    }
+    return ok ? cluster_flush(peer) : -1;
+}
+
+// Hand each worker a contiguous shard of molecules[0 .. count)
+static inline int cluster_send_molecules(Cluster* cluster, const IdList* molecules, int count) {
+    for (int w = 0; w < cluster->worker_count; ++w) {
+        int begin, end;
+        thread_pool_range(count, w, cluster->worker_count, &begin, &end);
+        if (cluster_send_shard(&cluster->workers[w], molecules + begin, end - begin) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Hand each worker a contiguous shard of the records of a segment store
+// (cvocgen_segments.h), streamed from one mapped segment at a time. Returns 0,
+// or -1 with errno set if a segment cannot be mapped or a worker is lost.
+static inline int cluster_send_segments(Cluster* cluster, const SegmentStore* store) {
+    int s = -1;
+    uint32_t* records = NULL;
+    const uint32_t* rec = NULL;
+    const uint32_t* end = NULL;
+    int ok = 1;
+    for (int w = 0; ok && w < cluster->worker_count; ++w) {
+        ClusterPeer* peer = &cluster->workers[w];
+        int begin, stop;
+        thread_pool_range(store->records, w, cluster->worker_count, &begin, &stop);
+        uint32_t head[2] = { CLUSTER_SHARD, (uint32_t)(stop - begin) };
+        ok = cluster_write(peer, head, sizeof(head)) == 0;
+        for (int i = begin; ok && i < stop; ++i) {
+            // Move on to the next segment that holds records
+            while (ok && rec == end) {
+                if (records) segment_unmap(&store->segments[s], records);
+                records = NULL;
+                s++;
+                if (s >= store->count) {
+                    ok = 0;
+                    errno = EIO;
+                } else if (store->segments[s].size > 0) {
+                    records = segment_map(store, &store->segments[s]);
+                    ok = records != NULL;
+                    rec = records;
+                    end = ok ? records + store->segments[s].size / sizeof(uint32_t) : NULL;
+                }
+            }
+            if (!ok) break;
+            int64_t weight = segment_record_weight(rec);
+            uint32_t count = rec[3];
+            ok = cluster_write(peer, &weight, sizeof(weight)) == 0 &&
+                 cluster_write(peer, &count, sizeof(count)) == 0 &&
+                 cluster_write(peer, rec + SEGMENT_RECORD_HEAD, sizeof(uint32_t) * count) == 0;
+            rec += SEGMENT_RECORD_HEAD + rec[2];
+        }
+        ok = ok && cluster_flush(peer) == 0;
+    }
+    if (records) segment_unmap(&store->segments[s], records);
+    return ok ? 0 : -1;
+}
+
+// Read a shard (after its 'S' tag) into a new molecule set
+static inline int cluster_read_shard(ClusterPeer* peer, MoleculeSet* shard) {
+    uint32_t count;
+    molecule_set_init(shard);
+    if (cluster_read(peer, &count, sizeof(count)) != 0 || count > INT32_MAX) {
+        errno = EIO;
+        return -1;
+    }
+    int ok = 1;
+    for (uint32_t i = 0; ok && i < count; ++i) {
+        int64_t weight;
+        uint32_t mol_count;
+        ok = cluster_read(peer, &weight, sizeof(weight)) == 0 &&
+             cluster_read(peer, &mol_count, sizeof(mol_count)) == 0;
+        uint32_t* ids = ok ? molecule_set_reserve(shard, mol_count) : NULL;
+        ok = ids && cluster_read(peer, ids, sizeof(uint32_t) * mol_count) == 0 &&
+             molecule_set_push(shard, mol_count, weight) == 0;
+    }
+    if (!ok) {
+        molecule_set_free(shard);
+        errno = EIO;
+        return -1;
+    }
+    molecule_set_seal(shard);
+    return 0;
+}
+
+// Send the nonzero counts of tables[0 .. table_count) as one reply
+static inline int cluster_send_deltas(ClusterPeer* peer, PairTable* const* tables, int table_count) {
+    uint32_t n = 0;
+    for (int t = 0; t < table_count; ++t) {
+        for (uint32_t idx = 0; idx < tables[t]->count; ++idx) {
+            if (tables[t]->counts[idx] != 0) n++;
+        }
+    }
+    int ok = cluster_write(peer, &n, sizeof(n)) == 0;
+    for (int t = 0; ok && t < table_count; ++t) {
+        const PairTable* delta = tables[t];
+        for (uint32_t idx = 0; ok && idx < delta->count; ++idx) {
+            if (delta->counts[idx] == 0) continue;
+            ok = cluster_write(peer, &delta->keys[idx], sizeof(uint64_t)) == 0 &&
+                 cluster_write(peer, &delta->counts[idx], sizeof(int64_t)) == 0;
+        }
+    }
+    return ok ? cluster_flush(peer) : -1;
+}
+
+// Add one reply of count changes to pairs, pushing every changed pair on heap (if any).
+// Returns -1 with errno = EIO if the peer is gone, or ENOMEM if pairs or heap cannot grow.
+static inline int cluster_add_deltas(ClusterPeer* peer, PairTable* pairs, PairHeap* heap) {
+    uint32_t n;
+    if (cluster_read(peer, &n, sizeof(n)) != 0) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < n; ++i) {
+        uint64_t key;
+        int64_t change;
+        if (cluster_read(peer, &key, sizeof(key)) != 0 || cluster_read(peer, &change, sizeof(change)) != 0) {
+            return -1;
+        }
+        uint32_t pair = pair_table_add(pairs, key, change);
+        if (pair == UINT32_MAX || (heap && pair_heap_push(heap, pair) != 0)) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Ask every worker to apply a merge
+static inline int cluster_broadcast_merge(Cluster* cluster, uint32_t left, uint32_t right, uint32_t merged) {
+    uint32_t message[4] = { CLUSTER_MERGE, left, right, merged };
+    for (int w = 0; w < cluster->worker_count; ++w) {
+        if (cluster_write(&cluster->workers[w], message, sizeof(message)) != 0 ||
+            cluster_flush(&cluster->workers[w]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+#endif /* CVOCGEN_CLUSTER_H */
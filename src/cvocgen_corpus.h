@@ -0,0 +1,315 @@
+#ifndef CVOCGEN_CORPUS_H
+#define CVOCGEN_CORPUS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cvocgen_decompress.h"
+
+// Line-oriented corpus reader.
+// Regular files are memory-mapped and lines are returned as (pointer, length) views
+// straight into the mapping. Pipes, stdin ("-") and anything that cannot be mapped
+// are read with getline() instead. gzip and zstd input (files, pipes or stdin) is
+// recognised by its magic bytes and streamed through a decoder thread
+// (cvocgen_decompress.h). Lines have no length limit; the '\n' is not
+// included. corpus_open_buffer reads a caller-owned buffer the same way as a mapping.
+typedef struct CorpusReader {
+    const char* data;        // Mapped file contents (NULL when streaming)
+    size_t size;             // Size of the mapping
+    size_t pos;              // Offset of the next line in the mapping
+    FILE* stream;            // Streaming fallback
+    char* line_buf;          // getline() buffer for the fallback
+    size_t line_cap;
+    size_t bytes_read;       // Bytes consumed so far in streaming mode
+    long total_size;         // File size for progress reporting, 0 if unknown
+    int borrowed;            // data belongs to the caller and is not unmapped
+    Decompressor* decoder;   // Compressed input, NULL = plain text
+    DecodedChunk* chunk;     // Decoded chunk being read
+    size_t chunk_pos;
+    char peek[4];            // Bytes read from a stream to detect its format, returned first
+    size_t peek_len;
+    size_t peek_pos;
+} CorpusReader;
+
+// Open a corpus; path "-" reads stdin. Compressed files are decoded with up to
+// decode_threads threads where the format allows it. Returns 0 on success, -1 on
+// error (errno ENOTSUP for zstd input without zstd support).
+static inline int corpus_open_threads(CorpusReader* reader, const char* path, int decode_threads) {
+    memset(reader, 0, sizeof(*reader));
+
+    int fd = STDIN_FILENO;
+    if (strcmp(path, "-") != 0) {
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            return -1;
+        }
+    }
+
+    // stdin is always streamed, even when it is redirected from a file
+    struct stat st;
+    int regular = fd != STDIN_FILENO && fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    unsigned char magic[4];
+    size_t magic_len = 0;
+    if (regular) {
+        ssize_t n = pread(fd, magic, sizeof(magic), 0);
+        magic_len = n > 0 ? (size_t)n : 0;
+    } else {
+        // A stream cannot be rewound, so the bytes read here are handed on
+        while (magic_len < sizeof(magic)) {
+            ssize_t n = read(fd, magic + magic_len, sizeof(magic) - magic_len);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            magic_len += (size_t)n;
+        }
+    }
+
+    int format = decompress_detect(magic, magic_len);
+    if (format != DECOMPRESS_NONE) {
+#ifndef CVOCGEN_ZSTD
+        if (format == DECOMPRESS_ZSTD) {
+            if (fd != STDIN_FILENO) close(fd);
+            errno = ENOTSUP;
+            return -1;
+        }
+#endif
+        // Progress is reported in compressed bytes
+        reader->total_size = regular ? (long)st.st_size : 0;
+        reader->decoder = decompress_open(fd, format, decode_threads, magic, regular ? 0 : magic_len);
+        return reader->decoder ? 0 : -1;
+    }
+
+    if (regular) {
+        reader->total_size = (long)st.st_size;
+        if (st.st_size == 0) {
+            // Nothing to map; an empty mapping reads as end of input
+            close(fd);
+            return 0;
+        }
+
+        void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+            close(fd);
+            reader->data = map;
+            reader->size = (size_t)st.st_size;
+            return 0;
+        }
+    }
+
+    // Not mappable (stdin, FIFO, device, ...): stream it
+    if (!regular) {
+        memcpy(reader->peek, magic, magic_len);
+        reader->peek_len = magic_len;
+    }
+    reader->stream = fd == STDIN_FILENO ? stdin : fdopen(fd, "r");
+    if (!reader->stream) {
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+static inline int corpus_open(CorpusReader* reader, const char* path) {
+    return corpus_open_threads(reader, path, 1);
+}
+
+// Read lines from data[0, size), which must stay valid until corpus_close
+static inline void corpus_open_buffer(CorpusReader* reader, const char* data, size_t size) {
+    memset(reader, 0, sizeof(*reader));
+    reader->data = size > 0 ? data : NULL;
+    reader->size = size;
+    reader->total_size = (long)size;
+    reader->borrowed = 1;
+}
+
+// Get the next line of data[*pos, end) and advance *pos past it.
+// Returns 1 and sets *line/*len, or 0 when the range is exhausted.
+static inline int corpus_range_next_line(const char* data, size_t end, size_t* pos,
+                                         const char** line, size_t* len) {
+    if (*pos >= end) {
+        return 0;
+    }
+    const char* start = data + *pos;
+    size_t remaining = end - *pos;
+    const char* newline = memchr(start, '\n', remaining);
+    size_t line_len = newline ? (size_t)(newline - start) : remaining;
+
+    *line = start;
+    *len = line_len;
+    *pos += line_len + (newline ? 1 : 0);
+    return 1;
+}
+
+// Split a mapped corpus into up to max_parts ranges of whole lines.
+// Fills bounds[0..parts] (bounds[0] = 0, bounds[parts] = size) and returns parts.
+static inline int corpus_split(const CorpusReader* reader, int max_parts, size_t* bounds) {
+    int parts = 0;
+    bounds[0] = 0;
+    for (int i = 1; i < max_parts; ++i) {
+        size_t target = reader->size / max_parts * i;
+        if (target <= bounds[parts]) {
+            continue;
+        }
+        const char* newline = memchr(reader->data + target, '\n', reader->size - target);
+        if (!newline) {
+            break;
+        }
+        size_t bound = (size_t)(newline - reader->data) + 1;
+        if (bound >= reader->size) {
+            break;
+        }
+        if (bound > bounds[parts]) {
+            bounds[++parts] = bound;
+        }
+    }
+    bounds[++parts] = reader->size;
+    return parts;
+}
+
+// Next line of decoded input. Lines are views into the current chunk; one that
+// crosses into the next chunk is collected in line_buf.
+static inline int corpus_decoded_next_line(CorpusReader* reader, const char** line, size_t* len) {
+    size_t carried = 0;
+    for (;;) {
+        DecodedChunk* chunk = reader->chunk;
+        if (!chunk || reader->chunk_pos >= chunk->size) {
+            if (chunk) {
+                reader->bytes_read = chunk->source_offset;
+                decompress_chunk_free(chunk);
+            }
+            reader->chunk = decompress_next(reader->decoder);
+            reader->chunk_pos = 0;
+            if (!reader->chunk) {
+                if (carried == 0) return 0;
+                *line = reader->line_buf;
+                *len = carried;
+                return 1;
+            }
+            continue;
+        }
+
+        const char* start = chunk->data + reader->chunk_pos;
+        size_t remaining = chunk->size - reader->chunk_pos;
+        const char* newline = memchr(start, '\n', remaining);
+        size_t part = newline ? (size_t)(newline - start) : remaining;
+        reader->chunk_pos += part + (newline ? 1 : 0);
+        if (newline && carried == 0) {
+            *line = start;
+            *len = part;
+            return 1;
+        }
+
+        if (carried + part + 1 > reader->line_cap) {
+            size_t cap = reader->line_cap ? reader->line_cap : 256;
+            while (cap < carried + part + 1) cap *= 2;
+            char* grown = realloc(reader->line_buf, cap);
+            if (!grown) return 0;
+            reader->line_buf = grown;
+            reader->line_cap = cap;
+        }
+        memcpy(reader->line_buf + carried, start, part);
+        carried += part;
+        if (newline) {
+            *line = reader->line_buf;
+            *len = carried;
+            return 1;
+        }
+    }
+}
+
+// Get the next line. Returns 1 and sets *line/*len, or 0 at end of input.
+// The view stays valid until the next call (streaming) or until corpus_close (mapped).
+static inline int corpus_next_line(CorpusReader* reader, const char** line, size_t* len) {
+    if (reader->data) {
+        return corpus_range_next_line(reader->data, reader->size, &reader->pos, line, len);
+    }
+    if (reader->decoder) {
+        return corpus_decoded_next_line(reader, line, len);
+    }
+
+    if (!reader->stream) {
+        return 0;
+    }
+
+    ssize_t read;
+    if (reader->peek_pos < reader->peek_len) {
+        // Lines that start in the bytes read to detect the format
+        const char* peek = reader->peek + reader->peek_pos;
+        size_t n = reader->peek_len - reader->peek_pos;
+        const char* newline = memchr(peek, '\n', n);
+        if (newline) {
+            *line = peek;
+            *len = (size_t)(newline - peek);
+            reader->peek_pos += *len + 1;
+            reader->bytes_read += *len + 1;
+            return 1;
+        }
+        reader->peek_pos = reader->peek_len;
+        read = getline(&reader->line_buf, &reader->line_cap, reader->stream);
+        size_t rest = read > 0 ? (size_t)read : 0;
+        if (n + rest + 1 > reader->line_cap) {
+            char* grown = realloc(reader->line_buf, n + rest + 1);
+            if (!grown) return 0;
+            reader->line_buf = grown;
+            reader->line_cap = n + rest + 1;
+        }
+        memmove(reader->line_buf + n, reader->line_buf, rest);
+        memcpy(reader->line_buf, peek, n);
+        read = (ssize_t)(n + rest);
+        reader->line_buf[read] = '\0';
+    } else {
+        read = getline(&reader->line_buf, &reader->line_cap, reader->stream);
+    }
+    if (read < 0) {
+        return 0;
+    }
+    reader->bytes_read += (size_t)read;
+    if (read > 0 && reader->line_buf[read - 1] == '\n') {
+        read--;
+    }
+    *line = reader->line_buf;
+    *len = (size_t)read;
+    return 1;
+}
+
+// Bytes consumed so far, for progress reporting
+static inline long corpus_offset(const CorpusReader* reader) {
+    if (reader->data) {
+        return (long)reader->pos;
+    }
+    const DecodedChunk* chunk = reader->chunk;
+    if (reader->decoder && chunk && chunk->size > 0) {
+        // Compressed offset, interpolated between those at the ends of the current chunk
+        double read = (double)reader->chunk_pos / (double)chunk->size;
+        return (long)(reader->bytes_read + (double)(chunk->source_offset - reader->bytes_read) * read);
+    }
+    return (long)reader->bytes_read;
+}
+
+// Whether the input could not be read to the end (a read error, or corrupt or
+// truncated compressed data). Lines read before that are still returned.
+static inline int corpus_failed(CorpusReader* reader) {
+    if (reader->decoder) {
+        return decompress_failed(reader->decoder);
+    }
+    return reader->stream && ferror(reader->stream);
+}
+
+static inline void corpus_close(CorpusReader* reader) {
+    decompress_chunk_free(reader->chunk);
+    decompress_close(reader->decoder);
+    if (reader->data && !reader->borrowed) {
+        munmap((void*)reader->data, reader->size);
+    }
+    if (reader->stream && reader->stream != stdin) {
+        fclose(reader->stream);
+    }
+    free(reader->line_buf);
+    memset(reader, 0, sizeof(*reader));
+}
+
+#endif /* CVOCGEN_CORPUS_H */
@@ -0,0 +1,530 @@
+#ifndef CVOCGEN_DECOMPRESS_H
+#define CVOCGEN_DECOMPRESS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#ifdef CVOCGEN_ZSTD
+#include <zstd.h>
+#endif
+#include "cvocgen_threads.h"
+
+// Compressed corpus input: gzip through zlib, and zstd when built with
+// CVOCGEN_ZSTD (make ZSTD=1).
+//
+// A decoder thread turns the compressed input into a short queue of plain-text
+// chunks that the corpus reader takes its lines from, so decompression runs
+// alongside tokenization. Mapped files made of blocks that can be decoded on
+// their own -- BGZF blocks (bgzip) and zstd frames that record their content
+// size (pzstd) -- are decoded a batch of blocks at a time on a thread pool.
+// Anything else (plain gzip, single-frame zstd, pipes) is decoded by the
+// decoder thread alone.
+#define DECOMPRESS_NONE 0
+#define DECOMPRESS_GZIP 1
+#define DECOMPRESS_ZSTD 2
+
+#define DECOMPRESS_CHUNK (4u << 20)      // Decoded bytes per chunk
+#define DECOMPRESS_QUEUE 4               // Chunks decoded ahead of the reader
+#define DECOMPRESS_INPUT (1u << 20)      // Compressed bytes per read
+#define DECOMPRESS_BATCH 1024            // Blocks per parallel batch
+#define DECOMPRESS_MAX_BLOCK (64u << 20) // Larger blocks are decoded as a stream
+
+typedef struct DecodedChunk {
+    char* data;
+    size_t size;
+    size_t source_offset;        // Compressed bytes consumed once this chunk is read
+    struct DecodedChunk* next;
+} DecodedChunk;
+
+typedef struct Decompressor {
+    int format;                  // DECOMPRESS_*
+    int fd;
+    const unsigned char* map;    // Mapped input (regular files), else NULL
+    size_t map_size;
+    unsigned char* in_buf;       // Read buffer for unmapped input
+    size_t in_pending;           // Bytes already in in_buf (read to detect the format)
+    size_t source_offset;        // Compressed bytes handed to the decoder so far
+    char* out;                   // Chunk being filled by the stream decoders
+    size_t out_len;
+    ThreadPool* pool;            // Block decoding threads, NULL = none
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    DecodedChunk* head;          // Decoded chunks in input order
+    DecodedChunk* tail;
+    int queued;
+    int finished;                // The decoder thread has queued its last chunk
+    int failed;                  // The input is corrupt or truncated
+    int stop;                    // The reader was closed early
+} Decompressor;
+
+// Format of a file from its first bytes
+static inline int decompress_detect(const unsigned char* p, size_t n) {
+    if (n >= 2 && p[0] == 0x1f && p[1] == 0x8b) return DECOMPRESS_GZIP;
+    if (n >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd) return DECOMPRESS_ZSTD;
+    return DECOMPRESS_NONE;
+}
+
+// Queue a decoded chunk for the reader; takes ownership of data.
+// Returns 0, or -1 if the reader has stopped.
+static inline int decompress_push(Decompressor* d, char* data, size_t size) {
+    DecodedChunk* chunk = malloc(sizeof(DecodedChunk));
+    if (!chunk) {
+        free(data);
+        return -1;
+    }
+    chunk->data = data;
+    chunk->size = size;
+    chunk->source_offset = d->source_offset;
+    chunk->next = NULL;
+
+    pthread_mutex_lock(&d->lock);
+    while (d->queued >= DECOMPRESS_QUEUE && !d->stop) {
+        pthread_cond_wait(&d->not_full, &d->lock);
+    }
+    if (d->stop) {
+        pthread_mutex_unlock(&d->lock);
+        free(data);
+        free(chunk);
+        return -1;
+    }
+    if (d->tail) d->tail->next = chunk;
+    else d->head = chunk;
+    d->tail = chunk;
+    d->queued++;
+    pthread_cond_signal(&d->not_empty);
+    pthread_mutex_unlock(&d->lock);
+    return 0;
+}
+
+// Queue what the stream decoders have written so far and start a new chunk
+static inline int decompress_emit(Decompressor* d) {
+    if (d->out_len == 0) return 0;
+    char* full = d->out;
+    size_t size = d->out_len;
+    d->out = malloc(DECOMPRESS_CHUNK);
+    d->out_len = 0;
+    if (!d->out) {
+        free(full);
+        return -1;
+    }
+    return decompress_push(d, full, size);
+}
+
+// Hand the next piece of compressed input, up to offset end of a mapping, to a
+// stream decoder. Returns its size, or 0 at the end of the input.
+static inline size_t decompress_fill(Decompressor* d, size_t end, const unsigned char** next) {
+    if (d->map) {
+        // Pieces of DECOMPRESS_INPUT keep source_offset close to what was decoded
+        size_t n = end > d->source_offset ? end - d->source_offset : 0;
+        if (n > DECOMPRESS_INPUT) n = DECOMPRESS_INPUT;
+        *next = d->map + d->source_offset;
+        d->source_offset += n;
+        return n;
+    }
+    if (d->in_pending > 0) {
+        size_t pending = d->in_pending;
+        d->in_pending = 0;
+        *next = d->in_buf;
+        d->source_offset += pending;
+        return pending;
+    }
+    ssize_t n;
+    do {
+        n = read(d->fd, d->in_buf, DECOMPRESS_INPUT);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        return 0;
+    }
+    *next = d->in_buf;
+    d->source_offset += (size_t)n;
+    return (size_t)n;
+}
+
+// Decode gzip members up to offset end (mapped) or the end of the input.
+// Returns 0, or -1 if the input is corrupt, truncated or the reader stopped.
+static inline int decompress_gzip_stream(Decompressor* d, size_t end) {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    // 15 + 32: gzip or zlib header, detected automatically
+    if (inflateInit2(&z, 15 + 32) != Z_OK) {
+        return -1;
+    }
+    int status = Z_OK;
+    int ok = 1;
+    int pending = 0;             // The output filled up, so inflate may hold more of it
+    for (;;) {
+        if (z.avail_in == 0 && !pending) {
+            const unsigned char* next;
+            size_t n = decompress_fill(d, end, &next);
+            if (n == 0) break;
+            z.next_in = (Bytef*)next;
+            z.avail_in = (uInt)n;
+        }
+        if (status == Z_STREAM_END && z.avail_in > 0) {
+            // Concatenated members (cat a.gz b.gz, pigz, bgzip); anything else is trailing garbage
+            if (z.next_in[0] != 0x1f) break;
+            inflateReset(&z);
+        }
+        if (d->out_len == DECOMPRESS_CHUNK && decompress_emit(d) != 0) {
+            ok = 0;
+            break;
+        }
+        z.next_out = (Bytef*)d->out + d->out_len;
+        z.avail_out = (uInt)(DECOMPRESS_CHUNK - d->out_len);
+        status = inflate(&z, Z_NO_FLUSH);
+        d->out_len = DECOMPRESS_CHUNK - z.avail_out;
+        if (status == Z_BUF_ERROR && z.avail_in == 0) {
+            // The output had just filled up exactly; nothing was held back
+            status = Z_OK;
+        } else if (status != Z_OK && status != Z_STREAM_END) {
+            ok = 0;
+            break;
+        }
+        pending = z.avail_out == 0 && status != Z_STREAM_END;
+    }
+    inflateEnd(&z);
+    return ok && status == Z_STREAM_END ? 0 : -1;
+}
+
+#ifdef CVOCGEN_ZSTD
+// Decode zstd frames up to offset end (mapped) or the end of the input
+static inline int decompress_zstd_stream(Decompressor* d, size_t end) {
+    ZSTD_DStream* z = ZSTD_createDStream();
+    if (!z) {
+        return -1;
+    }
+    ZSTD_initDStream(z);
+    ZSTD_inBuffer in = { NULL, 0, 0 };
+    size_t status = 1;
+    int ok = 1;
+    int pending = 0;             // The output filled up, so the decoder may hold more of it
+    for (;;) {
+        if (in.pos == in.size && !pending) {
+            const unsigned char* next;
+            size_t n = decompress_fill(d, end, &next);
+            if (n == 0) break;
+            in.src = next;
+            in.size = n;
+            in.pos = 0;
+        }
+        if (d->out_len == DECOMPRESS_CHUNK && decompress_emit(d) != 0) {
+            ok = 0;
+            break;
+        }
+        ZSTD_outBuffer out = { d->out, DECOMPRESS_CHUNK, d->out_len };
+        status = ZSTD_decompressStream(z, &out, &in);
+        d->out_len = out.pos;
+        if (ZSTD_isError(status)) {
+            ok = 0;
+            break;
+        }
+        pending = out.pos == out.size && status != 0;
+    }
+    ZSTD_freeDStream(z);
+    // status is 0 exactly when the last frame was complete and flushed
+    return ok && status == 0 ? 0 : -1;
+}
+#endif
+
+static inline int decompress_stream(Decompressor* d, size_t end) {
+#ifdef CVOCGEN_ZSTD
+    if (d->format == DECOMPRESS_ZSTD) {
+        return decompress_zstd_stream(d, end);
+    }
+#endif
+    return decompress_gzip_stream(d, end);
+}
+
+// One independently decodable block of a mapped input
+typedef struct {
+    size_t offset;               // Compressed range in the mapping
+    size_t size;
+    size_t out_offset;           // Decoded range in the batch output
+    size_t out_size;
+} DecodeBlock;
+
+// Find the block at offset. Returns 1 if it can be decoded on its own, 0 if it
+// must be streamed (*size is 0 when its end is unknown), or -1 if it is invalid.
+static inline int decompress_block_at(const Decompressor* d, size_t offset, size_t* size, size_t* out_size) {
+    const unsigned char* p = d->map + offset;
+    size_t n = d->map_size - offset;
+    *size = 0;
+    if (d->format == DECOMPRESS_GZIP) {
+        // BGZF: a gzip member with only FEXTRA set and a "BC" subfield holding its size
+        if (n < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || p[3] != 4) return 0;
+        size_t xlen = p[10] | (size_t)p[11] << 8;
+        for (size_t i = 12; i + 4 <= 12 + xlen && 12 + xlen <= n; ) {
+            size_t slen = p[i + 2] | (size_t)p[i + 3] << 8;
+            if (p[i] == 'B' && p[i + 1] == 'C' && slen == 2) {
+                size_t block = (p[i + 4] | (size_t)p[i + 5] << 8) + 1;
+                if (block < 12 + xlen + 8 || block > n) return -1;
+                const unsigned char* trailer = p + block - 4;
+                *size = block;
+                *out_size = trailer[0] | (size_t)trailer[1] << 8 | (size_t)trailer[2] << 16 |
+                            (size_t)trailer[3] << 24;
+                return 1;
+            }
+            i += 4 + slen;
+        }
+        return 0;
+    }
+#ifdef CVOCGEN_ZSTD
+    size_t frame = ZSTD_findFrameCompressedSize(p, n);
+    if (ZSTD_isError(frame)) return -1;
+    *size = frame;
+    unsigned long long content = ZSTD_getFrameContentSize(p, frame);
+    if (content == ZSTD_CONTENTSIZE_UNKNOWN || content == ZSTD_CONTENTSIZE_ERROR ||
+        content > DECOMPRESS_MAX_BLOCK) {
+        return 0;
+    }
+    *out_size = (size_t)content;
+    return 1;
+#else
+    return -1;
+#endif
+}
+
+typedef struct {
+    Decompressor* d;
+    DecodeBlock* blocks;
+    int count;
+    char* out;
+    int failed;
+} DecodeBatch;
+
+static inline int decompress_bgzf_block(const unsigned char* p, const DecodeBlock* b, char* out) {
+    size_t xlen = p[10] | (size_t)p[11] << 8;
+    const unsigned char* trailer = p + b->size - 8;
+    uLong crc = trailer[0] | (uLong)trailer[1] << 8 | (uLong)trailer[2] << 16 | (uLong)trailer[3] << 24;
+
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (inflateInit2(&z, -15) != Z_OK) {
+        return -1;
+    }
+    z.next_in = (Bytef*)p + 12 + xlen;
+    z.avail_in = (uInt)(b->size - 12 - xlen - 8);
+    z.next_out = (Bytef*)out;
+    z.avail_out = (uInt)b->out_size;
+    int status = inflate(&z, Z_FINISH);
+    int ok = status == Z_STREAM_END && z.total_out == b->out_size;
+    inflateEnd(&z);
+    return ok && crc32(crc32(0L, Z_NULL, 0), (const Bytef*)out, (uInt)b->out_size) == crc ? 0 : -1;
+}
+
+static inline void decompress_batch_worker(void* arg, int worker) {
+    DecodeBatch* batch = arg;
+    Decompressor* d = batch->d;
+    int workers = thread_pool_size(d->pool);
+#ifdef CVOCGEN_ZSTD
+    ZSTD_DCtx* dctx = d->format == DECOMPRESS_ZSTD ? ZSTD_createDCtx() : NULL;
+#endif
+    for (int i = worker; i < batch->count; i += workers) {
+        const DecodeBlock* b = &batch->blocks[i];
+        char* out = batch->out + b->out_offset;
+        int ok = 0;
+        if (d->format == DECOMPRESS_GZIP) {
+            ok = decompress_bgzf_block(d->map + b->offset, b, out) == 0;
+        }
+#ifdef CVOCGEN_ZSTD
+        else if (dctx) {
+            size_t n = ZSTD_decompressDCtx(dctx, out, b->out_size, d->map + b->offset, b->size);
+            ok = !ZSTD_isError(n) && n == b->out_size;
+        }
+#endif
+        if (!ok) {
+            __atomic_store_n(&batch->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+#ifdef CVOCGEN_ZSTD
+    ZSTD_freeDCtx(dctx);
+#endif
+}
+
+// Decode a mapped input block by block on the pool, streaming the parts that
+// are not made of independent blocks
+static inline int decompress_blocks(Decompressor* d) {
+    DecodeBlock* blocks = malloc(sizeof(DecodeBlock) * DECOMPRESS_BATCH);
+    if (!blocks) {
+        return -1;
+    }
+    int ret = 0;
+    while (ret == 0 && d->source_offset < d->map_size) {
+        // Collect about a chunk's worth of decoded bytes
+        int count = 0;
+        size_t out_total = 0;
+        size_t offset = d->source_offset;
+        int kind = 1;
+        size_t size = 0, out_size = 0;
+        while (count < DECOMPRESS_BATCH && out_total < DECOMPRESS_CHUNK && offset < d->map_size) {
+            kind = decompress_block_at(d, offset, &size, &out_size);
+            if (kind != 1) break;
+            blocks[count].offset = offset;
+            blocks[count].size = size;
+            blocks[count].out_offset = out_total;
+            blocks[count].out_size = out_size;
+            out_total += out_size;
+            offset += size;
+            count++;
+        }
+
+        if (count > 0) {
+            DecodeBatch batch = { d, blocks, count, malloc(out_total ? out_total : 1), 0 };
+            if (!batch.out) {
+                ret = -1;
+                break;
+            }
+            thread_pool_run(d->pool, decompress_batch_worker, &batch);
+            d->source_offset = offset;
+            if (batch.failed) {
+                free(batch.out);
+                ret = -1;
+            } else if (out_total == 0) {
+                free(batch.out);
+            } else {
+                ret = decompress_push(d, batch.out, out_total);
+            }
+        }
+        if (ret == 0 && kind == -1) {
+            ret = -1;
+        } else if (ret == 0 && kind == 0) {
+            // Stream this block, or the rest of the file if its end is unknown
+            ret = decompress_stream(d, size > 0 ? d->source_offset + size : d->map_size);
+            if (ret == 0) ret = decompress_emit(d);
+        }
+    }
+    free(blocks);
+    return ret;
+}
+
+static inline void* decompress_main(void* arg) {
+    Decompressor* d = arg;
+    int ret = d->map && d->pool ? decompress_blocks(d) : decompress_stream(d, d->map_size);
+    if (ret == 0) ret = decompress_emit(d);
+
+    pthread_mutex_lock(&d->lock);
+    if (ret != 0 && !d->stop) d->failed = 1;
+    d->finished = 1;
+    pthread_cond_signal(&d->not_empty);
+    pthread_mutex_unlock(&d->lock);
+    return NULL;
+}
+
+// Start decoding fd, a file in format (DECOMPRESS_*), with up to threads threads
+// for block decoding. prefix holds prefix_len bytes already read from a stream.
+// Takes ownership of fd, which is closed on error. Returns NULL on error.
+static inline Decompressor* decompress_open(int fd, int format, int threads,
+                                            const unsigned char* prefix, size_t prefix_len) {
+    Decompressor* d = calloc(1, sizeof(Decompressor));
+    if (!d) {
+        return NULL;
+    }
+    d->format = format;
+    d->fd = fd;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+            d->map = map;
+            d->map_size = (size_t)st.st_size;
+        }
+    }
+    if (!d->map) {
+        d->in_buf = malloc(DECOMPRESS_INPUT);
+        if (d->in_buf && prefix_len > 0) {
+            memcpy(d->in_buf, prefix, prefix_len);
+            d->in_pending = prefix_len;
+        }
+    }
+    d->out = malloc(DECOMPRESS_CHUNK);
+    if (d->map && threads > 1) {
+        d->pool = thread_pool_create(threads);
+    }
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->not_empty, NULL);
+    pthread_cond_init(&d->not_full, NULL);
+
+    if (!d->out || (!d->map && !d->in_buf) || pthread_create(&d->thread, NULL, decompress_main, d) != 0) {
+        thread_pool_free(d->pool);
+        pthread_mutex_destroy(&d->lock);
+        pthread_cond_destroy(&d->not_empty);
+        pthread_cond_destroy(&d->not_full);
+        if (d->map) munmap((void*)d->map, d->map_size);
+        free(d->in_buf);
+        free(d->out);
+        free(d);
+        if (fd != STDIN_FILENO) close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return d;
+}
+
+// Take the next decoded chunk, waiting for the decoder; NULL at the end of the input
+static inline DecodedChunk* decompress_next(Decompressor* d) {
+    pthread_mutex_lock(&d->lock);
+    while (!d->head && !d->finished) {
+        pthread_cond_wait(&d->not_empty, &d->lock);
+    }
+    DecodedChunk* chunk = d->head;
+    if (chunk) {
+        d->head = chunk->next;
+        if (!d->head) d->tail = NULL;
+        d->queued--;
+        pthread_cond_signal(&d->not_full);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return chunk;
+}
+
+static inline void decompress_chunk_free(DecodedChunk* chunk) {
+    if (!chunk) return;
+    free(chunk->data);
+    free(chunk);
+}
+
+// Whether decoding stopped on corrupt or truncated input
+static inline int decompress_failed(Decompressor* d) {
+    pthread_mutex_lock(&d->lock);
+    int failed = d->failed;
+    pthread_mutex_unlock(&d->lock);
+    return failed;
+}
+
+// Stop the decoder thread (if it is still running) and free everything
+static inline void decompress_close(Decompressor* d) {
+    if (!d) return;
+    pthread_mutex_lock(&d->lock);
+    d->stop = 1;
+    pthread_cond_broadcast(&d->not_full);
+    pthread_mutex_unlock(&d->lock);
+    pthread_join(d->thread, NULL);
+
+    while (d->head) {
+        DecodedChunk* next = d->head->next;
+        decompress_chunk_free(d->head);
+        d->head = next;
+    }
+    thread_pool_free(d->pool);
+    pthread_mutex_destroy(&d->lock);
+    pthread_cond_destroy(&d->not_empty);
+    pthread_cond_destroy(&d->not_full);
+    if (d->map) munmap((void*)d->map, d->map_size);
+    if (d->fd != STDIN_FILENO) close(d->fd);
+    free(d->in_buf);
+    free(d->out);
+    free(d);
+}
+
+#endif /* CVOCGEN_DECOMPRESS_H */
@@ -5,77 +5,194 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 #include "cvocgen.h"
 
-// External function declarations needed for this header
-extern unsigned int hash(const char* key, unsigned int size);
+// Special tokens, written first with IDs 0-4 by the JSON and binary writers
+static const char* const vocab_special_tokens[] = {"<s>", "<pad>", "</s>", "<unk>", "<mask>"};
+#define VOCAB_SPECIAL_COUNT 5
 
-// Helper function to escape strings for JSON output
-static inline char* json_escape_string(const char* input) {
-    if (!input) return NULL;
-    
-    // Count the number of characters that need escaping to determine output size
-    size_t escape_count = 0;
-    const char* p = input;
-    while (*p) {
-        // Characters that need escaping in JSON: ", \, /, \b, \f, \n, \r, \t
-        if (*p == '"' || *p == '\\' || *p == '/' || 
-            *p == '\b' || *p == '\f' || *p == '\n' || *p == '\r' || *p == '\t') {
-            escape_count++;
+static inline int vocab_is_special(const char* key) {
+    if (key[0] != '<') return 0;
+    for (int i = 0; i < VOCAB_SPECIAL_COUNT; i++) {
+        if (strcmp(key, vocab_special_tokens[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+static inline int vocab_order_by_key(const void* a, const void* b) {
+    const Ht_item* x = *(const Ht_item* const*)a;
+    const Ht_item* y = *(const Ht_item* const*)b;
+    return strcmp(x->key, y->key);
+}
+
+static inline int vocab_order_by_count(const void* a, const void* b) {
+    const Ht_item* x = *(const Ht_item* const*)a;
+    const Ht_item* y = *(const Ht_item* const*)b;
+    if (x->count != y->count) return x->count > y->count ? -1 : 1;
+    return strcmp(x->key, y->key);
+}
+
+// The tokens of vocab in output order (VOCAB_ORDER_*), without the special tokens.
+// symbols and merges are only needed for VOCAB_ORDER_RANK. Returns a malloc'ed
+// array of pointers into vocab->items and sets *count, or NULL if out of memory.
+static inline const Ht_item** vocab_token_order(HashTable* vocab, const SymbolTable* symbols,
+                                                const BpeMerge* merges, int merge_count,
+                                                int order, uint32_t* count) {
+    size_t alloc = vocab->count > 0 ? vocab->count : 1;
+    const Ht_item** tokens = malloc(sizeof(Ht_item*) * alloc);
+    if (!tokens) return NULL;
+
+    uint32_t n = 0;
+    if (order == VOCAB_ORDER_RANK && symbols) {
+        // Base tokens sorted byte-wise, then the merged tokens in the order they were made
+        unsigned char* merged = calloc(alloc, 1);
+        if (!merged) {
+            free(tokens);
+            return NULL;
+        }
+        for (int i = 0; i < merge_count; ++i) {
+            Ht_item* item = hash_search(vocab, symbols->strings[merges[i].merged]);
+            if (item) merged[item - vocab->items] = 1;
+        }
+        for (unsigned int i = 0; i < vocab->count; ++i) {
+            if (!merged[i] && !vocab_is_special(vocab->items[i].key)) tokens[n++] = &vocab->items[i];
+        }
+        qsort(tokens, n, sizeof(Ht_item*), vocab_order_by_key);
+        for (int i = 0; i < merge_count; ++i) {
+            Ht_item* item = hash_search(vocab, symbols->strings[merges[i].merged]);
+            if (item && merged[item - vocab->items] == 1 && !vocab_is_special(item->key)) {
+                merged[item - vocab->items] = 2;
+                tokens[n++] = item;
+            }
+        }
+        free(merged);
+    } else {
+        for (unsigned int i = 0; i < vocab->count; ++i) {
+            if (!vocab_is_special(vocab->items[i].key)) tokens[n++] = &vocab->items[i];
+        }
+        if (order == VOCAB_ORDER_FREQUENCY) {
+            qsort(tokens, n, sizeof(Ht_item*), vocab_order_by_count);
         }
-        p++;
     }
-    
-    // Allocate memory for the escaped string (each escaped char becomes two)
-    size_t input_len = strlen(input);
-    size_t output_len = input_len + escape_count + 1; // +1 for null terminator
-    char* output = (char*)malloc(output_len);
-    if (!output) return NULL;
-    
-    // Copy and escape
+    *count = n;
+    return tokens;
+}
+
+// Buffered output for the vocabulary writers: text is formatted and escaped
+// straight into one large buffer, which goes to the file with a single fwrite
+// whenever it fills up
+#define VOCAB_WRITE_BUFFER (1 << 20)
+
+typedef struct {
+    FILE* file;
+    char* data;
+    size_t len;
+    int failed;
+} VocabWriter;
+
+static inline int vocab_writer_open(VocabWriter* w, const char* filename) {
+    w->file = fopen(filename, "w");
+    w->data = w->file ? malloc(VOCAB_WRITE_BUFFER) : NULL;
+    w->len = 0;
+    w->failed = 0;
+    if (!w->data) {
+        if (w->file) fclose(w->file);
+        return -1;
+    }
+    setvbuf(w->file, NULL, _IONBF, 0);
+    return 0;
+}
+
+static inline void vocab_writer_flush(VocabWriter* w) {
+    if (w->len > 0 && fwrite(w->data, 1, w->len, w->file) != w->len) {
+        w->failed = 1;
+    }
+    w->len = 0;
+}
+
+// Room for n more bytes (n <= VOCAB_WRITE_BUFFER) at the returned position
+static inline char* vocab_writer_reserve(VocabWriter* w, size_t n) {
+    if (w->len + n > VOCAB_WRITE_BUFFER) {
+        vocab_writer_flush(w);
+    }
+    return w->data + w->len;
+}
+
+static inline void vocab_writer_bytes(VocabWriter* w, const char* s, size_t len) {
+    while (len > 0) {
+        size_t chunk = len < VOCAB_WRITE_BUFFER ? len : VOCAB_WRITE_BUFFER;
+        memcpy(vocab_writer_reserve(w, chunk), s, chunk);
+        w->len += chunk;
+        s += chunk;
+        len -= chunk;
+    }
+}
+
+static inline void vocab_writer_int(VocabWriter* w, int64_t value) {
+    char digits[20];
+    int n = 0;
+    uint64_t v = value < 0 ? 0u - (uint64_t)value : (uint64_t)value;
+    do {
+        digits[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v > 0);
+    if (value < 0) digits[n++] = '-';
+
+    char* out = vocab_writer_reserve(w, sizeof(digits));
+    for (int i = 0; i < n; ++i) {
+        out[i] = digits[n - 1 - i];
+    }
+    w->len += n;
+}
+
+// Escape len bytes of s for a JSON string into out, which must have room for
+// 6 * len bytes. Returns the number of bytes written.
+static inline size_t json_escape_into(char* out, const char* s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
     size_t j = 0;
-    for (size_t i = 0; i < input_len; i++) {
-        switch (input[i]) {
-            case '"':
-                output[j++] = '\\';
-                output[j++] = '"';
-                break;
-            case '\\':
-                output[j++] = '\\';
-                output[j++] = '\\';
-                break;
-            case '/':
-                output[j++] = '\\';
-                output[j++] = '/';
-                break;
-            case '\b':
-                output[j++] = '\\';
-                output[j++] = 'b';
-                break;
-            case '\f':
-                output[j++] = '\\';
-                output[j++] = 'f';
-                break;
-            case '\n':
-                output[j++] = '\\';
-                output[j++] = 'n';
-                break;
-            case '\r':
-                output[j++] = '\\';
-                output[j++] = 'r';
-                break;
-            case '\t':
-                output[j++] = '\\';
-                output[j++] = 't';
-                break;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        switch (c) {
+            case '"':  out[j++] = '\\'; out[j++] = '"'; break;
+            case '\\': out[j++] = '\\'; out[j++] = '\\'; break;
+            case '/':  out[j++] = '\\'; out[j++] = '/'; break;
+            case '\b': out[j++] = '\\'; out[j++] = 'b'; break;
+            case '\f': out[j++] = '\\'; out[j++] = 'f'; break;
+            case '\n': out[j++] = '\\'; out[j++] = 'n'; break;
+            case '\r': out[j++] = '\\'; out[j++] = 'r'; break;
+            case '\t': out[j++] = '\\'; out[j++] = 't'; break;
             default:
-                output[j++] = input[i];
+                if (c < 0x20) {
+                    memcpy(out + j, "\\u00", 4);
+                    out[j + 4] = hex[c >> 4];
+                    out[j + 5] = hex[c & 15];
+                    j += 6;
+                } else {
+                    out[j++] = (char)c;
+                }
                 break;
         }
     }
-    output[j] = '\0';
-    
-    return output;
+    return j;
+}
+
+static inline void vocab_writer_json_string(VocabWriter* w, const char* s, size_t len) {
+    // Any length works: long strings are escaped in buffer-sized pieces
+    while (len > 0) {
+        size_t chunk = len < VOCAB_WRITE_BUFFER / 6 ? len : VOCAB_WRITE_BUFFER / 6;
+        w->len += json_escape_into(vocab_writer_reserve(w, 6 * chunk), s, chunk);
+        s += chunk;
+        len -= chunk;
+    }
+}
+
+// Flush and close; returns 0, or -1 if anything failed to write
+static inline int vocab_writer_close(VocabWriter* w) {
+    vocab_writer_flush(w);
+    if (fclose(w->file) != 0) w->failed = 1;
+    free(w->data);
+    return w->failed ? -1 : 0;
 }
 
 // Save vocabulary and merges to a text file
@@ -84,255 +201,154 @@ static inline int save_vocabulary(HashTable* vocab, char** merges, int merge_cou
         return -1;
     }
 
-    FILE* file = fopen(filename, "w");
-    if (!file) {
+    VocabWriter w;
+    if (vocab_writer_open(&w, filename) != 0) {
         perror("Error opening file for writing");
         return -1;
     }
 
-    // Write the number of merges
-    fprintf(file, "%d\n", merge_count);
-
-    // Write the merge operations
+    // The number of merges, the merge operations, then the vocabulary
+    vocab_writer_int(&w, merge_count);
+    vocab_writer_bytes(&w, "\n", 1);
     for (int i = 0; i < merge_count; ++i) {
-        fprintf(file, "%s\n", merges[i]);
+        vocab_writer_bytes(&w, merges[i], strlen(merges[i]));
+        vocab_writer_bytes(&w, "\n", 1);
     }
-
-    // Write the vocabulary
-    fprintf(file, "---VOCABULARY---\n");
-    for (unsigned int i = 0; i < vocab->size; ++i) {
-        Ht_item* item = vocab->items[i];
-        while (item) {
-            fprintf(file, "%s\t%d\n", item->key, item->count);
-            item = item->next;
-        }
+    vocab_writer_bytes(&w, "---VOCABULARY---\n", 17);
+    for (unsigned int i = 0; i < vocab->count; ++i) {
+        Ht_item* item = &vocab->items[i];
+        vocab_writer_bytes(&w, item->key, strlen(item->key));
+        vocab_writer_bytes(&w, "\t", 1);
+        vocab_writer_int(&w, item->count);
+        vocab_writer_bytes(&w, "\n", 1);
     }
 
-    fclose(file);
-    return 0;
+    return vocab_writer_close(&w);
 }
 
-// Save vocabulary and merges to JSON files with simplified format
-static inline int save_vocabulary_json(HashTable* vocab, char** merges, int merge_count, const char* base_filename) {
-    if (!vocab || !base_filename) {
+// Save tokens (from vocab_token_order) to base_filename.json as token -> ID, the
+// special tokens taking IDs 0-4, and to base_filename_freq.json as token -> count.
+// Both files are written in one pass and each token is escaped once.
+static inline int save_vocabulary_json_tokens(const Ht_item* const* tokens, uint32_t token_count,
+                                              const char* base_filename) {
+    if (!tokens || !base_filename) {
         return -1;
     }
-    
-    // Create filenames for vocabulary and frequency JSON files
-    char vocab_filename[256];
-    char freq_filename[256];
+
+    char vocab_filename[PATH_MAX + 16];
+    char freq_filename[PATH_MAX + 16];
     snprintf(vocab_filename, sizeof(vocab_filename), "%s.json", base_filename);
     snprintf(freq_filename, sizeof(freq_filename), "%s_freq.json", base_filename);
-    
-    // Open vocabulary JSON file
-    FILE* vocab_file = fopen(vocab_filename, "w");
-    if (!vocab_file) {
+
+    VocabWriter vocab_out, freq_out;
+    if (vocab_writer_open(&vocab_out, vocab_filename) != 0) {
         perror("Error opening vocabulary JSON file for writing");
         return -1;
     }
-    
-    // Open frequency JSON file
-    FILE* freq_file = fopen(freq_filename, "w");
-    if (!freq_file) {
+    if (vocab_writer_open(&freq_out, freq_filename) != 0) {
         perror("Error opening frequency JSON file for writing");
-        fclose(vocab_file);
+        vocab_writer_close(&vocab_out);
         return -1;
     }
-    
-    // Start JSON objects with a single set of curly braces
-    fprintf(vocab_file, "{\n");
-    fprintf(freq_file, "{\n");
-    
-    // Special tokens first with fixed indices (0-4)
-    const char* special_tokens[] = {"<s>", "<pad>", "</s>", "<unk>", "<mask>"};
-    int special_token_count = 5;
+
+    vocab_writer_bytes(&vocab_out, "{\n", 2);
+    vocab_writer_bytes(&freq_out, "{\n", 2);
     int index = 0;
-    
-    // Add special tokens to vocabulary file
-    for (int i = 0; i < special_token_count; i++) {
-        fprintf(vocab_file, "  \"%s\": %d%s\n", 
-                special_tokens[i], index++, 
-                (i < special_token_count - 1 || vocab->size > 0 || merge_count > 0) ? "," : "");
+    for (int i = 0; i < VOCAB_SPECIAL_COUNT; i++) {
+        vocab_writer_bytes(&vocab_out, i > 0 ? ",\n  \"" : "  \"", i > 0 ? 5 : 3);
+        vocab_writer_bytes(&vocab_out, vocab_special_tokens[i], strlen(vocab_special_tokens[i]));
+        vocab_writer_bytes(&vocab_out, "\": ", 3);
+        vocab_writer_int(&vocab_out, index++);
     }
-    
-    // Count total items for proper JSON formatting (to handle commas)
-    int total_items = 0;
-    for (unsigned int i = 0; i < vocab->size; ++i) {
-        Ht_item* item = vocab->items[i];
-        while (item) {
-            // Skip special tokens that were already added
-            int is_special = 0;
-            for (int j = 0; j < special_token_count; j++) {
-                if (strcmp(item->key, special_tokens[j]) == 0) {
-                    is_special = 1;
-                    break;
-                }
-            }
-            if (!is_special) total_items++;
-            item = item->next;
+
+    for (uint32_t i = 0; i < token_count; i++) {
+        const char* key = tokens[i]->key;
+        size_t len = strlen(key);
+        vocab_writer_bytes(&vocab_out, ",\n  \"", 5);
+        vocab_writer_bytes(&freq_out, i > 0 ? ",\n  \"" : "  \"", i > 0 ? 5 : 3);
+        if (len <= VOCAB_WRITE_BUFFER / 8) {
+            // Escape into the vocabulary buffer and copy the result to the frequency buffer
+            char* escaped = vocab_writer_reserve(&vocab_out, 6 * len);
+            size_t escaped_len = json_escape_into(escaped, key, len);
+            vocab_out.len += escaped_len;
+            memcpy(vocab_writer_reserve(&freq_out, escaped_len), escaped, escaped_len);
+            freq_out.len += escaped_len;
+        } else {
+            vocab_writer_json_string(&vocab_out, key, len);
+            vocab_writer_json_string(&freq_out, key, len);
         }
+        vocab_writer_bytes(&vocab_out, "\": ", 3);
+        vocab_writer_int(&vocab_out, index++);
+        vocab_writer_bytes(&freq_out, "\": ", 3);
+        vocab_writer_int(&freq_out, tokens[i]->count);
     }
-    
-    // Add merge operations to the count
-    total_items += merge_count;
-    
-    // Create a list of tokens to write (excluding special tokens)
-    char** token_list = NULL;
-    int* count_list = NULL;
-    int token_count = 0;
-    int max_tokens = 100;
-    
-    // Allocate initial arrays
-    token_list = (char**)malloc(sizeof(char*) * max_tokens);
-    count_list = (int*)malloc(sizeof(int) * max_tokens);
-    
-    if (!token_list || !count_list) {
-        if (token_list) free(token_list);
-        if (count_list) free(count_list);
-        fclose(vocab_file);
-        fclose(freq_file);
+
+    vocab_writer_bytes(&vocab_out, "\n}\n", 3);
+    vocab_writer_bytes(&freq_out, token_count > 0 ? "\n}\n" : "}\n", token_count > 0 ? 3 : 2);
+    int failed = vocab_writer_close(&vocab_out) != 0;
+    failed |= vocab_writer_close(&freq_out) != 0;
+    return failed ? -1 : 0;
+}
+
+// Save vocabulary to JSON files in insertion order (merges are not written)
+static inline int save_vocabulary_json(HashTable* vocab, char** merges, int merge_count, const char* base_filename) {
+    (void)merges;
+    (void)merge_count;
+    if (!vocab || !base_filename) {
         return -1;
     }
-    
-    // Collect all tokens and counts first
-    for (unsigned int i = 0; i < vocab->size; ++i) {
-        Ht_item* item = vocab->items[i];
-        while (item) {
-            // Skip special tokens that were already added
-            int is_special = 0;
-            for (int j = 0; j < special_token_count; j++) {
-                if (strcmp(item->key, special_tokens[j]) == 0) {
-                    is_special = 1;
-                    break;
-                }
-            }
-            
-            if (!is_special) {
-                // Resize arrays if needed
-                if (token_count >= max_tokens) {
-                    max_tokens *= 2;
-                    char** new_tokens = (char**)realloc(token_list, sizeof(char*) * max_tokens);
-                    int* new_counts = (int*)realloc(count_list, sizeof(int) * max_tokens);
-                    
-                    if (!new_tokens || !new_counts) {
-                        // Free everything on error
-                        for (int j = 0; j < token_count; j++) {
-                            free(token_list[j]);
-                        }
-                        free(token_list);
-                        free(count_list);
-                        fclose(vocab_file);
-                        fclose(freq_file);
-                        return -1;
-                    }
-                    
-                    token_list = new_tokens;
-                    count_list = new_counts;
-                }
-                
-                // Add token and count to lists
-                token_list[token_count] = strdup(item->key);
-                count_list[token_count] = item->count;
-                token_count++;
-            }
-            
-            item = item->next;
-        }
+    uint32_t token_count;
+    const Ht_item** tokens = vocab_token_order(vocab, NULL, NULL, 0, VOCAB_ORDER_INSERTION, &token_count);
+    if (!tokens) return -1;
+    int ret = save_vocabulary_json_tokens(tokens, token_count, base_filename);
+    free(tokens);
+    return ret;
+}
+
+static inline void free_merge_strings(char** strings, int merge_count) {
+    for (int i = 0; i < merge_count; ++i) {
+        free(strings[i]);
     }
-    
-    // Now write tokens to files with proper comma handling
-    for (int i = 0; i < token_count; i++) {
-        // Escape the token for JSON
-        char* escaped_token = json_escape_string(token_list[i]);
-        if (!escaped_token) {
-            // Handle error
-            for (int j = i; j < token_count; j++) {
-                free(token_list[j]);
-            }
-            free(token_list);
-            free(count_list);
-            fclose(vocab_file);
-            fclose(freq_file);
-            return -1;
+    free(strings);
+}
+
+// Build the "<left> <right>" merge strings for ID-based merges
+static inline char** merges_to_strings(const SymbolTable* symbols, const BpeMerge* merges, int merge_count) {
+    char** strings = malloc(sizeof(char*) * (merge_count > 0 ? (size_t)merge_count : 1));
+    if (!strings) return NULL;
+
+    for (int i = 0; i < merge_count; ++i) {
+        const char* left = symbols->strings[merges[i].left];
+        const char* right = symbols->strings[merges[i].right];
+        size_t len = strlen(left) + 1 + strlen(right);
+        strings[i] = malloc(len + 1);
+        if (!strings[i]) {
+            free_merge_strings(strings, i);
+            return NULL;
         }
-        
-        // For vocabulary JSON: token -> index mapping
-        fprintf(vocab_file, "  \"%s\": %d%s\n", 
-                escaped_token, index++, (i < token_count - 1) ? "," : "");
-        
-        // For frequency JSON: token -> count mapping
-        fprintf(freq_file, "  \"%s\": %d%s\n", 
-                escaped_token, count_list[i], 
-                (i < token_count - 1) ? "," : "");
-        
-        // Free escaped token and original token
-        free(escaped_token);
-        free(token_list[i]);
+        snprintf(strings[i], len + 1, "%s %s", left, right);
     }
-    
-    // Free arrays
-    free(token_list);
-    free(count_list);
-    
-    // Add merge operations as regular tokens
-    // for (int i = 0; i < merge_count; i++) {
-    //     // Escape the merge operation for JSON
-    //     char* escaped_merge = json_escape_string(merges[i]);
-    //     if (!escaped_merge) {
-    //         // Handle error
-    //         fclose(vocab_file);
-    //         fclose(freq_file);
-    //         return -1;
-    //     }
-        
-    //     // Get the merged token from the vocabulary hash table
-    //     char* pair_copy = strdup(merges[i]);
-    //     char* space = strchr(pair_copy, ' ');
-    //     if (space) {
-    //         *space = '\0';  // Split the string
-    //         char* second = space + 1;
-    //         char merged[256];
-    //         snprintf(merged, sizeof(merged), "%s%s", pair_copy, second);
-            
-    //         // Look up the merged token in the vocabulary
-    //         Ht_item* item = hash_search(vocab, merged);
-    //         if (item) {
-    //             // Use the key from the vocabulary hash table
-    //             free(escaped_merge);
-    //             escaped_merge = json_escape_string(item->key);
-    //         }
-    //         free(pair_copy);
-    //     }
-        
-    //     // Add to vocabulary JSON with index
-    //     fprintf(vocab_file, "  \"%s\": %d%s\n", 
-    //             escaped_merge, index++, (i < merge_count - 1) ? "," : "");
-        
-    //     // Add to frequency JSON with a proper count
-    //     // Look up the merged token in the vocabulary to get its actual frequency
-    //     Ht_item* merged_item = hash_search(vocab, merges[i]);
-    //     int freq = merged_item ? merged_item->count : 1; // Use 1 as fallback if not found
-        
-    //     // Add comma if this isn't the last merge
-    //     fprintf(freq_file, "  \"%s\": %d%s\n", 
-    //             escaped_merge, freq, (i < merge_count - 1) ? "," : "");
-        
-    //     // Free escaped merge
-    //     free(escaped_merge);
-    // }
-    
-    // Close JSON objects
-    fprintf(vocab_file, "}\n");
-    fprintf(freq_file, "}\n");
-    
-    // Close files
-    fclose(vocab_file);
-    fclose(freq_file);
-    
-    printf("Vocabulary saved to %s\n", vocab_filename);
-    printf("Frequencies saved to %s\n", freq_filename);
-    
-    return 0;
+    return strings;
+}
+
+// Record each merged token in vocab with the frequency of its pair when it was merged
+static inline void add_merged_tokens_to_vocab(HashTable* vocab, const SymbolTable* symbols,
+                                              const BpeMerge* merges, int merge_count) {
+    for (int i = 0; i < merge_count; ++i) {
+        hash_set(vocab, symbols->strings[merges[i].merged], merges[i].count);
+    }
+}
+
+// Save an ID-based training result as text; vocab holds the initial token counts
+// and is updated with the merged tokens (idempotent)
+static inline int save_vocabulary_ids(HashTable* vocab, const SymbolTable* symbols,
+                                      const BpeMerge* merges, int merge_count, const char* filename) {
+    add_merged_tokens_to_vocab(vocab, symbols, merges, merge_count);
+    char** strings = merges_to_strings(symbols, merges, merge_count);
+    if (!strings) return -1;
+    int ret = save_vocabulary(vocab, strings, merge_count, filename);
+    free_merge_strings(strings, merge_count);
+    return ret;
 }
 
 // Load vocabulary and merges from a file
@@ -393,19 +409,9 @@ static inline HashTable* load_vocabulary(const char* filename, char*** merges_ou
 
     // Read the vocabulary entries
     char token[256];
-    int count;
-    while (fscanf(file, "%255s\t%d\n", token, &count) == 2) {
-        Ht_item* item = hash_search(vocab, token);
-        if (item) {
-            item->count = count;
-        } else {
-            unsigned int slot = hash(token, vocab->size);
-            Ht_item* new_item = malloc(sizeof(Ht_item));
-            new_item->key = strdup(token);
-            new_item->count = count;
-            new_item->next = vocab->items[slot];
-            vocab->items[slot] = new_item;
-        }
+    long long count;
+    while (fscanf(file, "%255s\t%lld\n", token, &count) == 2) {
+        hash_set(vocab, token, count);
     }
 
     fclose(file);
@@ -545,12 +551,7 @@ static inline HashTable* load_vocabulary_json(const char* json_filename, char***
                     merges[merge_count++] = strdup(value);
                 } else {
                     // Add to vocabulary with placeholder count
-                    unsigned int slot = hash(key, vocab->size);
-                    Ht_item* new_item = malloc(sizeof(Ht_item));
-                    new_item->key = strdup(key);
-                    new_item->count = 1; // Placeholder count
-                    new_item->next = vocab->items[slot];
-                    vocab->items[slot] = new_item;
+                    hash_set(vocab, key, 1); // Placeholder count
                 }
                 
                 free(value);
@@ -565,12 +566,7 @@ static inline HashTable* load_vocabulary_json(const char* json_filename, char***
                 while (*ptr && (isdigit(*ptr) || *ptr == '-' || *ptr == '.')) ptr++;
                 
                 // Add to vocabulary with index as count
-                unsigned int slot = hash(key, vocab->size);
-                Ht_item* new_item = malloc(sizeof(Ht_item));
-                new_item->key = strdup(key);
-                new_item->count = value;
-                new_item->next = vocab->items[slot];
-                vocab->items[slot] = new_item;
+                hash_set(vocab, key, value);
                 
                 free(key);
             } else {
@@ -659,7 +655,7 @@ static inline HashTable* load_vocabulary_json(const char* json_filename, char***
                     
                     // Parse number
                     if (isdigit(*ptr) || *ptr == '-') {
-                        int count = atoi(ptr);
+                        int64_t count = strtoll(ptr, NULL, 10);
                         
                         // Update count in vocabulary
                         Ht_item* item = hash_search(vocab, key);
@@ -0,0 +1,280 @@
+#ifndef CVOCGEN_LEXER_H
+#define CVOCGEN_LEXER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// Hand-written single-pass scanners for SMILES and SELFIES.
+//
+// They produce exactly the tokens the POSIX patterns in pre_tokenize_regex produce:
+//   SMILES:  (\[[^]]+\]|Br?|Cl?|N|O|S|P|F|I|b|c|n|o|s|p|\(|\)|\.|=|#|-|\+|\\|/|:|~|@|\?|>|\*|\$|%[0-9]{2}|[0-9])
+//   SELFIES: (\[[^]]+\]|\.)
+// Like regexec, bytes that do not start a token are skipped.
+
+// Byte classes
+enum {
+    LEX_SKIP = 0,     // Not the start of a token
+    LEX_SINGLE,       // One-character token
+    LEX_BRACKET,      // '[' of a bracket atom
+    LEX_B,            // 'B' or "Br"
+    LEX_C,            // 'C' or "Cl"
+    LEX_PERCENT       // "%nn" ring bond
+};
+
+static const unsigned char lex_smiles_class[256] = {
+    ['['] = LEX_BRACKET,
+    ['B'] = LEX_B, ['C'] = LEX_C, ['%'] = LEX_PERCENT,
+    ['N'] = LEX_SINGLE, ['O'] = LEX_SINGLE, ['S'] = LEX_SINGLE, ['P'] = LEX_SINGLE,
+    ['F'] = LEX_SINGLE, ['I'] = LEX_SINGLE,
+    ['b'] = LEX_SINGLE, ['c'] = LEX_SINGLE, ['n'] = LEX_SINGLE, ['o'] = LEX_SINGLE,
+    ['s'] = LEX_SINGLE, ['p'] = LEX_SINGLE,
+    ['('] = LEX_SINGLE, [')'] = LEX_SINGLE, ['.'] = LEX_SINGLE, ['='] = LEX_SINGLE,
+    ['#'] = LEX_SINGLE, ['-'] = LEX_SINGLE, ['+'] = LEX_SINGLE, ['\\'] = LEX_SINGLE,
+    ['/'] = LEX_SINGLE, [':'] = LEX_SINGLE, ['~'] = LEX_SINGLE, ['@'] = LEX_SINGLE,
+    ['?'] = LEX_SINGLE, ['>'] = LEX_SINGLE, ['*'] = LEX_SINGLE, ['$'] = LEX_SINGLE,
+    ['0'] = LEX_SINGLE, ['1'] = LEX_SINGLE, ['2'] = LEX_SINGLE, ['3'] = LEX_SINGLE,
+    ['4'] = LEX_SINGLE, ['5'] = LEX_SINGLE, ['6'] = LEX_SINGLE, ['7'] = LEX_SINGLE,
+    ['8'] = LEX_SINGLE, ['9'] = LEX_SINGLE,
+};
+
+static const unsigned char lex_selfies_class[256] = {
+    ['['] = LEX_BRACKET,
+    ['.'] = LEX_SINGLE,
+};
+
+static inline int lex_is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// Length of the bracket atom starting at p (*p == '['), or 0 if there is none.
+// The atom ends at the first ']' and must hold at least one character.
+static inline size_t lex_bracket_len(const char* p, const char* end) {
+    const char* close = memchr(p + 1, ']', end - (p + 1));
+    if (!close || close == p + 1) {
+        return 0;
+    }
+    return close - p + 1;
+}
+
+// Find the next token in [p, end) using the given class table.
+// Stores its start in *start and returns its length, or 0 when no token is left.
+static inline size_t lex_next(const unsigned char* classes, const char* p, const char* end,
+                              const char** start) {
+    for (; p < end; ++p) {
+        size_t len = 0;
+        switch (classes[(unsigned char)*p]) {
+            case LEX_SKIP:
+                continue;
+            case LEX_SINGLE:
+                len = 1;
+                break;
+            case LEX_BRACKET:
+                len = lex_bracket_len(p, end);
+                break;
+            case LEX_B:
+                len = (p + 1 < end && p[1] == 'r') ? 2 : 1;
+                break;
+            case LEX_C:
+                len = (p + 1 < end && p[1] == 'l') ? 2 : 1;
+                break;
+            case LEX_PERCENT:
+                len = (p + 2 < end && lex_is_digit(p[1]) && lex_is_digit(p[2])) ? 3 : 0;
+                break;
+        }
+        if (len) {
+            *start = p;
+            return len;
+        }
+    }
+    return 0;
+}
+
+static inline size_t lex_smiles_next(const char* p, const char* end, const char** start) {
+    return lex_next(lex_smiles_class, p, end, start);
+}
+
+// SELFIES scanning by bitmask. A scan of one token at a time is bound by the
+// latency from one token's end to the search for the next. Instead, the
+// positions of '[', ']' and '.' are found 64 bytes at a time with SIMD compares
+// (SSE2 on x86-64 and NEON on AArch64, which every such CPU has, or a plain
+// loop elsewhere). In the usual block, where brackets simply alternate, the
+// k-th '[' pairs with the k-th ']' and the tokens are popped off the two masks
+// independently. Any other block is walked bracket by bracket.
+#define LEX_BLOCK 64
+
+// Bit i of each mask is set if byte i of the LEX_BLOCK bytes at p is '[', ']' or '.'
+static inline void lex_block_masks(const char* p, uint64_t* open, uint64_t* close, uint64_t* dot) {
+    uint64_t o = 0, c = 0, d = 0;
+#if defined(__SSE2__)
+    const __m128i open_byte = _mm_set1_epi8('['), close_byte = _mm_set1_epi8(']'), dot_byte = _mm_set1_epi8('.');
+    for (int i = 0; i < LEX_BLOCK; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        o |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, open_byte)) << i;
+        c |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, close_byte)) << i;
+        d |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, dot_byte)) << i;
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    // One bit per byte: keep bit (i % 8) of each hit, then add up each half
+    static const uint8_t bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    const uint8x16_t bit = vld1q_u8(bits);
+    for (int i = 0; i < LEX_BLOCK; i += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t*)p + i);
+        uint8x16_t ho = vandq_u8(vceqq_u8(v, vdupq_n_u8('[')), bit);
+        uint8x16_t hc = vandq_u8(vceqq_u8(v, vdupq_n_u8(']')), bit);
+        uint8x16_t hd = vandq_u8(vceqq_u8(v, vdupq_n_u8('.')), bit);
+        o |= (uint64_t)(vaddv_u8(vget_low_u8(ho)) | vaddv_u8(vget_high_u8(ho)) << 8) << i;
+        c |= (uint64_t)(vaddv_u8(vget_low_u8(hc)) | vaddv_u8(vget_high_u8(hc)) << 8) << i;
+        d |= (uint64_t)(vaddv_u8(vget_low_u8(hd)) | vaddv_u8(vget_high_u8(hd)) << 8) << i;
+    }
+#else
+    for (int i = 0; i < LEX_BLOCK; ++i) {
+        o |= (uint64_t)(p[i] == '[') << i;
+        c |= (uint64_t)(p[i] == ']') << i;
+        d |= (uint64_t)(p[i] == '.') << i;
+    }
+#endif
+    *open = o;
+    *close = c;
+    *dot = d;
+}
+
+// Token iterator over [p, end). Each format has its own next function,
+// lex_smiles_scanner_next and lex_selfies_scanner_next: SMILES go through
+// lex_next, SELFIES are read through the block masks.
+typedef struct {
+    const char* p;           // Where the next token is looked for
+    const char* end;
+    const char* base;        // First byte covered by the masks
+    uint64_t open, close, dot;
+    uint64_t pair_open;      // Bracket atoms of the block still to return, when the
+    uint64_t pair_close;     // block's brackets alternate
+} LexScanner;
+
+static inline void lex_scanner_init(LexScanner* scan, const char* p, const char* end) {
+    scan->p = p;
+    scan->end = end;
+    scan->base = NULL;
+    scan->pair_open = 0;
+    scan->pair_close = 0;
+}
+
+// Bit i = parity of the set bits 0 .. i of x
+static inline uint64_t lex_prefix_xor(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+// Compute the masks for the block starting at base; bytes past the end stay clear
+static inline void lex_scanner_load(LexScanner* scan, const char* base) {
+    scan->base = base;
+    if (scan->end - base >= LEX_BLOCK) {
+        lex_block_masks(base, &scan->open, &scan->close, &scan->dot);
+    } else {
+        char tail[LEX_BLOCK] = { 0 };
+        memcpy(tail, base, scan->end - base);
+        lex_block_masks(tail, &scan->open, &scan->close, &scan->dot);
+    }
+
+    // Scanning starts outside any bracket. If every '[' opens one, every ']'
+    // closes one, none is empty and no '.' stands outside them, the atoms are
+    // the (k-th '[', k-th ']') pairs. A last '[' closing in a later block is
+    // left to the walk.
+    uint64_t inside = lex_prefix_xor(scan->open | scan->close);
+    if ((scan->open & ~inside) == 0 && (scan->close & inside) == 0 &&
+        ((scan->open << 1) & scan->close) == 0 && (scan->dot & ~inside) == 0 && scan->close) {
+        unsigned last = 63 - __builtin_clzll(scan->close);
+        scan->pair_close = scan->close;
+        scan->pair_open = scan->open & (last < 63 ? (2ull << last) - 1 : ~0ull);
+    }
+}
+
+// Walk the current block from scan->p to the next SELFIES token, loading
+// blocks as needed; the slow path of lex_selfies_scanner_next
+static size_t lex_scanner_walk(LexScanner* scan, const char** start) {
+    while (scan->p < scan->end) {
+        if (scan->pair_open) {
+            unsigned s = __builtin_ctzll(scan->pair_open);
+            unsigned e = __builtin_ctzll(scan->pair_close);
+            scan->pair_open &= scan->pair_open - 1;
+            scan->pair_close &= scan->pair_close - 1;
+            *start = scan->base + s;
+            scan->p = scan->base + e + 1;
+            return e - s + 1;
+        }
+        if (!scan->base || scan->p - scan->base >= LEX_BLOCK) {
+            lex_scanner_load(scan, scan->p);
+            continue;
+        }
+        unsigned offset = scan->p - scan->base;
+        uint64_t candidates = (scan->open | scan->dot) & (~0ull << offset);
+        if (!candidates) {
+            scan->p = scan->base + LEX_BLOCK;
+            continue;
+        }
+        unsigned s = __builtin_ctzll(candidates);
+        const char* token = scan->base + s;
+        if (scan->dot >> s & 1) {
+            scan->p = token + 1;
+            *start = token;
+            return 1;
+        }
+        // A bracket atom ends at the first ']' after its '['
+        uint64_t closes = s < LEX_BLOCK - 1 ? scan->close & (~0ull << (s + 1)) : 0;
+        size_t len;
+        if (closes) {
+            unsigned e = __builtin_ctzll(closes);
+            len = e == s + 1 ? 0 : e - s + 1;
+        } else {
+            len = lex_bracket_len(token, scan->end);   // It closes in a later block, if at all
+        }
+        if (len) {
+            scan->p = token + len;
+            *start = token;
+            return len;
+        }
+        scan->p = token + 1;
+    }
+    return 0;
+}
+
+// Store the start of the next SMILES token in *start and return its length, or 0 at the end
+static inline size_t lex_smiles_scanner_next(LexScanner* scan, const char** start) {
+    size_t len = lex_next(lex_smiles_class, scan->p, scan->end, start);
+    if (len) scan->p = *start + len;
+    return len;
+}
+
+// Store the start of the next SELFIES token in *start and return its length, or 0 at the end.
+// Kept small so that it inlines: popping a paired bracket atom is the common case.
+static inline size_t lex_selfies_scanner_next(LexScanner* scan, const char** start) {
+    if (scan->pair_open) {
+        unsigned s = __builtin_ctzll(scan->pair_open);
+        unsigned e = __builtin_ctzll(scan->pair_close);
+        scan->pair_open &= scan->pair_open - 1;
+        scan->pair_close &= scan->pair_close - 1;
+        *start = scan->base + s;
+        scan->p = scan->base + e + 1;
+        return e - s + 1;
+    }
+    return lex_scanner_walk(scan, start);
+}
+
+static inline size_t lex_selfies_next(const char* p, const char* end, const char** start) {
+    LexScanner scan;
+    lex_scanner_init(&scan, p, end);
+    return lex_selfies_scanner_next(&scan, start);
+}
+
+#endif /* CVOCGEN_LEXER_H */
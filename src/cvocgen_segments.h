@@ -0,0 +1,217 @@
+#ifndef CVOCGEN_SEGMENTS_H
+#define CVOCGEN_SEGMENTS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "cvocgen.h"
+
+// On-disk storage for ID-encoded molecules in bounded-memory training.
+//
+// Molecules are appended in segments to one unlinked spill file. Every segment
+// starts on a page boundary and is a sequence of records
+//     [weight (2 words, low first)][capacity][count][ids[0] .. ids[capacity-1]]   (all uint32_t)
+// Merges rewrite records in place through a shared mapping of one segment at a
+// time: count shrinks while capacity (the record's stride) stays fixed, so only
+// the pages of molecules that actually change are dirtied.
+//
+// Each segment also keeps a bitset of the symbols it contains, which lets a merge
+// skip segments that cannot hold its pair.
+typedef struct {
+    off_t offset;            // Start of the segment in the spill file
+    size_t size;             // Bytes of records
+    uint64_t* symbols;       // Bitset of symbol IDs present
+    uint32_t symbol_words;   // Allocated 64-bit words in symbols
+} Segment;
+
+typedef struct {
+    int fd;                  // Spill file (already unlinked)
+    off_t file_size;
+    Segment* segments;
+    int count;
+    int capacity;
+    int records;             // Records in all segments
+    uint32_t* buffer;        // Write buffer for segment_store_append
+    size_t buffer_len;       // uint32_t values in buffer
+    size_t buffer_cap;
+} SegmentStore;
+
+#define SEGMENT_WRITE_BUFFER (256 * 1024)  // uint32_t values
+
+// Fields of a record: weight, then capacity at rec[2], count at rec[3] and the IDs
+#define SEGMENT_RECORD_HEAD 4
+
+static inline int64_t segment_record_weight(const uint32_t* rec) {
+    return (int64_t)((uint64_t)rec[0] | (uint64_t)rec[1] << 32);
+}
+
+static inline int segment_has_symbol(const Segment* seg, uint32_t id) {
+    return id / 64 < seg->symbol_words && (seg->symbols[id / 64] >> (id % 64)) & 1;
+}
+
+// Mark a symbol as present. Returns 0, or -1 when out of memory.
+static inline int segment_add_symbol(Segment* seg, uint32_t id) {
+    if (id / 64 >= seg->symbol_words) {
+        uint32_t words = seg->symbol_words ? seg->symbol_words : 1;
+        while (words <= id / 64) words *= 2;
+        uint64_t* symbols = realloc(seg->symbols, sizeof(uint64_t) * words);
+        if (!symbols) {
+            return -1;
+        }
+        memset(symbols + seg->symbol_words, 0, sizeof(uint64_t) * (words - seg->symbol_words));
+        seg->symbols = symbols;
+        seg->symbol_words = words;
+    }
+    seg->symbols[id / 64] |= (uint64_t)1 << (id % 64);
+    return 0;
+}
+
+// Create the spill file in dir. Returns 0 on success, -1 on error.
+static inline int segment_store_open(SegmentStore* store, const char* dir) {
+    memset(store, 0, sizeof(*store));
+
+    char path[PATH_MAX];
+    int len = snprintf(path, sizeof(path), "%s/cvocgen-spill-XXXXXX", dir);
+    if (len < 0 || (size_t)len >= sizeof(path)) {
+        return -1;
+    }
+    store->fd = mkstemp(path);
+    if (store->fd < 0) {
+        return -1;
+    }
+    // The file disappears with the process, even on a crash
+    unlink(path);
+
+    store->buffer_cap = SEGMENT_WRITE_BUFFER;
+    store->buffer = malloc(sizeof(uint32_t) * store->buffer_cap);
+    if (!store->buffer) {
+        close(store->fd);
+        return -1;
+    }
+    return 0;
+}
+
+static inline int segment_store_flush(SegmentStore* store) {
+    const char* p = (const char*)store->buffer;
+    size_t remaining = store->buffer_len * sizeof(uint32_t);
+    while (remaining > 0) {
+        ssize_t written = pwrite(store->fd, p, remaining, store->file_size);
+        if (written < 0) {
+            return -1;
+        }
+        p += written;
+        remaining -= (size_t)written;
+        store->file_size += written;
+    }
+    store->buffer_len = 0;
+    return 0;
+}
+
+// Write molecules as a new segment. Molecules with fewer than two tokens hold
+// no pairs and are not stored. Returns 0 on success, -1 on a write error or
+// when out of memory.
+static inline int segment_store_append(SegmentStore* store, const IdList* molecules, int molecule_count) {
+    if (store->count >= store->capacity) {
+        int capacity = store->capacity ? store->capacity * 2 : 16;
+        Segment* segments = realloc(store->segments, sizeof(Segment) * capacity);
+        if (!segments) {
+            return -1;
+        }
+        store->segments = segments;
+        store->capacity = capacity;
+    }
+    Segment* seg = &store->segments[store->count];
+    memset(seg, 0, sizeof(*seg));
+
+    // Segments start on a page boundary so they can be mapped individually
+    long page = sysconf(_SC_PAGESIZE);
+    off_t aligned = (store->file_size + page - 1) / page * page;
+    if (aligned > store->file_size && ftruncate(store->fd, aligned) != 0) {
+        return -1;
+    }
+    store->file_size = aligned;
+    seg->offset = aligned;
+
+    int failed = 0;
+    for (int i = 0; !failed && i < molecule_count; ++i) {
+        const IdList* mol = &molecules[i];
+        if (mol->count < 2) {
+            continue;
+        }
+        if (store->buffer_len + SEGMENT_RECORD_HEAD + mol->count > store->buffer_cap) {
+            if (segment_store_flush(store) != 0) {
+                failed = 1;
+                break;
+            }
+            if (SEGMENT_RECORD_HEAD + mol->count > store->buffer_cap) {
+                uint32_t* buffer = realloc(store->buffer, sizeof(uint32_t) * (SEGMENT_RECORD_HEAD + mol->count));
+                if (!buffer) {
+                    failed = 1;
+                    break;
+                }
+                store->buffer = buffer;
+                store->buffer_cap = SEGMENT_RECORD_HEAD + mol->count;
+            }
+        }
+        uint32_t* rec = store->buffer + store->buffer_len;
+        rec[0] = (uint32_t)mol->weight;
+        rec[1] = (uint32_t)((uint64_t)mol->weight >> 32);
+        rec[2] = (uint32_t)mol->count;
+        rec[3] = (uint32_t)mol->count;
+        memcpy(rec + SEGMENT_RECORD_HEAD, mol->ids, sizeof(uint32_t) * mol->count);
+        store->buffer_len += SEGMENT_RECORD_HEAD + mol->count;
+        store->records++;
+        for (size_t k = 0; !failed && k < mol->count; ++k) {
+            failed = segment_add_symbol(seg, mol->ids[k]) != 0;
+        }
+    }
+    if (failed || segment_store_flush(store) != 0) {
+        free(seg->symbols);
+        seg->symbols = NULL;
+        return -1;
+    }
+
+    seg->size = (size_t)(store->file_size - seg->offset);
+    store->count++;
+    return 0;
+}
+
+// Map a segment for reading and in-place rewriting. Returns NULL with errno set
+// on error, and for a segment with no records (size 0), which callers skip.
+static inline uint32_t* segment_map(const SegmentStore* store, const Segment* seg) {
+    if (seg->size == 0) {
+        return NULL;
+    }
+    void* map = mmap(NULL, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED, store->fd, seg->offset);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    madvise(map, seg->size, MADV_SEQUENTIAL);
+    return map;
+}
+
+static inline void segment_unmap(const Segment* seg, uint32_t* records) {
+    if (records) {
+        munmap(records, seg->size);
+    }
+}
+
+static inline void segment_store_close(SegmentStore* store) {
+    for (int i = 0; i < store->count; ++i) {
+        free(store->segments[i].symbols);
+    }
+    free(store->segments);
+    free(store->buffer);
+    if (store->fd >= 0) {
+        close(store->fd);
+    }
+    memset(store, 0, sizeof(*store));
+    store->fd = -1;
+}
+
+#endif /* CVOCGEN_SEGMENTS_H */
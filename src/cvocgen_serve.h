@@ -0,0 +1,324 @@
+#ifndef CVOCGEN_SERVE_H
+#define CVOCGEN_SERVE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "cvocgen.h"
+
+// Encode server (cvocgen serve): batches of molecules in, token IDs out, over
+// stdin/stdout or the connections of a Unix socket.
+//
+// Messages. Integers are in native byte order (clients run on the same host):
+//   request    ServeRequest, uint32 lengths[count], then the molecules' bytes back to back
+//   response   ServeResponse, uint32 id_counts[count], then every molecule's token IDs
+//              back to back
+// A client may send any number of requests on one stream and gets the responses
+// in the same order. A request that breaks the limits gets status SERVE_BAD_REQUEST,
+// one the server has no memory for gets SERVE_SERVER_ERROR, and the stream is closed.
+#define SERVE_MAGIC 0x45535643u          // "CVSE" read in native order
+#define SERVE_FLAG_SPECIAL_TOKENS 1u     // Wrap every molecule in <s> ... </s>
+#define SERVE_OK 0
+#define SERVE_BAD_REQUEST 1
+#define SERVE_SERVER_ERROR 2
+#define SERVE_MAX_MOLECULES (1u << 20)   // Per request
+#define SERVE_MAX_TEXT (1u << 30)        // Bytes per request
+
+typedef struct {
+    uint32_t magic;
+    uint32_t count;              // Molecules
+    uint32_t flags;              // SERVE_FLAG_*
+    uint32_t text_size;          // Sum of the lengths
+} ServeRequest;
+
+typedef struct {
+    uint32_t status;             // SERVE_OK, SERVE_BAD_REQUEST or SERVE_SERVER_ERROR
+    uint32_t count;              // Molecules
+    uint64_t id_count;           // Sum of the ID counts
+} ServeResponse;
+
+// One client stream, buffered in both directions
+typedef struct {
+    FILE* in;
+    FILE* out;
+} ServePeer;
+
+static inline int serve_peer_open(ServePeer* peer, int fd) {
+    int out_fd = dup(fd);
+    peer->in = fdopen(fd, "rb");
+    peer->out = out_fd >= 0 ? fdopen(out_fd, "wb") : NULL;
+    if (!peer->in || !peer->out) {
+        if (peer->in) fclose(peer->in); else close(fd);
+        if (peer->out) fclose(peer->out); else if (out_fd >= 0) close(out_fd);
+        peer->in = peer->out = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static inline void serve_peer_close(ServePeer* peer) {
+    if (peer->out) fclose(peer->out);
+    if (peer->in) fclose(peer->in);
+    peer->in = peer->out = NULL;
+}
+
+// Listen on a Unix socket at path, replacing a socket left there by an earlier
+// server. Returns the listening descriptor, or -1 with errno set.
+static inline int serve_listen(const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    // A client that goes away mid-response must not end the server
+    signal(SIGPIPE, SIG_IGN);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    return fd;
+}
+
+static inline int serve_read(ServePeer* peer, void* data, size_t size) {
+    return fread(data, 1, size, peer->in) == size ? 0 : -1;
+}
+
+static inline int serve_write(ServePeer* peer, const void* data, size_t size) {
+    return fwrite(data, 1, size, peer->out) == size ? 0 : -1;
+}
+
+// Least recently used cache of encoded molecules, shared by the server's threads.
+// It is split into shards by hash, each with its own lock, entries and
+// open-addressing index. An entry holds a molecule's IDs without special tokens,
+// followed by its text, in one allocation.
+#define ENCODE_CACHE_SHARDS 16
+#define ENCODE_CACHE_NONE UINT32_MAX
+
+typedef struct {
+    uint64_t hash;
+    uint32_t prev, next;         // LRU list, most recently used first
+    uint32_t text_len;
+    uint32_t id_count;
+    uint32_t* data;              // id_count IDs, then text_len bytes of text
+} EncodeCacheEntry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    EncodeCacheEntry* entries;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t head, tail;         // Most and least recently used entry
+    uint32_t* slots;             // Linear probing index: entry index + 1, 0 = empty
+    uint32_t slot_mask;
+    uint64_t hits, misses;
+} EncodeCacheShard;
+
+typedef struct {
+    EncodeCacheShard shards[ENCODE_CACHE_SHARDS];
+} EncodeCache;
+
+static inline void encode_cache_free(EncodeCache* cache);
+
+// Create a cache of about capacity molecules. Returns NULL for capacity 0, and
+// also when out of memory, which callers asking for a cache must check.
+static inline EncodeCache* encode_cache_create(uint32_t capacity) {
+    if (capacity == 0) return NULL;
+    EncodeCache* cache = calloc(1, sizeof(EncodeCache));
+    if (!cache) return NULL;
+    uint32_t per_shard = (capacity + ENCODE_CACHE_SHARDS - 1) / ENCODE_CACHE_SHARDS;
+    uint32_t slots = 16;
+    while (slots < per_shard * 2) slots *= 2;
+    int failed = 0;
+    for (int s = 0; s < ENCODE_CACHE_SHARDS; ++s) {
+        EncodeCacheShard* shard = &cache->shards[s];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->entries = calloc(per_shard, sizeof(EncodeCacheEntry));
+        shard->capacity = per_shard;
+        shard->slots = calloc(slots, sizeof(uint32_t));
+        shard->slot_mask = slots - 1;
+        shard->head = shard->tail = ENCODE_CACHE_NONE;
+        failed |= !shard->entries || !shard->slots;
+    }
+    if (failed) {
+        encode_cache_free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+static inline void encode_cache_free(EncodeCache* cache) {
+    if (!cache) return;
+    for (int s = 0; s < ENCODE_CACHE_SHARDS; ++s) {
+        EncodeCacheShard* shard = &cache->shards[s];
+        for (uint32_t i = 0; i < shard->count; ++i) {
+            free(shard->entries[i].data);
+        }
+        free(shard->entries);
+        free(shard->slots);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(cache);
+}
+
+static inline EncodeCacheShard* encode_cache_shard(EncodeCache* cache, uint64_t hash) {
+    return &cache->shards[(hash >> 59) & (ENCODE_CACHE_SHARDS - 1)];
+}
+
+// Slot of the entry for a molecule, or the empty slot where it would go
+static inline uint32_t encode_cache_find(const EncodeCacheShard* shard, uint64_t hash,
+                                         const char* text, size_t len) {
+    uint32_t i = (uint32_t)hash & shard->slot_mask;
+    for (;;) {
+        uint32_t e = shard->slots[i];
+        if (e == 0) return i;
+        const EncodeCacheEntry* entry = &shard->entries[e - 1];
+        if (entry->hash == hash && entry->text_len == len &&
+            memcmp(entry->data + entry->id_count, text, len) == 0) {
+            return i;
+        }
+        i = (i + 1) & shard->slot_mask;
+    }
+}
+
+// Empty slot i, moving later entries of its probe run back (no tombstones)
+static inline void encode_cache_remove_slot(EncodeCacheShard* shard, uint32_t i) {
+    uint32_t j = i;
+    for (;;) {
+        j = (j + 1) & shard->slot_mask;
+        uint32_t e = shard->slots[j];
+        if (e == 0) break;
+        uint32_t home = (uint32_t)shard->entries[e - 1].hash & shard->slot_mask;
+        // The entry may move to i unless its home lies cyclically in (i, j]
+        int stays = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+        if (!stays) {
+            shard->slots[i] = e;
+            i = j;
+        }
+    }
+    shard->slots[i] = 0;
+}
+
+static inline void encode_cache_unlink(EncodeCacheShard* shard, uint32_t index) {
+    EncodeCacheEntry* entry = &shard->entries[index];
+    if (entry->prev != ENCODE_CACHE_NONE) shard->entries[entry->prev].next = entry->next;
+    else shard->head = entry->next;
+    if (entry->next != ENCODE_CACHE_NONE) shard->entries[entry->next].prev = entry->prev;
+    else shard->tail = entry->prev;
+}
+
+static inline void encode_cache_push_front(EncodeCacheShard* shard, uint32_t index) {
+    EncodeCacheEntry* entry = &shard->entries[index];
+    entry->prev = ENCODE_CACHE_NONE;
+    entry->next = shard->head;
+    if (shard->head != ENCODE_CACHE_NONE) shard->entries[shard->head].prev = index;
+    shard->head = index;
+    if (shard->tail == ENCODE_CACHE_NONE) shard->tail = index;
+}
+
+// Append the cached IDs of a molecule to buf. Returns the number of IDs, or -1
+// if the molecule is not cached.
+static inline long encode_cache_get(EncodeCache* cache, uint64_t hash, const char* text, size_t len,
+                                    EncodeBuffer* buf) {
+    EncodeCacheShard* shard = encode_cache_shard(cache, hash);
+    pthread_mutex_lock(&shard->lock);
+    uint32_t e = shard->slots[encode_cache_find(shard, hash, text, len)];
+    if (e == 0) {
+        shard->misses++;
+        pthread_mutex_unlock(&shard->lock);
+        return -1;
+    }
+    shard->hits++;
+    uint32_t index = e - 1;
+    if (shard->head != index) {
+        encode_cache_unlink(shard, index);
+        encode_cache_push_front(shard, index);
+    }
+    const EncodeCacheEntry* entry = &shard->entries[index];
+    if (buf->count + entry->id_count > buf->capacity) {
+        while (buf->count + entry->id_count > buf->capacity) {
+            buf->capacity = buf->capacity ? buf->capacity * 2 : 1024;
+        }
+        buf->ids = realloc(buf->ids, sizeof(uint32_t) * buf->capacity);
+    }
+    memcpy(buf->ids + buf->count, entry->data, sizeof(uint32_t) * entry->id_count);
+    buf->count += entry->id_count;
+    long count = entry->id_count;
+    pthread_mutex_unlock(&shard->lock);
+    return count;
+}
+
+// Store the IDs of a molecule, evicting the least recently used one if the shard is full
+static inline void encode_cache_put(EncodeCache* cache, uint64_t hash, const char* text, size_t len,
+                                    const uint32_t* ids, size_t id_count) {
+    uint32_t* data = malloc(sizeof(uint32_t) * id_count + len);
+    if (!data) return;
+    memcpy(data, ids, sizeof(uint32_t) * id_count);
+    memcpy(data + id_count, text, len);
+
+    EncodeCacheShard* shard = encode_cache_shard(cache, hash);
+    pthread_mutex_lock(&shard->lock);
+    uint32_t slot = encode_cache_find(shard, hash, text, len);
+    if (shard->slots[slot] != 0 || shard->capacity == 0) {
+        // Another thread stored it first
+        pthread_mutex_unlock(&shard->lock);
+        free(data);
+        return;
+    }
+    uint32_t index;
+    if (shard->count < shard->capacity) {
+        index = shard->count++;
+    } else {
+        index = shard->tail;
+        EncodeCacheEntry* old = &shard->entries[index];
+        encode_cache_unlink(shard, index);
+        encode_cache_remove_slot(shard, encode_cache_find(shard, old->hash,
+                                                          (const char*)(old->data + old->id_count),
+                                                          old->text_len));
+        free(old->data);
+        slot = encode_cache_find(shard, hash, text, len);
+    }
+    EncodeCacheEntry* entry = &shard->entries[index];
+    entry->hash = hash;
+    entry->text_len = (uint32_t)len;
+    entry->id_count = (uint32_t)id_count;
+    entry->data = data;
+    shard->slots[slot] = index + 1;
+    encode_cache_push_front(shard, index);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Lookups that found and did not find their molecule, over all shards
+static inline void encode_cache_stats(EncodeCache* cache, uint64_t* hits, uint64_t* misses) {
+    *hits = *misses = 0;
+    for (int s = 0; cache && s < ENCODE_CACHE_SHARDS; ++s) {
+        EncodeCacheShard* shard = &cache->shards[s];
+        pthread_mutex_lock(&shard->lock);
+        *hits += shard->hits;
+        *misses += shard->misses;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+#endif /* CVOCGEN_SERVE_H */
@@ -0,0 +1,192 @@
+#ifndef CVOCGEN_STATS_H
+#define CVOCGEN_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "cvocgen.h"
+
+// Phase timings and table statistics of a training run, written as JSON by
+// --stats-json. Times come from CLOCK_MONOTONIC. Every function takes a
+// TrainStats pointer that may be NULL, in which case nothing is measured.
+#define STATS_READ 0          // Reading and tokenizing the corpus, or loading a checkpoint
+#define STATS_DEDUP 1         // Collapsing repeated molecules
+#define STATS_PAIR_COUNT 2    // Counting pairs, building the occurrence index and heap
+#define STATS_BEST_PAIR 3     // Best-pair search, over all merges
+#define STATS_APPLY 4         // Applying merges and updating the pair counts
+#define STATS_INDEX 5         // Indexing the pairs around merged tokens
+#define STATS_CHECKPOINT 6    // Writing checkpoints and copying snapshots
+#define STATS_SAVE 7          // Writing the vocabulary files
+#define STATS_PHASE_COUNT 8
+
+static const char* const stats_phase_names[STATS_PHASE_COUNT] = {
+    "read", "dedup", "pair_count", "best_pair", "apply", "index", "checkpoint", "save"
+};
+
+// Merge latency histogram: bucket b counts merges that took less than 2^b
+// microseconds (and at least 2^(b-1)); the last bucket also takes anything longer
+#define STATS_LATENCY_BUCKETS 32
+
+// Size and load of one hash table
+typedef struct {
+    uint64_t count;
+    uint64_t slots;
+    uint32_t resizes;
+} TableStats;
+
+typedef struct TrainStats {
+    double start;
+    double phases[STATS_PHASE_COUNT];   // Seconds per STATS_* phase
+    uint64_t latency[STATS_LATENCY_BUCKETS];
+    uint64_t latency_count;
+    double latency_total;
+    double latency_max;
+    int molecules;                      // Molecules read
+    int entries;                        // Molecules trained on, after deduplication
+    int merges;
+    TableStats symbols;                 // Symbol table
+    TableStats vocab;                   // Initial vocabulary
+    TableStats pairs;                   // Pair table at the end of training
+    uint64_t heap_capacity;
+    uint32_t heap_allocations;
+    uint64_t occurrence_entries;        // Molecule entries left in the occurrence index
+    uint64_t occurrence_allocations;
+    uint32_t delta_tables;              // Per-worker pair delta tables
+    uint32_t delta_resizes;
+} TrainStats;
+
+static inline double stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static inline void stats_init(TrainStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->start = stats_now();
+}
+
+// Current time, or 0 if nothing is measured
+static inline double stats_clock(const TrainStats* stats) {
+    return stats ? stats_now() : 0.0;
+}
+
+// Add the time since `since` to a phase; returns the current time
+static inline double stats_phase(TrainStats* stats, int phase, double since) {
+    if (!stats) return 0.0;
+    double now = stats_now();
+    stats->phases[phase] += now - since;
+    return now;
+}
+
+static inline void stats_merge_latency(TrainStats* stats, double seconds) {
+    if (!stats) return;
+    double us = seconds * 1e6;
+    int bucket = 0;
+    while (bucket < STATS_LATENCY_BUCKETS - 1 && us >= (double)(1ull << bucket)) bucket++;
+    stats->latency[bucket]++;
+    stats->latency_count++;
+    stats->latency_total += seconds;
+    if (seconds > stats->latency_max) stats->latency_max = seconds;
+}
+
+static inline void stats_table(TableStats* table, uint64_t count, uint64_t slots, uint32_t resizes) {
+    table->count = count;
+    table->slots = slots;
+    table->resizes = resizes;
+}
+
+// Record the pair state of a merge loop before it is freed (occurrences may be NULL)
+static inline void stats_pair_state(TrainStats* stats, const PairTable* pairs, const PairHeap* heap,
+                                    const PairOccurrences* occurrences) {
+    if (!stats) return;
+    stats_table(&stats->pairs, pairs->count, pairs->slot_mask + 1, pairs->resizes);
+    stats->heap_capacity = heap->capacity;
+    stats->heap_allocations = heap->allocations;
+    if (occurrences) {
+        stats->occurrence_entries = 0;
+        for (uint32_t i = 0; i < occurrences->size; ++i) {
+            stats->occurrence_entries += occurrences->lists[i].count;
+        }
+        stats->occurrence_allocations = occurrences->allocations;
+    }
+}
+
+// Upper bound in microseconds of the bucket holding the q-th quantile of merge latency
+static inline double stats_latency_quantile(const TrainStats* stats, double q) {
+    uint64_t rank = (uint64_t)(q * stats->latency_count);
+    uint64_t seen = 0;
+    for (int b = 0; b < STATS_LATENCY_BUCKETS; ++b) {
+        seen += stats->latency[b];
+        if (seen > rank) return (double)(1ull << b);
+    }
+    return 0.0;
+}
+
+static inline void stats_write_table(FILE* f, const char* name, const TableStats* table, const char* tail) {
+    fprintf(f, "    \"%s\": {\"count\": %llu, \"slots\": %llu, \"load_factor\": %.4f, \"resizes\": %u}%s\n",
+            name, (unsigned long long)table->count, (unsigned long long)table->slots,
+            table->slots ? (double)table->count / table->slots : 0.0, table->resizes, tail);
+}
+
+// Write the report to path. Returns 0 on success, -1 on error.
+static inline int save_train_stats(const TrainStats* stats, const char* path) {
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        return -1;
+    }
+    struct rusage usage;
+    long peak_rss_kb = getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : 0;
+
+    fprintf(f, "{\n");
+    fprintf(f, "  \"total_seconds\": %.6f,\n", stats_now() - stats->start);
+    fprintf(f, "  \"phases\": {\n");
+    for (int p = 0; p < STATS_PHASE_COUNT; ++p) {
+        fprintf(f, "    \"%s\": %.6f%s\n", stats_phase_names[p], stats->phases[p],
+                p + 1 < STATS_PHASE_COUNT ? "," : "");
+    }
+    fprintf(f, "  },\n");
+    fprintf(f, "  \"molecules\": %d,\n", stats->molecules);
+    fprintf(f, "  \"entries\": %d,\n", stats->entries);
+    fprintf(f, "  \"merges\": %d,\n", stats->merges);
+
+    fprintf(f, "  \"merge_latency_us\": {\n");
+    fprintf(f, "    \"count\": %llu,\n", (unsigned long long)stats->latency_count);
+    fprintf(f, "    \"mean\": %.3f,\n",
+            stats->latency_count ? stats->latency_total * 1e6 / stats->latency_count : 0.0);
+    fprintf(f, "    \"max\": %.3f,\n", stats->latency_max * 1e6);
+    fprintf(f, "    \"p50\": %.0f,\n", stats_latency_quantile(stats, 0.50));
+    fprintf(f, "    \"p90\": %.0f,\n", stats_latency_quantile(stats, 0.90));
+    fprintf(f, "    \"p99\": %.0f,\n", stats_latency_quantile(stats, 0.99));
+    // Non-empty buckets as [upper bound in microseconds, merges]
+    fprintf(f, "    \"histogram\": [");
+    int first = 1;
+    for (int b = 0; b < STATS_LATENCY_BUCKETS; ++b) {
+        if (stats->latency[b] == 0) continue;
+        fprintf(f, "%s[%llu, %llu]", first ? "" : ", ", 1ull << b, (unsigned long long)stats->latency[b]);
+        first = 0;
+    }
+    fprintf(f, "]\n");
+    fprintf(f, "  },\n");
+
+    fprintf(f, "  \"peak_rss_kb\": %ld,\n", peak_rss_kb);
+    fprintf(f, "  \"tables\": {\n");
+    stats_write_table(f, "symbols", &stats->symbols, ",");
+    stats_write_table(f, "vocab", &stats->vocab, ",");
+    stats_write_table(f, "pairs", &stats->pairs, "");
+    fprintf(f, "  },\n");
+    fprintf(f, "  \"allocations\": {\n");
+    fprintf(f, "    \"symbol_strings\": %llu,\n", (unsigned long long)stats->symbols.count);
+    fprintf(f, "    \"heap\": %u,\n", stats->heap_allocations);
+    fprintf(f, "    \"occurrence_lists\": %llu,\n", (unsigned long long)stats->occurrence_allocations);
+    fprintf(f, "    \"delta_tables\": %u,\n", stats->delta_tables);
+    fprintf(f, "    \"delta_table_resizes\": %u\n", stats->delta_resizes);
+    fprintf(f, "  },\n");
+    fprintf(f, "  \"heap_capacity\": %llu,\n", (unsigned long long)stats->heap_capacity);
+    fprintf(f, "  \"occurrence_entries\": %llu\n", (unsigned long long)stats->occurrence_entries);
+    fprintf(f, "}\n");
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+#endif /* CVOCGEN_STATS_H */
@@ -0,0 +1,223 @@
+#ifndef CVOCGEN_THREADS_H
+#define CVOCGEN_THREADS_H
+
+#include <stdlib.h>
+#include <pthread.h>
+
+// Fixed-size pool of worker threads that all run the same task.
+// thread_pool_run(pool, fn, arg) calls fn(arg, worker) once for every worker index
+// 0..size-1 (the calling thread runs worker 0) and returns when all have finished.
+typedef void (*ThreadPoolTask)(void* arg, int worker);
+
+typedef struct ThreadPool {
+    int size;                    // Number of workers, including the calling thread
+    pthread_t* threads;          // size - 1 background threads
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    ThreadPoolTask task;
+    void* arg;
+    unsigned long generation;    // Incremented for every submitted task
+    int pending;                 // Background workers still running the current task
+    int stop;
+} ThreadPool;
+
+typedef struct {
+    ThreadPool* pool;
+    int worker;
+} ThreadPoolWorker;
+
+static inline void* thread_pool_main(void* arg) {
+    ThreadPoolWorker self = *(ThreadPoolWorker*)arg;
+    free(arg);
+    ThreadPool* pool = self.pool;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stop && pool->generation == seen) {
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        }
+        if (pool->stop) break;
+        seen = pool->generation;
+        ThreadPoolTask task = pool->task;
+        void* task_arg = pool->arg;
+        pthread_mutex_unlock(&pool->lock);
+
+        task(task_arg, self.worker);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0) {
+            pthread_cond_signal(&pool->work_done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Create a pool of size workers (at least 1; a pool of 1 runs tasks inline)
+static inline ThreadPool* thread_pool_create(int size) {
+    if (size < 1) size = 1;
+
+    ThreadPool* pool = calloc(1, sizeof(ThreadPool));
+    if (!pool) return NULL;
+    pool->size = size;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+    pool->threads = malloc(sizeof(pthread_t) * size);
+    if (!pool->threads) {
+        pool->size = 1;
+    }
+
+    for (int i = 1; i < pool->size; ++i) {
+        ThreadPoolWorker* worker = malloc(sizeof(ThreadPoolWorker));
+        if (worker) {
+            worker->pool = pool;
+            worker->worker = i;
+        }
+        if (!worker || pthread_create(&pool->threads[i], NULL, thread_pool_main, worker) != 0) {
+            // Run with the workers we have
+            free(worker);
+            pool->size = i;
+            break;
+        }
+    }
+    return pool;
+}
+
+// Run task on every worker and wait for all of them
+static inline void thread_pool_run(ThreadPool* pool, ThreadPoolTask task, void* arg) {
+    if (!pool || pool->size == 1) {
+        task(arg, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->arg = arg;
+    pool->pending = pool->size - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    task(arg, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->work_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static inline int thread_pool_size(const ThreadPool* pool) {
+    return pool ? pool->size : 1;
+}
+
+static inline void thread_pool_free(ThreadPool* pool) {
+    if (!pool) return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 1; i < pool->size; ++i) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_cond_destroy(&pool->work_done);
+    free(pool->threads);
+    free(pool);
+}
+
+// Background thread that runs submitted jobs one at a time, in submission order.
+// Used to keep slow work such as file writes off the calling thread.
+typedef void (*JobFunction)(void* arg);
+
+typedef struct Job {
+    JobFunction fn;
+    void* arg;
+    struct Job* next;
+} Job;
+
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    Job* head;                   // Pending jobs, oldest first
+    Job* tail;
+    int started;                 // 0: the thread could not be created, jobs run inline
+    int stop;
+} JobQueue;
+
+static inline void* job_queue_main(void* arg) {
+    JobQueue* queue = arg;
+    pthread_mutex_lock(&queue->lock);
+    for (;;) {
+        while (!queue->head && !queue->stop) {
+            pthread_cond_wait(&queue->ready, &queue->lock);
+        }
+        Job* job = queue->head;
+        if (!job) break;
+        queue->head = job->next;
+        if (!queue->head) queue->tail = NULL;
+        pthread_mutex_unlock(&queue->lock);
+
+        job->fn(job->arg);
+        free(job);
+
+        pthread_mutex_lock(&queue->lock);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+static inline void job_queue_start(JobQueue* queue) {
+    queue->head = queue->tail = NULL;
+    queue->stop = 0;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->ready, NULL);
+    queue->started = pthread_create(&queue->thread, NULL, job_queue_main, queue) == 0;
+}
+
+static inline void job_queue_push(JobQueue* queue, JobFunction fn, void* arg) {
+    Job* job = malloc(sizeof(Job));
+    if (!queue->started || !job) {
+        free(job);
+        fn(arg);
+        return;
+    }
+    job->fn = fn;
+    job->arg = arg;
+    job->next = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail) queue->tail->next = job;
+    else queue->head = job;
+    queue->tail = job;
+    pthread_cond_signal(&queue->ready);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Run the remaining jobs and stop the thread
+static inline void job_queue_finish(JobQueue* queue) {
+    if (queue->started) {
+        pthread_mutex_lock(&queue->lock);
+        queue->stop = 1;
+        pthread_cond_signal(&queue->ready);
+        pthread_mutex_unlock(&queue->lock);
+        pthread_join(queue->thread, NULL);
+    }
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->ready);
+}
+
+// Half-open range [*begin, *end) of the worker's share of count items
+static inline void thread_pool_range(int count, int worker, int workers, int* begin, int* end) {
+    *begin = (int)((long long)count * worker / workers);
+    *end = (int)((long long)count * (worker + 1) / workers);
+}
+
+#endif /* CVOCGEN_THREADS_H */
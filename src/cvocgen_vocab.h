@@ -0,0 +1,424 @@
+#ifndef CVOCGEN_VOCAB_H
+#define CVOCGEN_VOCAB_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cvocgen.h"
+
+// Binary vocabulary format (.bin), loaded with a single mmap and no parsing.
+//
+// All integers are native little-endian. Sections start on 8-byte boundaries,
+// and every offset is from the start of the file:
+//   BinaryVocabHeader
+//   BinaryVocabToken[token_count]     token ID -> string and frequency
+//   uint32_t[token_count]             token IDs sorted by string bytes (lookup index)
+//   BinaryVocabMerge[merge_count]     merges in rank order
+//   uint32_t[merge_count]             merge ranks sorted by (left ID, right ID)
+//   char[strings_size]                string pool of NUL-terminated tokens
+//
+// Token IDs match the JSON vocabulary: the special tokens take IDs 0-4 and the
+// trained tokens follow in vocabulary order.
+#define BINARY_VOCAB_MAGIC "CVOCBIN"
+#define BINARY_VOCAB_VERSION 2
+#define BINARY_VOCAB_FLAG_SMILES 1u
+
+typedef struct {
+    char magic[8];               // "CVOCBIN\0"
+    uint32_t version;
+    uint32_t flags;              // BINARY_VOCAB_FLAG_*
+    uint32_t token_count;
+    uint32_t merge_count;
+    uint64_t tokens_offset;
+    uint64_t token_index_offset;
+    uint64_t merges_offset;
+    uint64_t merge_index_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t file_size;
+} BinaryVocabHeader;
+
+typedef struct {
+    uint32_t offset;             // Into the string pool
+    uint32_t length;             // Bytes, without the NUL
+    int64_t count;               // Frequency
+} BinaryVocabToken;
+
+typedef struct {
+    uint32_t left;               // Token IDs
+    uint32_t right;
+    uint32_t merged;
+    uint32_t reserved;           // 0
+    int64_t count;               // Pair frequency when the merge was made
+} BinaryVocabMerge;
+
+// A loaded (memory-mapped) binary vocabulary; all pointers point into the mapping
+typedef struct BinaryVocab {
+    const void* map;
+    size_t map_size;
+    const BinaryVocabHeader* header;
+    const BinaryVocabToken* tokens;
+    const uint32_t* token_index;
+    const BinaryVocabMerge* merges;
+    const uint32_t* merge_index;
+    const char* strings;
+    uint32_t token_count;
+    uint32_t merge_count;
+} BinaryVocab;
+
+static const char* const binary_vocab_special_tokens[] = {"<s>", "<pad>", "</s>", "<unk>", "<mask>"};
+#define BINARY_VOCAB_SPECIAL_COUNT 5
+
+static inline uint64_t binary_vocab_align(uint64_t offset) {
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+// Byte order of two strings given with lengths (matches strcmp for NUL-free tokens)
+static inline int binary_vocab_compare(const char* a, size_t a_len, const char* b, size_t b_len) {
+    int c = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (c != 0) return c;
+    return a_len < b_len ? -1 : (a_len > b_len ? 1 : 0);
+}
+
+typedef struct {
+    const char* string;
+    uint32_t length;
+    uint32_t id;
+} BinaryVocabSortEntry;
+
+static inline int binary_vocab_sort_tokens(const void* a, const void* b) {
+    const BinaryVocabSortEntry* x = a;
+    const BinaryVocabSortEntry* y = b;
+    return binary_vocab_compare(x->string, x->length, y->string, y->length);
+}
+
+typedef struct {
+    uint64_t key;
+    uint32_t rank;
+} BinaryVocabMergeSortEntry;
+
+static inline int binary_vocab_sort_merges(const void* a, const void* b) {
+    const BinaryVocabMergeSortEntry* x = a;
+    const BinaryVocabMergeSortEntry* y = b;
+    if (x->key != y->key) return x->key < y->key ? -1 : 1;
+    return x->rank < y->rank ? -1 : (x->rank > y->rank ? 1 : 0);
+}
+
+// The tables save_vocabulary_binary builds, sized for the most tokens there can be
+typedef struct {
+    const char** strings;        // Token ID -> string
+    int64_t* counts;             // Token ID -> frequency
+    HashTable* ids;              // String -> token ID
+    BinaryVocabToken* tokens;
+    BinaryVocabSortEntry* sorted;
+    uint32_t* token_index;
+    BinaryVocabMerge* records;
+    BinaryVocabMergeSortEntry* merge_sorted;
+    uint32_t* merge_index;
+} BinaryVocabTables;
+
+static inline void binary_vocab_tables_free(BinaryVocabTables* t) {
+    free(t->strings);
+    free(t->counts);
+    ht_free(t->ids);
+    free(t->tokens);
+    free(t->sorted);
+    free(t->token_index);
+    free(t->records);
+    free(t->merge_sorted);
+    free(t->merge_index);
+    memset(t, 0, sizeof(*t));
+}
+
+// Returns 0, or -1 with nothing allocated if any table cannot be
+static inline int binary_vocab_tables_init(BinaryVocabTables* t, uint32_t token_capacity, size_t merge_capacity) {
+    t->strings = malloc(sizeof(char*) * token_capacity);
+    t->counts = malloc(sizeof(int64_t) * token_capacity);
+    t->ids = ht_create(token_capacity * 2);
+    t->tokens = malloc(sizeof(BinaryVocabToken) * token_capacity);
+    t->sorted = malloc(sizeof(BinaryVocabSortEntry) * token_capacity);
+    t->token_index = malloc(sizeof(uint32_t) * token_capacity);
+    t->records = malloc(sizeof(BinaryVocabMerge) * merge_capacity);
+    t->merge_sorted = malloc(sizeof(BinaryVocabMergeSortEntry) * merge_capacity);
+    t->merge_index = malloc(sizeof(uint32_t) * merge_capacity);
+    if (!t->strings || !t->counts || !t->ids || !t->tokens || !t->sorted || !t->token_index ||
+        !t->records || !t->merge_sorted || !t->merge_index) {
+        binary_vocab_tables_free(t);
+        return -1;
+    }
+    return 0;
+}
+
+// Save a training result as a binary vocabulary. order is the vocabulary in
+// output order without the special tokens (vocab_token_order in cvocgen_io.h)
+// and must include the merged tokens. Returns 0 on success.
+static inline int save_vocabulary_binary(const Ht_item* const* order, uint32_t vocab_count,
+                                         const SymbolTable* symbols,
+                                         const BpeMerge* merges, int merge_count,
+                                         int is_smiles, const char* filename) {
+    if (!order || !symbols || !filename || merge_count < 0) {
+        return -1;
+    }
+
+    BinaryVocabTables t;
+    if (binary_vocab_tables_init(&t, BINARY_VOCAB_SPECIAL_COUNT + vocab_count,
+                                 merge_count > 0 ? (size_t)merge_count : 1) != 0) {
+        fprintf(stderr, "Error: Out of memory writing binary vocabulary %s\n", filename);
+        return -1;
+    }
+    const char** strings = t.strings;
+    int64_t* counts = t.counts;
+    HashTable* ids = t.ids;
+    BinaryVocabToken* tokens = t.tokens;
+    BinaryVocabSortEntry* sorted = t.sorted;
+    uint32_t* token_index = t.token_index;
+    BinaryVocabMerge* records = t.records;
+    BinaryVocabMergeSortEntry* merge_sorted = t.merge_sorted;
+    uint32_t* merge_index = t.merge_index;
+
+    // Token IDs: special tokens first, then the tokens in order, as in the JSON file
+    uint32_t token_count = 0;
+    for (int i = 0; i < BINARY_VOCAB_SPECIAL_COUNT; ++i) {
+        hash_set(ids, binary_vocab_special_tokens[i], (int)token_count);
+        counts[token_count] = 0;
+        strings[token_count++] = binary_vocab_special_tokens[i];
+    }
+    for (uint32_t i = 0; i < vocab_count; ++i) {
+        const Ht_item* item = order[i];
+        if (hash_search(ids, item->key)) {
+            continue;
+        }
+        hash_set(ids, item->key, (int)token_count);
+        counts[token_count] = item->count;
+        strings[token_count++] = item->key;
+    }
+
+    // Lay out the sections
+    BinaryVocabHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BINARY_VOCAB_MAGIC, sizeof(BINARY_VOCAB_MAGIC));
+    header.version = BINARY_VOCAB_VERSION;
+    header.flags = is_smiles ? BINARY_VOCAB_FLAG_SMILES : 0;
+    header.token_count = token_count;
+    header.merge_count = (uint32_t)merge_count;
+    header.tokens_offset = binary_vocab_align(sizeof(header));
+    header.token_index_offset = binary_vocab_align(header.tokens_offset + sizeof(BinaryVocabToken) * token_count);
+    header.merges_offset = binary_vocab_align(header.token_index_offset + sizeof(uint32_t) * token_count);
+    header.merge_index_offset = binary_vocab_align(header.merges_offset + sizeof(BinaryVocabMerge) * merge_count);
+    header.strings_offset = binary_vocab_align(header.merge_index_offset + sizeof(uint32_t) * merge_count);
+
+    uint64_t pool_size = 0;
+    for (uint32_t id = 0; id < token_count; ++id) {
+        size_t len = strlen(strings[id]);
+        tokens[id].offset = (uint32_t)pool_size;
+        tokens[id].length = (uint32_t)len;
+        tokens[id].count = counts[id];
+        sorted[id].string = strings[id];
+        sorted[id].length = (uint32_t)len;
+        sorted[id].id = id;
+        pool_size += len + 1;
+    }
+    qsort(sorted, token_count, sizeof(BinaryVocabSortEntry), binary_vocab_sort_tokens);
+    for (uint32_t i = 0; i < token_count; ++i) {
+        token_index[i] = sorted[i].id;
+    }
+    header.strings_size = pool_size;
+    header.file_size = header.strings_offset + pool_size;
+
+    for (int i = 0; i < merge_count; ++i) {
+        const Ht_item* left = hash_search(ids, symbols->strings[merges[i].left]);
+        const Ht_item* right = hash_search(ids, symbols->strings[merges[i].right]);
+        const Ht_item* merged = hash_search(ids, symbols->strings[merges[i].merged]);
+        if (!left || !right || !merged) {
+            // load_vocabulary_binary would reject the file
+            fprintf(stderr, "Error: Merge %d of %s uses a token missing from the vocabulary\n", i, filename);
+            binary_vocab_tables_free(&t);
+            return -1;
+        }
+        records[i].left = (uint32_t)left->count;
+        records[i].right = (uint32_t)right->count;
+        records[i].merged = (uint32_t)merged->count;
+        records[i].reserved = 0;
+        records[i].count = merges[i].count;
+        merge_sorted[i].key = PAIR_KEY(records[i].left, records[i].right);
+        merge_sorted[i].rank = (uint32_t)i;
+    }
+    qsort(merge_sorted, merge_count, sizeof(BinaryVocabMergeSortEntry), binary_vocab_sort_merges);
+    for (int i = 0; i < merge_count; ++i) {
+        merge_index[i] = merge_sorted[i].rank;
+    }
+
+    int ret = -1;
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        perror("Error opening binary vocabulary file for writing");
+    } else {
+        static const char padding[8] = {0};
+        uint64_t pos = 0;
+        #define BINARY_VOCAB_WRITE(offset, data, size) do { \
+            fwrite(padding, 1, (size_t)((offset) - pos), file); \
+            fwrite((data), 1, (size), file); \
+            pos = (offset) + (size); \
+        } while (0)
+        BINARY_VOCAB_WRITE(0, &header, sizeof(header));
+        BINARY_VOCAB_WRITE(header.tokens_offset, tokens, sizeof(BinaryVocabToken) * token_count);
+        BINARY_VOCAB_WRITE(header.token_index_offset, token_index, sizeof(uint32_t) * token_count);
+        BINARY_VOCAB_WRITE(header.merges_offset, records, sizeof(BinaryVocabMerge) * merge_count);
+        BINARY_VOCAB_WRITE(header.merge_index_offset, merge_index, sizeof(uint32_t) * merge_count);
+        fwrite(padding, 1, (size_t)(header.strings_offset - pos), file);
+        for (uint32_t id = 0; id < token_count; ++id) {
+            fwrite(strings[id], 1, tokens[id].length + 1, file);
+        }
+        #undef BINARY_VOCAB_WRITE
+        ret = ferror(file) ? -1 : 0;
+        if (fclose(file) != 0) ret = -1;
+    }
+
+    binary_vocab_tables_free(&t);
+    return ret;
+}
+
+// Release a vocabulary from load_vocabulary_binary
+static inline void binary_vocab_close(BinaryVocab* bv) {
+    if (!bv) return;
+    if (bv->map) {
+        munmap((void*)bv->map, bv->map_size);
+    }
+    free(bv);
+}
+
+// Check every record once, so lookups and the encoder can index without bounds
+// checks: each token string lies in the pool and is NUL-terminated, each merge
+// names existing tokens, and both indexes hold valid IDs and ranks. The sections
+// themselves must already lie inside the file. Returns 0 if the records are valid.
+static inline int binary_vocab_check_records(const BinaryVocabHeader* h, const char* base) {
+    const BinaryVocabToken* tokens = (const BinaryVocabToken*)(base + h->tokens_offset);
+    const uint32_t* token_index = (const uint32_t*)(base + h->token_index_offset);
+    const BinaryVocabMerge* merges = (const BinaryVocabMerge*)(base + h->merges_offset);
+    const uint32_t* merge_index = (const uint32_t*)(base + h->merge_index_offset);
+    const char* strings = base + h->strings_offset;
+    for (uint32_t id = 0; id < h->token_count; ++id) {
+        uint64_t end = (uint64_t)tokens[id].offset + tokens[id].length;
+        if (end >= h->strings_size || strings[end] != '\0' || token_index[id] >= h->token_count) {
+            return -1;
+        }
+    }
+    for (uint32_t i = 0; i < h->merge_count; ++i) {
+        if (merges[i].left >= h->token_count || merges[i].right >= h->token_count ||
+            merges[i].merged >= h->token_count || merge_index[i] >= h->merge_count) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Map a binary vocabulary file. Returns NULL if it cannot be read or is not valid.
+static inline BinaryVocab* load_vocabulary_binary(const char* filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening binary vocabulary file");
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(BinaryVocabHeader)) {
+        close(fd);
+        return NULL;
+    }
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    BinaryVocab* bv = calloc(1, sizeof(BinaryVocab));
+    if (!bv) {
+        munmap(map, (size_t)st.st_size);
+        return NULL;
+    }
+    bv->map = map;
+    bv->map_size = (size_t)st.st_size;
+
+    // Check the header and that every section lies inside the file
+    const BinaryVocabHeader* h = map;
+    uint64_t size = (uint64_t)st.st_size;
+    if (memcmp(h->magic, BINARY_VOCAB_MAGIC, sizeof(BINARY_VOCAB_MAGIC)) != 0 ||
+        h->version != BINARY_VOCAB_VERSION || h->file_size != size ||
+        h->tokens_offset > size || h->token_index_offset > size || h->merges_offset > size ||
+        h->merge_index_offset > size || h->strings_offset > size || h->strings_size > size ||
+        h->tokens_offset + sizeof(BinaryVocabToken) * (uint64_t)h->token_count > size ||
+        h->token_index_offset + sizeof(uint32_t) * (uint64_t)h->token_count > size ||
+        h->merges_offset + sizeof(BinaryVocabMerge) * (uint64_t)h->merge_count > size ||
+        h->merge_index_offset + sizeof(uint32_t) * (uint64_t)h->merge_count > size ||
+        h->strings_offset + h->strings_size > size ||
+        (h->tokens_offset | h->token_index_offset | h->merges_offset | h->merge_index_offset) % 8 != 0) {
+        fprintf(stderr, "Error: %s is not a valid binary vocabulary (version %d)\n",
+                filename, BINARY_VOCAB_VERSION);
+        binary_vocab_close(bv);
+        return NULL;
+    }
+
+    const char* base = map;
+    if (binary_vocab_check_records(h, base) != 0) {
+        fprintf(stderr, "Error: %s has token or merge records outside the vocabulary\n", filename);
+        binary_vocab_close(bv);
+        return NULL;
+    }
+    bv->header = h;
+    bv->tokens = (const BinaryVocabToken*)(base + h->tokens_offset);
+    bv->token_index = (const uint32_t*)(base + h->token_index_offset);
+    bv->merges = (const BinaryVocabMerge*)(base + h->merges_offset);
+    bv->merge_index = (const uint32_t*)(base + h->merge_index_offset);
+    bv->strings = base + h->strings_offset;
+    bv->token_count = h->token_count;
+    bv->merge_count = h->merge_count;
+    return bv;
+}
+
+// String of a token ID (NUL-terminated, inside the mapping)
+static inline const char* binary_vocab_token(const BinaryVocab* bv, uint32_t id) {
+    return bv->strings + bv->tokens[id].offset;
+}
+
+// ID of a token, or UINT32_MAX if it is not in the vocabulary
+static inline uint32_t binary_vocab_find(const BinaryVocab* bv, const char* token, size_t len) {
+    uint32_t lo = 0, hi = bv->token_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const BinaryVocabToken* t = &bv->tokens[bv->token_index[mid]];
+        int c = binary_vocab_compare(bv->strings + t->offset, t->length, token, len);
+        if (c == 0) return bv->token_index[mid];
+        if (c < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return UINT32_MAX;
+}
+
+// Rank of the merge of (left, right), or UINT32_MAX if the pair is never merged
+static inline uint32_t binary_vocab_merge_rank(const BinaryVocab* bv, uint32_t left, uint32_t right) {
+    uint64_t key = PAIR_KEY(left, right);
+    uint32_t lo = 0, hi = bv->merge_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const BinaryVocabMerge* m = &bv->merges[bv->merge_index[mid]];
+        uint64_t mid_key = PAIR_KEY(m->left, m->right);
+        if (mid_key == key) {
+            // Duplicate pairs keep only their first (lowest) rank, which sorts first
+            while (mid > lo) {
+                const BinaryVocabMerge* prev = &bv->merges[bv->merge_index[mid - 1]];
+                if (PAIR_KEY(prev->left, prev->right) != key) break;
+                mid--;
+            }
+            return bv->merge_index[mid];
+        }
+        if (mid_key < key) lo = mid + 1;
+        else hi = mid;
+    }
+    return UINT32_MAX;
+}
+
+#endif /* CVOCGEN_VOCAB_H */
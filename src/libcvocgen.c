@@ -0,0 +1,278 @@
+#include "libcvocgen.h"
+#include "cvocgen.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>  /* For PATH_MAX */
+#include "cvocgen_corpus.h"
+#include "cvocgen_vocab.h"
+
+// Library front end over the reentrant training and encoding functions of
+// cvocgen.c (see libcvocgen.h). Everything a call needs is reached through its
+// arguments; the command-line globals of cvocgen.c are never read.
+
+struct CvocgenContext {
+    TrainConfig config;
+    char spill_directory[PATH_MAX];
+    char checkpoint_path[PATH_MAX];
+    char extend_path[PATH_MAX];
+    char snapshot_prefix[PATH_MAX];
+    char cache_directory[PATH_MAX];
+    int* snapshots;
+    char error[256];
+};
+
+struct CvocgenModel {
+    TrainResult result;
+    int is_smiles;
+};
+
+struct CvocgenTokenizer {
+    BinaryVocab* vocab;
+    BpeEncoder* encoder;
+};
+
+static void set_error(CvocgenContext* ctx, const char* what, const char* detail) {
+    snprintf(ctx->error, sizeof(ctx->error), "%s: %s", what, detail);
+}
+
+CvocgenContext* cvocgen_context_create(void) {
+    CvocgenContext* ctx = calloc(1, sizeof(CvocgenContext));
+    if (!ctx) return NULL;
+    ctx->config.is_smiles = 0;
+    ctx->config.lexer_mode = LEXER_FAST;
+    ctx->config.threads = 1;
+    ctx->config.deduplicate = 0;
+    ctx->config.max_memory = 0;
+    ctx->config.verbose = 0;
+    ctx->config.vocab_order = VOCAB_ORDER_INSERTION;
+    strcpy(ctx->spill_directory, ".");
+    ctx->config.spill_directory = ctx->spill_directory;
+    return ctx;
+}
+
+void cvocgen_context_free(CvocgenContext* ctx) {
+    if (!ctx) return;
+    free(ctx->snapshots);
+    free(ctx);
+}
+
+void cvocgen_set_format(CvocgenContext* ctx, int format) {
+    ctx->config.is_smiles = format == CVOCGEN_FORMAT_SMILES;
+}
+
+void cvocgen_set_threads(CvocgenContext* ctx, int threads) {
+    ctx->config.threads = threads > 0 ? threads : 1;
+}
+
+void cvocgen_set_deduplicate(CvocgenContext* ctx, int deduplicate) {
+    ctx->config.deduplicate = deduplicate != 0;
+}
+
+void cvocgen_set_max_memory(CvocgenContext* ctx, size_t max_memory, const char* spill_directory) {
+    ctx->config.max_memory = max_memory;
+    strncpy(ctx->spill_directory, spill_directory ? spill_directory : ".", sizeof(ctx->spill_directory) - 1);
+    ctx->spill_directory[sizeof(ctx->spill_directory) - 1] = '\0';
+}
+
+// Copy a path into the context's storage; returns the copy, or NULL for NULL
+static const char* copy_path(char* storage, const char* path) {
+    if (!path) return NULL;
+    strncpy(storage, path, PATH_MAX - 1);
+    storage[PATH_MAX - 1] = '\0';
+    return storage;
+}
+
+void cvocgen_set_checkpoint(CvocgenContext* ctx, const char* path, int every_merges, int every_seconds) {
+    ctx->config.checkpoint_path = copy_path(ctx->checkpoint_path, path);
+    ctx->config.checkpoint_merges = every_merges > 0 ? every_merges : 0;
+    ctx->config.checkpoint_seconds = every_seconds > 0 ? every_seconds : 0;
+}
+
+void cvocgen_set_extend(CvocgenContext* ctx, const char* vocab_txt) {
+    ctx->config.extend_path = copy_path(ctx->extend_path, vocab_txt);
+}
+
+static int compare_ints(const void* a, const void* b) {
+    int x = *(const int*)a, y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+void cvocgen_set_snapshots(CvocgenContext* ctx, const int* merges, int count, const char* prefix) {
+    free(ctx->snapshots);
+    ctx->snapshots = NULL;
+    ctx->config.snapshots = NULL;
+    ctx->config.snapshot_count = 0;
+    ctx->config.snapshot_prefix = NULL;
+    if (!merges || count <= 0 || !prefix) return;
+
+    ctx->snapshots = malloc(sizeof(int) * count);
+    if (!ctx->snapshots) return;
+    int kept = 0;
+    for (int i = 0; i < count; ++i) {
+        if (merges[i] > 0) ctx->snapshots[kept++] = merges[i];
+    }
+    // Training walks the list in order, so sort it and drop repeats
+    qsort(ctx->snapshots, kept, sizeof(int), compare_ints);
+    int unique = 0;
+    for (int i = 0; i < kept; ++i) {
+        if (unique == 0 || ctx->snapshots[unique - 1] != ctx->snapshots[i]) {
+            ctx->snapshots[unique++] = ctx->snapshots[i];
+        }
+    }
+    ctx->config.snapshots = ctx->snapshots;
+    ctx->config.snapshot_count = unique;
+    ctx->config.snapshot_prefix = copy_path(ctx->snapshot_prefix, prefix);
+}
+
+void cvocgen_set_vocab_order(CvocgenContext* ctx, int order) {
+    ctx->config.vocab_order = order == CVOCGEN_ORDER_RANK ? VOCAB_ORDER_RANK
+                            : order == CVOCGEN_ORDER_FREQUENCY ? VOCAB_ORDER_FREQUENCY
+                            : VOCAB_ORDER_INSERTION;
+}
+
+void cvocgen_set_stop_rules(CvocgenContext* ctx, int min_frequency, int target_vocab_size) {
+    ctx->config.min_frequency = min_frequency > 0 ? min_frequency : 0;
+    ctx->config.target_vocab_size = target_vocab_size > 0 ? target_vocab_size : 0;
+}
+
+void cvocgen_set_prune_below(CvocgenContext* ctx, int min_count) {
+    ctx->config.prune_below = min_count > 0 ? min_count : 0;
+}
+
+void cvocgen_set_cache(CvocgenContext* ctx, const char* directory) {
+    ctx->config.cache_directory = copy_path(ctx->cache_directory, directory);
+}
+
+void cvocgen_set_verbose(CvocgenContext* ctx, int verbose) {
+    ctx->config.verbose = verbose != 0;
+}
+
+const char* cvocgen_last_error(const CvocgenContext* ctx) {
+    return ctx->error;
+}
+
+static CvocgenModel* train_reader(CvocgenContext* ctx, CorpusReader* reader, const TrainConfig* config,
+                                  int num_merges) {
+    CvocgenModel* model = calloc(1, sizeof(CvocgenModel));
+    if (!model) {
+        set_error(ctx, "Training failed", strerror(ENOMEM));
+        return NULL;
+    }
+    if (train_corpus(reader, config, num_merges, &model->result) != 0) {
+        set_error(ctx, "Training failed", strerror(errno));
+        free(model);
+        return NULL;
+    }
+    model->is_smiles = config->is_smiles;
+    ctx->error[0] = '\0';
+    return model;
+}
+
+CvocgenModel* cvocgen_train_file(CvocgenContext* ctx, const char* path, int num_merges) {
+    CorpusReader reader;
+    if (!path || corpus_open_threads(&reader, path, ctx->config.threads) != 0) {
+        set_error(ctx, "Error opening corpus file", path ? strerror(errno) : "no path");
+        return NULL;
+    }
+    TrainConfig config = ctx->config;
+    config.corpus_path = path;
+    CvocgenModel* model = train_reader(ctx, &reader, &config, num_merges);
+    corpus_close(&reader);
+    return model;
+}
+
+CvocgenModel* cvocgen_train_buffer(CvocgenContext* ctx, const char* data, size_t size, int num_merges) {
+    CorpusReader reader;
+    corpus_open_buffer(&reader, data, data ? size : 0);
+    CvocgenModel* model = train_reader(ctx, &reader, &ctx->config, num_merges);
+    corpus_close(&reader);
+    return model;
+}
+
+CvocgenModel* cvocgen_resume(CvocgenContext* ctx, const char* checkpoint, int num_merges) {
+    if (!checkpoint) {
+        set_error(ctx, "Error reading checkpoint", "no path");
+        return NULL;
+    }
+    // The corpus is not read again; the reader stays empty
+    CorpusReader reader;
+    corpus_open_buffer(&reader, NULL, 0);
+    TrainConfig config = ctx->config;
+    config.resume_path = checkpoint;
+    config.extend_path = NULL;
+    return train_reader(ctx, &reader, &config, num_merges);
+}
+
+int cvocgen_model_merge_count(const CvocgenModel* model) {
+    return model->result.merge_count;
+}
+
+int cvocgen_model_save(CvocgenContext* ctx, CvocgenModel* model, const char* base) {
+    errno = 0;
+    if (save_train_result(&model->result, model->is_smiles, ctx->config.vocab_order, base) != 0) {
+        set_error(ctx, "Error saving vocabulary", errno ? strerror(errno) : base);
+        return -1;
+    }
+    ctx->error[0] = '\0';
+    return 0;
+}
+
+void cvocgen_model_free(CvocgenModel* model) {
+    if (!model) return;
+    train_result_free(&model->result);
+    free(model);
+}
+
+CvocgenTokenizer* cvocgen_load(CvocgenContext* ctx, const char* path) {
+    CvocgenTokenizer* tokenizer = calloc(1, sizeof(CvocgenTokenizer));
+    if (!tokenizer) {
+        set_error(ctx, "Error loading vocabulary", strerror(ENOMEM));
+        return NULL;
+    }
+    tokenizer->vocab = path ? load_vocabulary_binary(path) : NULL;
+    if (tokenizer->vocab) {
+        tokenizer->encoder = bpe_encoder_create(tokenizer->vocab);
+    }
+    if (!tokenizer->encoder) {
+        set_error(ctx, "Error loading vocabulary", path ? path : "no path");
+        cvocgen_tokenizer_free(tokenizer);
+        return NULL;
+    }
+    ctx->error[0] = '\0';
+    return tokenizer;
+}
+
+void cvocgen_tokenizer_free(CvocgenTokenizer* tokenizer) {
+    if (!tokenizer) return;
+    bpe_encoder_free(tokenizer->encoder);
+    binary_vocab_close(tokenizer->vocab);
+    free(tokenizer);
+}
+
+uint32_t cvocgen_vocab_size(const CvocgenTokenizer* tokenizer) {
+    return tokenizer->vocab->token_count;
+}
+
+const char* cvocgen_id_to_token(const CvocgenTokenizer* tokenizer, uint32_t id) {
+    if (id >= tokenizer->vocab->token_count) return NULL;
+    return binary_vocab_token(tokenizer->vocab, id);
+}
+
+uint32_t cvocgen_token_to_id(const CvocgenTokenizer* tokenizer, const char* token, size_t len) {
+    return binary_vocab_find(tokenizer->vocab, token, len);
+}
+
+size_t cvocgen_encode(const CvocgenTokenizer* tokenizer, const char* text, size_t len,
+                      int add_special_tokens, uint32_t* ids, size_t capacity) {
+    // Scratch space is per call, so concurrent calls share nothing mutable
+    EncodeBuffer buf;
+    encode_buffer_init(&buf);
+    size_t count = bpe_encode(tokenizer->encoder, &buf, text, len, add_special_tokens);
+    if (ids) {
+        memcpy(ids, buf.ids, sizeof(uint32_t) * (count < capacity ? count : capacity));
+    }
+    encode_buffer_free(&buf);
+    return count;
+}
@@ -0,0 +1,105 @@
+#ifndef LIBCVOCGEN_H
+#define LIBCVOCGEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Public C API of libcvocgen (libcvocgen.so / libcvocgen.a).
+//
+// All state lives in the objects below; the library has no global settings.
+// A context holds the training options and the last error message and must not
+// be used by two threads at once, but any number of threads can each use their
+// own context. A tokenizer is read-only once loaded: one tokenizer can be shared
+// by all threads and cvocgen_encode called on it concurrently.
+#if defined(__GNUC__)
+#define CVOCGEN_API __attribute__((visibility("default")))
+#else
+#define CVOCGEN_API
+#endif
+
+#define CVOCGEN_FORMAT_SELFIES 0
+#define CVOCGEN_FORMAT_SMILES 1
+
+// Returned by cvocgen_token_to_id for unknown tokens
+#define CVOCGEN_NO_ID UINT32_MAX
+
+typedef struct CvocgenContext CvocgenContext;
+typedef struct CvocgenModel CvocgenModel;          // A trained vocabulary
+typedef struct CvocgenTokenizer CvocgenTokenizer;  // A loaded binary vocabulary
+
+// Contexts start with the command-line defaults: SELFIES, one thread,
+// no deduplication, unbounded memory and no output
+CVOCGEN_API CvocgenContext* cvocgen_context_create(void);
+CVOCGEN_API void cvocgen_context_free(CvocgenContext* ctx);
+CVOCGEN_API void cvocgen_set_format(CvocgenContext* ctx, int format);
+CVOCGEN_API void cvocgen_set_threads(CvocgenContext* ctx, int threads);
+CVOCGEN_API void cvocgen_set_deduplicate(CvocgenContext* ctx, int deduplicate);
+// Train from on-disk segments within max_memory bytes (0 = in memory); the spill
+// file goes to spill_directory (NULL = ".")
+CVOCGEN_API void cvocgen_set_max_memory(CvocgenContext* ctx, size_t max_memory,
+                                        const char* spill_directory);
+// Write a training checkpoint to path every every_merges merges and/or every
+// every_seconds seconds (0 = off; path NULL turns checkpoints off)
+CVOCGEN_API void cvocgen_set_checkpoint(CvocgenContext* ctx, const char* path, int every_merges,
+                                        int every_seconds);
+// Replay the merges of an existing vocab_<n>.txt before training more (NULL = off)
+CVOCGEN_API void cvocgen_set_extend(CvocgenContext* ctx, const char* vocab_txt);
+// While training, also save the vocabulary after each of the given merge counts
+// as <prefix><k>.txt/.json/_freq.json/.bin, written in the background
+// (merges NULL or count 0 turns snapshots off)
+CVOCGEN_API void cvocgen_set_snapshots(CvocgenContext* ctx, const int* merges, int count,
+                                       const char* prefix);
+#define CVOCGEN_ORDER_INSERTION 0  // Tokens as first seen, then merged tokens (default)
+#define CVOCGEN_ORDER_RANK 1       // Base tokens sorted byte-wise, then merged tokens by merge rank
+#define CVOCGEN_ORDER_FREQUENCY 2  // Most frequent first, ties sorted byte-wise
+// Token ID order of the vocabularies cvocgen_model_save and snapshots write
+CVOCGEN_API void cvocgen_set_vocab_order(CvocgenContext* ctx, int order);
+// Stop before num_merges once the best pair occurs fewer than min_frequency
+// times, or once the vocabulary, special tokens included, has target_vocab_size
+// tokens (0 = no limit). The model then holds fewer merges.
+CVOCGEN_API void cvocgen_set_stop_rules(CvocgenContext* ctx, int min_frequency, int target_vocab_size);
+// Never merge pairs occurring fewer than min_count times and keep them out of the
+// pair index, which also stops training like min_frequency would (0 = off)
+CVOCGEN_API void cvocgen_set_prune_below(CvocgenContext* ctx, int min_count);
+// Reuse a run cached in directory for the same corpus and settings, and cache the
+// runs that are trained (NULL = off). Not used by cvocgen_resume or with extend.
+CVOCGEN_API void cvocgen_set_cache(CvocgenContext* ctx, const char* directory);
+// Print progress and merges to stdout like the command line does
+CVOCGEN_API void cvocgen_set_verbose(CvocgenContext* ctx, int verbose);
+// Message of the last failed call on ctx, or "" if none failed
+CVOCGEN_API const char* cvocgen_last_error(const CvocgenContext* ctx);
+
+// Train num_merges merges on one molecule per line, from a file ("-" = stdin)
+// or from a caller-owned buffer. Return NULL on error.
+CVOCGEN_API CvocgenModel* cvocgen_train_file(CvocgenContext* ctx, const char* path, int num_merges);
+CVOCGEN_API CvocgenModel* cvocgen_train_buffer(CvocgenContext* ctx, const char* data, size_t size,
+                                               int num_merges);
+// Continue a checkpointed run up to num_merges merges. Returns NULL on error.
+CVOCGEN_API CvocgenModel* cvocgen_resume(CvocgenContext* ctx, const char* checkpoint, int num_merges);
+CVOCGEN_API int cvocgen_model_merge_count(const CvocgenModel* model);
+// Write base.txt, base.json, base_freq.json and base.bin. Returns 0, or -1 on error.
+CVOCGEN_API int cvocgen_model_save(CvocgenContext* ctx, CvocgenModel* model, const char* base);
+CVOCGEN_API void cvocgen_model_free(CvocgenModel* model);
+
+// Load a binary vocabulary (.bin) for encoding. Returns NULL on error.
+CVOCGEN_API CvocgenTokenizer* cvocgen_load(CvocgenContext* ctx, const char* path);
+CVOCGEN_API void cvocgen_tokenizer_free(CvocgenTokenizer* tokenizer);
+CVOCGEN_API uint32_t cvocgen_vocab_size(const CvocgenTokenizer* tokenizer);
+// Token of an ID (NUL-terminated, valid until the tokenizer is freed), or NULL
+CVOCGEN_API const char* cvocgen_id_to_token(const CvocgenTokenizer* tokenizer, uint32_t id);
+CVOCGEN_API uint32_t cvocgen_token_to_id(const CvocgenTokenizer* tokenizer, const char* token,
+                                         size_t len);
+// Encode one molecule. Writes up to capacity IDs to ids and returns the full
+// number of IDs, so a return value > capacity means ids was too small.
+CVOCGEN_API size_t cvocgen_encode(const CvocgenTokenizer* tokenizer, const char* text, size_t len,
+                                  int add_special_tokens, uint32_t* ids, size_t capacity);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBCVOCGEN_H */
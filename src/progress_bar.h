@@ -2,102 +2,182 @@
 #define PROGRESS_BAR_H
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <time.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Progress bar drawn by its own timer thread. The loop being measured only
+// stores its position in a relaxed atomic, so an update costs a plain store and
+// never touches the clock or stdout. Nothing is drawn, and no thread started,
+// when the bar is quiet or stdout is not a terminal.
+//
+//   ProgressBar bar;
+//   progress_bar_start(&bar, "Counting", total, quiet);
+//   for (...) progress_bar_increment(&bar);     // one thread updates the position
+//   progress_bar_finish(&bar);                  // draws the final state
+#define PROGRESS_BAR_WIDTH 30
+#define PROGRESS_BAR_INTERVAL_MS 250   // Redraw rate of the timer thread
 
 typedef struct {
-    int total;              // Total number of iterations
-    int current;            // Current iteration
+    atomic_long current;    // Current iteration, written by one thread only
+    long total;             // Total number of iterations
     int bar_width;          // Width of the progress bar
-    time_t start_time;      // Start time
-    time_t last_update;     // Last update time
+    double start_time;      // Start time (CLOCK_MONOTONIC seconds)
     char prefix[50];        // Prefix string
     int last_printed_len;   // Length of the last printed line
+    int quiet;              // No output at all
+    int running;            // The timer thread is drawing the bar
+    int drawn;              // The bar is on screen; other output must clear it first
+    int stop;               // Set by progress_bar_finish
+    pthread_t thread;
+    pthread_mutex_t lock;   // Guards drawn, stop and the drawing itself
+    pthread_cond_t wake;
 } ProgressBar;
 
-// Initialize a new progress bar
-static inline ProgressBar progress_bar_init(const char* prefix, int total, int bar_width) {
-    ProgressBar bar;
-    bar.total = total;
-    bar.current = 0;
-    bar.bar_width = bar_width;
-    bar.start_time = time(NULL);
-    bar.last_update = bar.start_time;
-    bar.last_printed_len = 0;
-    
-    strncpy(bar.prefix, prefix, sizeof(bar.prefix) - 1);
-    bar.prefix[sizeof(bar.prefix) - 1] = '\0';
-    
-    return bar;
+static inline double progress_bar_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Draw the bar at its current position; the caller holds bar->lock
+static inline void progress_bar_draw(ProgressBar* bar) {
+    long current = atomic_load_explicit(&bar->current, memory_order_relaxed);
+    long total = bar->total > 0 ? bar->total : 1;
+    float progress = current >= total ? 1.0f : (float)current / total;
+    int pos = bar->bar_width * progress;
+
+    // Calculate time metrics
+    double elapsed_seconds = progress_bar_now() - bar->start_time;
+    long elapsed = (long)elapsed_seconds;
+    double iterations_per_sec = elapsed_seconds > 0 ? current / elapsed_seconds : 0;
+    double sec_per_iteration = current > 0 ? elapsed_seconds / current : 0;
+    long eta = current > 0 && current < total ? (long)((total - current) * sec_per_iteration) : 0;
+
+    // Build the whole line first so it reaches the terminal in one write
+    char line[256];
+    int len = snprintf(line, sizeof(line), "\r%*s\r%s [", bar->last_printed_len, "", bar->prefix);
+    for (int i = 0; i < bar->bar_width && len < (int)sizeof(line) - 1; i++) {
+        line[len++] = i < pos ? '=' : i == pos ? '>' : ' ';
+    }
+    int metrics = snprintf(line + len, sizeof(line) - len,
+                           "] %3d%% | %02ld:%02ld:%02ld | %.2f it/s | %.2f s/it | ETA: %02ld:%02ld:%02ld",
+                           (int)(progress * 100),
+                           elapsed / 3600, (elapsed % 3600) / 60, elapsed % 60,
+                           iterations_per_sec, sec_per_iteration,
+                           eta / 3600, (eta % 3600) / 60, eta % 60);
+    if (metrics > 0) len += metrics;
+    if (len >= (int)sizeof(line)) len = sizeof(line) - 1;
+    fwrite(line, 1, len, stdout);
+    fflush(stdout);
+
+    bar->last_printed_len = strlen(bar->prefix) + 2 + bar->bar_width + (metrics > 0 ? metrics : 0);
+    bar->drawn = 1;
 }
 
-// Update the progress bar
-static inline void progress_bar_update(ProgressBar* bar, int current) {
-    bar->current = current;
-    time_t now = time(NULL);
-    
-    // Only update the display if at least 1 second has passed since the last update
-    // or if this is the first or last update
-    if (now > bar->last_update || current == 0 || current >= bar->total) {
-        bar->last_update = now;
-        
-        // Calculate progress
-        float progress = (float)current / bar->total;
-        int pos = bar->bar_width * progress;
-        
-        // Calculate time metrics
-        time_t elapsed = now - bar->start_time;
-        double iterations_per_sec = (elapsed > 0) ? (double)current / elapsed : 0;
-        double sec_per_iteration = (current > 0) ? (double)elapsed / current : 0;
-        
-        // Calculate estimated time remaining
-        time_t eta = (current > 0) ? (time_t)((bar->total - current) * sec_per_iteration) : 0;
-        
-        // Clear the previous line
-        char clear_line[128];
-        memset(clear_line, ' ', bar->last_printed_len);
-        clear_line[bar->last_printed_len] = '\0';
-        printf("\r%s", clear_line);
-        
-        // Print the progress bar
-        printf("\r%s [", bar->prefix);
-        for (int i = 0; i < bar->bar_width; i++) {
-            if (i < pos) printf("=");
-            else if (i == pos) printf(">");
-            else printf(" ");
+static inline void* progress_bar_thread(void* arg) {
+    ProgressBar* bar = arg;
+    pthread_mutex_lock(&bar->lock);
+    while (!bar->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += PROGRESS_BAR_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
         }
-        
-        // Print the metrics
-        char buffer[256];
-        int len = snprintf(buffer, sizeof(buffer), 
-                 "] %3d%% | %02ld:%02ld:%02ld | %.2f it/s | %.2f s/it | ETA: %02ld:%02ld:%02ld",
-                 (int)(progress * 100),
-                 elapsed / 3600, (elapsed % 3600) / 60, elapsed % 60,
-                 iterations_per_sec,
-                 sec_per_iteration,
-                 eta / 3600, (eta % 3600) / 60, eta % 60);
-        
-        printf("%s", buffer);
-        fflush(stdout);
-        
-        // Store the length of the printed line
-        bar->last_printed_len = strlen(bar->prefix) + 2 + bar->bar_width + len;
-        
-        // Print a newline when done
-        if (current >= bar->total) {
-            printf("\n");
+        pthread_cond_timedwait(&bar->wake, &bar->lock, &deadline);
+        if (!bar->stop) {
+            progress_bar_draw(bar);
         }
     }
+    pthread_mutex_unlock(&bar->lock);
+    return NULL;
+}
+
+// Start a bar over total iterations; quiet (or a stdout that is not a terminal)
+// turns all output off
+static inline void progress_bar_start(ProgressBar* bar, const char* prefix, long total, int quiet) {
+    atomic_init(&bar->current, 0);
+    bar->total = total;
+    bar->bar_width = PROGRESS_BAR_WIDTH;
+    bar->start_time = progress_bar_now();
+    bar->last_printed_len = 0;
+    bar->quiet = quiet || !isatty(fileno(stdout));
+    bar->running = 0;
+    bar->drawn = 0;
+    bar->stop = 0;
+    strncpy(bar->prefix, prefix, sizeof(bar->prefix) - 1);
+    bar->prefix[sizeof(bar->prefix) - 1] = '\0';
+    if (bar->quiet) {
+        return;
+    }
+
+    pthread_mutex_init(&bar->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&bar->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&bar->thread, NULL, progress_bar_thread, bar) == 0) {
+        bar->running = 1;
+    } else {
+        pthread_cond_destroy(&bar->wake);
+        pthread_mutex_destroy(&bar->lock);
+        bar->quiet = 1;
+    }
 }
 
-// Increment the progress bar by one step
+// Set the position (from the one thread that updates this bar)
+static inline void progress_bar_update(ProgressBar* bar, long current) {
+    atomic_store_explicit(&bar->current, current, memory_order_relaxed);
+}
+
+// Advance by one step; a load and a store rather than a locked add, since only
+// one thread writes the position
 static inline void progress_bar_increment(ProgressBar* bar) {
-    progress_bar_update(bar, bar->current + 1);
+    long current = atomic_load_explicit(&bar->current, memory_order_relaxed);
+    atomic_store_explicit(&bar->current, current + 1, memory_order_relaxed);
+}
+
+// printf to stdout without garbling the bar: the bar line is cleared first and
+// redrawn at the next tick
+static inline void progress_bar_printf(ProgressBar* bar, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    if (bar && bar->running) {
+        pthread_mutex_lock(&bar->lock);
+        if (bar->drawn) {
+            printf("\r%*s\r", bar->last_printed_len, "");
+            bar->drawn = 0;
+        }
+        vprintf(format, args);
+        pthread_mutex_unlock(&bar->lock);
+    } else {
+        vprintf(format, args);
+    }
+    va_end(args);
 }
 
-// Finish the progress bar
+// Stop the timer thread and leave the final state on its own line
 static inline void progress_bar_finish(ProgressBar* bar) {
-    progress_bar_update(bar, bar->total);
+    if (!bar->running) {
+        return;
+    }
+    pthread_mutex_lock(&bar->lock);
+    bar->stop = 1;
+    pthread_cond_signal(&bar->wake);
+    pthread_mutex_unlock(&bar->lock);
+    pthread_join(bar->thread, NULL);
+    bar->running = 0;
+
+    progress_bar_draw(bar);
+    printf("\n");
+    pthread_cond_destroy(&bar->wake);
+    pthread_mutex_destroy(&bar->lock);
 }
 
 #endif /* PROGRESS_BAR_H */
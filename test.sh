@@ -40,3 +40,43 @@ PYTHONPATH="$(pwd):$PYTHONPATH" python3 tests/compare_tokenizers.py \
   --merges "$MERGES"
 
 echo "Comparison complete. Results are in $OUTPUT_DIR/"
+
+# Training must give byte-identical vocabularies whatever the thread count, and
+# when resumed from a checkpoint or reused from the cache
+echo "Checking that training is deterministic..."
+CORPUS="data/test.selfies.unique.txt.gz"
+DET_DIR="$OUTPUT_DIR/determinism"
+DET_MERGES=200
+DET_THREADS=4
+rm -rf "$DET_DIR"
+mkdir -p "$DET_DIR"/{threads1,threadsN,checkpoint,resumed,cache,cached,cut}
+
+same_vocab() {
+  for ext in .txt .json _freq.json .bin; do
+    cmp "$1/vocab_$3$ext" "$2/vocab_$3$ext"
+  done
+  echo "  $2 matches $1"
+}
+
+./bin/cvocgen -f "$CORPUS" -n $DET_MERGES --threads 1 -o "$DET_DIR/threads1" > /dev/null
+./bin/cvocgen -f "$CORPUS" -n $DET_MERGES --threads $DET_THREADS -o "$DET_DIR/threadsN" > /dev/null
+same_vocab "$DET_DIR/threads1" "$DET_DIR/threadsN" $DET_MERGES
+
+# Stop halfway with a checkpoint, then resume with the other thread count
+./bin/cvocgen -f "$CORPUS" -n $((DET_MERGES / 2)) --threads $DET_THREADS --checkpoint-every $((DET_MERGES / 2)) \
+  -o "$DET_DIR/checkpoint" > /dev/null
+./bin/cvocgen -f "$CORPUS" -n $DET_MERGES --threads 1 --resume "$DET_DIR/checkpoint/vocab_$((DET_MERGES / 2)).ckpt" \
+  -o "$DET_DIR/resumed" > /dev/null
+same_vocab "$DET_DIR/threads1" "$DET_DIR/resumed" $DET_MERGES
+
+# Fill the cache with one thread, then hit it with N: the same run, and a shorter one cut from it
+./bin/cvocgen -f "$CORPUS" -n $DET_MERGES --threads 1 --cache "$DET_DIR/cache" -o "$DET_DIR/cache" > /dev/null
+./bin/cvocgen -f "$CORPUS" -n $DET_MERGES --threads $DET_THREADS --cache "$DET_DIR/cache" -o "$DET_DIR/cached" > /dev/null
+same_vocab "$DET_DIR/threads1" "$DET_DIR/cached" $DET_MERGES
+./bin/cvocgen -f "$CORPUS" -n $((DET_MERGES / 2)) --threads $DET_THREADS --cache "$DET_DIR/cache" -o "$DET_DIR/cut" > /dev/null
+same_vocab "$DET_DIR/checkpoint" "$DET_DIR/cut" $((DET_MERGES / 2))
+
+# Check cvocgen encode and the cvocgen_native binding (needs make -C src lib)
+# against APETokenizer.encode on the checked-in sample
+echo "Checking the native encoders..."
+PYTHONPATH="$(pwd):$PYTHONPATH" python3 tests/check_encode.py
@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+"""
+Check the native encoders against APETokenizer on a checked-in sample.
+
+This script:
+1. Trains cvocgen vocabularies on tests/encode_sample.selfies.txt
+2. Encodes the sample with `cvocgen encode` and with the cvocgen_native binding
+3. Compares both with APETokenizer.encode on the same vocabulary.json
+
+With no merges every token is a base token, and all three must give the same IDs.
+With merges, APETokenizer.encode matches the longest vocabulary entry, while cvocgen
+applies the merges by rank as training made them, so the IDs may differ. Both
+encoders must then agree with replaying the merges of vocab_<n>.txt, in order, on
+APETokenizer.pre_tokenize output, and all of them must decode back to the molecule.
+"""
+
+import os
+import sys
+import subprocess
+import tempfile
+import argparse
+
+sys.path.insert(0, os.path.abspath(os.path.join(os.path.dirname(__file__), '..')))
+from apetokenizer.ape_tokenizer import APETokenizer
+from apetokenizer import cvocgen_native
+
+
+def load_corpus(file_path):
+    """Load corpus from a file."""
+    with open(file_path, 'r', encoding='utf-8') as f:
+        return [line.strip() for line in f if line.strip()]
+
+
+def train_cvocgen(cvocgen, input_file, output_dir, num_merges):
+    """Train a vocabulary and return the path without extension."""
+    cmd = [cvocgen, "-f", input_file, "-n", str(num_merges), "-t", "selfies", "-o", output_dir]
+    subprocess.run(cmd, check=True, stdout=subprocess.DEVNULL)
+    return os.path.join(output_dir, f"vocab_{num_merges}")
+
+
+def encode_cli(cvocgen, vocab_bin, input_file, add_special_tokens):
+    """Encode with `cvocgen encode` (text output, one line of IDs per molecule)."""
+    cmd = [cvocgen, "encode", vocab_bin, input_file]
+    if add_special_tokens:
+        cmd.append("--add-special-tokens")
+    result = subprocess.run(cmd, check=True, capture_output=True, text=True)
+    return [[int(x) for x in line.split()] for line in result.stdout.splitlines()]
+
+
+def load_merges(vocab_txt):
+    """Read the merges of a vocab_<n>.txt: a count line, then one 'left right' pair per line."""
+    with open(vocab_txt, 'r', encoding='utf-8') as f:
+        count = int(f.readline())
+        return [tuple(f.readline().split()) for _ in range(count)]
+
+
+def encode_by_rank(tokenizer, merges, molecule, add_special_tokens):
+    """Reference encoding: replay the merges in training order on the pre-tokens."""
+    tokens = tokenizer.pre_tokenize(molecule)
+    for left, right in merges:
+        merged = []
+        i = 0
+        while i < len(tokens):
+            if i + 1 < len(tokens) and tokens[i] == left and tokens[i + 1] == right:
+                merged.append(left + right)
+                i += 2
+            else:
+                merged.append(tokens[i])
+                i += 1
+        tokens = merged
+    unk = tokenizer.vocabulary[tokenizer.unk_token]
+    ids = [tokenizer.vocabulary.get(token, unk) for token in tokens]
+    if add_special_tokens:
+        ids = [tokenizer.vocabulary[tokenizer.bos_token]] + ids + [tokenizer.vocabulary[tokenizer.eos_token]]
+    return ids
+
+
+def decode(tokenizer, ids):
+    """Concatenate the tokens of a sequence of IDs, leaving out the special tokens."""
+    tokens = tokenizer.convert_ids_to_tokens(ids)
+    return "".join(token for token in tokens if token not in tokenizer.special_tokens)
+
+
+def report(name, corpus, expected, actual, limit=3):
+    """Print the molecules where actual differs from expected; return the number of them."""
+    mismatches = [i for i in range(len(corpus)) if expected[i] != actual[i]]
+    status = "OK" if not mismatches else f"FAILED ({len(mismatches)} of {len(corpus)} molecules differ)"
+    print(f"  {name:<60} {status}")
+    for i in mismatches[:limit]:
+        print(f"    {corpus[i]}")
+        print(f"      expected {expected[i]}")
+        print(f"      got      {actual[i]}")
+    return len(mismatches)
+
+
+def check_vocabulary(cvocgen, input_file, output_dir, num_merges, corpus):
+    """Compare the encoders on a vocabulary with num_merges merges; return the number of failures."""
+    print(f"\n=== {num_merges} merges ===")
+    base = train_cvocgen(cvocgen, input_file, output_dir, num_merges)
+
+    ape = APETokenizer()
+    ape.load_vocabulary(base + ".json")
+    merges = load_merges(base + ".txt")
+
+    context = cvocgen_native.Context()
+    native = context.load(base + ".bin")
+
+    failures = 0
+    for add_special_tokens in (False, True):
+        suffix = " with special tokens" if add_special_tokens else ""
+        cli_ids = encode_cli(cvocgen, base + ".bin", input_file, add_special_tokens)
+        native_ids = [native.encode(m, add_special_tokens) for m in corpus]
+        ape_ids = [ape.encode(m, add_special_tokens=add_special_tokens) for m in corpus]
+        reference = [encode_by_rank(ape, merges, m, add_special_tokens) for m in corpus]
+
+        failures += report("cvocgen encode vs cvocgen_native" + suffix, corpus, cli_ids, native_ids)
+        failures += report("cvocgen encode vs merges by rank" + suffix, corpus, reference, cli_ids)
+        if num_merges == 0:
+            failures += report("cvocgen encode vs APETokenizer.encode" + suffix, corpus, ape_ids, cli_ids)
+        else:
+            differ = sum(1 for i in range(len(corpus)) if ape_ids[i] != cli_ids[i])
+            print(f"  {'APETokenizer.encode (longest match) differs on':<60} {differ} of {len(corpus)} molecules")
+        failures += report("APETokenizer.encode decodes to the molecule" + suffix, corpus, corpus,
+                           [decode(ape, ids) for ids in ape_ids])
+        failures += report("cvocgen encode decodes to the molecule" + suffix, corpus, corpus,
+                           [decode(ape, ids) for ids in cli_ids])
+
+    native.close()
+    context.close()
+    return failures
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Check cvocgen encode and cvocgen_native against APETokenizer")
+    parser.add_argument("--input-file", type=str,
+                        default=os.path.join(os.path.dirname(os.path.abspath(__file__)), "encode_sample.selfies.txt"),
+                        help="Sample of SELFIES molecules, one per line")
+    parser.add_argument("--cvocgen", type=str, default="./bin/cvocgen",
+                        help="cvocgen binary")
+    parser.add_argument("--merges", type=int, nargs="+", default=[0, 30, 200],
+                        help="Vocabulary sizes to check, in merges")
+    args = parser.parse_args()
+
+    corpus = load_corpus(args.input_file)
+    print(f"Loaded sample with {len(corpus)} molecules from {args.input_file}")
+
+    failures = 0
+    with tempfile.TemporaryDirectory() as output_dir:
+        for num_merges in args.merges:
+            failures += check_vocabulary(args.cvocgen, args.input_file, output_dir, num_merges, corpus)
+
+    if failures:
+        print(f"\nEncode check failed: {failures} comparisons differ")
+        sys.exit(1)
+    print("\nEncode check passed")
+
+
+if __name__ == "__main__":
+    main()